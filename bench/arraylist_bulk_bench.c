@@ -0,0 +1,102 @@
+#include <string.h>
+#include "bench.h"
+#include "../src/data_struct.h"
+
+bench_DEFAULT_RESOURCE_HANDLERS
+
+#define NITEMS (1 << 20)
+#define CHUNK 4096    /* Items moved per range operation. */
+#define NREPEATS 8
+
+static long source[NITEMS];
+
+static bool keep_odd(const void *item)
+{
+	return *(const long *)item & 1;
+}
+
+static bool keep_odd_blocks(const void *item)
+{
+	return *(const long *)item / 64 & 1;
+}
+
+static void remove_middle(arraylist_t(long) list)
+{
+	size_t nitems = min(arraylist_size(list), CHUNK);
+	arraylist_remove_range(list, (arraylist_size(list) - nitems) / 2, nitems, NULL);
+}
+
+/* Reports the best of a few runs, as bytes of items moved per second. */
+#define measure(label, nbytes, setup, body, teardown)                                \
+	({                                                                                  \
+		double best = 0;                                                                \
+		for (int repeat = 0; repeat < NREPEATS; repeat++)                               \
+		{                                                                               \
+			setup;                                                                      \
+			uint64_t start = bench_now_ns();                                            \
+			body;                                                                       \
+			double seconds = (double)(bench_now_ns() - start) / 1e9;                    \
+			teardown;                                                                   \
+			if ((double)(nbytes) / seconds > best)                                      \
+				best = (double)(nbytes) / seconds;                                      \
+		}                                                                               \
+		printf("%-28s %8.2f GB/s\n", (label), best / 1e9);                              \
+	})
+
+int main(void)
+{
+	bench_header("arraylist bulk operations");
+	printf("%d longs per list, %d-item ranges, best of %d\n\n", NITEMS, CHUNK, NREPEATS);
+
+	for (long i = 0; i < NITEMS; i++)
+		source[i] = i;
+
+	arraylist_t(long) list;
+	arraylist_t(long) other;
+	arraylist_t(long) result;
+
+	measure("add one at a time", NITEMS * sizeof(long),
+			list = arraylist_new(long),
+			for (long i = 0; i < NITEMS; i++) arraylist_add(list, source[i]),
+			arraylist_free(list));
+
+	measure("extend_from_buffer", NITEMS * sizeof(long),
+			list = arraylist_new(long),
+			for (long i = 0; i < NITEMS; i += CHUNK) arraylist_extend_from_buffer(list, CHUNK, &source[i]),
+			arraylist_free(list));
+
+	/* Every range in the middle also moves the shorter side of the list,
+	 * a quarter of the final size on average, which is what is counted. */
+	measure("insert_range (middle)", (size_t)NITEMS / CHUNK * NITEMS / 4 * sizeof(long),
+			list = arraylist_new(long),
+			for (long i = 0; i < NITEMS; i += CHUNK) arraylist_insert_range(list, arraylist_size(list) / 2, CHUNK, &source[i]),
+			arraylist_free(list));
+
+	measure("remove_range (middle)", (size_t)NITEMS / CHUNK * NITEMS / 4 * sizeof(long),
+			(list = arraylist_new(long), arraylist_extend_from_buffer(list, NITEMS, source)),
+			while (!arraylist_is_empty(list)) remove_middle(list),
+			arraylist_free(list));
+
+	measure("splice (middle, same size)", (size_t)NITEMS / CHUNK * CHUNK * sizeof(long),
+			(list = arraylist_new(long), arraylist_extend_from_buffer(list, NITEMS, source)),
+			for (long i = 0; i < NITEMS; i += CHUNK) arraylist_splice(list, NITEMS / 2, CHUNK, CHUNK, &source[i]),
+			arraylist_free(list));
+
+	measure("concat", 2 * NITEMS * sizeof(long),
+			(list = arraylist_new(long), arraylist_extend_from_buffer(list, NITEMS, source),
+			 other = arraylist_new(long), arraylist_extend_from_buffer(other, NITEMS, source)),
+			result = arraylist_concat(list, other),
+			(arraylist_free(list), arraylist_free(other), arraylist_free(result)));
+
+	measure("filter (every other item)", NITEMS * sizeof(long),
+			(list = arraylist_new(long), arraylist_extend_from_buffer(list, NITEMS, source)),
+			result = arraylist_filter(list, keep_odd),
+			(arraylist_free(list), arraylist_free(result)));
+
+	measure("filter (runs of 64 items)", NITEMS * sizeof(long),
+			(list = arraylist_new(long), arraylist_extend_from_buffer(list, NITEMS, source)),
+			result = arraylist_filter(list, keep_odd_blocks),
+			(arraylist_free(list), arraylist_free(result)));
+
+	return 0;
+}
@@ -0,0 +1,66 @@
+#include "bench.h"
+#include "../src/data_struct.h"
+
+bench_DEFAULT_RESOURCE_HANDLERS
+
+#define NITEMS (1 << 22)
+#define NROUNDS (1 << 22) /* Pop/push pairs across a growth threshold. */
+
+/* Counts the buffer resizes the list asks for. */
+static struct bench_alloc_counts counts;
+static allocator_t counting_allocator = bench_COUNTING_ALLOCATOR(&counts);
+
+static void run(const char *label, arraylist_growth_t growth)
+{
+	arraylist_t(long) list = arraylist_new(long, .growth = growth, .allocator = &counting_allocator);
+	counts.nreallocs = 0;
+
+	uint64_t start = bench_now_ns();
+	for (long i = 0; i < NITEMS; i++)
+		arraylist_add_back(list, i);
+	double push_ns = (double)(bench_now_ns() - start) / NITEMS;
+	size_t push_resizes = counts.nreallocs;
+	size_t capacity = arraylist_capacity(list);
+
+	/* Alternates across the size the list grows at. */
+	while (arraylist_capacity(list) == capacity)
+		arraylist_add_back(list, 0);
+
+	counts.nreallocs = 0;
+	start = bench_now_ns();
+	for (long i = 0; i < NROUNDS; i++)
+	{
+		free(_arraylist_remove_back_((struct arraylist *)list));
+		arraylist_add_back(list, i);
+	}
+	double alternate_ns = (double)(bench_now_ns() - start) / NROUNDS;
+	size_t alternate_resizes = counts.nreallocs;
+
+	counts.nreallocs = 0;
+	start = bench_now_ns();
+	size_t size = arraylist_size(list);
+	for (size_t i = 0; i < size; i++)
+		free(_arraylist_remove_back_((struct arraylist *)list));
+	double pop_ns = (double)(bench_now_ns() - start) / size;
+
+	printf("%-6s push %5.1f ns (%2zu resizes, %4.0f%% used) | pop+push %5.1f ns (%zu resizes) | pop %5.1f ns (%2zu resizes)\n",
+		   label, push_ns, push_resizes, 100.0 * NITEMS / capacity,
+		   alternate_ns, alternate_resizes, pop_ns, counts.nreallocs);
+
+	arraylist_free(list);
+}
+
+int main(void)
+{
+	bench_header("arraylist push/pop");
+	printf("%d items pushed, %d pop+push pairs where the list grew, then all popped\n\n", NITEMS, NROUNDS);
+
+	for (int i = 0; i < 3; i++)
+	{
+		run("2x", ARRAYLIST_GROWTH_2X);
+		run("1.5x", ARRAYLIST_GROWTH_1_5X);
+		printf("\n");
+	}
+
+	return 0;
+}
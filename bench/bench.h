@@ -0,0 +1,90 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include "../src/testing.h"
+#include "../src/alloc.h"
+
+/* Benchmarks link against the whole library, and panic.c reports
+ * through the testing module, which expects these hooks. */
+#define bench_DEFAULT_RESOURCE_HANDLERS testing_DEFAULT_RESOURCE_HANDLERS
+
+static inline uint64_t bench_now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int bench_compare_u64(const void *first, const void *second)
+{
+	uint64_t a = *(const uint64_t *)first;
+	uint64_t b = *(const uint64_t *)second;
+	return a < b ? -1 : a > b;
+}
+
+/* Sorts the samples in place and returns the given percentile of them. */
+static inline uint64_t bench_percentile(uint64_t *samples, size_t n, double percentile)
+{
+	qsort(samples, n, sizeof(uint64_t), bench_compare_u64);
+	size_t pos = (size_t)(percentile / 100.0 * (n - 1));
+	return samples[pos];
+}
+
+/* A small xorshift generator, so that runs are reproducible and the
+ * generator itself costs next to nothing inside timed loops. */
+static inline uint64_t bench_rand(uint64_t *state)
+{
+	uint64_t x = *state;
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	return *state = x;
+}
+
+#define bench_header(title) \
+	(printf("\n------------ %s ------------\n\n", (title)))
+
+/* Counts what a container asks of its allocator. Every block also costs
+ * malloc's own header, which is why the block count is kept too. */
+struct bench_alloc_counts
+{
+	size_t nbytes;
+	size_t nblocks;
+	size_t nreallocs;
+};
+
+static inline void *bench_counting_alloc(void *context, size_t size)
+{
+	struct bench_alloc_counts *counts = context;
+	counts->nbytes += size;
+	counts->nblocks++;
+	return malloc(size);
+}
+
+static inline void *bench_counting_realloc(void *context, void *ptr, size_t old_size, size_t new_size)
+{
+	struct bench_alloc_counts *counts = context;
+	counts->nbytes += new_size - old_size;
+	counts->nreallocs++;
+	return realloc(ptr, new_size);
+}
+
+static inline void bench_counting_free(void *context, void *ptr, size_t size)
+{
+	struct bench_alloc_counts *counts = context;
+	counts->nbytes -= size;
+	counts->nblocks--;
+	free(ptr);
+}
+
+/* Initializes an allocator over malloc that keeps its tallies in the
+ * given struct bench_alloc_counts. */
+#define bench_COUNTING_ALLOCATOR(counts)   \
+	{                                      \
+		.alloc = bench_counting_alloc,     \
+		.realloc = bench_counting_realloc, \
+		.free = bench_counting_free,       \
+		.context = (counts)}
@@ -0,0 +1,120 @@
+#include <pthread.h>
+#include <unistd.h>
+#include "bench.h"
+#include "../src/data_struct.h"
+#include "../src/concurrent.h"
+
+bench_DEFAULT_RESOURCE_HANDLERS
+
+#define NKEYS (1 << 16)
+#define NOPS (1 << 21) /* Split evenly across the threads of a run. */
+#define MAX_THREADS 64
+
+static const int thread_counts[] = {1, 2, 4, 8, 16, 32, 64};
+static const int read_percents[] = {50, 90, 99};
+
+/* The baseline: a plain hashmap behind one global mutex. */
+static hashmap_t *locked_map;
+static pthread_mutex_t locked_map_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static concurrent_hashmap_t *sharded_map;
+
+struct worker
+{
+	pthread_t thread;
+	bool sharded;
+	int read_percent;
+	size_t nops;
+	uint64_t seed;
+};
+
+static void *run_worker(void *arg)
+{
+	struct worker *worker = arg;
+	uint64_t state = worker->seed;
+
+	for (size_t i = 0; i < worker->nops; i++)
+	{
+		uint64_t r = bench_rand(&state);
+		void *key = _(r % NKEYS + 1);
+		bool read = (int)(r >> 32) % 100 < worker->read_percent;
+
+		if (worker->sharded)
+		{
+			if (read)
+				concurrent_hashmap_get_at(sharded_map, key);
+			else
+				concurrent_hashmap_set_at(sharded_map, key, _(i));
+		}
+		else
+		{
+			pthread_mutex_lock(&locked_map_lock);
+			if (read)
+				hashmap_get_at(locked_map, key);
+			else
+				hashmap_set_at(locked_map, key, _(i));
+			pthread_mutex_unlock(&locked_map_lock);
+		}
+	}
+
+	return NULL;
+}
+
+static double run(bool sharded, int nthreads, int read_percent)
+{
+	static struct worker workers[MAX_THREADS];
+
+	uint64_t start = bench_now_ns();
+
+	for (int t = 0; t < nthreads; t++)
+	{
+		workers[t] = (struct worker){
+			.sharded = sharded,
+			.read_percent = read_percent,
+			.nops = NOPS / nthreads,
+			.seed = 88172645463325252ull + t * 7919};
+		pthread_create(&workers[t].thread, NULL, run_worker, &workers[t]);
+	}
+
+	for (int t = 0; t < nthreads; t++)
+		pthread_join(workers[t].thread, NULL);
+
+	double seconds = (double)(bench_now_ns() - start) / 1e9;
+	return (double)(NOPS / nthreads * nthreads) / seconds / 1e6;
+}
+
+int main(void)
+{
+	bench_header("concurrent hashmap scaling");
+	printf("%d keys, %d operations split across the threads, Mops/s\n", NKEYS, NOPS);
+	printf("%ld online cpus\n\n", sysconf(_SC_NPROCESSORS_ONLN));
+
+	locked_map = hashmap_new();
+	sharded_map = concurrent_hashmap_new(.capacity = NKEYS);
+
+	for (size_t i = 0; i < NKEYS; i++)
+	{
+		hashmap_set_at(locked_map, _(i + 1), _(i));
+		concurrent_hashmap_set_at(sharded_map, _(i + 1), _(i));
+	}
+
+	for (size_t r = 0; r < sizeof(read_percents) / sizeof(int); r++)
+	{
+		printf("%d%% reads\n", read_percents[r]);
+		printf("%8s %14s %14s\n", "threads", "global mutex", "sharded");
+
+		for (size_t t = 0; t < sizeof(thread_counts) / sizeof(int); t++)
+		{
+			double locked = run(false, thread_counts[t], read_percents[r]);
+			double sharded = run(true, thread_counts[t], read_percents[r]);
+			printf("%8d %14.2f %14.2f\n", thread_counts[t], locked, sharded);
+		}
+
+		printf("\n");
+	}
+
+	hashmap_free(locked_map);
+	concurrent_hashmap_free(sharded_map);
+
+	return 0;
+}
@@ -0,0 +1,95 @@
+#include "bench.h"
+#include "../src/functions.h"
+
+bench_DEFAULT_RESOURCE_HANDLERS
+
+#define NBUCKETS (1 << 17)
+#define NKEYS (NBUCKETS * 7 / 10)
+#define NROUNDS 50
+
+static size_t chains[NBUCKETS];
+static const void *keys[NKEYS];
+
+/* The defaults before the mixer: the key itself, and djb2 for strings. */
+
+static size_t old_strhash(const void *s)
+{
+	size_t hash = 53812;
+	const char *str = s;
+	char c;
+
+	while ((c = *str++))
+		hash = ((hash << 5) + hash) + c;
+
+	return hash;
+}
+
+static size_t mixed_hash(const void *key)
+{
+	return hash_mix((size_t)key);
+}
+
+static void run(const char *label, hash_fn_t fn)
+{
+	memset(chains, 0, sizeof(chains));
+
+	for (size_t i = 0; i < NKEYS; i++)
+		chains[fn(keys[i]) & (NBUCKETS - 1)]++;
+
+	size_t occupied = 0, longest = 0;
+	for (size_t i = 0; i < NBUCKETS; i++)
+	{
+		occupied += chains[i] != 0;
+		longest = max(longest, chains[i]);
+	}
+
+	volatile size_t sink = 0;
+	uint64_t start = bench_now_ns();
+	for (int round = 0; round < NROUNDS; round++)
+		for (size_t i = 0; i < NKEYS; i++)
+			sink += fn(keys[i]);
+	double ns = (double)(bench_now_ns() - start) / ((double)NROUNDS * NKEYS);
+
+	printf("  %-22s occupancy %5.1f%% | max chain %6zu | %5.2f ns/hash\n",
+		   label, 100.0 * occupied / NBUCKETS, longest, ns);
+}
+
+int main(void)
+{
+	bench_header("hash quality");
+	printf("%d keys into %d buckets indexed by mask; "
+		   "an ideal hash occupies ~50.3%% with max chain ~7\n",
+		   NKEYS, NBUCKETS);
+
+	printf("\nheap pointers (24-byte allocations)\n");
+	for (size_t i = 0; i < NKEYS; i++)
+		keys[i] = malloc(24);
+	run("identity (old default)", identity_hash);
+	run("hash_mix", mixed_hash);
+	for (size_t i = 0; i < NKEYS; i++)
+		free((void *)keys[i]);
+
+	printf("\nsequential ints\n");
+	for (size_t i = 0; i < NKEYS; i++)
+		keys[i] = _(i * 8);
+	run("identity (old default)", identity_hash);
+	run("hash_mix", mixed_hash);
+
+	printf("\nrandom strings (8-40 chars)\n");
+	uint64_t state = 88172645463325252ull;
+	for (size_t i = 0; i < NKEYS; i++)
+	{
+		size_t len = 8 + bench_rand(&state) % 33;
+		char *str = malloc(len + 1);
+		for (size_t c = 0; c < len; c++)
+			str[c] = 'a' + bench_rand(&state) % 26;
+		str[len] = '\0';
+		keys[i] = str;
+	}
+	run("djb2 (old strhash)", old_strhash);
+	run("strhash (hash_bytes)", strhash);
+	for (size_t i = 0; i < NKEYS; i++)
+		free((void *)keys[i]);
+
+	return 0;
+}
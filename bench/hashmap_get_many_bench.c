@@ -0,0 +1,51 @@
+#include "bench.h"
+#include "../src/data_struct.h"
+
+bench_DEFAULT_RESOURCE_HANDLERS
+
+#define NKEYS (1 << 22)
+#define NQUERIES (1 << 22)
+#define BATCH 64
+
+static void *queries[NQUERIES];
+static void *values[NQUERIES];
+
+static void run(const char *label, hashmap_backend_t backend)
+{
+	hashmap_t *map = hashmap_new(.backend = backend);
+	hashmap_reserve(map, NKEYS);
+
+	for (size_t i = 0; i < NKEYS; i++)
+		hashmap_set_at(map, _(i + 1), _(i));
+
+	uint64_t start = bench_now_ns();
+	for (size_t i = 0; i < NQUERIES; i++)
+		values[i] = hashmap_get_at(map, queries[i]);
+	double single_ns = (double)(bench_now_ns() - start) / NQUERIES;
+
+	start = bench_now_ns();
+	for (size_t i = 0; i < NQUERIES; i += BATCH)
+		hashmap_get_many(map, BATCH, queries + i, values + i);
+	double batch_ns = (double)(bench_now_ns() - start) / NQUERIES;
+
+	printf("%-16s get_at loop %6.1f ns/key | get_many %6.1f ns/key | %.2fx\n",
+		   label, single_ns, batch_ns, single_ns / batch_ns);
+
+	hashmap_free(map);
+}
+
+int main(void)
+{
+	bench_header("hashmap batched lookups");
+	printf("%d keys (well past the LLC), %d random hits looked up in batches of %d\n\n",
+		   NKEYS, NQUERIES, BATCH);
+
+	uint64_t state = 88172645463325252ull;
+	for (size_t i = 0; i < NQUERIES; i++)
+		queries[i] = _(bench_rand(&state) % NKEYS + 1);
+
+	run("chained", HASHMAP_BACKEND_CHAINED);
+	run("open addressing", HASHMAP_BACKEND_OPEN_ADDRESSING);
+
+	return 0;
+}
@@ -0,0 +1,56 @@
+#include "bench.h"
+#include "../src/data_struct.h"
+
+bench_DEFAULT_RESOURCE_HANDLERS
+
+#define NINSERTS (1 << 21)
+#define WINDOW 4096
+
+static uint64_t latencies[NINSERTS];
+static uint64_t window[WINDOW];
+
+static void run(const char *label, hashmap_config_t config)
+{
+	hashmap_t *map = _hashmap_new_(config);
+
+	for (size_t i = 0; i < NINSERTS; i++)
+	{
+		uint64_t start = bench_now_ns();
+		hashmap_set_at(map, _(i + 1), _(i));
+		latencies[i] = bench_now_ns() - start;
+	}
+
+	/* Per-window tails show whether the cost of a resize lands on a
+	 * single unlucky insert or is spread across its neighbours. */
+	uint64_t best_window_p99 = UINT64_MAX, worst_window_p99 = 0;
+
+	for (size_t start = 0; start < NINSERTS; start += WINDOW)
+	{
+		memcpy(window, latencies + start, sizeof(window));
+		uint64_t p99 = bench_percentile(window, WINDOW, 99);
+		best_window_p99 = min(best_window_p99, p99);
+		worst_window_p99 = max(worst_window_p99, p99);
+	}
+
+	uint64_t p50 = bench_percentile(latencies, NINSERTS, 50);
+	uint64_t p99 = bench_percentile(latencies, NINSERTS, 99);
+	uint64_t p999 = bench_percentile(latencies, NINSERTS, 99.9);
+	uint64_t worst = latencies[NINSERTS - 1];
+
+	printf("%-12s p50 %5lu ns | p99 %5lu ns | p99.9 %6lu ns | max %9lu ns | "
+		   "p99 per window %lu..%lu ns\n",
+		   label, p50, p99, p999, worst, best_window_p99, worst_window_p99);
+
+	hashmap_free(map);
+}
+
+int main(void)
+{
+	bench_header("hashmap insert latency across growth");
+	printf("%d inserts, windows of %d inserts\n\n", NINSERTS, WINDOW);
+
+	run("one-shot", (hashmap_config_t){0});
+	run("incremental", (hashmap_config_t){.incremental_rehash = true});
+
+	return 0;
+}
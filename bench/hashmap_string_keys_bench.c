@@ -0,0 +1,85 @@
+#include "bench.h"
+#include "../src/data_struct.h"
+
+bench_DEFAULT_RESOURCE_HANDLERS
+
+#define NKEYS (1 << 20)
+
+static char *keys[NKEYS];
+static char *missing[NKEYS];
+static size_t nhashes, ncompares;
+
+static size_t counted_strhash(const void *s)
+{
+	nhashes++;
+	return strhash(s);
+}
+
+static bool counted_streq(const void *s1, const void *s2)
+{
+	ncompares++;
+	return streq(s1, s2);
+}
+
+static char *random_string(uint64_t *state)
+{
+	size_t len = 16 + bench_rand(state) % 17;
+	char *str = malloc(len + 1);
+	for (size_t c = 0; c < len; c++)
+		str[c] = 'a' + bench_rand(state) % 26;
+	str[len] = '\0';
+	return str;
+}
+
+static void run(const char *label, hashmap_backend_t backend)
+{
+	hashmap_t *map = hashmap_new(
+		.backend = backend,
+		.hash_fn = counted_strhash,
+		.key_equal_fn = counted_streq);
+
+	nhashes = ncompares = 0;
+	uint64_t start = bench_now_ns();
+	for (size_t i = 0; i < NKEYS; i++)
+		hashmap_set_at(map, keys[i], keys[i]);
+	double insert_ns = (double)(bench_now_ns() - start) / NKEYS;
+	double insert_hashes = (double)nhashes / NKEYS;
+
+	nhashes = ncompares = 0;
+	start = bench_now_ns();
+	for (size_t i = 0; i < NKEYS; i++)
+		hashmap_get_at(map, keys[i]);
+	double hit_ns = (double)(bench_now_ns() - start) / NKEYS;
+	double hit_compares = (double)ncompares / NKEYS;
+
+	nhashes = ncompares = 0;
+	start = bench_now_ns();
+	for (size_t i = 0; i < NKEYS; i++)
+		hashmap_get_at(map, missing[i]);
+	double miss_ns = (double)(bench_now_ns() - start) / NKEYS;
+	double miss_compares = (double)ncompares / NKEYS;
+
+	printf("%-16s insert %6.1f ns, %.2f hashes | hit %6.1f ns, %.2f compares | "
+		   "miss %6.1f ns, %.2f compares\n",
+		   label, insert_ns, insert_hashes, hit_ns, hit_compares, miss_ns, miss_compares);
+
+	hashmap_free(map);
+}
+
+int main(void)
+{
+	bench_header("string-keyed hashmap");
+	printf("%d random 16-32 char keys, grown from the default capacity; "
+		   "hash and compare counts are per operation\n\n", NKEYS);
+
+	uint64_t state = 88172645463325252ull;
+	for (size_t i = 0; i < NKEYS; i++)
+		keys[i] = random_string(&state);
+	for (size_t i = 0; i < NKEYS; i++)
+		missing[i] = random_string(&state);
+
+	run("chained", HASHMAP_BACKEND_CHAINED);
+	run("open addressing", HASHMAP_BACKEND_OPEN_ADDRESSING);
+
+	return 0;
+}
@@ -0,0 +1,104 @@
+#include <string.h>
+#include "bench.h"
+#include "../src/sort.h"
+
+bench_DEFAULT_RESOURCE_HANDLERS
+
+#define NITEMS (1 << 22)
+#define NREPEATS 3
+
+static long source[NITEMS];
+static long items[NITEMS];
+
+static int compare_long(const void *first, const void *second)
+{
+	long a = *(const long *)first, b = *(const long *)second;
+	return (a > b) - (a < b);
+}
+
+static void qsort_long(long *buffer, size_t n)
+{
+	qsort(buffer, n, sizeof(long), compare_long);
+}
+
+static void sort_buffer_long(long *buffer, size_t n)
+{
+	sort_buffer(buffer, n, sizeof(long), compare_long);
+}
+
+static void stable_sort_buffer_long(long *buffer, size_t n)
+{
+	stable_sort_buffer(buffer, n, sizeof(long), compare_long);
+}
+
+static struct
+{
+	const char *label;
+	void (*sort_fn)(long *, size_t);
+} sorts[] = {
+	{"qsort", qsort_long},
+	{"sort_buffer", sort_buffer_long},
+	{"sort_long", sort_long},
+	{"stable_sort_buffer", stable_sort_buffer_long},
+	{"stable_sort_long", stable_sort_long},
+	{"radix_sort_long", radix_sort_long},
+};
+
+static void fill(const char *pattern)
+{
+	uint64_t state = 88172645463325252ull;
+
+	for (long i = 0; i < NITEMS; i++)
+	{
+		if (strcmp(pattern, "random") == 0)
+			source[i] = (long)bench_rand(&state);
+		else if (strcmp(pattern, "few keys") == 0)
+			source[i] = bench_rand(&state) % 16;
+		else if (strcmp(pattern, "sorted") == 0)
+			source[i] = i;
+		else if (strcmp(pattern, "reversed") == 0)
+			source[i] = NITEMS - i;
+		else if (strcmp(pattern, "sorted + 1% random") == 0)
+			source[i] = bench_rand(&state) % 100 == 0 ? (long)bench_rand(&state) : i;
+		else if (strcmp(pattern, "organ pipe") == 0)
+			source[i] = i < NITEMS / 2 ? i : NITEMS - i;
+	}
+}
+
+/* Reports the best of a few runs, in nanoseconds per item. */
+static void run(const char *pattern)
+{
+	fill(pattern);
+	printf("%s\n", pattern);
+
+	for (size_t s = 0; s < sizeof(sorts) / sizeof(*sorts); s++)
+	{
+		double best = 0;
+		for (int repeat = 0; repeat < NREPEATS; repeat++)
+		{
+			memcpy(items, source, sizeof(items));
+			uint64_t start = bench_now_ns();
+			sorts[s].sort_fn(items, NITEMS);
+			double ns = (double)(bench_now_ns() - start) / NITEMS;
+			if (best == 0 || ns < best)
+				best = ns;
+		}
+		printf("  %-20s %6.2f ns/item\n", sorts[s].label, best);
+	}
+	printf("\n");
+}
+
+int main(void)
+{
+	bench_header("sort");
+	printf("%d longs, best of %d\n\n", NITEMS, NREPEATS);
+
+	run("random");
+	run("few keys");
+	run("sorted");
+	run("reversed");
+	run("sorted + 1% random");
+	run("organ pipe");
+
+	return 0;
+}
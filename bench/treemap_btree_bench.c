@@ -0,0 +1,58 @@
+#include "bench.h"
+#include "../src/data_struct.h"
+
+bench_DEFAULT_RESOURCE_HANDLERS
+
+#define NKEYS (10 * 1000 * 1000)
+#define NQUERIES (1 << 22)
+
+static void *queries[NQUERIES];
+
+static struct bench_alloc_counts counts;
+static allocator_t counting_allocator = bench_COUNTING_ALLOCATOR(&counts);
+
+static void run(const char *label, treemap_backend_t backend)
+{
+	counts = (struct bench_alloc_counts){0};
+	treemap_t *map = treemap_new(.backend = backend, .allocator = &counting_allocator);
+
+	uint64_t state = 2463534242ull;
+	uint64_t start = bench_now_ns();
+	for (size_t i = 0; i < NKEYS; i++)
+		treemap_set_at(map, _(bench_rand(&state) % (NKEYS * 4) + 1), _(i));
+	double insert_ns = (double)(bench_now_ns() - start) / NKEYS;
+
+	size_t found = 0;
+	start = bench_now_ns();
+	for (size_t i = 0; i < NQUERIES; i++)
+		found += treemap_get_at(map, queries[i]) != NULL;
+	double lookup_ns = (double)(bench_now_ns() - start) / NQUERIES;
+
+	start = bench_now_ns();
+	treemap_ref_t *ref = treemap_ref(map);
+	for (; treemap_ref_is_valid(ref); treemap_ref_next(ref))
+		;
+	double scan_ns = (double)(bench_now_ns() - start) / treemap_size(map);
+	treemap_ref_free(ref);
+
+	printf("%-8s insert %6.0f ns | lookup %6.0f ns | scan %5.1f ns/key | %5.1f bytes/key in %zu blocks (%zu hits)\n",
+		   label, insert_ns, lookup_ns, scan_ns,
+		   (double)counts.nbytes / treemap_size(map), counts.nblocks, found);
+
+	treemap_free(map);
+}
+
+int main(void)
+{
+	bench_header("treemap engines");
+	printf("%d random keys, %d random lookups, about a quarter of them hits\n\n", NKEYS, NQUERIES);
+
+	uint64_t state = 88172645463325252ull;
+	for (size_t i = 0; i < NQUERIES; i++)
+		queries[i] = _(bench_rand(&state) % (NKEYS * 4) + 1);
+
+	run("rbtree", TREEMAP_BACKEND_RBTREE);
+	run("btree", TREEMAP_BACKEND_BTREE);
+
+	return 0;
+}
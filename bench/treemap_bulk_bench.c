@@ -0,0 +1,64 @@
+#include "bench.h"
+#include "../src/data_struct.h"
+
+bench_DEFAULT_RESOURCE_HANDLERS
+
+#define NKEYS (1 << 20)
+
+static map_entry_t sorted[NKEYS];
+static map_entry_t shuffled[NKEYS];
+
+/* Loads NKEYS entries into a map each way a service could rebuild an
+ * index on start up, and reports the time per entry. */
+static void run(const char *name, treemap_backend_t backend)
+{
+	uint64_t start = bench_now_ns();
+	treemap_t *map = treemap_new(.backend = backend, .pool_nodes = true);
+	for (size_t i = 0; i < NKEYS; i++)
+		treemap_set_at(map, shuffled[i].key, shuffled[i].value);
+	double insert_ns = (double)(bench_now_ns() - start) / NKEYS;
+	treemap_free(map);
+
+	start = bench_now_ns();
+	map = treemap_new(.backend = backend, .pool_nodes = true);
+	_treemap_set_all_(map, NKEYS, shuffled);
+	double set_all_ns = (double)(bench_now_ns() - start) / NKEYS;
+	treemap_free(map);
+
+	start = bench_now_ns();
+	map = treemap_from_sorted(sorted, NKEYS, .backend = backend, .pool_nodes = true);
+	double from_sorted_ns = (double)(bench_now_ns() - start) / NKEYS;
+
+	/* Lookups, to check the built tree is no worse to search. */
+	start = bench_now_ns();
+	for (size_t i = 0; i < NKEYS; i++)
+		treemap_get_at(map, shuffled[i].key);
+	double lookup_ns = (double)(bench_now_ns() - start) / NKEYS;
+	treemap_free(map);
+
+	printf("%-14s | one by one %6.1f | sort and build %6.1f | from sorted %6.1f | lookup %6.1f ns\n",
+		   name, insert_ns, set_all_ns, from_sorted_ns, lookup_ns);
+}
+
+int main(void)
+{
+	bench_header("treemap bulk construction");
+	printf("%d entries, ns per entry\n\n", NKEYS);
+
+	uint64_t state = 88172645463325252ull;
+
+	for (size_t i = 0; i < NKEYS; i++)
+		sorted[i] = shuffled[i] = (map_entry_t){.key = _(i + 1), .value = _(i)};
+	for (size_t i = NKEYS - 1; i > 0; i--)
+	{
+		size_t j = bench_rand(&state) % (i + 1);
+		map_entry_t entry = shuffled[i];
+		shuffled[i] = shuffled[j];
+		shuffled[j] = entry;
+	}
+
+	run("red-black tree", TREEMAP_BACKEND_RBTREE);
+	run("B+tree", TREEMAP_BACKEND_BTREE);
+
+	return 0;
+}
@@ -0,0 +1,83 @@
+#include "bench.h"
+#include "../src/data_struct.h"
+
+bench_DEFAULT_RESOURCE_HANDLERS
+
+#define NKEYS (4 * 1000 * 1000)
+#define NQUERIES (1 << 22)
+
+static void *keys[NKEYS];
+static void *queries[NQUERIES];
+
+static struct bench_alloc_counts counts;
+static allocator_t counting_allocator = bench_COUNTING_ALLOCATOR(&counts);
+
+static void run(const char *label, treemap_backend_t backend, bool pool_nodes)
+{
+	counts = (struct bench_alloc_counts){0};
+	treemap_t *map = treemap_new(.backend = backend, .pool_nodes = pool_nodes, .allocator = &counting_allocator);
+
+	uint64_t start = bench_now_ns();
+	for (size_t i = 0; i < NKEYS; i++)
+		treemap_set_at(map, keys[i], _(i));
+	double insert_ns = (double)(bench_now_ns() - start) / NKEYS;
+
+	size_t found = 0;
+	start = bench_now_ns();
+	for (size_t i = 0; i < NQUERIES; i++)
+		found += treemap_get_at(map, queries[i]) != NULL;
+	double lookup_ns = (double)(bench_now_ns() - start) / NQUERIES;
+
+	start = bench_now_ns();
+	treemap_ref_t *ref = treemap_ref(map);
+	for (; treemap_ref_is_valid(ref); treemap_ref_next(ref))
+		;
+	double scan_ns = (double)(bench_now_ns() - start) / treemap_size(map);
+	treemap_ref_free(ref);
+
+	printf("%-14s insert %5.0f ns | lookup %5.0f ns | scan %5.1f ns/key | %5.1f bytes/key in %zu blocks (%zu hits)\n",
+		   label, insert_ns, lookup_ns, scan_ns,
+		   (double)counts.nbytes / treemap_size(map), counts.nblocks, found);
+
+	treemap_free(map);
+}
+
+static void run_all(void)
+{
+	run("rbtree", TREEMAP_BACKEND_RBTREE, false);
+	run("rbtree pooled", TREEMAP_BACKEND_RBTREE, true);
+	run("compact", TREEMAP_BACKEND_RBTREE_COMPACT, false);
+	printf("\n");
+}
+
+int main(void)
+{
+	bench_header("compact treemap nodes");
+	printf("%d keys, %d lookups of keys in the map\n\n", NKEYS, NQUERIES);
+
+	uint64_t state = 88172645463325252ull;
+	for (size_t i = 0; i < NQUERIES; i++)
+		queries[i] = _(bench_rand(&state) % NKEYS + 1);
+
+	/* A random permutation, so that every key is distinct. */
+	for (size_t i = 0; i < NKEYS; i++)
+		keys[i] = _(i + 1);
+	for (size_t i = NKEYS - 1; i > 0; i--)
+	{
+		size_t j = bench_rand(&state) % (i + 1);
+		void *swap = keys[i];
+		keys[i] = keys[j];
+		keys[j] = swap;
+	}
+
+	printf("keys inserted in random order\n");
+	run_all();
+
+	for (size_t i = 0; i < NKEYS; i++)
+		keys[i] = _(i + 1);
+
+	printf("keys inserted in increasing order\n");
+	run_all();
+
+	return 0;
+}
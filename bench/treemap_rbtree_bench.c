@@ -0,0 +1,69 @@
+#include "bench.h"
+#include "../src/data_struct.h"
+
+bench_DEFAULT_RESOURCE_HANDLERS
+
+#define MAX_KEYS (1 << 20)
+
+static void *keys[MAX_KEYS];
+
+/* Inserts, then removes, n distinct keys in random order, repeated
+ * over enough rounds to time about as many operations at every size. */
+static void run(size_t n)
+{
+	size_t rounds = MAX_KEYS / n;
+	uint64_t insert_ns = 0, remove_ns = 0, free_ns = 0;
+	uint64_t state = 2463534242ull;
+
+	for (size_t round = 0; round < rounds; round++)
+	{
+		for (size_t i = 0; i < n; i++)
+			keys[i] = _(i + 1);
+		for (size_t i = n - 1; i > 0; i--)
+		{
+			size_t j = bench_rand(&state) % (i + 1);
+			void *key = keys[i];
+			keys[i] = keys[j];
+			keys[j] = key;
+		}
+
+		treemap_t *map = treemap_new(.pool_nodes = true);
+
+		uint64_t start = bench_now_ns();
+		for (size_t i = 0; i < n; i++)
+			treemap_set_at(map, keys[i], keys[i]);
+		insert_ns += bench_now_ns() - start;
+
+		start = bench_now_ns();
+		for (size_t i = 0; i < n / 2; i++)
+			treemap_remove_at(map, keys[i]);
+		remove_ns += bench_now_ns() - start;
+
+		/* Without the pool, so that the destroy walk frees every node. */
+		treemap_t *copy = treemap_new();
+		for (size_t i = n / 2; i < n; i++)
+			treemap_set_at(copy, keys[i], keys[i]);
+
+		start = bench_now_ns();
+		treemap_free(copy);
+		free_ns += bench_now_ns() - start;
+
+		treemap_free(map);
+	}
+
+	printf("%8zu keys | insert %6.1f ns | remove %6.1f ns | free %6.1f ns/node\n",
+		   n,
+		   (double)insert_ns / (rounds * n),
+		   (double)remove_ns / (rounds * (n / 2)),
+		   (double)free_ns / (rounds * (n - n / 2)));
+}
+
+int main(void)
+{
+	bench_header("treemap red-black tree operations");
+
+	for (size_t n = 1 << 10; n <= MAX_KEYS; n <<= 5)
+		run(n);
+
+	return 0;
+}
@@ -0,0 +1,78 @@
+#include <unistd.h>
+#include "bench.h"
+#include "../src/data_struct.h"
+#include "../src/concurrent.h"
+
+bench_DEFAULT_RESOURCE_HANDLERS
+
+#define NITEMS (1 << 20)
+
+static const int thread_counts[] = {1, 2, 4, 8};
+
+static void *first_items[NITEMS], *second_items[NITEMS];
+
+static treeset_t *build(void **items)
+{
+	treeset_t *set = treeset_new(.order_statistics = true);
+	_treeset_add_all_(set, NITEMS, items);
+	return set;
+}
+
+/* Times one operation on fresh copies of both sets, which it consumes. */
+static double run(treeset_t *(*op)(thread_pool_t *, treeset_t *, treeset_t *), thread_pool_t *pool)
+{
+	treeset_t *first = build(first_items), *second = build(second_items);
+
+	uint64_t start = bench_now_ns();
+	treeset_t *result = op(pool, first, second);
+	double ms = (double)(bench_now_ns() - start) / 1e6;
+
+	treeset_free(result);
+	return ms;
+}
+
+static double run_sequential(treeset_t *(*op)(treeset_t *, treeset_t *))
+{
+	treeset_t *first = build(first_items), *second = build(second_items);
+
+	uint64_t start = bench_now_ns();
+	treeset_t *result = op(first, second);
+	double ms = (double)(bench_now_ns() - start) / 1e6;
+
+	treeset_free(result);
+	treeset_free(first);
+	treeset_free(second);
+	return ms;
+}
+
+int main(void)
+{
+	bench_header("parallel treeset operations");
+	printf("two sets of %d random draws from 1.5x as many items, ms\n", NITEMS);
+	printf("%ld online cpus\n\n", sysconf(_SC_NPROCESSORS_ONLN));
+
+	uint64_t state = 88172645463325252ull;
+	for (size_t i = 0; i < NITEMS; i++)
+	{
+		first_items[i] = _(bench_rand(&state) % (3 * NITEMS / 2) + 1);
+		second_items[i] = _(bench_rand(&state) % (3 * NITEMS / 2) + 1);
+	}
+
+	printf("%10s %12s %14s %12s\n", "threads", "union", "intersection", "difference");
+	printf("%10s %12.1f %14.1f %12.1f\n", "merging",
+		   run_sequential(treeset_union),
+		   run_sequential(treeset_intersection),
+		   run_sequential(treeset_difference));
+
+	for (size_t t = 0; t < sizeof(thread_counts) / sizeof(int); t++)
+	{
+		thread_pool_t *pool = thread_pool_new(.nthreads = thread_counts[t]);
+		printf("%10d %12.1f %14.1f %12.1f\n", thread_counts[t],
+			   run(treeset_parallel_union, pool),
+			   run(treeset_parallel_intersection, pool),
+			   run(treeset_parallel_difference, pool));
+		thread_pool_free(pool);
+	}
+
+	return 0;
+}
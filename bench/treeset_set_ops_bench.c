@@ -0,0 +1,99 @@
+#include "bench.h"
+#include "../src/data_struct.h"
+
+bench_DEFAULT_RESOURCE_HANDLERS
+
+#define NITEMS (1 << 20)
+
+/* Two sets of NITEMS random draws, overlapping by about a third. */
+static treeset_t *first, *second;
+
+/* The previous approach, for comparison: a lookup into the second set
+ * for each item of the first, and one insertion per item kept. */
+static treeset_t *probe_intersection(treeset_t *set1, treeset_t *set2)
+{
+	treeset_t *result = treeset_new();
+	treeset_ref_t *ref = treeset_ref(set1);
+
+	for (; treeset_ref_is_valid(ref); treeset_ref_next(ref))
+	{
+		if (treeset_contains(set2, treeset_ref_get_item(ref)))
+			treeset_add(result, treeset_ref_get_item(ref));
+	}
+
+	treeset_ref_free(ref);
+	return result;
+}
+
+static treeset_t *insert_union(treeset_t *set1, treeset_t *set2)
+{
+	treeset_t *result = treeset_new();
+	treeset_ref_t *ref = treeset_ref(set1);
+
+	for (; treeset_ref_is_valid(ref); treeset_ref_next(ref))
+		treeset_add(result, treeset_ref_get_item(ref));
+	treeset_ref_free(ref);
+
+	ref = treeset_ref(set2);
+	for (; treeset_ref_is_valid(ref); treeset_ref_next(ref))
+		treeset_add(result, treeset_ref_get_item(ref));
+	treeset_ref_free(ref);
+
+	return result;
+}
+
+static void run(const char *name, treeset_t *(*op)(treeset_t *, treeset_t *))
+{
+	uint64_t start = bench_now_ns();
+	treeset_t *result = op(first, second);
+	double ms = (double)(bench_now_ns() - start) / 1e6;
+
+	printf("%-22s %9.1f ms  (%zu items)\n", name, ms, treeset_size(result));
+	treeset_free(result);
+}
+
+static treeset_t *copy(treeset_t *set)
+{
+	treeset_t *result = treeset_new();
+	treeset_union_into(result, set);
+	return result;
+}
+
+int main(void)
+{
+	bench_header("treeset set algebra");
+	printf("two sets of %d random draws from 1.5x as many items\n\n", NITEMS);
+
+	uint64_t state = 88172645463325252ull;
+	first = treeset_new();
+	second = treeset_new();
+
+	for (size_t i = 0; i < NITEMS; i++)
+	{
+		treeset_add(first, _(bench_rand(&state) % (3 * NITEMS / 2) + 1));
+		treeset_add(second, _(bench_rand(&state) % (3 * NITEMS / 2) + 1));
+	}
+
+	run("union, inserting", insert_union);
+	run("union, merging", treeset_union);
+	run("intersection, probing", probe_intersection);
+	run("intersection, merging", treeset_intersection);
+	run("difference, merging", treeset_difference);
+
+	treeset_t *target = copy(first);
+	uint64_t start = bench_now_ns();
+	treeset_union_into(target, second);
+	printf("%-22s %9.1f ms  (%zu items)\n", "union_into", (double)(bench_now_ns() - start) / 1e6, treeset_size(target));
+	treeset_free(target);
+
+	target = copy(first);
+	start = bench_now_ns();
+	treeset_retain_all(target, second);
+	printf("%-22s %9.1f ms  (%zu items)\n", "retain_all", (double)(bench_now_ns() - start) / 1e6, treeset_size(target));
+	treeset_free(target);
+
+	treeset_free(first);
+	treeset_free(second);
+
+	return 0;
+}
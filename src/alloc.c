@@ -0,0 +1,502 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "alloc.h"
+#include "panic.h"
+#include "functions.h"
+#include "debug.h"
+
+/* ------------------------------------------------------------- */
+/*                ---------- allocator ----------                */
+/* ------------------------------------------------------------- */
+
+static void *system_alloc(void *context, size_t size)
+{
+    return malloc(size);
+}
+
+static void *system_realloc(void *context, void *ptr, size_t old_size, size_t new_size)
+{
+    return realloc(ptr, new_size);
+}
+
+static void system_free(void *context, void *ptr, size_t size)
+{
+    free(ptr);
+}
+
+allocator_t system_allocator = {
+    .alloc = system_alloc,
+    .realloc = system_realloc,
+    .free = system_free,
+    .context = NULL};
+
+void *allocator_alloc(allocator_t *allocator, size_t size)
+{
+    void *ptr = (allocator->alloc)(allocator->context, size);
+    if (ptr == NULL && size > 0)
+        panic("Out of memory allocating %zu bytes", size);
+    return ptr;
+}
+
+void *allocator_calloc(allocator_t *allocator, size_t nitems, size_t size)
+{
+    void *ptr = allocator_alloc(allocator, nitems * size);
+    memset(ptr, 0, nitems * size);
+    return ptr;
+}
+
+void *allocator_realloc(allocator_t *allocator, void *ptr, size_t old_size, size_t new_size)
+{
+    void *new_ptr = (allocator->realloc)(allocator->context, ptr, old_size, new_size);
+    if (new_ptr == NULL && new_size > 0)
+        panic("Out of memory reallocating %zu bytes", new_size);
+    return new_ptr;
+}
+
+void allocator_free(allocator_t *allocator, void *ptr, size_t size)
+{
+    if (ptr != NULL)
+        (allocator->free)(allocator->context, ptr, size);
+}
+
+/* ------------------------------------------------------------- */
+/*                  ---------- arena ----------                  */
+/* ------------------------------------------------------------- */
+
+#define arena_ALIGN (_Alignof(max_align_t))
+
+struct arena_block
+{
+    struct arena_block *next;
+    size_t size;
+    _Alignas(max_align_t) uint8_t data[];
+};
+
+struct arena
+{
+    allocator_t allocator;
+    size_t block_size;
+    size_t used;
+    struct arena_block *blocks; /* Newest first; allocations bump out of the head. */
+    uint8_t *bump;
+    uint8_t *bump_end;
+    uint8_t *last;              /* Most recent allocation, which can grow or be rolled back in place. */
+};
+
+static size_t arena_align(size_t size)
+{
+    return (size + arena_ALIGN - 1) / arena_ALIGN * arena_ALIGN;
+}
+
+static void arena_grow(arena_t *arena, size_t size)
+{
+    size_t block_size = max(arena->block_size, size);
+    struct arena_block *block = malloc(sizeof(struct arena_block) + block_size);
+
+    if (block == NULL)
+        panic("Out of memory growing arena by %zu bytes", block_size);
+
+    block->next = arena->blocks;
+    block->size = block_size;
+    arena->blocks = block;
+
+    arena->bump = block->data;
+    arena->bump_end = block->data + block_size;
+}
+
+static void *arena_alloc(void *context, size_t size)
+{
+    arena_t *arena = context;
+    size = arena_align(size);
+
+    if ((size_t)(arena->bump_end - arena->bump) < size)
+        arena_grow(arena, size);
+
+    arena->last = arena->bump;
+    arena->bump += size;
+    arena->used += size;
+
+    return arena->last;
+}
+
+static void *arena_realloc(void *context, void *ptr, size_t old_size, size_t new_size)
+{
+    arena_t *arena = context;
+
+    if (ptr == NULL)
+        return arena_alloc(arena, new_size);
+
+    /* The most recent allocation can be resized in place. */
+    if (ptr == arena->last &&
+        arena->last + arena_align(new_size) <= arena->bump_end)
+    {
+        arena->used += arena_align(new_size) - (arena->bump - arena->last);
+        arena->bump = arena->last + arena_align(new_size);
+        return ptr;
+    }
+
+    void *new_ptr = arena_alloc(arena, new_size);
+    memcpy(new_ptr, ptr, min(old_size, new_size));
+    return new_ptr;
+}
+
+static void arena_free_block(void *context, void *ptr, size_t size)
+{
+    arena_t *arena = context;
+
+    if (ptr == arena->last)
+    {
+        arena->used -= arena->bump - arena->last;
+        arena->bump = arena->last;
+        arena->last = NULL;
+    }
+}
+
+arena_t *_arena_new_(arena_config_t config)
+{
+    arena_t *arena = $new(
+        arena_t,
+        .block_size = config.block_size > 0
+                          ? config.block_size
+                          : arena_DEFAULT_BLOCK_SIZE,
+        .used = 0,
+        .blocks = NULL,
+        .bump = NULL,
+        .bump_end = NULL,
+        .last = NULL);
+
+    arena->allocator = (allocator_t){
+        .alloc = arena_alloc,
+        .realloc = arena_realloc,
+        .free = arena_free_block,
+        .context = arena};
+
+    return arena;
+}
+
+allocator_t *arena_allocator(arena_t *arena)
+{
+    return &arena->allocator;
+}
+
+size_t arena_used(arena_t *arena)
+{
+    return arena->used;
+}
+
+void arena_reset(arena_t *arena)
+{
+    if (arena->blocks == NULL)
+        return;
+
+    /* Keep the oldest block for reuse, whatever its size (an oversized first
+       allocation makes it larger than the default), and free the rest. */
+    struct arena_block *block = arena->blocks;
+    while (block->next != NULL)
+    {
+        struct arena_block *next = block->next;
+        free(block);
+        block = next;
+    }
+
+    arena->blocks = block;
+    arena->bump = block->data;
+    arena->bump_end = block->data + block->size;
+    arena->last = NULL;
+    arena->used = 0;
+}
+
+void arena_free(arena_t *arena)
+{
+    for (struct arena_block *block = arena->blocks, *next; block != NULL; block = next)
+    {
+        next = block->next;
+        free(block);
+    }
+
+    free(arena);
+}
+
+/* ------------------------------------------------------------- */
+/*              ---------- thread cache ----------               */
+/* ------------------------------------------------------------- */
+
+#define thread_cache_NCLASSES (thread_cache_MAX_SIZE / thread_cache_CLASS_SIZE)
+
+struct thread_cache_block
+{
+    struct thread_cache_block *next;
+};
+
+struct thread_cache_bin
+{
+    struct thread_cache_block *blocks;
+    size_t nblocks;
+};
+
+static _Thread_local struct thread_cache_bin thread_cache_bins[thread_cache_NCLASSES];
+
+/* A thread that caches a block sets its value of this key, whose
+ * destructor flushes the thread's bins when it exits. */
+static pthread_key_t thread_cache_exit_key;
+static pthread_once_t thread_cache_exit_key_once = PTHREAD_ONCE_INIT;
+static _Thread_local bool thread_cache_exit_registered;
+
+static void thread_cache_on_exit(void *value)
+{
+    thread_cache_flush();
+}
+
+static void thread_cache_create_exit_key(void)
+{
+    if (pthread_key_create(&thread_cache_exit_key, thread_cache_on_exit) != 0)
+        panic("Failed to create the thread cache's exit key");
+}
+
+static void thread_cache_register_exit(void)
+{
+    pthread_once(&thread_cache_exit_key_once, thread_cache_create_exit_key);
+    pthread_setspecific(thread_cache_exit_key, &thread_cache_exit_registered);
+    thread_cache_exit_registered = true;
+}
+
+/* Every block of a class is malloc'ed at the class's full size, so any
+ * cached block can serve any request of that class. */
+static size_t thread_cache_class(size_t size)
+{
+    return size == 0 ? 0 : (size - 1) / thread_cache_CLASS_SIZE;
+}
+
+static void *thread_cache_alloc(void *context, size_t size)
+{
+    if (size > thread_cache_MAX_SIZE)
+        return malloc(size);
+
+    size_t class = thread_cache_class(size);
+    struct thread_cache_bin *bin = &thread_cache_bins[class];
+
+    if (bin->blocks == NULL)
+        return malloc((class + 1) * thread_cache_CLASS_SIZE);
+
+    struct thread_cache_block *block = bin->blocks;
+    bin->blocks = block->next;
+    bin->nblocks--;
+
+    return block;
+}
+
+static void thread_cache_free(void *context, void *ptr, size_t size)
+{
+    if (size > thread_cache_MAX_SIZE)
+    {
+        free(ptr);
+        return;
+    }
+
+    struct thread_cache_bin *bin = &thread_cache_bins[thread_cache_class(size)];
+
+    if (bin->nblocks == thread_cache_MAX_BLOCKS)
+    {
+        free(ptr);
+        return;
+    }
+
+    if (!thread_cache_exit_registered)
+        thread_cache_register_exit();
+
+    struct thread_cache_block *block = ptr;
+    block->next = bin->blocks;
+    bin->blocks = block;
+    bin->nblocks++;
+}
+
+static void *thread_cache_realloc(void *context, void *ptr, size_t old_size, size_t new_size)
+{
+    if (ptr == NULL)
+        return thread_cache_alloc(context, new_size);
+
+    if (old_size > thread_cache_MAX_SIZE && new_size > thread_cache_MAX_SIZE)
+        return realloc(ptr, new_size);
+
+    if (old_size <= thread_cache_MAX_SIZE && new_size <= thread_cache_MAX_SIZE &&
+        thread_cache_class(old_size) == thread_cache_class(new_size))
+        return ptr;
+
+    void *new_ptr = thread_cache_alloc(context, new_size);
+    if (new_ptr != NULL)
+    {
+        memcpy(new_ptr, ptr, min(old_size, new_size));
+        thread_cache_free(context, ptr, old_size);
+    }
+
+    return new_ptr;
+}
+
+allocator_t thread_cache_allocator = {
+    .alloc = thread_cache_alloc,
+    .realloc = thread_cache_realloc,
+    .free = thread_cache_free,
+    .context = NULL};
+
+void thread_cache_flush(void)
+{
+    for (size_t class = 0; class < thread_cache_NCLASSES; class++)
+    {
+        struct thread_cache_bin *bin = &thread_cache_bins[class];
+
+        while (bin->blocks != NULL)
+        {
+            struct thread_cache_block *block = bin->blocks;
+            bin->blocks = block->next;
+            free(block);
+        }
+
+        bin->nblocks = 0;
+    }
+
+    /* Blocks cached after this, such as by other exit destructors, set
+       the key again, so that its destructor runs another round. */
+    thread_cache_exit_registered = false;
+}
+
+/* ------------------------------------------------------------- */
+/*                ---------- node pool ----------                */
+/* ------------------------------------------------------------- */
+
+struct node_pool_chunk
+{
+    struct node_pool_chunk *next;
+    size_t nnodes;
+    _Alignas(max_align_t) uint8_t nodes[];
+};
+
+struct node_pool_free_node
+{
+    struct node_pool_free_node *next;
+};
+
+struct node_pool
+{
+    size_t node_size;
+    size_t chunk_nodes;
+    size_t size;
+    size_t nchunks;
+    struct node_pool_chunk *chunks;
+    struct node_pool_free_node *free_list;
+    allocator_t *allocator;
+
+    /* Untouched tail of the newest chunk. Nodes are handed out from here
+     * in order, so a new chunk is never walked to build its freelist. */
+    uint8_t *bump;
+    uint8_t *bump_end;
+};
+
+node_pool_t *_node_pool_new_(node_pool_config_t config)
+{
+    if (config.node_size == 0)
+        panic("Can't create a node pool for nodes of size 0");
+
+    /* Every node must be able to hold a freelist link, and stay aligned
+     * for the pointers at the front of the containers' nodes. */
+    size_t node_size = max(config.node_size, sizeof(struct node_pool_free_node));
+    node_size = (node_size + sizeof(void *) - 1) / sizeof(void *) * sizeof(void *);
+
+    allocator_t *allocator = allocator_or_default(config.allocator);
+
+    return $new_in(
+        allocator,
+        node_pool_t,
+        .node_size = node_size,
+        .chunk_nodes = config.chunk_nodes == 0
+                           ? node_pool_MIN_CHUNK_NODES
+                           : config.chunk_nodes,
+        .size = 0,
+        .nchunks = 0,
+        .chunks = NULL,
+        .free_list = NULL,
+        .allocator = allocator,
+        .bump = NULL,
+        .bump_end = NULL);
+}
+
+static void node_pool_add_chunk(node_pool_t *pool, size_t nnodes)
+{
+    struct node_pool_chunk *chunk = allocator_alloc(
+        pool->allocator,
+        sizeof(struct node_pool_chunk) + pool->node_size * nnodes);
+
+    chunk->next = pool->chunks;
+    chunk->nnodes = nnodes;
+    pool->chunks = chunk;
+    pool->nchunks++;
+
+    pool->bump = chunk->nodes;
+    pool->bump_end = chunk->nodes + pool->node_size * nnodes;
+}
+
+static void node_pool_grow(node_pool_t *pool)
+{
+    node_pool_add_chunk(pool, pool->chunk_nodes);
+
+    if (pool->chunk_nodes < node_pool_MAX_CHUNK_NODES)
+        pool->chunk_nodes *= 2;
+}
+
+void node_pool_reserve(node_pool_t *pool, size_t nnodes)
+{
+    if ((size_t)(pool->bump_end - pool->bump) < pool->node_size * nnodes)
+        node_pool_add_chunk(pool, nnodes);
+}
+
+void *node_pool_alloc(node_pool_t *pool)
+{
+    void *node;
+
+    if (pool->free_list != NULL)
+    {
+        node = pool->free_list;
+        pool->free_list = pool->free_list->next;
+    }
+    else
+    {
+        if (pool->bump == pool->bump_end)
+            node_pool_grow(pool);
+
+        node = pool->bump;
+        pool->bump += pool->node_size;
+    }
+
+    pool->size++;
+    return node;
+}
+
+void node_pool_release(node_pool_t *pool, void *node)
+{
+    struct node_pool_free_node *free_node = node;
+    free_node->next = pool->free_list;
+    pool->free_list = free_node;
+    pool->size--;
+}
+
+size_t node_pool_size(node_pool_t *pool)
+{
+    return pool->size;
+}
+
+size_t node_pool_nchunks(node_pool_t *pool)
+{
+    return pool->nchunks;
+}
+
+void node_pool_free(node_pool_t *pool)
+{
+    for (struct node_pool_chunk *chunk = pool->chunks, *next; chunk != NULL; chunk = next)
+    {
+        next = chunk->next;
+        allocator_free(pool->allocator, chunk,
+                       sizeof(struct node_pool_chunk) + pool->node_size * chunk->nnodes);
+    }
+
+    allocator_free(pool->allocator, pool, sizeof(node_pool_t));
+}
@@ -0,0 +1,116 @@
+#pragma once
+
+#include <stdlib.h>
+#include <stdbool.h>
+
+/* ---------------- allocator -----------------
+ * The interface containers allocate through. A
+ * NULL allocator in a config means the system
+ * allocator. Callers pass back the size of every
+ * block on realloc and free, so allocators never
+ * need to keep a header for it.
+ */
+
+typedef struct allocator
+{
+    void *(*alloc)   (void *context, size_t size);
+    void *(*realloc) (void *context, void *ptr, size_t old_size, size_t new_size);
+    void  (*free)    (void *context, void *ptr, size_t size);
+    void *context;
+} allocator_t;
+
+extern allocator_t system_allocator;
+
+#define allocator_or_default(_allocator_) \
+    ((_allocator_) != NULL ? (_allocator_) : &system_allocator)
+
+#define $new_in(allocator, type, ...)                                     \
+    ({                                                                    \
+        type *v = (type *)allocator_alloc((allocator), sizeof(type));     \
+        *v = (type){__VA_ARGS__};                                         \
+        v;                                                                \
+    })
+
+void *allocator_alloc   (allocator_t *, size_t size);
+void *allocator_calloc  (allocator_t *, size_t nitems, size_t size);
+void *allocator_realloc (allocator_t *, void *, size_t old_size, size_t new_size);
+void  allocator_free    (allocator_t *, void *, size_t size);
+
+/* ------------------ arena -------------------
+ * A bump allocator. Allocations are carved in
+ * order out of large blocks, freeing is a no-op
+ * (except for the most recent allocation, which
+ * is rolled back), and resetting or freeing the
+ * arena drops every allocation at once. Place
+ * short-lived containers in an arena to release
+ * them together.
+ */
+
+#define arena_DEFAULT_BLOCK_SIZE 65536
+
+#define arena_new(...) \
+    (_arena_new_((arena_config_t){__VA_ARGS__}))
+
+typedef struct arena arena_t;
+
+typedef struct arena_config
+{
+    size_t block_size;
+} arena_config_t;
+
+arena_t     *_arena_new_      (arena_config_t);
+allocator_t *arena_allocator  (arena_t *);      /* Returns the allocator handing out the arena's memory. */
+size_t       arena_used       (arena_t *);      /* Returns the number of bytes currently allocated from the arena. */
+void         arena_reset      (arena_t *);      /* Drops every allocation, keeping the first block for reuse. */
+void         arena_free       (arena_t *);      /* Frees the arena and every allocation made from it. */
+
+/* --------------- thread cache ---------------
+ * A system allocator front end that keeps a
+ * small per-thread cache of freed blocks for
+ * each size class up to thread_cache_MAX_SIZE,
+ * so small allocations and frees mostly skip
+ * malloc. Blocks may be freed from any thread.
+ * A thread's cache is flushed when it exits
+ * through pthread_exit or by returning from its
+ * start routine.
+ */
+
+#define thread_cache_CLASS_SIZE 16
+#define thread_cache_MAX_SIZE 256
+#define thread_cache_MAX_BLOCKS 64 /* Cached blocks per size class. */
+
+extern allocator_t thread_cache_allocator;
+
+void thread_cache_flush (void); /* Returns the calling thread's cached blocks to the system. */
+
+/* ---------------- node pool -----------------
+ * A slab allocator for nodes of a single, fixed
+ * size. Nodes are carved out of chunks that grow
+ * geometrically, released nodes are threaded on
+ * an intrusive freelist for reuse, and freeing
+ * the pool returns every node at once, with one
+ * free per chunk.
+ */
+
+#define node_pool_MIN_CHUNK_NODES 32
+#define node_pool_MAX_CHUNK_NODES 65536
+
+#define node_pool_new(_node_size_, ...) \
+    (_node_pool_new_((node_pool_config_t){.node_size = (_node_size_), __VA_ARGS__}))
+
+typedef struct node_pool node_pool_t;
+
+typedef struct node_pool_config
+{
+    size_t node_size;
+    size_t chunk_nodes; /* Number of nodes in the first chunk. */
+    allocator_t *allocator;
+} node_pool_config_t;
+
+node_pool_t *_node_pool_new_     (node_pool_config_t);
+void        *node_pool_alloc     (node_pool_t *);         /* Returns an uninitialized node. */
+void         node_pool_release   (node_pool_t *, void *); /* Returns a node to the pool for reuse. */
+void         node_pool_reserve   (node_pool_t *, size_t); /* Makes the next n nodes handed out past the freelist come from one contiguous chunk. Leaves the growth of later chunks as it was. */
+size_t       node_pool_size      (node_pool_t *);         /* Returns the number of nodes currently handed out. */
+size_t       node_pool_nchunks   (node_pool_t *);         /* Returns the number of chunks backing the pool. */
+void         node_pool_free      (node_pool_t *);         /* Frees the pool, along with every node it handed out. */
@@ -0,0 +1,886 @@
+#include <stdint.h>
+#include <unistd.h>
+#include "concurrent.h"
+#include "panic.h"
+#include "functions.h"
+#include "debug.h"
+
+/* ------------------------------------------------------------- */
+/*           ---------- concurrent hashmap ----------            */
+/* ------------------------------------------------------------- */
+
+/* Each shard sits on its own cache lines, so that taking one shard's
+ * lock never invalidates the line holding a neighbouring shard's. */
+struct concurrent_hashmap_shard
+{
+    _Alignas(64) pthread_rwlock_t lock;
+    hashmap_t *map;
+};
+
+struct concurrent_hashmap
+{
+    size_t nshards;
+    unsigned shard_shift;
+#if hashmap_ALLOW_HASH_FN_OVERLOAD
+    hash_fn_t hash_fn;
+#endif
+    struct concurrent_hashmap_shard *shards;
+};
+
+/* Shards are picked from the top bits of the hash, which the shards'
+ * tables never index by, so that the keys of one shard still spread
+ * over every bucket of its table. */
+static struct concurrent_hashmap_shard *concurrent_hashmap_shard(concurrent_hashmap_t *map, void *key)
+{
+#if hashmap_ALLOW_HASH_FN_OVERLOAD
+    uint64_t hash = hash_key(map->hash_fn, key);
+#else
+    uint64_t hash = hash_key(NULL, key);
+#endif
+
+    return &map->shards[map->shard_shift == 64 ? 0 : hash >> map->shard_shift];
+}
+
+concurrent_hashmap_t *_concurrent_hashmap_new_(concurrent_hashmap_config_t config)
+{
+    size_t nshards = 1;
+    unsigned bits = 0;
+    size_t requested = config.nshards > 0 ? config.nshards : concurrent_hashmap_DEFAULT_SHARDS;
+
+    while (nshards < requested)
+    {
+        nshards <<= 1;
+        bits++;
+    }
+
+    struct concurrent_hashmap_shard *shards = aligned_alloc(
+        _Alignof(struct concurrent_hashmap_shard),
+        nshards * sizeof(struct concurrent_hashmap_shard));
+
+    if (shards == NULL)
+        panic("Out of memory allocating %zu hashmap shards", nshards);
+
+    for (size_t i = 0; i < nshards; i++)
+    {
+        if (pthread_rwlock_init(&shards[i].lock, NULL) != 0)
+            panic("Failed to initialize the lock of hashmap shard %zu", i);
+
+        shards[i].map = hashmap_new(
+            .capacity = config.capacity > 0
+                            ? max(config.capacity / nshards, (size_t)hashmap_DEFAULT_CAP)
+                            : 0,
+            .backend = config.backend,
+#if hashmap_ALLOW_KEY_EQ_FN_OVERLOAD
+            .key_equal_fn = config.key_equal_fn,
+#endif
+#if hashmap_ALLOW_HASH_FN_OVERLOAD
+            .hash_fn = config.hash_fn,
+#endif
+        );
+    }
+
+    return $new(
+        concurrent_hashmap_t,
+        .nshards = nshards,
+        .shard_shift = 64 - bits,
+#if hashmap_ALLOW_HASH_FN_OVERLOAD
+        .hash_fn = config.hash_fn,
+#endif
+        .shards = shards);
+}
+
+size_t concurrent_hashmap_nshards(concurrent_hashmap_t *map)
+{
+    return map->nshards;
+}
+
+size_t concurrent_hashmap_size(concurrent_hashmap_t *map)
+{
+    size_t size = 0;
+
+    for (size_t i = 0; i < map->nshards; i++)
+    {
+        pthread_rwlock_rdlock(&map->shards[i].lock);
+        size += hashmap_size(map->shards[i].map);
+        pthread_rwlock_unlock(&map->shards[i].lock);
+    }
+
+    return size;
+}
+
+bool concurrent_hashmap_contains_key(concurrent_hashmap_t *map, void *key)
+{
+    struct concurrent_hashmap_shard *shard = concurrent_hashmap_shard(map, key);
+
+    pthread_rwlock_rdlock(&shard->lock);
+    bool contains = hashmap_contains_key(shard->map, key);
+    pthread_rwlock_unlock(&shard->lock);
+
+    return contains;
+}
+
+void *concurrent_hashmap_get_at(concurrent_hashmap_t *map, void *key)
+{
+    struct concurrent_hashmap_shard *shard = concurrent_hashmap_shard(map, key);
+
+    pthread_rwlock_rdlock(&shard->lock);
+    void *value = hashmap_get_at(shard->map, key);
+    pthread_rwlock_unlock(&shard->lock);
+
+    return value;
+}
+
+void concurrent_hashmap_set_at(concurrent_hashmap_t *map, void *key, void *value)
+{
+    struct concurrent_hashmap_shard *shard = concurrent_hashmap_shard(map, key);
+
+    pthread_rwlock_wrlock(&shard->lock);
+    hashmap_set_at(shard->map, key, value);
+    pthread_rwlock_unlock(&shard->lock);
+}
+
+void *concurrent_hashmap_remove_at(concurrent_hashmap_t *map, void *key)
+{
+    struct concurrent_hashmap_shard *shard = concurrent_hashmap_shard(map, key);
+
+    pthread_rwlock_wrlock(&shard->lock);
+    void *value = hashmap_remove_at(shard->map, key);
+    pthread_rwlock_unlock(&shard->lock);
+
+    return value;
+}
+
+void *concurrent_hashmap_compute_if_absent(concurrent_hashmap_t *map, void *key, map_fn_t map_fn)
+{
+    struct concurrent_hashmap_shard *shard = concurrent_hashmap_shard(map, key);
+    void *value;
+
+    /* Most calls find the key, and only need the read lock. */
+    pthread_rwlock_rdlock(&shard->lock);
+    bool found = hashmap_contains_key(shard->map, key);
+    if (found)
+        value = hashmap_get_at(shard->map, key);
+    pthread_rwlock_unlock(&shard->lock);
+
+    if (found)
+        return value;
+
+    /* Another thread may have inserted the key between the two locks. */
+    pthread_rwlock_wrlock(&shard->lock);
+    if (hashmap_contains_key(shard->map, key))
+        value = hashmap_get_at(shard->map, key);
+    else
+    {
+        value = map_fn(key);
+        hashmap_set_at(shard->map, key, value);
+    }
+    pthread_rwlock_unlock(&shard->lock);
+
+    return value;
+}
+
+void concurrent_hashmap_free(concurrent_hashmap_t *map)
+{
+    for (size_t i = 0; i < map->nshards; i++)
+    {
+        pthread_rwlock_destroy(&map->shards[i].lock);
+        hashmap_free(map->shards[i].map);
+    }
+
+    /* Shards come from aligned_alloc, which the memory debugger doesn't track. */
+    (free)(map->shards);
+    free(map);
+}
+
+/* ------------------------------------------------------------- */
+/*                ---------- rcu epochs ----------                */
+/* ------------------------------------------------------------- */
+
+/* Every thread that reads an rcu hashmap claims a slot, where it
+ * publishes the global epoch it started reading in, or 0 outside of
+ * reads. Slots are shared by all maps, and released on thread exit. */
+struct rcu_slot
+{
+    _Alignas(64) uint64_t epoch;
+    bool in_use;
+};
+
+static struct rcu_slot rcu_slots[rcu_MAX_THREADS];
+static size_t rcu_nslots;     /* High-water mark of claimed slots, bounding writers' scans. */
+static uint64_t rcu_epoch = 1;
+
+static pthread_once_t rcu_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t rcu_key;
+
+static _Thread_local struct rcu_slot *rcu_thread_slot;
+static _Thread_local unsigned rcu_depth;
+
+static void rcu_release_slot(void *slot)
+{
+    __atomic_store_n(&((struct rcu_slot *)slot)->epoch, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&((struct rcu_slot *)slot)->in_use, false, __ATOMIC_RELEASE);
+}
+
+static void rcu_create_key(void)
+{
+    if (pthread_key_create(&rcu_key, rcu_release_slot) != 0)
+        panic("Failed to create the rcu thread key");
+}
+
+static struct rcu_slot *rcu_claim_slot(void)
+{
+    pthread_once(&rcu_key_once, rcu_create_key);
+
+    for (size_t i = 0; i < rcu_MAX_THREADS; i++)
+    {
+        bool in_use = false;
+        if (__atomic_compare_exchange_n(&rcu_slots[i].in_use, &in_use, true, false,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+        {
+            size_t nslots = __atomic_load_n(&rcu_nslots, __ATOMIC_RELAXED);
+            while (nslots < i + 1 &&
+                   !__atomic_compare_exchange_n(&rcu_nslots, &nslots, i + 1, false,
+                                                __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+                ;
+
+            pthread_setspecific(rcu_key, &rcu_slots[i]);
+            return &rcu_slots[i];
+        }
+    }
+
+    panic("More than %d threads are reading rcu hashmaps", rcu_MAX_THREADS);
+}
+
+/* Entering a read publishes the current epoch, then fences, so that a
+ * writer either sees the epoch when it scans the slots, or unlinked
+ * whatever it frees before this thread's first load from the map.
+ * Past a thread's first read, neither step can wait. */
+static inline void rcu_read_lock(void)
+{
+    if (rcu_depth++ > 0)
+        return;
+
+    if (rcu_thread_slot == NULL)
+        rcu_thread_slot = rcu_claim_slot();
+
+    __atomic_store_n(&rcu_thread_slot->epoch,
+                     __atomic_load_n(&rcu_epoch, __ATOMIC_ACQUIRE),
+                     __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+static inline void rcu_read_unlock(void)
+{
+    if (--rcu_depth == 0)
+        __atomic_store_n(&rcu_thread_slot->epoch, 0, __ATOMIC_RELEASE);
+}
+
+/* Called after unlinking a block. Returns the epoch to tag it with: it
+ * may be freed once no thread is reading in that epoch or an earlier
+ * one, since later readers start after the unlink. */
+static uint64_t rcu_retire_epoch(void)
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    return __atomic_fetch_add(&rcu_epoch, 1, __ATOMIC_SEQ_CST);
+}
+
+/* Returns the oldest epoch still being read in, or UINT64_MAX. */
+static uint64_t rcu_oldest_epoch(void)
+{
+    uint64_t oldest = UINT64_MAX;
+    size_t nslots = __atomic_load_n(&rcu_nslots, __ATOMIC_ACQUIRE);
+
+    for (size_t i = 0; i < nslots; i++)
+    {
+        uint64_t epoch = __atomic_load_n(&rcu_slots[i].epoch, __ATOMIC_ACQUIRE);
+        if (epoch != 0 && epoch < oldest)
+            oldest = epoch;
+    }
+
+    return oldest;
+}
+
+/* ------------------------------------------------------------- */
+/*              ---------- rcu hashmap ----------                */
+/* ------------------------------------------------------------- */
+
+/* Readers walk entries and tables with acquire loads of the pointers
+ * writers publish with release stores. An entry's key and hash never
+ * change once it is linked, and its value is replaced atomically. */
+
+struct rcu_hashmap_entry
+{
+    struct rcu_hashmap_entry *next;
+    void *key;
+    void *value;
+    size_t hash;
+};
+
+struct rcu_hashmap_table
+{
+    size_t capacity;
+    struct rcu_hashmap_entry *buckets[];
+};
+
+typedef enum rcu_retired_kind
+{
+    RCU_RETIRED_ENTRY,
+    RCU_RETIRED_TABLE /* Freed along with every entry still linked in it. */
+} rcu_retired_kind_t;
+
+struct rcu_retired
+{
+    struct rcu_retired *next;
+    uint64_t epoch;
+    rcu_retired_kind_t kind;
+    void *block;
+};
+
+struct rcu_hashmap
+{
+    struct rcu_hashmap_table *table;
+    size_t size;
+    pthread_mutex_t write_lock;
+    allocator_t *allocator;
+#if hashmap_ALLOW_KEY_EQ_FN_OVERLOAD
+    equal_fn_t key_eq_fn;
+#endif
+#if hashmap_ALLOW_HASH_FN_OVERLOAD
+    hash_fn_t hash_fn;
+#endif
+    struct rcu_retired *retired; /* Newest first. */
+    size_t nretired;
+};
+
+static inline size_t rcu_hashmap_hash(rcu_hashmap_t *map, void *key)
+{
+#if hashmap_ALLOW_HASH_FN_OVERLOAD
+    return hash_key(map->hash_fn, key);
+#else
+    return hash_key(NULL, key);
+#endif
+}
+
+static inline bool rcu_hashmap_keys_eq(rcu_hashmap_t *map, void *key1, void *key2)
+{
+#if hashmap_ALLOW_KEY_EQ_FN_OVERLOAD
+    return map->key_eq_fn != NULL ? map->key_eq_fn(key1, key2) : key1 == key2;
+#else
+    return key1 == key2;
+#endif
+}
+
+static struct rcu_hashmap_table *rcu_hashmap_table_new(rcu_hashmap_t *map, size_t capacity)
+{
+    struct rcu_hashmap_table *table = allocator_calloc(
+        map->allocator, 1,
+        sizeof(struct rcu_hashmap_table) + capacity * sizeof(struct rcu_hashmap_entry *));
+    table->capacity = capacity;
+    return table;
+}
+
+static void rcu_hashmap_table_free(rcu_hashmap_t *map, struct rcu_hashmap_table *table)
+{
+    for (size_t pos = 0; pos < table->capacity; pos++)
+    {
+        for (struct rcu_hashmap_entry *entry = table->buckets[pos], *next; entry != NULL; entry = next)
+        {
+            next = entry->next;
+            allocator_free(map->allocator, entry, sizeof(struct rcu_hashmap_entry));
+        }
+    }
+
+    allocator_free(map->allocator, table,
+                   sizeof(struct rcu_hashmap_table) + table->capacity * sizeof(struct rcu_hashmap_entry *));
+}
+
+static void rcu_hashmap_free_retired(rcu_hashmap_t *map, struct rcu_retired *retired)
+{
+    if (retired->kind == RCU_RETIRED_TABLE)
+        rcu_hashmap_table_free(map, retired->block);
+    else
+        allocator_free(map->allocator, retired->block, sizeof(struct rcu_hashmap_entry));
+
+    allocator_free(map->allocator, retired, sizeof(struct rcu_retired));
+    map->nretired--;
+}
+
+/* Frees every retired block no reader can still reach. */
+static void rcu_hashmap_reclaim_retired(rcu_hashmap_t *map)
+{
+    uint64_t oldest = rcu_oldest_epoch();
+
+    for (struct rcu_retired **link = &map->retired, *retired; (retired = *link) != NULL;)
+    {
+        if (retired->epoch < oldest)
+        {
+            *link = retired->next;
+            rcu_hashmap_free_retired(map, retired);
+        }
+        else
+            link = &retired->next;
+    }
+}
+
+static void rcu_hashmap_retire(rcu_hashmap_t *map, rcu_retired_kind_t kind, void *block)
+{
+    map->retired = $new_in(
+        map->allocator,
+        struct rcu_retired,
+        .next = map->retired,
+        .epoch = rcu_retire_epoch(),
+        .kind = kind,
+        .block = block);
+
+    if (++map->nretired >= rcu_hashmap_RECLAIM_THRESHOLD)
+        rcu_hashmap_reclaim_retired(map);
+}
+
+rcu_hashmap_t *_rcu_hashmap_new_(rcu_hashmap_config_t config)
+{
+    allocator_t *allocator = allocator_or_default(config.allocator);
+
+    size_t capacity = rcu_hashmap_DEFAULT_CAP;
+    while (capacity < config.capacity)
+        capacity <<= 1;
+
+    rcu_hashmap_t *map = $new_in(
+        allocator,
+        rcu_hashmap_t,
+        .size = 0,
+        .allocator = allocator,
+#if hashmap_ALLOW_KEY_EQ_FN_OVERLOAD
+        .key_eq_fn = config.key_equal_fn,
+#endif
+#if hashmap_ALLOW_HASH_FN_OVERLOAD
+        .hash_fn = config.hash_fn,
+#endif
+        .retired = NULL,
+        .nretired = 0);
+
+    if (pthread_mutex_init(&map->write_lock, NULL) != 0)
+        panic("Failed to initialize the write lock of an rcu hashmap");
+
+    map->table = rcu_hashmap_table_new(map, capacity);
+    return map;
+}
+
+size_t rcu_hashmap_size(rcu_hashmap_t *map)
+{
+    return __atomic_load_n(&map->size, __ATOMIC_RELAXED);
+}
+
+bool rcu_hashmap_is_empty(rcu_hashmap_t *map)
+{
+    return rcu_hashmap_size(map) == 0;
+}
+
+/* Must be called from a read section or under the write lock. */
+static struct rcu_hashmap_entry *rcu_hashmap_find(rcu_hashmap_t *map, void *key, size_t hash)
+{
+    struct rcu_hashmap_table *table = __atomic_load_n(&map->table, __ATOMIC_ACQUIRE);
+
+    for (struct rcu_hashmap_entry *entry = __atomic_load_n(&table->buckets[hash & (table->capacity - 1)], __ATOMIC_ACQUIRE);
+         entry != NULL;
+         entry = __atomic_load_n(&entry->next, __ATOMIC_ACQUIRE))
+    {
+        if (entry->hash == hash && rcu_hashmap_keys_eq(map, entry->key, key))
+            return entry;
+    }
+
+    return NULL;
+}
+
+bool rcu_hashmap_contains_key(rcu_hashmap_t *map, void *key)
+{
+    size_t hash = rcu_hashmap_hash(map, key);
+
+    rcu_read_lock();
+    bool contains = rcu_hashmap_find(map, key, hash) != NULL;
+    rcu_read_unlock();
+
+    return contains;
+}
+
+void *rcu_hashmap_get_at(rcu_hashmap_t *map, void *key)
+{
+    size_t hash = rcu_hashmap_hash(map, key);
+
+    rcu_read_lock();
+    struct rcu_hashmap_entry *entry = rcu_hashmap_find(map, key, hash);
+    void *value = entry != NULL ? __atomic_load_n(&entry->value, __ATOMIC_ACQUIRE) : NULL;
+    rcu_read_unlock();
+
+    return value;
+}
+
+/* Copies every entry into a table twice the size, since entries linked
+ * in the old table can't be relinked under readers, and swaps it in. */
+static void rcu_hashmap_grow(rcu_hashmap_t *map)
+{
+    struct rcu_hashmap_table *old_table = map->table;
+    struct rcu_hashmap_table *table = rcu_hashmap_table_new(map, old_table->capacity * 2);
+
+    for (size_t pos = 0; pos < old_table->capacity; pos++)
+    {
+        for (struct rcu_hashmap_entry *entry = old_table->buckets[pos]; entry != NULL; entry = entry->next)
+        {
+            size_t new_pos = entry->hash & (table->capacity - 1);
+            table->buckets[new_pos] = $new_in(
+                map->allocator,
+                struct rcu_hashmap_entry,
+                .next = table->buckets[new_pos],
+                .key = entry->key,
+                .value = entry->value,
+                .hash = entry->hash);
+        }
+    }
+
+    __atomic_store_n(&map->table, table, __ATOMIC_RELEASE);
+    rcu_hashmap_retire(map, RCU_RETIRED_TABLE, old_table);
+}
+
+void rcu_hashmap_set_at(rcu_hashmap_t *map, void *key, void *value)
+{
+    size_t hash = rcu_hashmap_hash(map, key);
+
+    pthread_mutex_lock(&map->write_lock);
+
+    struct rcu_hashmap_entry *entry = rcu_hashmap_find(map, key, hash);
+    if (entry != NULL)
+    {
+        __atomic_store_n(&entry->value, value, __ATOMIC_RELEASE);
+        pthread_mutex_unlock(&map->write_lock);
+        return;
+    }
+
+    if ((double)(map->size + 1) / map->table->capacity > hashmap_SIZE_UP_RATIO)
+        rcu_hashmap_grow(map);
+
+    struct rcu_hashmap_entry **bucket = &map->table->buckets[hash & (map->table->capacity - 1)];
+    entry = $new_in(
+        map->allocator,
+        struct rcu_hashmap_entry,
+        .next = *bucket,
+        .key = key,
+        .value = value,
+        .hash = hash);
+
+    __atomic_store_n(bucket, entry, __ATOMIC_RELEASE);
+    __atomic_store_n(&map->size, map->size + 1, __ATOMIC_RELAXED);
+
+    pthread_mutex_unlock(&map->write_lock);
+}
+
+void *rcu_hashmap_remove_at(rcu_hashmap_t *map, void *key)
+{
+    size_t hash = rcu_hashmap_hash(map, key);
+    void *value = NULL;
+
+    pthread_mutex_lock(&map->write_lock);
+
+    for (struct rcu_hashmap_entry **link = &map->table->buckets[hash & (map->table->capacity - 1)];
+         *link != NULL;
+         link = &(*link)->next)
+    {
+        struct rcu_hashmap_entry *entry = *link;
+
+        if (entry->hash == hash && rcu_hashmap_keys_eq(map, entry->key, key))
+        {
+            /* Readers standing on the entry can still follow its next. */
+            __atomic_store_n(link, entry->next, __ATOMIC_RELEASE);
+            __atomic_store_n(&map->size, map->size - 1, __ATOMIC_RELAXED);
+            value = entry->value;
+            rcu_hashmap_retire(map, RCU_RETIRED_ENTRY, entry);
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&map->write_lock);
+    return value;
+}
+
+size_t rcu_hashmap_reclaim(rcu_hashmap_t *map)
+{
+    pthread_mutex_lock(&map->write_lock);
+    rcu_hashmap_reclaim_retired(map);
+    size_t nretired = map->nretired;
+    pthread_mutex_unlock(&map->write_lock);
+
+    return nretired;
+}
+
+void rcu_hashmap_free(rcu_hashmap_t *map)
+{
+    while (map->retired != NULL)
+    {
+        struct rcu_retired *retired = map->retired;
+        map->retired = retired->next;
+        rcu_hashmap_free_retired(map, retired);
+    }
+
+    rcu_hashmap_table_free(map, map->table);
+    pthread_mutex_destroy(&map->write_lock);
+    allocator_free(map->allocator, map, sizeof(rcu_hashmap_t));
+}
+
+/* ------------------------------------------------------------- */
+/*               ---------- thread pool ----------                */
+/* ------------------------------------------------------------- */
+
+struct thread_pool_task
+{
+    struct thread_pool_task *next;
+    thread_pool_fn_t fn;
+    void *arg;
+    void *result;
+    bool done;
+};
+
+struct thread_pool
+{
+    pthread_mutex_t lock;
+    pthread_cond_t changed; /* Broadcast when a task is queued or done, or the pool stops. */
+    struct thread_pool_task *queue;
+    bool stopping;
+    size_t nthreads;
+    pthread_t *threads;
+};
+
+/* Runs the newest queued task, with the lock held around but not
+ * during it. Returns false if there was none. */
+static bool thread_pool_run_one(thread_pool_t *pool)
+{
+    struct thread_pool_task *task = pool->queue;
+    if (task == NULL)
+        return false;
+
+    pool->queue = task->next;
+    pthread_mutex_unlock(&pool->lock);
+
+    void *result = task->fn(task->arg);
+
+    pthread_mutex_lock(&pool->lock);
+    task->result = result;
+    task->done = true;
+    pthread_cond_broadcast(&pool->changed);
+
+    return true;
+}
+
+static void *thread_pool_worker(void *arg)
+{
+    thread_pool_t *pool = arg;
+
+    pthread_mutex_lock(&pool->lock);
+    while (!pool->stopping)
+    {
+        if (!thread_pool_run_one(pool))
+            pthread_cond_wait(&pool->changed, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return NULL;
+}
+
+thread_pool_t *_thread_pool_new_(thread_pool_config_t config)
+{
+    size_t nthreads = config.nthreads > 0 ? config.nthreads : (size_t)max(sysconf(_SC_NPROCESSORS_ONLN), 1L);
+
+    thread_pool_t *pool = $new(
+        thread_pool_t,
+        .queue = NULL,
+        .stopping = false,
+        .nthreads = nthreads,
+        .threads = malloc(nthreads * sizeof(pthread_t)));
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->changed, NULL);
+
+    for (size_t i = 0; i < nthreads; i++)
+    {
+        if (pthread_create(&pool->threads[i], NULL, thread_pool_worker, pool) != 0)
+            panic("Failed to start thread pool worker %zu of %zu", i + 1, nthreads);
+    }
+
+    return pool;
+}
+
+size_t thread_pool_nthreads(thread_pool_t *pool)
+{
+    return pool->nthreads;
+}
+
+thread_pool_task_t *thread_pool_submit(thread_pool_t *pool, thread_pool_fn_t fn, void *arg)
+{
+    thread_pool_task_t *task = $new(
+        thread_pool_task_t,
+        .fn = fn,
+        .arg = arg,
+        .done = false);
+
+    pthread_mutex_lock(&pool->lock);
+    task->next = pool->queue;
+    pool->queue = task;
+    pthread_cond_broadcast(&pool->changed);
+    pthread_mutex_unlock(&pool->lock);
+
+    return task;
+}
+
+void *thread_pool_wait(thread_pool_t *pool, thread_pool_task_t *task)
+{
+    pthread_mutex_lock(&pool->lock);
+    while (!task->done)
+    {
+        if (!thread_pool_run_one(pool))
+            pthread_cond_wait(&pool->changed, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    void *result = task->result;
+    free(task);
+    return result;
+}
+
+void thread_pool_free(thread_pool_t *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    pool->stopping = true;
+    pthread_cond_broadcast(&pool->changed);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (size_t i = 0; i < pool->nthreads; i++)
+        pthread_join(pool->threads[i], NULL);
+
+    pthread_cond_destroy(&pool->changed);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->threads);
+    free(pool);
+}
+
+/* ------------------------------------------------------------- */
+/*             ---------- parallel treeset ----------             */
+/* ------------------------------------------------------------- */
+
+typedef enum treeset_parallel_op
+{
+    TREESET_PARALLEL_UNION,
+    TREESET_PARALLEL_INTERSECTION,
+    TREESET_PARALLEL_DIFFERENCE,
+} treeset_parallel_op_t;
+
+struct treeset_parallel_merge
+{
+    thread_pool_t *pool;
+    treeset_parallel_op_t op;
+    treeset_t *set1;
+    treeset_t *set2;
+    size_t depth; /* Levels of splitting left before merging sequentially. */
+};
+
+static void *treeset_parallel_merge(void *arg)
+{
+    struct treeset_parallel_merge *merge = arg;
+    size_t size1 = treeset_size(merge->set1), size2 = treeset_size(merge->set2);
+
+    if (merge->depth == 0 || size1 + size2 <= treeset_PARALLEL_GRAIN || size1 == 0 || size2 == 0)
+    {
+        if (merge->op == TREESET_PARALLEL_UNION)
+            treeset_union_into(merge->set1, merge->set2);
+        else if (merge->op == TREESET_PARALLEL_INTERSECTION)
+            treeset_retain_all(merge->set1, merge->set2);
+        else
+            treeset_remove_all(merge->set1, merge->set2);
+
+        treeset_free(merge->set2);
+        return merge->set1;
+    }
+
+    void *pivot = size1 >= size2
+                      ? treeset_select(merge->set1, size1 / 2)
+                      : treeset_select(merge->set2, size2 / 2);
+
+    struct treeset_parallel_merge lo = *merge, hi = *merge;
+    lo.depth = hi.depth = merge->depth - 1;
+    treeset_split(merge->set1, pivot, &lo.set1, &hi.set1);
+    treeset_split(merge->set2, pivot, &lo.set2, &hi.set2);
+
+    thread_pool_task_t *task = thread_pool_submit(merge->pool, treeset_parallel_merge, &lo);
+    treeset_t *result_hi = treeset_parallel_merge(&hi);
+    treeset_t *result_lo = thread_pool_wait(merge->pool, task);
+
+    /* Splitting leaves the lower half in the set it split, so the
+     * result always ends up in the first set. */
+    return treeset_join(result_lo, result_hi);
+}
+
+static treeset_t *treeset_parallel_run(thread_pool_t *pool, treeset_parallel_op_t op, treeset_t *set1, treeset_t *set2)
+{
+    /* A few more pieces than threads, to even out their sizes. */
+    size_t depth = 2;
+    for (size_t nthreads = thread_pool_nthreads(pool); nthreads > 1; nthreads = (nthreads + 1) / 2)
+        depth++;
+
+    return treeset_parallel_merge(&(struct treeset_parallel_merge){
+        .pool = pool,
+        .op = op,
+        .set1 = set1,
+        .set2 = set2,
+        .depth = depth});
+}
+
+treeset_t *treeset_parallel_union(thread_pool_t *pool, treeset_t *set1, treeset_t *set2)
+{
+    return treeset_parallel_run(pool, TREESET_PARALLEL_UNION, set1, set2);
+}
+
+treeset_t *treeset_parallel_intersection(thread_pool_t *pool, treeset_t *set1, treeset_t *set2)
+{
+    return treeset_parallel_run(pool, TREESET_PARALLEL_INTERSECTION, set1, set2);
+}
+
+treeset_t *treeset_parallel_difference(thread_pool_t *pool, treeset_t *set1, treeset_t *set2)
+{
+    return treeset_parallel_run(pool, TREESET_PARALLEL_DIFFERENCE, set1, set2);
+}
+
+struct treeset_parallel_build
+{
+    treeset_config_t config;
+    size_t nitems;
+    void **items;
+};
+
+static void *treeset_parallel_build(void *arg)
+{
+    struct treeset_parallel_build *build = arg;
+    treeset_t *set = _treeset_new_(build->config);
+    _treeset_add_all_(set, build->nitems, build->items);
+    return set;
+}
+
+void treeset_parallel_add_all(thread_pool_t *pool, treeset_t *set, size_t n, void *items[n])
+{
+    size_t nshares = min(thread_pool_nthreads(pool), max(n / treeset_PARALLEL_GRAIN, (size_t)1));
+    struct treeset_parallel_build *builds = malloc(nshares * sizeof(struct treeset_parallel_build));
+    thread_pool_task_t **tasks = malloc(nshares * sizeof(thread_pool_task_t *));
+
+    for (size_t i = 0, start = 0; i < nshares; i++)
+    {
+        size_t nitems = n / nshares + (i < n % nshares);
+        builds[i] = (struct treeset_parallel_build){
+            .config = treeset_get_config(set),
+            .nitems = nitems,
+            .items = items + start};
+        tasks[i] = thread_pool_submit(pool, treeset_parallel_build, &builds[i]);
+        start += nitems;
+    }
+
+    /* Each union leaves its result in the set it is given first. */
+    for (size_t i = 0; i < nshares; i++)
+        treeset_parallel_union(pool, set, thread_pool_wait(pool, tasks[i]));
+
+    free(builds);
+    free(tasks);
+}
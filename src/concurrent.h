@@ -0,0 +1,157 @@
+#pragma once
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include "functions.h"
+#include "data_struct.h"
+
+/* ----------- concurrent hashmap -------------
+ * A hashmap that may be shared between threads.
+ * Keys are partitioned across independently
+ * locked shards, each an ordinary hashmap_t
+ * behind a reader/writer lock, so lookups of
+ * any keys proceed in parallel, and updates
+ * only contend with operations on the same
+ * shard. A key's shard is picked from the high
+ * bits of its hash, while each shard indexes
+ * its table by the low bits.
+ *
+ * Shards use the system allocator, since they
+ * are written from whichever thread holds the
+ * lock, and the chained engine's incremental
+ * rehash is never enabled, since it would make
+ * lookups mutate the shard under a read lock.
+ */
+
+#define concurrent_hashmap_DEFAULT_SHARDS 64 /* Shard counts are always powers of two. */
+
+#define concurrent_hashmap_new(...) \
+    (_concurrent_hashmap_new_((concurrent_hashmap_config_t){__VA_ARGS__}))
+
+typedef struct concurrent_hashmap concurrent_hashmap_t;
+
+typedef struct concurrent_hashmap_config
+{
+    size_t nshards;
+    size_t capacity; /* Expected number of keys, spread across the shards. */
+    hashmap_backend_t backend;
+#if hashmap_ALLOW_KEY_EQ_FN_OVERLOAD
+    equal_fn_t key_equal_fn;
+#endif
+#if hashmap_ALLOW_HASH_FN_OVERLOAD
+    hash_fn_t hash_fn;
+#endif
+} concurrent_hashmap_config_t;
+
+concurrent_hashmap_t *_concurrent_hashmap_new_              (concurrent_hashmap_config_t);
+size_t                concurrent_hashmap_nshards            (concurrent_hashmap_t *);
+size_t                concurrent_hashmap_size               (concurrent_hashmap_t *);       /* Not a snapshot: shards are counted one at a time. */
+bool                  concurrent_hashmap_contains_key       (concurrent_hashmap_t *, void *);
+void                 *concurrent_hashmap_get_at             (concurrent_hashmap_t *, void *);
+void                  concurrent_hashmap_set_at             (concurrent_hashmap_t *, void *, void *);
+void                 *concurrent_hashmap_remove_at          (concurrent_hashmap_t *, void *);
+void                 *concurrent_hashmap_compute_if_absent  (concurrent_hashmap_t *, void *, map_fn_t); /* Returns the key's value, computing and inserting it with map_fn(key) if the key is absent. map_fn runs at most once per key, under the shard's write lock. */
+void                  concurrent_hashmap_free               (concurrent_hashmap_t *);
+
+/* ------------- rcu hashmap ------------------
+ * A hashmap for read-mostly workloads, where
+ * lookups are wait-free: they take no locks and
+ * only load from the table. Writers serialize
+ * on a mutex and never modify what a reader may
+ * be walking; a new entry is linked in whole
+ * with one atomic store to its bucket, and a
+ * resize builds a new table and publishes it
+ * with one atomic pointer swap.
+ *
+ * Unlinked entries and replaced tables are only
+ * freed once every thread that was reading when
+ * they were retired has finished. Reads record
+ * the epoch they started in, and writers free
+ * what was retired before the oldest epoch still
+ * being read. A thread that stalls mid-read
+ * delays reclamation, never correctness.
+ *
+ * The map itself must not be freed while other
+ * threads may still use it.
+ */
+
+#define rcu_hashmap_DEFAULT_CAP 16        /* Capacities are always powers of two. */
+#define rcu_hashmap_RECLAIM_THRESHOLD 64  /* Retired blocks that trigger a reclamation pass. */
+#define rcu_MAX_THREADS 256               /* Threads that may read rcu hashmaps at the same time. */
+
+#define rcu_hashmap_new(...) \
+    (_rcu_hashmap_new_((rcu_hashmap_config_t){__VA_ARGS__}))
+
+typedef struct rcu_hashmap rcu_hashmap_t;
+
+typedef struct rcu_hashmap_config
+{
+    size_t capacity;
+    allocator_t *allocator; /* Only ever called by writers, under the map's lock. */
+#if hashmap_ALLOW_KEY_EQ_FN_OVERLOAD
+    equal_fn_t key_equal_fn;
+#endif
+#if hashmap_ALLOW_HASH_FN_OVERLOAD
+    hash_fn_t hash_fn;
+#endif
+} rcu_hashmap_config_t;
+
+rcu_hashmap_t *_rcu_hashmap_new_        (rcu_hashmap_config_t);
+size_t         rcu_hashmap_size         (rcu_hashmap_t *);
+bool           rcu_hashmap_is_empty     (rcu_hashmap_t *);
+bool           rcu_hashmap_contains_key (rcu_hashmap_t *, void *);       /* Wait-free. */
+void          *rcu_hashmap_get_at       (rcu_hashmap_t *, void *);       /* Wait-free. */
+void           rcu_hashmap_set_at       (rcu_hashmap_t *, void *, void *);
+void          *rcu_hashmap_remove_at    (rcu_hashmap_t *, void *);
+size_t         rcu_hashmap_reclaim      (rcu_hashmap_t *);               /* Frees what no reader can reach, and returns the number of retired blocks left. */
+void           rcu_hashmap_free         (rcu_hashmap_t *);
+
+/* --------------- thread pool ----------------
+ * A fixed set of worker threads running tasks
+ * for fork-join parallelism. Tasks are taken
+ * newest first, so that recursive forks run
+ * depth first, and a thread waiting on a task
+ * runs queued tasks until it is done, so that
+ * tasks may wait on tasks of their own without
+ * tying up the pool.
+ */
+
+#define thread_pool_new(...) \
+    (_thread_pool_new_((thread_pool_config_t){__VA_ARGS__}))
+
+typedef void *(*thread_pool_fn_t)(void *);
+
+typedef struct thread_pool      thread_pool_t;
+typedef struct thread_pool_task thread_pool_task_t;
+
+typedef struct thread_pool_config
+{
+    size_t nthreads; /* Worker threads. 0 means one per online cpu. */
+} thread_pool_config_t;
+
+thread_pool_t      *_thread_pool_new_    (thread_pool_config_t);
+size_t              thread_pool_nthreads (thread_pool_t *);
+thread_pool_task_t *thread_pool_submit   (thread_pool_t *, thread_pool_fn_t, void *arg);
+void               *thread_pool_wait     (thread_pool_t *, thread_pool_task_t *); /* Runs queued tasks until the given one is done, then frees it and returns its result. */
+void                thread_pool_free     (thread_pool_t *);                       /* Every submitted task must have been waited on. */
+
+/* ------------- parallel treeset -------------
+ * Set operations that split both sets at the
+ * median item of the larger one, run on the
+ * two halves in parallel on a thread pool, and
+ * join the halves of the result, down to pieces
+ * small enough to merge in one go.
+ *
+ * The sets are consumed, and the result is the
+ * first of them. They must allow splitting (see
+ * treemap_split), and their allocator must be
+ * safe to call from several threads at once.
+ */
+
+#define treeset_PARALLEL_GRAIN 16384 /* Items below which both halves are merged sequentially. */
+
+treeset_t *treeset_parallel_union        (thread_pool_t *, treeset_t *, treeset_t *);
+treeset_t *treeset_parallel_intersection (thread_pool_t *, treeset_t *, treeset_t *);
+treeset_t *treeset_parallel_difference   (thread_pool_t *, treeset_t *, treeset_t *);
+void       treeset_parallel_add_all      (thread_pool_t *, treeset_t *, size_t n, void *[n]); /* Sorts and builds a set from each share of the items in parallel, then unions them into the set. */
@@ -1,6 +1,9 @@
 #include <stddef.h>
 #include <stdarg.h>
 #include <stdint.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 #include "data_struct.h"
 #include "panic.h"
 #include "functions.h"
@@ -34,6 +37,7 @@ struct array_header
 #if array_ALLOW_EQ_FN_OVERLOAD
     equal_fn_t equal_fn;
 #endif
+    allocator_t *allocator;
     size_t item_size;
     size_t size;
     uint8_t *arr[]; // Type as byte buffer so that pointer arithmetic is easier.
@@ -41,12 +45,15 @@ struct array_header
 
 void *_array_new_(array_config_t config)
 {
-    struct array_header *header = calloc(1, sizeof(struct array_header) + config.size * config.item_size);
+    allocator_t *allocator = allocator_or_default(config.allocator);
+    struct array_header *header = allocator_calloc(
+        allocator, 1, sizeof(struct array_header) + config.size * config.item_size);
     *header = (struct array_header)
     {
 #if POLYMORPHIC_DS
         .type = DS_TYPE_ARRAY,
 #endif
+        .allocator = allocator,
         .item_size = config.item_size,
         .size = config.size,
 #if array_ALLOW_EQ_FN_OVERLOAD
@@ -97,7 +104,8 @@ void *_array_concat_(const void *_first_, const void *_second_)
     uint8_t *new_arr = _array_new_(
         (array_config_t){
             .item_size = header(first)->item_size,
-            .size = header(first)->size + header(second)->size});
+            .size = header(first)->size + header(second)->size,
+            .allocator = header(first)->allocator});
 
     size_t new_pos = 0;
 
@@ -151,7 +159,8 @@ void *_array_map_(const void *_arr_, map_fn_t fn)
     uint8_t *new_arr = _array_new_(
         (array_config_t){
             .item_size = header(arr)->item_size,
-            .size = header(arr)->size});
+            .size = header(arr)->size,
+            .allocator = header(arr)->allocator});
 
     for (int i = 0; i < header(arr)->size; i++)
     {
@@ -181,14 +190,15 @@ void *_array_filter_(const void *_arr_, pred_fn_t pred)
     uint8_t *new_arr = _array_new_(
         (array_config_t){
             .item_size = header(arr)->item_size,
-            .size = arraylist_size(list)});
+            .size = arraylist_size(list),
+            .allocator = header(arr)->allocator});
 
     for (int i = 0; i < arraylist_size(list); i++)
         memcpy(array_addr_at(new_arr, arr, i),
                _arraylist_at_(list, i),
                header(arr)->item_size);
 
-    free(list);
+    _arraylist_free_(list);
     return new_arr;
 }
 
@@ -236,6 +246,7 @@ void **_array_slice_(const void *_arr_, size_t n, long indices[n])
         (array_config_t) {
             .item_size = sizeof(void *),
             .size = n,
+            .allocator = header(arr)->allocator,
 #if array_ALLOW_EQ_FN_OVERLOAD
             .equal_fn = header(arr)->equal_fn
 #endif
@@ -257,7 +268,8 @@ void *_array_unslice_(const void **arr, size_t referred_item_size)
     uint8_t *new_arr = _array_new_(
         (array_config_t){
             .item_size = referred_item_size,
-            .size = header(arr)->size});
+            .size = header(arr)->size,
+            .allocator = header(arr)->allocator});
 
     for (int i = 0; i < header(arr)->size; i++)
         memcpy(array_addr_at(new_arr, new_arr, i),
@@ -292,7 +304,8 @@ void _array_free_(void *arr)
 {
     if (arr == NULL)
         return;
-    free(header(arr));
+    allocator_free(header(arr)->allocator, header(arr),
+                   sizeof(struct array_header) + header(arr)->size * header(arr)->item_size);
 }
 
 string_t _string_concat_(const char *str1, const char *str2)
@@ -576,12 +589,27 @@ void list_ref_free(list_ref_t *ref)
 /*                ---------- arraylist ----------                */
 /* ------------------------------------------------------------- */
 
-#define arraylist_addr_at(buf, list, pos) \
-    ((typeof(buf))((uint8_t *)(buf) + (list)->item_size * collection_ordered_pos((pos), (list)->size)))
-
 #define arraylist_addr_at_unchecked(buf, list, pos) \
     ((typeof(buf))((uint8_t *)(buf) + (list)->item_size * (pos)))
 
+/* Items are kept in a ring: the item at pos lives in the slot pos past
+   the head, wrapping around the end of the buffer. */
+#define arraylist_slot(list, pos)                            \
+    ({                                                       \
+        size_t slot = (list)->head + (pos);                  \
+        slot >= (list)->capacity ? slot - (list)->capacity   \
+                                 : slot;                     \
+    })
+
+#define arraylist_item_at(list, pos) \
+    (arraylist_item_at_unchecked((list), collection_ordered_pos((pos), (list)->size)))
+
+#define arraylist_item_at_unchecked(list, pos) \
+    ((void *)((list)->buffer + (list)->item_size * arraylist_slot((list), (pos))))
+
+#define arraylist_is_inline(list) \
+    ((list)->buffer == (list)->inline_items)
+
 struct arraylist
 {
 #if POLYMORPHIC_DS
@@ -590,10 +618,16 @@ struct arraylist
 #if arraylist_ALLOW_EQ_FN_OVERLOAD
     equal_fn_t eq_fn;
 #endif
+    allocator_t *allocator;
     size_t capacity;
+    size_t min_capacity; /* Shrinking stops here: the initial capacity, or the largest reservation. */
     size_t item_size;
     size_t size;
-    uint8_t *buffer;
+    size_t head; /* Slot of the first item. */
+    arraylist_growth_t growth;
+    uint8_t *buffer;          /* Either inline_items or a heap buffer. */
+    size_t inline_capacity;
+    _Alignas(max_align_t) uint8_t inline_items[];
 };
 
 struct arraylist_ref
@@ -605,21 +639,136 @@ struct arraylist_ref
     size_t pos;
 };
 
-static void arraylist_check_size_up(struct arraylist *list)
+/* Copies n items from a flat buffer into the ring, starting at pos. */
+static void arraylist_copy_in(struct arraylist *list, size_t pos, const void *items, size_t n)
+{
+    if (n == 0)
+        return;
+
+    size_t slot = arraylist_slot(list, pos);
+    size_t first_run = min(n, list->capacity - slot);
+
+    memcpy(arraylist_addr_at_unchecked(list->buffer, list, slot),
+           items,
+           first_run * list->item_size);
+    if (first_run < n)
+        memcpy(list->buffer,
+               arraylist_addr_at_unchecked((const uint8_t *)items, list, first_run),
+               (n - first_run) * list->item_size);
+}
+
+/* Copies n items from the ring, starting at pos, into a flat buffer. */
+static void arraylist_copy_out(struct arraylist *list, size_t pos, size_t n, void *items)
+{
+    if (n == 0)
+        return;
+
+    size_t slot = arraylist_slot(list, pos);
+    size_t first_run = min(n, list->capacity - slot);
+
+    memcpy(items,
+           arraylist_addr_at_unchecked(list->buffer, list, slot),
+           first_run * list->item_size);
+    if (first_run < n)
+        memcpy(arraylist_addr_at_unchecked((uint8_t *)items, list, first_run),
+               list->buffer,
+               (n - first_run) * list->item_size);
+}
+
+static void arraylist_resize(struct arraylist *list, size_t capacity)
 {
-    while (((double)list->size) / list->capacity >= arraylist_SIZE_UP_RATIO)
+    /* Any capacity the inline buffer covers is served by all of it. */
+    if (capacity <= list->inline_capacity)
+        capacity = list->inline_capacity;
+    if (capacity == list->capacity)
+        return;
+
+    bool to_inline = capacity == list->inline_capacity;
+
+    /* Items that stay clear of the end of both buffers can be moved by
+       realloc as they are. Otherwise they are unwrapped into a new buffer. */
+    if (!arraylist_is_inline(list) && !to_inline &&
+        list->head + list->size <= list->capacity &&
+        list->head + list->size <= capacity)
     {
-        list->buffer = realloc(list->buffer, list->item_size * list->capacity * 2);
-        list->capacity *= 2;
+        list->buffer = allocator_realloc(list->allocator, list->buffer,
+                                         list->item_size * list->capacity,
+                                         list->item_size * capacity);
+        list->capacity = capacity;
+        return;
     }
+
+    uint8_t *buffer = to_inline ? list->inline_items
+                                : allocator_alloc(list->allocator, list->item_size * capacity);
+    arraylist_copy_out(list, 0, list->size, buffer);
+
+    if (!arraylist_is_inline(list))
+        allocator_free(list->allocator, list->buffer, list->item_size * list->capacity);
+    list->buffer = buffer;
+    list->capacity = capacity;
+    list->head = 0;
+}
+
+/* The capacity after growing to hold at least nitems. */
+static size_t arraylist_grown_capacity(struct arraylist *list, size_t nitems)
+{
+    size_t step = list->growth == ARRAYLIST_GROWTH_1_5X ? list->capacity / 2
+                                                        : list->capacity;
+    size_t capacity = list->capacity + max(step, 1);
+    return max(capacity, nitems);
+}
+
+static void arraylist_check_size_up(struct arraylist *list)
+{
+    if (list->size == list->capacity)
+        arraylist_resize(list, arraylist_grown_capacity(list, list->size + 1));
 }
 
+/* Halves the buffer once at most a quarter of it is used. The list then
+   needs to double or halve again before the next resize, so that adding
+   and removing around either threshold cannot thrash. */
 static void arraylist_check_size_down(struct arraylist *list)
 {
-    while (list->capacity > 10 && ((double)list->size) / list->capacity <= arraylist_SIZE_DOWN_RATIO)
+    while (list->size <= list->capacity / arraylist_SHRINK_DIVISOR &&
+           list->capacity / 2 >= list->min_capacity)
+        arraylist_resize(list, list->capacity / 2);
+}
+
+/* Moves n items from src to dst, both positions in the ring, one
+   contiguous run at a time. Runs are copied front first when moving
+   items towards the head and back first otherwise, so that each item is
+   read before the move overwrites its slot. */
+static void arraylist_move(struct arraylist *list, size_t dst, size_t src, size_t n)
+{
+    if (dst < src)
+    {
+        while (n > 0)
+        {
+            size_t from = arraylist_slot(list, src);
+            size_t to = arraylist_slot(list, dst);
+            size_t run = min(n, min(list->capacity - from, list->capacity - to));
+
+            memmove(arraylist_addr_at_unchecked(list->buffer, list, to),
+                    arraylist_addr_at_unchecked(list->buffer, list, from),
+                    run * list->item_size);
+            src += run;
+            dst += run;
+            n -= run;
+        }
+    }
+    else if (dst > src)
     {
-        list->buffer = realloc(list->buffer, list->item_size * list->capacity / 2);
-        list->capacity /= 2;
+        while (n > 0)
+        {
+            size_t from = arraylist_slot(list, src + n - 1) + 1;
+            size_t to = arraylist_slot(list, dst + n - 1) + 1;
+            size_t run = min(n, min(from, to));
+
+            memmove(arraylist_addr_at_unchecked(list->buffer, list, to - run),
+                    arraylist_addr_at_unchecked(list->buffer, list, from - run),
+                    run * list->item_size);
+            n -= run;
+        }
     }
 }
 
@@ -636,24 +785,39 @@ static bool arraylist_items_equal(struct arraylist *list, void *item1, void *ite
 
 struct arraylist *_arraylist_new_(arraylist_config_t config)
 {
+    size_t inline_capacity = (long)config.inline_capacity > 0
+                                 ? config.inline_capacity
+                                 : 0;
     size_t capacity = (long)config.capacity > 0
-                          ? config.capacity
+                          ? max(config.capacity, inline_capacity)
+                      : inline_capacity > 0
+                          ? inline_capacity
                           : arraylist_DEFAULT_CAP;
 
-    uint8_t *buffer = calloc(capacity, config.item_size);
+    allocator_t *allocator = allocator_or_default(config.allocator);
+    struct arraylist *list = allocator_alloc(
+        allocator, sizeof(struct arraylist) + inline_capacity * config.item_size);
 
-    return $new(
-        struct arraylist,
+    *list = (struct arraylist){
 #if POLYMORPHIC_DS
         .type = DS_TYPE_ARRAYLIST,
 #endif
 #if arraylist_ALLOW_EQ_FN_OVERLOAD
         .eq_fn = config.equal_fn,
 #endif
+        .allocator = allocator,
         .capacity = capacity,
+        .min_capacity = capacity,
         .item_size = config.item_size,
         .size = 0,
-        .buffer = buffer);
+        .head = 0,
+        .growth = config.growth,
+        .inline_capacity = inline_capacity};
+
+    list->buffer = capacity == inline_capacity
+                       ? list->inline_items
+                       : allocator_calloc(allocator, capacity, config.item_size);
+    return list;
 }
 
 #if arraylist_ALLOW_EQ_FN_OVERLOAD
@@ -673,7 +837,7 @@ bool _arraylist_contains_(struct arraylist *list, void *item)
     for (int i = 0; i < list->size; i++)
     {
         if (arraylist_items_equal(
-                list, arraylist_addr_at(list->buffer, list, i), item))
+                list, arraylist_item_at(list, i), item))
             return true;
     }
 
@@ -685,9 +849,30 @@ size_t _arraylist_size_(struct arraylist *list)
     return list->size;
 }
 
+size_t _arraylist_capacity_(struct arraylist *list)
+{
+    return list->capacity;
+}
+
+void _arraylist_reserve_(struct arraylist *list, size_t capacity)
+{
+    if (capacity > list->capacity)
+        arraylist_resize(list, capacity);
+    list->min_capacity = max(list->min_capacity, capacity);
+}
+
+void _arraylist_shrink_to_fit_(struct arraylist *list)
+{
+    size_t capacity = max(list->size, 1);
+
+    if (capacity < list->capacity)
+        arraylist_resize(list, capacity);
+    list->min_capacity = list->capacity;
+}
+
 void *_arraylist_at_(struct arraylist *list, int pos)
 {
-    return arraylist_addr_at(list->buffer, list, pos);
+    return arraylist_item_at(list, pos);
 }
 
 void *_arraylist_get_first_(struct arraylist *list)
@@ -695,7 +880,7 @@ void *_arraylist_get_first_(struct arraylist *list)
     if (list->size == 0)
         panic("Cannot access first element of empty list");
 
-    return arraylist_addr_at(list->buffer, list, 0);
+    return arraylist_item_at(list, 0);
 }
 
 void *_arraylist_get_last_(struct arraylist *list)
@@ -703,7 +888,7 @@ void *_arraylist_get_last_(struct arraylist *list)
     if (list->size == 0)
         panic("Cannot access last element of empty list");
 
-    return arraylist_addr_at(list->buffer, list, list->size - 1);
+    return arraylist_item_at(list, list->size - 1);
 }
 
 void _arraylist_add_(struct arraylist *list, void *item)
@@ -715,22 +900,15 @@ void _arraylist_add_front_(struct arraylist *list, void *item)
 {
     arraylist_check_size_up(list);
 
-    uint8_t *new_buffer = calloc(list->capacity, list->item_size);
-    memcpy(new_buffer + list->item_size, list->buffer, list->size * list->item_size);
-    free(list->buffer);
-
+    list->head = list->head == 0 ? list->capacity - 1 : list->head - 1;
     list->size++;
-    list->buffer = new_buffer;
-    memcpy(new_buffer, item, list->item_size);
+    memcpy(arraylist_item_at_unchecked(list, 0), item, list->item_size);
 }
 
 void _arraylist_add_back_(struct arraylist *list, void *item)
 {
     arraylist_check_size_up(list);
-    memcpy(
-        arraylist_addr_at_unchecked(list->buffer, list, list->size),
-        item,
-        list->item_size);
+    memcpy(arraylist_item_at_unchecked(list, list->size), item, list->item_size);
     list->size++;
 }
 
@@ -739,29 +917,113 @@ void _arraylist_add_at_(struct arraylist *list, long pos, void *item)
     arraylist_check_size_up(list);
     pos = collection_ordered_pos(pos, list->size);
 
-    memcpy(arraylist_addr_at_unchecked(list->buffer, list, pos + 1),
-           arraylist_addr_at_unchecked(list->buffer, list, pos),
-           (list->size - pos) * list->item_size);
-
-    memcpy(arraylist_addr_at_unchecked(list->buffer, list, pos),
-           item, list->item_size);
+    /* Make room by moving whichever side of pos is shorter. */
+    if (pos < list->size / 2)
+    {
+        list->head = list->head == 0 ? list->capacity - 1 : list->head - 1;
+        arraylist_move(list, 0, 1, pos);
+    }
+    else
+    {
+        arraylist_move(list, pos + 1, pos, list->size - pos);
+    }
 
+    memcpy(arraylist_item_at_unchecked(list, pos), item, list->item_size);
     list->size++;
 }
 
-void _arraylist_add_all_(struct arraylist *list, size_t nitems, void *_items_)
+void _arraylist_add_all_(struct arraylist *list, size_t nitems, void *items)
+{
+    _arraylist_extend_from_buffer_(list, nitems, items);
+}
+
+void _arraylist_splice_(struct arraylist *list, size_t pos, size_t nremove, size_t ninsert, void *items)
 {
-    uint8_t *items = (uint8_t *)_items_;
+    if (pos > list->size || nremove > list->size - pos)
+        panic("Range [%zu, %zu) out of bounds for list of size %zu", pos, pos + nremove, list->size);
+
+    size_t tail = list->size - pos - nremove;
+    size_t size = list->size - nremove + ninsert;
+
+    if (size > list->capacity)
+        arraylist_resize(list, arraylist_grown_capacity(list, size));
 
-    /* Extend list to the requisite capacity to reduce resizes. */
-    if (list->size + nitems / list->capacity >= arraylist_SIZE_UP_RATIO)
+    /* Make room or close the gap by moving whichever side of the range is
+       shorter, as one block per contiguous run. */
+    if (pos < tail && ninsert > nremove)
+    {
+        size_t shift = ninsert - nremove;
+        list->head = list->head >= shift ? list->head - shift
+                                         : list->head + list->capacity - shift;
+        arraylist_move(list, 0, shift, pos);
+    }
+    else if (pos < tail)
+    {
+        size_t shift = nremove - ninsert;
+        arraylist_move(list, shift, 0, pos);
+        list->head = arraylist_slot(list, shift);
+    }
+    else
     {
-        list->buffer = realloc(list->buffer, (list->size + nitems) * list->item_size / arraylist_SIZE_UP_RATIO);
-        list->capacity = (list->size + nitems) / arraylist_SIZE_UP_RATIO;
+        arraylist_move(list, pos + ninsert, pos + nremove, tail);
     }
 
-    for (size_t i = 0; i < nitems; i++)
-        _arraylist_add_(list, arraylist_addr_at_unchecked(items, list, i));
+    list->size = size;
+    arraylist_copy_in(list, pos, items, ninsert);
+    arraylist_check_size_down(list);
+}
+
+void _arraylist_insert_range_(struct arraylist *list, size_t pos, size_t nitems, void *items)
+{
+    _arraylist_splice_(list, pos, 0, nitems, items);
+}
+
+void _arraylist_remove_range_(struct arraylist *list, size_t pos, size_t nitems, void *removed)
+{
+    if (pos > list->size || nitems > list->size - pos)
+        panic("Range [%zu, %zu) out of bounds for list of size %zu", pos, pos + nitems, list->size);
+
+    if (removed != NULL)
+        arraylist_copy_out(list, pos, nitems, removed);
+    _arraylist_splice_(list, pos, nitems, 0, NULL);
+}
+
+void _arraylist_extend_from_buffer_(struct arraylist *list, size_t nitems, void *items)
+{
+    /* Appending moves nothing, so skips the rest of splicing. */
+    if (list->size + nitems > list->capacity)
+        arraylist_resize(list, arraylist_grown_capacity(list, list->size + nitems));
+
+    arraylist_copy_in(list, list->size, items, nitems);
+    list->size += nitems;
+}
+
+void *_arraylist_contiguous_(struct arraylist *list)
+{
+    /* Items that wrap around the end of the buffer are unwrapped to its
+       start. Items that don't are left where they are. */
+    if (list->head + list->size > list->capacity)
+    {
+        size_t nbytes = list->size * list->item_size;
+        void *items = allocator_alloc(list->allocator, nbytes);
+
+        arraylist_copy_out(list, 0, list->size, items);
+        memcpy(list->buffer, items, nbytes);
+        allocator_free(list->allocator, items, nbytes);
+        list->head = 0;
+    }
+
+    return arraylist_addr_at_unchecked(list->buffer, list, list->head);
+}
+
+/* Appends the items of another list, one block per contiguous run. */
+static void arraylist_extend_from_list(struct arraylist *list, struct arraylist *other)
+{
+    size_t first_run = min(other->size, other->capacity - other->head);
+
+    _arraylist_extend_from_buffer_(
+        list, first_run, arraylist_addr_at_unchecked(other->buffer, other, other->head));
+    _arraylist_extend_from_buffer_(list, other->size - first_run, other->buffer);
 }
 
 struct arraylist *_arraylist_concat_(struct arraylist *first, struct arraylist *second)
@@ -772,21 +1034,13 @@ struct arraylist *_arraylist_concat_(struct arraylist *first, struct arraylist *
     struct arraylist *new_list = _arraylist_new_(
         (arraylist_config_t){
             .item_size = first->item_size,
-            .capacity = first->size + second->size / arraylist_SIZE_UP_RATIO});
-
-    for (struct arraylist_ref *ref = _arraylist_ref_(first);
-         _arraylist_ref_is_valid_(ref);
-         _arraylist_ref_next_(ref))
-    {
-        _arraylist_add_(new_list, _arraylist_ref_get_item_(ref));
-    }
+            .capacity = first->size + second->size,
+            .inline_capacity = first->inline_capacity,
+            .growth = first->growth,
+            .allocator = first->allocator});
 
-    for (struct arraylist_ref *ref = _arraylist_ref_(second);
-         arraylist_ref_is_valid(ref);
-         _arraylist_ref_next_(ref))
-    {
-        _arraylist_add_(new_list, _arraylist_ref_get_item_(ref));
-    }
+    arraylist_extend_from_list(new_list, first);
+    arraylist_extend_from_list(new_list, second);
 
     return new_list;
 }
@@ -795,7 +1049,7 @@ size_t _arraylist_pos_of_(struct arraylist *list, void *item)
 {
     for (int i = 0; i < list->size; i++)
     {
-        if (arraylist_items_equal(list, arraylist_addr_at(list->buffer, list, i), item))
+        if (arraylist_items_equal(list, arraylist_item_at(list, i), item))
             return i;
     }
 
@@ -829,10 +1083,19 @@ void *_arraylist_remove_at_(struct arraylist *list, int pos)
     arraylist_check_size_down(list);
     void *item = malloc(list->item_size);
 
-    memcpy(item, arraylist_addr_at(list->buffer, list, pos), list->item_size);
-    memcpy(arraylist_addr_at(list->buffer, list, pos),
-           arraylist_addr_at_unchecked(list->buffer, list, pos + 1),
-           (list->size - pos - 1) * list->item_size);
+    pos = collection_ordered_pos(pos, list->size);
+    memcpy(item, arraylist_item_at_unchecked(list, pos), list->item_size);
+
+    /* Close the gap by moving whichever side of pos is shorter. */
+    if (pos < list->size / 2)
+    {
+        arraylist_move(list, 1, 0, pos);
+        list->head = arraylist_slot(list, 1);
+    }
+    else
+    {
+        arraylist_move(list, pos, pos + 1, list->size - pos - 1);
+    }
 
     list->size--;
     return item;
@@ -842,8 +1105,8 @@ void *_arraylist_find_(struct arraylist *list, pred_fn_t pred)
 {
     for (int i = 0; i < list->size; i++)
     {
-        if (pred(arraylist_addr_at(list->buffer, list, i)))
-            return arraylist_addr_at(list->buffer, list, i);
+        if (pred(arraylist_item_at(list, i)))
+            return arraylist_item_at(list, i);
     }
 
     return NULL;
@@ -854,29 +1117,59 @@ struct arraylist *_arraylist_map_(struct arraylist *list, map_fn_t fn)
     struct arraylist *new_list = _arraylist_new_(
         (struct arraylist_config){
             .item_size = list->item_size,
-            .capacity = list->capacity});
-
-    for (int i = 0; i < list->size; i++)
+            .capacity = list->capacity,
+            .inline_capacity = list->inline_capacity,
+            .growth = list->growth,
+            .allocator = list->allocator});
+
+    /* The new list starts empty at slot 0 with room for every result, so
+       they go straight into its buffer. */
+    for (size_t i = 0; i < list->size; i++)
     {
-        void *result = fn(arraylist_addr_at(list->buffer, list, i));
-        _arraylist_add_(new_list, result);
+        void *result = fn(arraylist_item_at_unchecked(list, i));
+        memcpy(arraylist_addr_at_unchecked(new_list->buffer, new_list, i), result, list->item_size);
         free(result);
     }
+    new_list->size = list->size;
 
     return new_list;
 }
 
+/* Appends the items of a contiguous run that pass pred, copying each
+   stretch of passing items as one block. */
+static void arraylist_filter_run(struct arraylist *list, uint8_t *items, size_t nitems, pred_fn_t pred)
+{
+    size_t kept_from = 0;
+
+    for (size_t i = 0; i < nitems; i++)
+    {
+        if (!pred(arraylist_addr_at_unchecked(items, list, i)))
+        {
+            if (i > kept_from)
+                _arraylist_extend_from_buffer_(list, i - kept_from,
+                                               arraylist_addr_at_unchecked(items, list, kept_from));
+            kept_from = i + 1;
+        }
+    }
+
+    _arraylist_extend_from_buffer_(list, nitems - kept_from,
+                                   arraylist_addr_at_unchecked(items, list, kept_from));
+}
+
 struct arraylist *_arraylist_filter_(struct arraylist *list, pred_fn_t pred)
 {
     struct arraylist *new_list = _arraylist_new_(
         (arraylist_config_t){
-            .item_size = list->item_size});
+            .item_size = list->item_size,
+            .inline_capacity = list->inline_capacity,
+            .growth = list->growth,
+            .allocator = list->allocator});
 
-    for (int i = 0; i < list->size; i++)
-    {
-        if (pred(arraylist_addr_at(list->buffer, list, i)))
-            _arraylist_add_(new_list, arraylist_addr_at(list->buffer, list, i));
-    }
+    size_t first_run = min(list->size, list->capacity - list->head);
+
+    arraylist_filter_run(new_list, arraylist_addr_at_unchecked(list->buffer, list, list->head),
+                         first_run, pred);
+    arraylist_filter_run(new_list, list->buffer, list->size - first_run, pred);
 
     return new_list;
 }
@@ -885,7 +1178,7 @@ void *_arraylist_reduce_(struct arraylist *list, reduce_fn_t fn)
 {
     void **work_buffer = calloc(list->size, sizeof(void *));
     for (int i = 0; i < list->size; i++)
-        work_buffer[i] = arraylist_addr_at(list->buffer, list, i);
+        work_buffer[i] = arraylist_item_at(list, i);
 
     for (int stride = 1; stride < list->size; stride *= 2)
     {
@@ -915,15 +1208,15 @@ bool _arraylist_equal_(struct arraylist *list1, struct arraylist *list2, eq_conf
     {
         if (config.eq_fn == NULL)
         {
-            if (memcmp(arraylist_addr_at(list1->buffer, list1, i),
-                       arraylist_addr_at(list2->buffer, list2, i),
+            if (memcmp(arraylist_item_at(list1, i),
+                       arraylist_item_at(list2, i),
                        list1->item_size) != 0)
                 return false;
         }
         else
         {
-            if (!config.eq_fn(arraylist_addr_at(list1->buffer, list1, i),
-                              arraylist_addr_at(list2->buffer, list2, i)))
+            if (!config.eq_fn(arraylist_item_at(list1, i),
+                              arraylist_item_at(list2, i)))
                 return false;
         }
     }
@@ -933,8 +1226,10 @@ bool _arraylist_equal_(struct arraylist *list1, struct arraylist *list2, eq_conf
 
 void _arraylist_free_(struct arraylist *list)
 {
-    free(list->buffer);
-    free(list);
+    if (!arraylist_is_inline(list))
+        allocator_free(list->allocator, list->buffer, list->capacity * list->item_size);
+    allocator_free(list->allocator, list,
+                   sizeof(struct arraylist) + list->inline_capacity * list->item_size);
 }
 
 struct arraylist_ref *_arraylist_ref_(struct arraylist *list)
@@ -958,7 +1253,7 @@ void *_arraylist_ref_get_item_(struct arraylist_ref *ref)
         panic("Reference is out of bounds");
         return NULL;
     }
-    return arraylist_addr_at(ref->list->buffer, ref->list, ref->pos);
+    return arraylist_item_at(ref->list, ref->pos);
 }
 
 struct arraylist *_arraylist_ref_get_list_(struct arraylist_ref *ref)
@@ -1002,7 +1297,7 @@ void *_arraylist_ref_next_(struct arraylist_ref *ref)
         return NULL;
     }
 
-    return arraylist_addr_at(ref->list->buffer, ref->list, ++ref->pos);
+    return arraylist_item_at(ref->list, ++ref->pos);
 }
 
 void *_arraylist_ref_prev_(struct arraylist_ref *ref)
@@ -1015,7 +1310,7 @@ void *_arraylist_ref_prev_(struct arraylist_ref *ref)
         return NULL;
     }
 
-    return arraylist_addr_at(ref->list->buffer, ref->list, --ref->pos);
+    return arraylist_item_at(ref->list, --ref->pos);
 }
 
 void _arraylist_ref_free_(struct arraylist_ref *ref)
@@ -1046,6 +1341,8 @@ struct linkedlist
     size_t size;
     struct linkedlist_node *first;
     struct linkedlist_node *last;
+    allocator_t *allocator;
+    node_pool_t *pool;
 };
 
 struct linkedlist_ref
@@ -1071,7 +1368,10 @@ bool _linkedlist_items_equal_(struct linkedlist *list, void *item1, void *item2)
 
 struct linkedlist *_linkedlist_new_(linkedlist_config_t config)
 {
-    return $new(
+    allocator_t *allocator = allocator_or_default(config.allocator);
+
+    return $new_in(
+        allocator,
         struct linkedlist,
 #if POLYMORPHIC_DS
         .type = DS_TYPE_LINKEDLIST_REF,
@@ -1082,16 +1382,38 @@ struct linkedlist *_linkedlist_new_(linkedlist_config_t config)
         .item_size = config.item_size,
         .size = 0,
         .first = NULL,
-        .last = NULL);
+        .last = NULL,
+        .allocator = allocator,
+        .pool = config.pool_nodes
+                    ? node_pool_new(sizeof(struct linkedlist_node) + config.item_size,
+                                    .allocator = allocator)
+                    : NULL);
 }
 
 linkedlist_config_t _linkedlist_get_config_(struct linkedlist *list)
 {
     return (linkedlist_config_t){
         .item_size = list->item_size,
+        .pool_nodes = list->pool != NULL,
+        .allocator = list->allocator,
         .equal_fn = list->eq_fn};
 }
 
+static struct linkedlist_node *linkedlist_node_alloc(struct linkedlist *list)
+{
+    return list->pool != NULL
+               ? node_pool_alloc(list->pool)
+               : allocator_alloc(list->allocator, sizeof(struct linkedlist_node) + list->item_size);
+}
+
+static void linkedlist_node_free(struct linkedlist *list, struct linkedlist_node *node)
+{
+    if (list->pool != NULL)
+        node_pool_release(list->pool, node);
+    else
+        allocator_free(list->allocator, node, sizeof(struct linkedlist_node) + list->item_size);
+}
+
 bool _linkedlist_is_empty_(struct linkedlist *list)
 {
     return list->size == 0;
@@ -1145,8 +1467,7 @@ void _linkedlist_add_(struct linkedlist *list, void *item)
 
 void _linkedlist_add_front_(struct linkedlist *list, void *item)
 {
-    struct linkedlist_node *node = malloc(
-        sizeof(struct linkedlist_node) + list->item_size);
+    struct linkedlist_node *node = linkedlist_node_alloc(list);
     *node = (struct linkedlist_node){
         .prev = NULL,
         .next = list->first};
@@ -1166,8 +1487,7 @@ void _linkedlist_add_front_(struct linkedlist *list, void *item)
 
 void _linkedlist_add_back_(struct linkedlist *list, void *item)
 {
-    struct linkedlist_node *node = malloc(
-        sizeof(struct linkedlist_node) + list->item_size);
+    struct linkedlist_node *node = linkedlist_node_alloc(list);
     *node = (struct linkedlist_node){
         .prev = list->last,
         .next = NULL};
@@ -1193,8 +1513,7 @@ void _linkedlist_add_at_(struct linkedlist *list, int pos, void *item)
     for (int i = 0; i < pos; node = node->next, i++)
         ;
 
-    struct linkedlist_node *new_node = malloc(
-        sizeof(struct linkedlist_node) + list->item_size);
+    struct linkedlist_node *new_node = linkedlist_node_alloc(list);
     *new_node = (struct linkedlist_node){
         .prev = node->prev,
         .next = node};
@@ -1217,10 +1536,7 @@ struct linkedlist *_linkedlist_concat_(struct linkedlist *first, struct linkedli
     if (first->item_size != second->item_size)
         panic("Can't concatenate two lists with different sized items");
 
-    struct linkedlist *new_list = _linkedlist_new_(
-        (linkedlist_config_t){
-            .item_size = first->item_size,
-            .equal_fn = first->eq_fn});
+    struct linkedlist *new_list = _linkedlist_new_(_linkedlist_get_config_(first));
 
     for (struct linkedlist_ref *ref = _linkedlist_ref_(first);
          _linkedlist_ref_is_valid_(ref);
@@ -1268,7 +1584,7 @@ void *_linkedlist_remove_(struct linkedlist *list, void *item)
 
             list->size--;
             void *item = node->item;
-            free(node);
+            linkedlist_node_free(list, node);
 
             return item;
         }
@@ -1291,7 +1607,7 @@ void *_linkedlist_remove_front_(struct linkedlist *list)
 
     list->size--;
     void *item = first->item;
-    free(first);
+    linkedlist_node_free(list, first);
 
     return item;
 }
@@ -1310,7 +1626,7 @@ void *_linkedlist_remove_back_(struct linkedlist *list)
 
     list->size--;
     void *item = last->item;
-    free(last);
+    linkedlist_node_free(list, last);
 
     return item;
 }
@@ -1334,7 +1650,7 @@ void *_linkedlist_remove_at_(struct linkedlist *list, int pos)
 
     list->size--;
     void *item = node->item;
-    free(node);
+    linkedlist_node_free(list, node);
 
     return item;
 }
@@ -1352,10 +1668,7 @@ void *_linkedlist_find_(struct linkedlist *list, pred_fn_t pred)
 
 struct linkedlist *_linkedlist_map_(struct linkedlist *list, map_fn_t fn)
 {
-    struct linkedlist *new_list = _linkedlist_new_(
-        (linkedlist_config_t){
-            .item_size = list->item_size,
-            .equal_fn = list->eq_fn});
+    struct linkedlist *new_list = _linkedlist_new_(_linkedlist_get_config_(list));
 
     for (struct linkedlist_node *node = list->first; node != NULL; node = node->next)
         _linkedlist_add_back_(new_list, fn(node->item));
@@ -1365,10 +1678,7 @@ struct linkedlist *_linkedlist_map_(struct linkedlist *list, map_fn_t fn)
 
 struct linkedlist *_linkedlist_filter_(struct linkedlist *list, pred_fn_t pred)
 {
-    struct linkedlist *new_list = _linkedlist_new_(
-        (linkedlist_config_t){
-            .item_size = list->item_size,
-            .equal_fn = list->eq_fn});
+    struct linkedlist *new_list = _linkedlist_new_(_linkedlist_get_config_(list));
 
     for (struct linkedlist_node *node = list->first; node != NULL; node = node->next)
     {
@@ -1480,9 +1790,18 @@ struct linkedlist_ref *_linkedlist_ref_back_(struct linkedlist *list)
 
 void _linkedlist_free_(struct linkedlist *list)
 {
-    for (struct linkedlist_node *node = list->first; node != NULL; node = node->next)
-        free(node);
-    free(list);
+    if (list->pool != NULL)
+        node_pool_free(list->pool);
+    else
+    {
+        for (struct linkedlist_node *node = list->first, *next; node != NULL; node = next)
+        {
+            next = node->next;
+            linkedlist_node_free(list, node);
+        }
+    }
+
+    allocator_free(list->allocator, list, sizeof(struct linkedlist));
 }
 
 void *_linkedlist_ref_get_item_(struct linkedlist_ref *ref)
@@ -1793,11 +2112,21 @@ struct hashmap_entry
 {
     void *key;
     void *value;
+    size_t hash;
     struct hashmap_entry *next;
     struct hashmap_entry *prev_entry;
     struct hashmap_entry *next_entry;
 };
 
+/* A slot of the open addressing engine. Slots carry no links; a slot
+ * is occupied exactly when its control byte is non-negative. */
+struct hashmap_slot
+{
+    void *key;
+    void *value;
+    size_t hash;
+};
+
 struct hashmap
 {
 #if POLYMORPHIC_DS
@@ -1809,11 +2138,25 @@ struct hashmap
 #if hashmap_ALLOW_HASH_FN_OVERLOAD
     hash_fn_t hash_fn;
 #endif
+    hashmap_backend_t backend;
     size_t capacity;
     size_t size;
+
+    /* Chained engine. */
     struct hashmap_entry *first_entry;
     struct hashmap_entry *last_entry;
     struct hashmap_entry **buffer;
+    bool incremental_rehash;
+    struct hashmap_entry **old_buffer;
+    size_t old_capacity;
+    size_t rehash_pos;
+    allocator_t *allocator;
+    node_pool_t *pool;
+
+    /* Open addressing engine. */
+    int8_t *ctrl;
+    struct hashmap_slot *slots;
+    size_t growth_left;
 };
 
 struct hashmap_ref
@@ -1824,6 +2167,7 @@ struct hashmap_ref
     hashmap_t *map;
     size_t pos;
     struct hashmap_entry *entry;
+    size_t slot;
 };
 
 bool hashmap_keys_eq(hashmap_t *map, void *key1, void *key2)
@@ -1835,211 +2179,664 @@ bool hashmap_keys_eq(hashmap_t *map, void *key1, void *key2)
 #endif
 }
 
-size_t hashmap_pos_by_capacity(hashmap_t *map, void *key, size_t capacity)
+/* Tables are indexed by the low bits of the hash, and the open engine's
+ * control bytes keep its low 7 bits, so every bit of the result must
+ * depend on every bit of the key, which hash_key ensures. */
+size_t hashmap_hash(hashmap_t *map, void *key)
 {
 #if hashmap_ALLOW_HASH_FN_OVERLOAD
-    return (map->hash_fn != NULL ? map->hash_fn(key) : (size_t)key) % capacity;
+    return hash_key(map->hash_fn, key);
 #else
-    return (size_t)key % capacity;
+    return hash_key(NULL, key);
 #endif
 }
 
-size_t hashmap_pos(hashmap_t *map, void *key)
+/* Entries and slots cache the hash of their key, so resizing never
+ * calls the hash function, and the key equality function only runs on
+ * keys whose full hash matches. */
+static inline bool hashmap_entry_matches(hashmap_t *map, void *entry_key, size_t entry_hash,
+                                         void *key, size_t hash)
 {
-#if hashmap_ALLOW_HASH_FN_OVERLOAD
-    return (map->hash_fn != NULL ? map->hash_fn(key) : (size_t)key) % map->capacity;
-#else
-    return (size_t)key % map->capacity;
-#endif
+    return entry_hash == hash && hashmap_keys_eq(map, entry_key, key);
 }
 
-void hashmap_rehash(hashmap_t *map, size_t new_capacity)
+/* The chained engine resizes by doubling or halving, so every bucket
+ * of the old table feeds either two buckets of the new one (i and
+ * i + old capacity) or half of one (i modulo the new capacity). This
+ * lets an incremental rehash leave the new table uninitialized, and
+ * clear each bucket of it only once the first old bucket feeding it
+ * is migrated. Until then, a key is looked up and inserted in the old
+ * table, so every key has exactly one live bucket. */
+
+static void hashmap_rehash_bucket(hashmap_t *map, size_t old_pos)
 {
-    struct hashmap_entry **new_buffer = calloc(new_capacity, sizeof(void *));
+    if (map->capacity > map->old_capacity)
+    {
+        map->buffer[old_pos] = NULL;
+        map->buffer[old_pos + map->old_capacity] = NULL;
+    }
+    else if (old_pos < map->capacity)
+        map->buffer[old_pos] = NULL;
 
-    for (struct hashmap_entry *entry = map->first_entry;
+    for (struct hashmap_entry *entry = map->old_buffer[old_pos], *next;
          entry != NULL;
-         entry = entry->next)
+         entry = next)
     {
-        size_t key_pos = hashmap_pos_by_capacity(map, entry->key, new_capacity);
-        struct hashmap_entry *current_entry = new_buffer[key_pos];
+        next = entry->next;
+        size_t key_pos = entry->hash & (map->capacity - 1);
+        entry->next = map->buffer[key_pos];
+        map->buffer[key_pos] = entry;
+    }
 
-        if (current_entry == NULL)
-        {
-            new_buffer[key_pos] = entry;
-            return;
-        }
+    map->old_buffer[old_pos] = NULL;
+}
+
+static void hashmap_rehash_finish(hashmap_t *map)
+{
+    for (; map->rehash_pos < map->old_capacity; map->rehash_pos++)
+        hashmap_rehash_bucket(map, map->rehash_pos);
+
+    allocator_free(map->allocator, map->old_buffer, map->old_capacity * sizeof(struct hashmap_entry *));
+    map->old_buffer = NULL;
+    map->old_capacity = 0;
+}
 
-        for (; current_entry != NULL; current_entry = current_entry->next)
-            ;
-        current_entry->next = entry;
+/* Advances an in-progress incremental rehash by at most
+ * hashmap_REHASH_STEP populated buckets. Runs of empty buckets are
+ * bounded too, so a single call never scans the whole table. */
+static void hashmap_rehash_step(hashmap_t *map)
+{
+    if (map->old_buffer == NULL)
+        return;
+
+    for (size_t moved = 0, visited = 0;
+         map->rehash_pos < map->old_capacity &&
+         moved < hashmap_REHASH_STEP &&
+         visited < hashmap_REHASH_STEP * 10;
+         map->rehash_pos++, visited++)
+    {
+        moved += map->old_buffer[map->rehash_pos] != NULL;
+        hashmap_rehash_bucket(map, map->rehash_pos);
     }
 
-    map->buffer = new_buffer;
+    if (map->rehash_pos == map->old_capacity)
+        hashmap_rehash_finish(map);
+}
+
+/* Swaps in a table of the new capacity. Unless the map rehashes
+ * incrementally, every entry is moved over before returning; otherwise
+ * the old table is kept around and drained by later operations. */
+void hashmap_rehash(hashmap_t *map, size_t new_capacity)
+{
+    if (map->old_buffer != NULL)
+        hashmap_rehash_finish(map);
+
+    bool incremental = map->incremental_rehash &&
+                       (new_capacity == map->capacity * 2 || new_capacity * 2 == map->capacity);
+
+    map->old_buffer = map->buffer;
+    map->old_capacity = map->capacity;
+    map->rehash_pos = 0;
+
+    map->buffer = incremental
+                      ? allocator_alloc(map->allocator, new_capacity * sizeof(struct hashmap_entry *))
+                      : allocator_calloc(map->allocator, new_capacity, sizeof(struct hashmap_entry *));
     map->capacity = new_capacity;
+
+    if (!incremental)
+        hashmap_rehash_finish(map);
 }
 
 void hashmap_check_size_up(hashmap_t *map)
 {
-    if (map->size / map->capacity > hashmap_SIZE_UP_RATIO)
+    if (map->size > map->capacity * hashmap_SIZE_UP_RATIO)
         hashmap_rehash(map, map->capacity * 2);
 }
 
 void hashmap_check_size_down(hashmap_t *map)
 {
-    if (map->capacity >= 10 && map->size / map->capacity < hashmap_SIZE_DOWN_RATIO)
+    if (map->capacity > hashmap_DEFAULT_CAP && map->size < map->capacity * hashmap_SIZE_DOWN_RATIO)
         hashmap_rehash(map, map->capacity / 2);
 }
 
-hashmap_t *_hashmap_new_(hashmap_config_t config)
+/* Returns the bucket whose chain holds (or would hold) keys of the
+ * given hash. Capacities are powers of two, so a mask stands in for
+ * the modulo. */
+static struct hashmap_entry **hashmap_bucket(hashmap_t *map, size_t hash)
 {
-    size_t capacity = config.capacity > 0
-                          ? config.capacity
-                          : hashmap_DEFAULT_CAP;
-
-    struct hashmap_entry **buffer = calloc(capacity, sizeof(struct hashmap_entry *));
+    if (map->old_buffer != NULL)
+    {
+        size_t old_pos = hash & (map->old_capacity - 1);
+        if (old_pos >= map->rehash_pos)
+            return &map->old_buffer[old_pos];
+    }
 
-    return $new(
-        hashmap_t,
-#if POLYMORPHIC_DS
-        .type = DS_TYPE_HASHMAP,
-#endif
-#if hashmap_ALLOW_KEY_EQ_FN_OVERLOAD
-        .key_eq_fn = config.key_equal_fn,
-#endif
-#if hashmap_ALLOW_HASH_FN_OVERLOAD
-        .hash_fn = config.hash_fn,
-#endif
-        .capacity = hashmap_DEFAULT_CAP,
-        .size = 0,
-        .first_entry = NULL,
-        .last_entry = NULL,
-        .buffer = buffer);
+    return &map->buffer[hash & (map->capacity - 1)];
 }
 
-#if hashmap_ALLOW_KEY_EQ_FN_OVERLOAD
-equal_fn_t hashmap_get_key_eq_fn(hashmap_t *map)
+/* Returns the link (bucket head or predecessor's next pointer) that
+ * points to the entry holding the key, or NULL if there is none. */
+static struct hashmap_entry **hashmap_find_link(hashmap_t *map, void *key, size_t hash)
 {
-    return map->key_eq_fn;
+    for (struct hashmap_entry **link = hashmap_bucket(map, hash);
+         *link != NULL;
+         link = &(*link)->next)
+    {
+        if (hashmap_entry_matches(map, (*link)->key, (*link)->hash, key, hash))
+            return link;
+    }
+
+    return NULL;
 }
-#endif // hashmap_ALLOW_KEY_EQ_FN_OVERLOAD
 
-#if hashmap_ALLOW_HASH_FN_OVERLOAD
-hash_fn_t hashmap_get_hash_fn(hashmap_t *map)
+/* --------- open addressing engine ---------
+ * Keys and values live in a flat array of slots, shadowed by an
+ * array of one-byte control words. A full slot's control byte holds
+ * the low 7 bits of the key's hash (H2), while the remaining bits (H1)
+ * pick where probing starts. Lookups scan hashmap_GROUP_WIDTH control
+ * bytes at once, and only compare keys whose H2 matches, so a probe
+ * touches one cache line of control bytes and, usually, one slot.
+ *
+ * The first hashmap_GROUP_WIDTH control bytes are mirrored past the
+ * end of the array so that a group can be loaded at any position
+ * without wrapping. Deleted slots are left as tombstones, which are
+ * reclaimed the next time the table is rebuilt.
+ */
+
+#define hashmap_GROUP_WIDTH 16
+#define hashmap_OPEN_MIN_CAP hashmap_GROUP_WIDTH
+#define hashmap_OPEN_MAX_LOAD_NUM 7
+#define hashmap_OPEN_MAX_LOAD_DEN 8
+#define hashmap_OPEN_NOT_FOUND SIZE_MAX
+
+enum hashmap_ctrl
+{
+    HASHMAP_CTRL_EMPTY = -128,
+    HASHMAP_CTRL_DELETED = -2,
+    HASHMAP_CTRL_SENTINEL = -1
+};
+
+
+static inline uint32_t hashmap_group_match(const int8_t *group, int8_t h2)
 {
-    return map->hash_fn;
+#if defined(__SSE2__)
+    __m128i ctrl = _mm_loadu_si128((const __m128i *)group);
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_set1_epi8(h2), ctrl));
+#else
+    uint32_t mask = 0;
+    for (int i = 0; i < hashmap_GROUP_WIDTH; i++)
+        mask |= (uint32_t)(group[i] == h2) << i;
+    return mask;
+#endif
 }
-#endif // hashmap_ALLOW_HASH_FN_OVERLOAD
 
-bool hashmap_is_empty(hashmap_t *map)
+static inline uint32_t hashmap_group_match_empty(const int8_t *group)
 {
-    return map->size == 0;
+    return hashmap_group_match(group, HASHMAP_CTRL_EMPTY);
 }
 
-bool hashmap_contains_key(hashmap_t *map, void *key)
+static inline uint32_t hashmap_group_match_free(const int8_t *group)
 {
-    size_t key_pos = hashmap_pos(map, key);
-
-    for (struct hashmap_entry *entry = map->buffer[key_pos];
-         entry != NULL;
-         entry = entry->next)
-    {
-        if (hashmap_keys_eq(map, entry->key, key))
-            return true;
-    }
-
-    return false;
+    /* Empty and deleted are the only control bytes below the sentinel. */
+#if defined(__SSE2__)
+    __m128i ctrl = _mm_loadu_si128((const __m128i *)group);
+    return _mm_movemask_epi8(_mm_cmpgt_epi8(_mm_set1_epi8(HASHMAP_CTRL_SENTINEL), ctrl));
+#else
+    uint32_t mask = 0;
+    for (int i = 0; i < hashmap_GROUP_WIDTH; i++)
+        mask |= (uint32_t)(group[i] < HASHMAP_CTRL_SENTINEL) << i;
+    return mask;
+#endif
 }
 
-bool hashmap_contains_value(hashmap_t *map, void *value)
+static inline bool hashmap_ctrl_is_full(int8_t ctrl)
 {
-    for (struct hashmap_entry *node = map->first_entry; node != NULL; node = node->next_entry)
-    {
-        if (node->value == value)
-            return true;
-    }
-
-    return false;
+    return ctrl >= 0;
 }
 
-size_t hashmap_size(hashmap_t *map)
+static inline void hashmap_open_set_ctrl(hashmap_t *map, size_t slot, int8_t ctrl)
 {
-    return map->size;
+    map->ctrl[slot] = ctrl;
+    if (slot < hashmap_GROUP_WIDTH)
+        map->ctrl[map->capacity + slot] = ctrl;
 }
 
-void *hashmap_get_at(hashmap_t *map, void *key)
+static size_t hashmap_open_capacity_for(size_t nitems)
 {
-    size_t key_pos = hashmap_pos(map, key);
-
-    for (struct hashmap_entry *entry = map->buffer[key_pos];
-         entry != NULL;
-         entry = entry->next)
-    {
-        if (hashmap_keys_eq(map, entry->key, key))
-            return entry->value;
-    }
+    size_t capacity = hashmap_OPEN_MIN_CAP;
+    while (capacity * hashmap_OPEN_MAX_LOAD_NUM / hashmap_OPEN_MAX_LOAD_DEN < nitems)
+        capacity *= 2;
+    return capacity;
+}
 
-    return NULL;
+static void hashmap_open_alloc(hashmap_t *map, size_t capacity)
+{
+    map->capacity = capacity;
+    map->ctrl = allocator_alloc(map->allocator, capacity + hashmap_GROUP_WIDTH);
+    memset(map->ctrl, HASHMAP_CTRL_EMPTY, capacity + hashmap_GROUP_WIDTH);
+    map->slots = allocator_calloc(map->allocator, capacity, sizeof(struct hashmap_slot));
+    map->growth_left = capacity * hashmap_OPEN_MAX_LOAD_NUM / hashmap_OPEN_MAX_LOAD_DEN - map->size;
 }
 
-void hashmap_set_at(hashmap_t *map, void *key, void *value)
+static size_t hashmap_open_find(hashmap_t *map, void *key, size_t hash)
 {
-    size_t key_pos = hashmap_pos(map, key);
-    struct hashmap_entry *entry = map->buffer[key_pos];
+    size_t mask = map->capacity - 1;
+    size_t pos = (hash >> 7) & mask;
+    int8_t h2 = hash & 0x7f;
 
-    /* If the table entry doesn't exist, the key isn't in the map. 
-     * Create a new node and put it in the table. */
-    if (entry == NULL)
+    for (size_t stride = hashmap_GROUP_WIDTH;; stride += hashmap_GROUP_WIDTH)
     {
-        struct hashmap_entry *new_entry = $new(
-            struct hashmap_entry,
-            .key = key,
-            .value = value,
-            .next = NULL,
-            .prev_entry = map->last_entry,
-            .next_entry = NULL);
-
-        map->buffer[key_pos] = new_entry;
+        const int8_t *group = map->ctrl + pos;
 
-        if (map->first_entry == NULL)
-            map->first_entry = map->last_entry = new_entry;
-        else
+        for (uint32_t match = hashmap_group_match(group, h2); match != 0; match &= match - 1)
         {
-            map->last_entry->next_entry = new_entry;
-            map->last_entry = new_entry;
+            size_t slot = (pos + __builtin_ctz(match)) & mask;
+            if (hashmap_entry_matches(map, map->slots[slot].key, map->slots[slot].hash, key, hash))
+                return slot;
         }
 
-        map->size++;
-        return;
+        /* An empty slot ends every probe sequence that reached it. */
+        if (hashmap_group_match_empty(group) != 0)
+            return hashmap_OPEN_NOT_FOUND;
+
+        pos = (pos + stride) & mask;
     }
+}
 
-    struct hashmap_entry *prev_entry = NULL;
+static size_t hashmap_open_find_free(hashmap_t *map, size_t hash)
+{
+    size_t mask = map->capacity - 1;
+    size_t pos = (hash >> 7) & mask;
 
-    for (; entry != NULL; prev_entry = entry, entry = entry->next)
+    for (size_t stride = hashmap_GROUP_WIDTH;; stride += hashmap_GROUP_WIDTH)
     {
-        /* If the key is already present in the map, overwrite it. */
-        if (hashmap_keys_eq(map, entry->key, key))
-        {
-            entry->value = value;
-            return;
+        uint32_t match = hashmap_group_match_free(map->ctrl + pos);
+        if (match != 0)
+            return (pos + __builtin_ctz(match)) & mask;
+
+        pos = (pos + stride) & mask;
+    }
+}
+
+static void hashmap_open_rehash(hashmap_t *map, size_t new_capacity)
+{
+    int8_t *old_ctrl = map->ctrl;
+    struct hashmap_slot *old_slots = map->slots;
+    size_t old_capacity = map->capacity;
+
+    hashmap_open_alloc(map, new_capacity);
+
+    for (size_t i = 0; i < old_capacity; i++)
+    {
+        if (!hashmap_ctrl_is_full(old_ctrl[i]))
+            continue;
+
+        size_t hash = old_slots[i].hash;
+        size_t slot = hashmap_open_find_free(map, hash);
+
+        hashmap_open_set_ctrl(map, slot, hash & 0x7f);
+        map->slots[slot] = old_slots[i];
+    }
+
+    allocator_free(map->allocator, old_ctrl, old_capacity + hashmap_GROUP_WIDTH);
+    allocator_free(map->allocator, old_slots, old_capacity * sizeof(struct hashmap_slot));
+}
+
+static void hashmap_open_new(hashmap_t *map, size_t capacity)
+{
+    hashmap_open_alloc(map, hashmap_open_capacity_for(capacity));
+}
+
+static bool hashmap_open_contains_key(hashmap_t *map, void *key)
+{
+    return hashmap_open_find(map, key, hashmap_hash(map, key)) != hashmap_OPEN_NOT_FOUND;
+}
+
+static void *hashmap_open_get_at(hashmap_t *map, void *key)
+{
+    size_t slot = hashmap_open_find(map, key, hashmap_hash(map, key));
+    return slot != hashmap_OPEN_NOT_FOUND ? map->slots[slot].value : NULL;
+}
+
+static void hashmap_open_set_at(hashmap_t *map, void *key, void *value)
+{
+    size_t hash = hashmap_hash(map, key);
+    size_t slot = hashmap_open_find(map, key, hash);
+
+    if (slot != hashmap_OPEN_NOT_FOUND)
+    {
+        map->slots[slot].value = value;
+        return;
+    }
+
+    slot = hashmap_open_find_free(map, hash);
+
+    /* Reusing a tombstone costs nothing, but filling an empty slot
+     * needs headroom. If most of the used slots are tombstones, rebuild
+     * at the same size to sweep them, rather than growing. */
+    if (map->growth_left == 0 && map->ctrl[slot] == HASHMAP_CTRL_EMPTY)
+    {
+        size_t capacity = map->size * 2 < map->capacity * hashmap_OPEN_MAX_LOAD_NUM / hashmap_OPEN_MAX_LOAD_DEN
+                              ? map->capacity
+                              : map->capacity * 2;
+        hashmap_open_rehash(map, capacity);
+        slot = hashmap_open_find_free(map, hash);
+    }
+
+    if (map->ctrl[slot] == HASHMAP_CTRL_EMPTY)
+        map->growth_left--;
+
+    hashmap_open_set_ctrl(map, slot, hash & 0x7f);
+    map->slots[slot] = (struct hashmap_slot){.key = key, .value = value, .hash = hash};
+    map->size++;
+}
+
+static void *hashmap_open_remove_at(hashmap_t *map, void *key)
+{
+    size_t slot = hashmap_open_find(map, key, hashmap_hash(map, key));
+    if (slot == hashmap_OPEN_NOT_FOUND)
+        return NULL;
+
+    void *value = map->slots[slot].value;
+
+    hashmap_open_set_ctrl(map, slot, HASHMAP_CTRL_DELETED);
+    map->slots[slot] = (struct hashmap_slot){0};
+    map->size--;
+
+    return value;
+}
+
+static size_t hashmap_open_next_full(hashmap_t *map, size_t slot)
+{
+    for (; slot < map->capacity; slot++)
+    {
+        if (hashmap_ctrl_is_full(map->ctrl[slot]))
+            return slot;
+    }
+
+    return hashmap_OPEN_NOT_FOUND;
+}
+
+static size_t hashmap_open_prev_full(hashmap_t *map, size_t slot)
+{
+    while (slot-- > 0)
+    {
+        if (hashmap_ctrl_is_full(map->ctrl[slot]))
+            return slot;
+    }
+
+    return hashmap_OPEN_NOT_FOUND;
+}
+
+static void hashmap_open_free(hashmap_t *map)
+{
+    allocator_free(map->allocator, map->ctrl, map->capacity + hashmap_GROUP_WIDTH);
+    allocator_free(map->allocator, map->slots, map->capacity * sizeof(struct hashmap_slot));
+}
+
+static size_t hashmap_round_capacity(size_t capacity)
+{
+    size_t rounded = hashmap_DEFAULT_CAP;
+    while (rounded < capacity)
+        rounded *= 2;
+    return rounded;
+}
+
+hashmap_t *_hashmap_new_(hashmap_config_t config)
+{
+    size_t capacity = hashmap_round_capacity(config.capacity);
+
+    allocator_t *allocator = allocator_or_default(config.allocator);
+
+    hashmap_t *map = $new_in(
+        allocator,
+        hashmap_t,
+#if POLYMORPHIC_DS
+        .type = DS_TYPE_HASHMAP,
+#endif
+#if hashmap_ALLOW_KEY_EQ_FN_OVERLOAD
+        .key_eq_fn = config.key_equal_fn,
+#endif
+#if hashmap_ALLOW_HASH_FN_OVERLOAD
+        .hash_fn = config.hash_fn,
+#endif
+        .backend = config.backend,
+        .capacity = capacity,
+        .size = 0,
+        .first_entry = NULL,
+        .last_entry = NULL,
+        .buffer = NULL,
+        .incremental_rehash = config.incremental_rehash,
+        .old_buffer = NULL,
+        .allocator = allocator,
+        .pool = NULL);
+
+    switch (config.backend)
+    {
+    case HASHMAP_BACKEND_CHAINED:
+        map->buffer = allocator_calloc(allocator, capacity, sizeof(struct hashmap_entry *));
+        if (config.pool_nodes)
+            map->pool = node_pool_new(sizeof(struct hashmap_entry), .allocator = allocator);
+        break;
+
+    case HASHMAP_BACKEND_OPEN_ADDRESSING:
+        hashmap_open_new(map, capacity);
+        break;
+
+    default:
+        panic("Unknown hashmap backend: %d", config.backend);
+    }
+
+    return map;
+}
+
+void hashmap_reserve(hashmap_t *map, size_t nitems)
+{
+    if (map->backend == HASHMAP_BACKEND_OPEN_ADDRESSING)
+    {
+        size_t capacity = hashmap_open_capacity_for(nitems);
+        if (capacity > map->capacity)
+            hashmap_open_rehash(map, capacity);
+        return;
+    }
+
+    size_t capacity = map->capacity;
+    while (nitems > capacity * hashmap_SIZE_UP_RATIO)
+        capacity *= 2;
+
+    if (capacity > map->capacity)
+        hashmap_rehash(map, capacity);
+}
+
+#if hashmap_ALLOW_KEY_EQ_FN_OVERLOAD
+equal_fn_t hashmap_get_key_eq_fn(hashmap_t *map)
+{
+    return map->key_eq_fn;
+}
+#endif // hashmap_ALLOW_KEY_EQ_FN_OVERLOAD
+
+#if hashmap_ALLOW_HASH_FN_OVERLOAD
+hash_fn_t hashmap_get_hash_fn(hashmap_t *map)
+{
+    return map->hash_fn;
+}
+#endif // hashmap_ALLOW_HASH_FN_OVERLOAD
+
+bool hashmap_is_empty(hashmap_t *map)
+{
+    return map->size == 0;
+}
+
+bool hashmap_contains_key(hashmap_t *map, void *key)
+{
+    if (map->backend == HASHMAP_BACKEND_OPEN_ADDRESSING)
+        return hashmap_open_contains_key(map, key);
+
+    hashmap_rehash_step(map);
+    return hashmap_find_link(map, key, hashmap_hash(map, key)) != NULL;
+}
+
+bool hashmap_contains_value(hashmap_t *map, void *value)
+{
+    if (map->backend == HASHMAP_BACKEND_OPEN_ADDRESSING)
+    {
+        for (size_t slot = hashmap_open_next_full(map, 0);
+             slot != hashmap_OPEN_NOT_FOUND;
+             slot = hashmap_open_next_full(map, slot + 1))
+        {
+            if (map->slots[slot].value == value)
+                return true;
+        }
+
+        return false;
+    }
+
+    for (struct hashmap_entry *node = map->first_entry; node != NULL; node = node->next_entry)
+    {
+        if (node->value == value)
+            return true;
+    }
+
+    return false;
+}
+
+size_t hashmap_size(hashmap_t *map)
+{
+    return map->size;
+}
+
+void *hashmap_get_at(hashmap_t *map, void *key)
+{
+    if (map->backend == HASHMAP_BACKEND_OPEN_ADDRESSING)
+        return hashmap_open_get_at(map, key);
+
+    hashmap_rehash_step(map);
+    struct hashmap_entry **link = hashmap_find_link(map, key, hashmap_hash(map, key));
+    return link != NULL ? (*link)->value : NULL;
+}
+
+/* Looks up a batch of keys in stages, so that the cache misses of
+ * every key in a batch are in flight at once instead of one after the
+ * other: hash every key and prefetch its bucket (or control group),
+ * then prefetch the entry (or slot) each bucket leads to, and only
+ * then compare keys. Either output array may be NULL. */
+static void hashmap_lookup_many(hashmap_t *map, size_t n, void *keys[n], void *values[n], bool found[n])
+{
+    size_t hashes[hashmap_BATCH_SIZE];
+    size_t positions[hashmap_BATCH_SIZE];
+
+    if (map->backend == HASHMAP_BACKEND_CHAINED)
+        hashmap_rehash_step(map);
+
+    for (size_t start = 0; start < n; start += hashmap_BATCH_SIZE)
+    {
+        size_t batch = min(n - start, (size_t)hashmap_BATCH_SIZE);
+        void **batch_keys = keys + start;
+
+        if (map->backend == HASHMAP_BACKEND_OPEN_ADDRESSING)
+        {
+            size_t mask = map->capacity - 1;
+
+            for (size_t i = 0; i < batch; i++)
+            {
+                hashes[i] = hashmap_hash(map, batch_keys[i]);
+                positions[i] = (hashes[i] >> 7) & mask;
+                __builtin_prefetch(map->ctrl + positions[i]);
+            }
+
+            for (size_t i = 0; i < batch; i++)
+            {
+                uint32_t match = hashmap_group_match(map->ctrl + positions[i], hashes[i] & 0x7f);
+                if (match != 0)
+                    __builtin_prefetch(&map->slots[(positions[i] + __builtin_ctz(match)) & mask]);
+            }
+
+            for (size_t i = 0; i < batch; i++)
+            {
+                size_t slot = hashmap_open_find(map, batch_keys[i], hashes[i]);
+                if (values != NULL)
+                    values[start + i] = slot != hashmap_OPEN_NOT_FOUND ? map->slots[slot].value : NULL;
+                if (found != NULL)
+                    found[start + i] = slot != hashmap_OPEN_NOT_FOUND;
+            }
+        }
+        else
+        {
+            struct hashmap_entry **buckets[hashmap_BATCH_SIZE];
+
+            for (size_t i = 0; i < batch; i++)
+            {
+                hashes[i] = hashmap_hash(map, batch_keys[i]);
+                buckets[i] = hashmap_bucket(map, hashes[i]);
+                __builtin_prefetch(buckets[i]);
+            }
+
+            for (size_t i = 0; i < batch; i++)
+            {
+                if (*buckets[i] != NULL)
+                    __builtin_prefetch(*buckets[i]);
+            }
+
+            for (size_t i = 0; i < batch; i++)
+            {
+                struct hashmap_entry *entry = *buckets[i];
+                while (entry != NULL &&
+                       !hashmap_entry_matches(map, entry->key, entry->hash, batch_keys[i], hashes[i]))
+                    entry = entry->next;
+
+                if (values != NULL)
+                    values[start + i] = entry != NULL ? entry->value : NULL;
+                if (found != NULL)
+                    found[start + i] = entry != NULL;
+            }
         }
     }
+}
+
+void hashmap_get_many(hashmap_t *map, size_t n, void *keys[n], void *values[n])
+{
+    hashmap_lookup_many(map, n, keys, values, NULL);
+}
+
+void hashmap_contains_many(hashmap_t *map, size_t n, void *keys[n], bool found[n])
+{
+    hashmap_lookup_many(map, n, keys, NULL, found);
+}
+
+void hashmap_set_at(hashmap_t *map, void *key, void *value)
+{
+    if (map->backend == HASHMAP_BACKEND_OPEN_ADDRESSING)
+    {
+        hashmap_open_set_at(map, key, value);
+        return;
+    }
+
+    hashmap_rehash_step(map);
 
-    /* Take a step back in the traversal. */
-    entry = prev_entry;
+    /* If the key is already present in the map, overwrite it. */
+    size_t hash = hashmap_hash(map, key);
+    struct hashmap_entry **link = hashmap_find_link(map, key, hash);
+    if (link != NULL)
+    {
+        (*link)->value = value;
+        return;
+    }
 
-    /* If the key doesn't exist in the map, but its entry is populated, 
-     * create a new node and add it to the list of other keys at that 
-     * entry. */
-    struct hashmap_entry *new_entry = $new(
-        struct hashmap_entry,
+    /* Otherwise, chain a new entry at the head of its bucket, and
+     * append it to the insertion order. */
+    struct hashmap_entry **bucket = hashmap_bucket(map, hash);
+    struct hashmap_entry *new_entry = map->pool != NULL
+                                          ? node_pool_alloc(map->pool)
+                                          : allocator_alloc(map->allocator, sizeof(struct hashmap_entry));
+    *new_entry = (struct hashmap_entry){
         .key = key,
         .value = value,
-        .next = NULL,
+        .hash = hash,
+        .next = *bucket,
         .prev_entry = map->last_entry,
-        .next_entry = NULL);
+        .next_entry = NULL};
 
-    entry->next = new_entry;
+    *bucket = new_entry;
 
     if (map->first_entry == NULL)
         map->first_entry = map->last_entry = new_entry;
@@ -2056,33 +2853,38 @@ void hashmap_set_at(hashmap_t *map, void *key, void *value)
 
 void *hashmap_remove_at(hashmap_t *map, void *key)
 {
-    size_t key_pos = hashmap_pos(map, key);
-    struct hashmap_entry *entry = map->buffer[key_pos];
+    if (map->backend == HASHMAP_BACKEND_OPEN_ADDRESSING)
+        return hashmap_open_remove_at(map, key);
 
-    for (struct hashmap_entry *prev_entry = NULL;
-         entry != NULL;
-         prev_entry = entry, entry = entry->next)
-    {
-        if (hashmap_keys_eq(map, entry->key, key))
-        {
-            if (prev_entry != NULL)
-                prev_entry->next = entry->next;
-            if (entry->prev_entry)
-                entry->prev_entry->next_entry = entry->next_entry;
-            if (entry->next_entry)
-                entry->next_entry->prev_entry = entry->prev_entry;
+    hashmap_rehash_step(map);
 
-            void *value = entry->value;
+    struct hashmap_entry **link = hashmap_find_link(map, key, hashmap_hash(map, key));
+    if (link == NULL)
+        return NULL;
 
-            free(entry);
-            map->size--;
+    struct hashmap_entry *entry = *link;
+    *link = entry->next;
 
-            hashmap_check_size_down(map);
-            return value;
-        }
-    }
+    if (entry->prev_entry != NULL)
+        entry->prev_entry->next_entry = entry->next_entry;
+    else
+        map->first_entry = entry->next_entry;
 
-    return NULL;
+    if (entry->next_entry != NULL)
+        entry->next_entry->prev_entry = entry->prev_entry;
+    else
+        map->last_entry = entry->prev_entry;
+
+    void *value = entry->value;
+
+    if (map->pool != NULL)
+        node_pool_release(map->pool, entry);
+    else
+        allocator_free(map->allocator, entry, sizeof(struct hashmap_entry));
+    map->size--;
+
+    hashmap_check_size_down(map);
+    return value;
 }
 
 void _hashmap_set_all_(hashmap_t *map, size_t n, map_entry_t entries[n])
@@ -2096,6 +2898,21 @@ void _hashmap_set_all_(hashmap_t *map, size_t n, map_entry_t entries[n])
 
 map_entry_t hashmap_find(hashmap_t *map, bipred_fn_t bipred)
 {
+    if (map->backend == HASHMAP_BACKEND_OPEN_ADDRESSING)
+    {
+        for (size_t slot = hashmap_open_next_full(map, 0);
+             slot != hashmap_OPEN_NOT_FOUND;
+             slot = hashmap_open_next_full(map, slot + 1))
+        {
+            if (bipred(map->slots[slot].key, map->slots[slot].value))
+                return (map_entry_t){
+                    .key = map->slots[slot].key,
+                    .value = map->slots[slot].value};
+        }
+
+        return (map_entry_t){0};
+    }
+
     for (struct hashmap_entry *entry = map->first_entry;
          entry != NULL;
          entry = entry->next_entry)
@@ -2113,6 +2930,18 @@ hashset_t *hashmap_keys(hashmap_t *map)
 {
     hashset_t *keys = hashset_new();
 
+    if (map->backend == HASHMAP_BACKEND_OPEN_ADDRESSING)
+    {
+        for (size_t slot = hashmap_open_next_full(map, 0);
+             slot != hashmap_OPEN_NOT_FOUND;
+             slot = hashmap_open_next_full(map, slot + 1))
+        {
+            hashset_add(keys, map->slots[slot].key);
+        }
+
+        return keys;
+    }
+
     for (struct hashmap_entry *entry = map->first_entry;
          entry != NULL;
          entry = entry->next_entry)
@@ -2127,14 +2956,25 @@ struct arraylist *hashmap_values(hashmap_t *map)
 {
     struct arraylist *values = _arraylist_new_(
         (arraylist_config_t){
-            .item_size = 0 // TODO
-        });
+            .item_size = sizeof(void *)});
+
+    if (map->backend == HASHMAP_BACKEND_OPEN_ADDRESSING)
+    {
+        for (size_t slot = hashmap_open_next_full(map, 0);
+             slot != hashmap_OPEN_NOT_FOUND;
+             slot = hashmap_open_next_full(map, slot + 1))
+        {
+            _arraylist_add_(values, &map->slots[slot].value);
+        }
+
+        return values;
+    }
 
     for (struct hashmap_entry *entry = map->first_entry;
          entry != NULL;
          entry = entry->next_entry)
     {
-        _arraylist_add_(values, entry->value);
+        _arraylist_add_(values, &entry->value);
     }
 
     return values;
@@ -2152,7 +2992,10 @@ hashmap_ref_t *hashmap_ref(hashmap_t *map)
 #endif
         .map = map,
         .pos = 0,
-        .entry = map->first_entry);
+        .entry = map->first_entry,
+        .slot = map->backend == HASHMAP_BACKEND_OPEN_ADDRESSING
+                    ? hashmap_open_next_full(map, 0)
+                    : 0);
 }
 
 bool hashmap_equal(hashmap_t *map1, hashmap_t *map2)
@@ -2160,6 +3003,22 @@ bool hashmap_equal(hashmap_t *map1, hashmap_t *map2)
     if (map1->size != map2->size)
         return false;
 
+    if (map1->backend == HASHMAP_BACKEND_OPEN_ADDRESSING)
+    {
+        for (size_t slot = hashmap_open_next_full(map1, 0);
+             slot != hashmap_OPEN_NOT_FOUND;
+             slot = hashmap_open_next_full(map1, slot + 1))
+        {
+            if (!hashmap_contains_key(map2, map1->slots[slot].key) ||
+                hashmap_get_at(map2, map1->slots[slot].key) != map1->slots[slot].value)
+            {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
     for (struct hashmap_entry *entry = map1->first_entry;
          entry != NULL;
          entry = entry->next_entry)
@@ -2176,39 +3035,62 @@ bool hashmap_equal(hashmap_t *map1, hashmap_t *map2)
 
 void hashmap_free(hashmap_t *map)
 {
-    for (struct hashmap_entry *entry = map->first_entry;
-         entry != NULL;)
+    if (map->backend == HASHMAP_BACKEND_OPEN_ADDRESSING)
+    {
+        hashmap_open_free(map);
+        allocator_free(map->allocator, map, sizeof(hashmap_t));
+        return;
+    }
+
+    if (map->pool != NULL)
+        node_pool_free(map->pool);
+    else
     {
-        struct hashmap_entry *next_entry = entry->next_entry;
-        free(entry);
-        entry = next_entry;
+        for (struct hashmap_entry *entry = map->first_entry;
+             entry != NULL;)
+        {
+            struct hashmap_entry *next_entry = entry->next_entry;
+            allocator_free(map->allocator, entry, sizeof(struct hashmap_entry));
+            entry = next_entry;
+        }
     }
 
-    free(map->buffer);
-    free(map);
+    allocator_free(map->allocator, map->buffer, map->capacity * sizeof(struct hashmap_entry *));
+    allocator_free(map->allocator, map->old_buffer, map->old_capacity * sizeof(struct hashmap_entry *));
+    allocator_free(map->allocator, map, sizeof(hashmap_t));
+}
+
+static map_entry_t hashmap_ref_current(hashmap_ref_t *ref)
+{
+    if (ref->map->backend == HASHMAP_BACKEND_OPEN_ADDRESSING)
+        return (map_entry_t){
+            .key = ref->map->slots[ref->slot].key,
+            .value = ref->map->slots[ref->slot].value};
+
+    return (map_entry_t){
+        .key = ref->entry->key,
+        .value = ref->entry->value};
 }
 
 void *hashmap_ref_get_key(hashmap_ref_t *ref)
 {
     if (!hashmap_ref_is_valid(ref))
         panic("Reference is out of bounds");
-    return ref->entry->key;
+    return hashmap_ref_current(ref).key;
 }
 
 void *hashmap_ref_get_value(hashmap_ref_t *ref)
 {
     if (!hashmap_ref_is_valid(ref))
         panic("Reference is out of bounds");
-    return ref->entry->value;
+    return hashmap_ref_current(ref).value;
 }
 
 map_entry_t hashmap_ref_get_entry(hashmap_ref_t *ref)
 {
     if (!hashmap_ref_is_valid(ref))
         panic("Reference is out of bounds");
-    return (map_entry_t){
-        .key = ref->entry->key,
-        .value = ref->entry->value};
+    return hashmap_ref_current(ref);
 }
 
 hashmap_t *hashmap_ref_get_map(hashmap_ref_t *ref)
@@ -2232,6 +3114,8 @@ bool hashmap_ref_has_prev(hashmap_ref_t *ref)
 {
     if (!hashmap_ref_is_valid(ref))
         panic("Reference is out of bounds");
+    if (ref->map->backend == HASHMAP_BACKEND_OPEN_ADDRESSING)
+        return hashmap_open_prev_full(ref->map, ref->slot) != hashmap_OPEN_NOT_FOUND;
     return ref->entry->prev_entry != NULL;
 }
 
@@ -2239,6 +3123,8 @@ bool hashmap_ref_has_next(hashmap_ref_t *ref)
 {
     if (!hashmap_ref_is_valid(ref))
         panic("Reference is out of bounds");
+    if (ref->map->backend == HASHMAP_BACKEND_OPEN_ADDRESSING)
+        return hashmap_open_next_full(ref->map, ref->slot + 1) != hashmap_OPEN_NOT_FOUND;
     return ref->entry->next_entry != NULL;
 }
 
@@ -2252,8 +3138,11 @@ map_entry_t hashmap_ref_next(hashmap_ref_t *ref)
         return (map_entry_t){0};
     }
     ref->pos++;
-    ref->entry = ref->entry->next_entry;
-    return (map_entry_t){.key = ref->entry->key, .value = ref->entry->value};
+    if (ref->map->backend == HASHMAP_BACKEND_OPEN_ADDRESSING)
+        ref->slot = hashmap_open_next_full(ref->map, ref->slot + 1);
+    else
+        ref->entry = ref->entry->next_entry;
+    return hashmap_ref_current(ref);
 }
 
 map_entry_t hashmap_ref_prev(hashmap_ref_t *ref)
@@ -2266,8 +3155,11 @@ map_entry_t hashmap_ref_prev(hashmap_ref_t *ref)
         return (map_entry_t){0};
     }
     ref->pos--;
-    ref->entry = ref->entry->prev_entry;
-    return (map_entry_t){.key = ref->entry->key, .value = ref->entry->value};
+    if (ref->map->backend == HASHMAP_BACKEND_OPEN_ADDRESSING)
+        ref->slot = hashmap_open_prev_full(ref->map, ref->slot);
+    else
+        ref->entry = ref->entry->prev_entry;
+    return hashmap_ref_current(ref);
 }
 
 void hashmap_ref_free(hashmap_ref_t *ref)
@@ -2295,164 +3187,356 @@ struct rbtree_node
     struct rbtree_node *right;
 };
 
-bool rbtree_is_leaf(struct rbtree_node *node)
-{
-    return node != NULL && node->left == NULL && node->right == NULL;
-}
-
-bool rbtree_is_red(struct rbtree_node *node)
+/* A node of the compact engine, which keeps every node in one array and
+ * links them by their positions in it. */
+struct crbtree_node
 {
-    if (node == NULL)
-        return false;
-    return node->color == RBTREE_COLOR_RED;
-}
+    void *key;
+    void *value;
+    uint32_t parent; /* The top bit holds the color, set for red. */
+    uint32_t child[2]; /* Left, then right. */
+};
 
-bool rbtree_is_black(struct rbtree_node *node)
+struct crbtree
 {
-    return !rbtree_is_red(node);
-}
+    struct crbtree_node *nodes; /* nodes[0] is the nil sentinel, always black. */
+    void *block; /* The allocation holding the nodes, aligned within it. */
+    uint32_t root;
+    uint32_t capacity;
+    uint32_t end;  /* One past the last node ever used. */
+    uint32_t free; /* Removed nodes, linked through their right child. */
+};
 
-void rbtree_set_right(struct rbtree_node *parent, struct rbtree_node *right)
+struct treemap
 {
-    parent->right = right;
-    right->parent = parent;
-}
+#if POLYMORPHIC_DS
+    ds_type_t type;
+#endif
+#if treemap_ALLOW_KEY_CMP_FN_OVERLOAD
+    compare_fn_t key_cmp_fn;
+#endif
+    treemap_backend_t backend;
+    bool order_statistics;
+    size_t size;
+    struct rbtree_node *root;
+    struct btree_node *btree_root;
+    struct crbtree compact;
+    allocator_t *allocator;
+    node_pool_t *pool;
+};
+
+/* With order statistics, every node also carries the number of nodes
+ * in its subtree, stored past the end of the plain node so that maps
+ * without them do not pay for it. */
+struct rbtree_counted_node
+{
+    struct rbtree_node node;
+    size_t count;
+};
+
+#define rbtree_NODE_SIZE(counted) \
+    ((counted) ? sizeof(struct rbtree_counted_node) : sizeof(struct rbtree_node))
+
+static inline size_t rbtree_count(struct rbtree_node *node)
+{
+    return node != NULL ? ((struct rbtree_counted_node *)node)->count : 0;
+}
 
-void rbtree_set_left(struct rbtree_node *parent, struct rbtree_node *left)
+static inline void rbtree_recount(struct rbtree_node *node)
 {
-    parent->left = left;
-    left->parent = parent;
+    ((struct rbtree_counted_node *)node)->count = rbtree_count(node->left) + rbtree_count(node->right) + 1;
 }
 
-struct rbtree_node *rbtree_rotate_left(struct rbtree_node *node)
+bool rbtree_is_red(struct rbtree_node *node)
 {
     if (node == NULL)
-        panic("RB tree node cannot be NULL");
-    else if (!rbtree_is_red(node->right))
-        panic("RB tree node must be right-leaning");
+        return false;
+    return node->color == RBTREE_COLOR_RED;
+}
 
-    struct rbtree_node *right = node->right;
-    rbtree_set_right(node, right->left);
-    rbtree_set_left(right, node);
+bool rbtree_is_black(struct rbtree_node *node)
+{
+    return !rbtree_is_red(node);
+}
 
-    right->color = right->left->color;
-    right->left->color = RBTREE_COLOR_RED;
+struct rbtree_node *rbtree_min_at(struct rbtree_node *node)
+{
+    while (node->left != NULL)
+        node = node->left;
+    return node;
+}
 
-    return right;
+struct rbtree_node *rbtree_max_at(struct rbtree_node *node)
+{
+    while (node->right != NULL)
+        node = node->right;
+    return node;
 }
 
-struct rbtree_node *rbtree_rotate_right(struct rbtree_node *node)
+/* Returns the in-order successor of node, or NULL. */
+struct rbtree_node *rbtree_next(struct rbtree_node *node)
 {
-    if (node == NULL)
-        panic("RB tree node cannot be NULL");
-    else if (!rbtree_is_red(node->left))
-        panic("RB tree node must be left-leaning");
+    if (node->right != NULL)
+        return rbtree_min_at(node->right);
 
-    struct rbtree_node *left = node->left;
-    rbtree_set_left(node, left->right);
-    rbtree_set_right(left, node);
+    while (node->parent != NULL && node == node->parent->right)
+        node = node->parent;
+    return node->parent;
+}
 
-    left->color = left->right->color;
-    left->right->color = RBTREE_COLOR_RED;
+/* Returns the in-order predecessor of node, or NULL. */
+struct rbtree_node *rbtree_prev(struct rbtree_node *node)
+{
+    if (node->left != NULL)
+        return rbtree_max_at(node->left);
 
-    return left;
+    while (node->parent != NULL && node == node->parent->left)
+        node = node->parent;
+    return node->parent;
 }
 
-void rbtree_flip_colors(struct rbtree_node *node)
+/* Puts replacement where node hangs from its parent, or at the root. */
+static void rbtree_replace(treemap_t *map, struct rbtree_node *node, struct rbtree_node *replacement)
 {
-    if (node == NULL || node->left == NULL || node->right == NULL)
-        panic("RB tree node or its children cannot be NULL");
-    if (!(rbtree_is_red(node) && rbtree_is_black(node->left) && rbtree_is_black(node->right)) &&
-        !(rbtree_is_black(node) && rbtree_is_red(node->left) && rbtree_is_red(node->right)))
-        panic("RB tree node must be opposite color of children to be flipped");
+    if (node->parent == NULL)
+        map->root = replacement;
+    else if (node == node->parent->left)
+        node->parent->left = replacement;
+    else
+        node->parent->right = replacement;
 
-    node->color = !node->color;
-    node->left->color = !node->left->color;
-    node->right->color = !node->right->color;
+    if (replacement != NULL)
+        replacement->parent = node->parent;
 }
 
-struct rbtree_node *rbtree_move_red_left(struct rbtree_node *node)
+static void rbtree_rotate_left(treemap_t *map, struct rbtree_node *node)
 {
-    if (node == NULL)
-        panic("RB tree node cannot be NULL");
-    if (rbtree_is_black(node) || rbtree_is_red(node->left) || rbtree_is_red(node->left->left))
-        panic("RB tree node must be red and along and its left child and grandchild must be black to be moved left");
+    struct rbtree_node *right = node->right;
 
-    rbtree_flip_colors(node);
+    node->right = right->left;
+    if (right->left != NULL)
+        right->left->parent = node;
 
-    if (rbtree_is_red(node->right->left))
+    rbtree_replace(map, node, right);
+    right->left = node;
+    node->parent = right;
+
+    if (map->order_statistics)
     {
-        rbtree_set_right(node, rbtree_rotate_right(node->right));
-        node = rbtree_rotate_left(node);
-        rbtree_flip_colors(node);
+        rbtree_recount(node);
+        rbtree_recount(right);
     }
-
-    return node;
 }
 
-struct rbtree_node *rbtree_move_red_right(struct rbtree_node *node)
+static void rbtree_rotate_right(treemap_t *map, struct rbtree_node *node)
 {
-    if (node == NULL)
-        panic("RB tree node cannot be NULL");
-    if (rbtree_is_black(node) || rbtree_is_red(node->right) || rbtree_is_red(node->right->right))
-        panic("RB tree node must be red and along and its left child and grandchild must be black to be moved right");
+    struct rbtree_node *left = node->left;
+
+    node->left = left->right;
+    if (left->right != NULL)
+        left->right->parent = node;
 
-    rbtree_flip_colors(node);
+    rbtree_replace(map, node, left);
+    left->right = node;
+    node->parent = left;
 
-    if (rbtree_is_red(node->left->left)) // TODO: is this right?
+    if (map->order_statistics)
     {
-        node = rbtree_rotate_right(node);
-        rbtree_flip_colors(node);
+        rbtree_recount(node);
+        rbtree_recount(left);
     }
-
-    return node;
 }
 
-struct rbtree_node *rbtree_balance(struct rbtree_node *node)
+/* Restores the red-black invariants after linking the red leaf node,
+ * walking up through parent pointers while it has a red parent. */
+static void rbtree_insert_fixup(treemap_t *map, struct rbtree_node *node)
 {
-    if (node == NULL)
-        panic("RB tree node cannot be NULL");
+    while (rbtree_is_red(node->parent))
+    {
+        /* A red parent is never the root, so the grandparent exists. */
+        struct rbtree_node *parent = node->parent;
+        struct rbtree_node *grandparent = parent->parent;
 
-    if (rbtree_is_red(node->right))
-        node = rbtree_rotate_left(node);
-    if (rbtree_is_red(node->left) && rbtree_is_red(node->left->left))
-        node = rbtree_rotate_right(node);
-    if (rbtree_is_red(node->left) && rbtree_is_red(node->right))
-        rbtree_flip_colors(node);
+        if (parent == grandparent->left)
+        {
+            struct rbtree_node *uncle = grandparent->right;
+
+            if (rbtree_is_red(uncle))
+            {
+                parent->color = uncle->color = RBTREE_COLOR_BLACK;
+                grandparent->color = RBTREE_COLOR_RED;
+                node = grandparent;
+                continue;
+            }
+
+            if (node == parent->right)
+            {
+                rbtree_rotate_left(map, parent);
+                parent = node;
+            }
+
+            parent->color = RBTREE_COLOR_BLACK;
+            grandparent->color = RBTREE_COLOR_RED;
+            rbtree_rotate_right(map, grandparent);
+            break;
+        }
+        else
+        {
+            struct rbtree_node *uncle = grandparent->left;
+
+            if (rbtree_is_red(uncle))
+            {
+                parent->color = uncle->color = RBTREE_COLOR_BLACK;
+                grandparent->color = RBTREE_COLOR_RED;
+                node = grandparent;
+                continue;
+            }
+
+            if (node == parent->left)
+            {
+                rbtree_rotate_right(map, parent);
+                parent = node;
+            }
+
+            parent->color = RBTREE_COLOR_BLACK;
+            grandparent->color = RBTREE_COLOR_RED;
+            rbtree_rotate_left(map, grandparent);
+            break;
+        }
+    }
 
-    return node;
+    map->root->color = RBTREE_COLOR_BLACK;
 }
 
-struct rbtree_node *rbtree_min_at(struct rbtree_node *node)
+/* Restores the black height after a black node was unlinked from below
+ * parent, leaving node (possibly NULL) one black short in its place. */
+static void rbtree_remove_fixup(treemap_t *map, struct rbtree_node *node, struct rbtree_node *parent)
 {
-    if (node->left == NULL)
-        return node;
-    return rbtree_min_at(node->left);
+    while (node != map->root && rbtree_is_black(node))
+    {
+        /* The sibling has a black height of at least one, so it exists. */
+        if (node == parent->left)
+        {
+            struct rbtree_node *sibling = parent->right;
+
+            if (rbtree_is_red(sibling))
+            {
+                sibling->color = RBTREE_COLOR_BLACK;
+                parent->color = RBTREE_COLOR_RED;
+                rbtree_rotate_left(map, parent);
+                sibling = parent->right;
+            }
+
+            if (rbtree_is_black(sibling->left) && rbtree_is_black(sibling->right))
+            {
+                sibling->color = RBTREE_COLOR_RED;
+                node = parent;
+                parent = node->parent;
+                continue;
+            }
+
+            if (rbtree_is_black(sibling->right))
+            {
+                sibling->left->color = RBTREE_COLOR_BLACK;
+                sibling->color = RBTREE_COLOR_RED;
+                rbtree_rotate_right(map, sibling);
+                sibling = parent->right;
+            }
+
+            sibling->color = parent->color;
+            parent->color = RBTREE_COLOR_BLACK;
+            sibling->right->color = RBTREE_COLOR_BLACK;
+            rbtree_rotate_left(map, parent);
+        }
+        else
+        {
+            struct rbtree_node *sibling = parent->left;
+
+            if (rbtree_is_red(sibling))
+            {
+                sibling->color = RBTREE_COLOR_BLACK;
+                parent->color = RBTREE_COLOR_RED;
+                rbtree_rotate_right(map, parent);
+                sibling = parent->left;
+            }
+
+            if (rbtree_is_black(sibling->left) && rbtree_is_black(sibling->right))
+            {
+                sibling->color = RBTREE_COLOR_RED;
+                node = parent;
+                parent = node->parent;
+                continue;
+            }
+
+            if (rbtree_is_black(sibling->left))
+            {
+                sibling->right->color = RBTREE_COLOR_BLACK;
+                sibling->color = RBTREE_COLOR_RED;
+                rbtree_rotate_left(map, sibling);
+                sibling = parent->left;
+            }
+
+            sibling->color = parent->color;
+            parent->color = RBTREE_COLOR_BLACK;
+            sibling->left->color = RBTREE_COLOR_BLACK;
+            rbtree_rotate_right(map, parent);
+        }
+
+        node = map->root;
+    }
+
+    if (node != NULL)
+        node->color = RBTREE_COLOR_BLACK;
 }
 
-struct rbtree_node *rbtree_remove_min_at(struct rbtree_node *node)
+/* Unlinks node from the tree and rebalances it. A node with two
+ * children is replaced by its successor, which is relinked in its
+ * place rather than having its key and value copied over, so other
+ * nodes never change identity. */
+static void rbtree_remove(treemap_t *map, struct rbtree_node *node)
 {
-    if (node->left == NULL)
-        return NULL;
+    struct rbtree_node *child, *parent;
+    enum rbtree_color removed_color;
 
-    if (rbtree_is_black(node->left) && rbtree_is_black(node->left->left))
-        node = rbtree_move_red_left(node);
+    if (node->left == NULL || node->right == NULL)
+    {
+        child = node->left != NULL ? node->left : node->right;
+        parent = node->parent;
+        removed_color = node->color;
+        rbtree_replace(map, node, child);
+    }
+    else
+    {
+        struct rbtree_node *successor = rbtree_min_at(node->right);
+        child = successor->right;
+        removed_color = successor->color;
 
-    rbtree_set_left(node, rbtree_remove_min_at(node->left));
-    return rbtree_balance(node);
-}
+        if (successor->parent == node)
+            parent = successor;
+        else
+        {
+            parent = successor->parent;
+            rbtree_replace(map, successor, child);
+            successor->right = node->right;
+            successor->right->parent = successor;
+        }
 
-struct treemap
-{
-#if POLYMORPHIC_DS
-    ds_type_t type;
-#endif
-#if treemap_ALLOW_KEY_CMP_FN_OVERLOAD
-    compare_fn_t key_cmp_fn;
-#endif
-    size_t size;
-    struct rbtree_node *root;
-};
+        rbtree_replace(map, node, successor);
+        successor->left = node->left;
+        successor->left->parent = successor;
+        successor->color = node->color;
+    }
+
+    /* Every subtree that lost a node hangs on the path up from parent. */
+    if (map->order_statistics)
+    {
+        for (struct rbtree_node *ancestor = parent; ancestor != NULL; ancestor = ancestor->parent)
+            rbtree_recount(ancestor);
+    }
+
+    if (removed_color == RBTREE_COLOR_BLACK)
+        rbtree_remove_fixup(map, child, parent);
+}
 
 struct treemap_ref
 {
@@ -2462,7 +3546,18 @@ struct treemap_ref
     treemap_t *map;
     size_t pos;
     struct rbtree_node *node;
-    struct linkedlist *inorder_history;
+
+    /* B+tree engine. */
+    struct btree_leaf *leaf;
+    size_t leaf_pos;
+
+    /* Compact engine. */
+    uint32_t index;
+
+    /* Range references stay within [lo, hi). */
+    bool bounded;
+    void *lo;
+    void *hi;
 };
 
 int treemap_compare_keys(treemap_t *map, void *key1, void *key2)
@@ -2474,396 +3569,2558 @@ int treemap_compare_keys(treemap_t *map, void *key1, void *key2)
 #endif
 }
 
-treemap_t *_treemap_new_(treemap_config_t config)
+/* ------------------------- B+tree engine -------------------------
+ * Inner nodes hold sorted separators, where children[i] holds the keys
+ * in [keys[i - 1], keys[i]), and leaves hold the sorted entries, linked
+ * in order to their neighbours. Every node but the root stays at least
+ * half full, so the tree stays log(n) / log(node keys / 2) deep.
+ */
+
+#define btree_INNER_MIN_KEYS (treemap_BTREE_INNER_KEYS / 2)
+#define btree_LEAF_MIN_KEYS (treemap_BTREE_LEAF_KEYS / 2)
+
+struct btree_node
 {
-    return $new(
-        treemap_t,
-#if POLYMORPHIC_DS
-        .type = DS_TYPE_TREEMAP,
-#endif
-#if treemap_ALLOW_KEY_CMP_FN_OVERLOAD
-        .key_cmp_fn = config.key_compare_fn,
-#endif
-        .size = 0,
-        .root = NULL);
+    uint16_t nkeys;
+    bool is_leaf;
+};
+
+struct btree_inner
+{
+    struct btree_node header;
+    void *keys[treemap_BTREE_INNER_KEYS];
+    struct btree_node *children[treemap_BTREE_INNER_KEYS + 1];
+};
+
+struct btree_leaf
+{
+    struct btree_node header;
+    struct btree_leaf *prev;
+    struct btree_leaf *next;
+    void *keys[treemap_BTREE_LEAF_KEYS];
+    void *values[treemap_BTREE_LEAF_KEYS];
+};
+
+#define btree_NODE_SIZE max(sizeof(struct btree_inner), sizeof(struct btree_leaf))
+
+/* The split that inserting into a node caused, if any: right is the new
+ * node holding the upper half, and separator its smallest key. */
+struct btree_split
+{
+    void *separator;
+    struct btree_node *right;
+};
+
+static void *btree_node_alloc(treemap_t *map, size_t size)
+{
+    return map->pool != NULL
+               ? node_pool_alloc(map->pool)
+               : allocator_alloc(map->allocator, size);
 }
 
-#if treemap_ALLOW_KEY_CMP_FN_OVERLOAD
-compare_fn_t treemap_get_key_cmp_fn(treemap_t *map)
+static void btree_node_free(treemap_t *map, struct btree_node *node)
 {
-    return map->key_cmp_fn;
+    if (map->pool != NULL)
+        node_pool_release(map->pool, node);
+    else
+        allocator_free(map->allocator, node,
+                       node->is_leaf ? sizeof(struct btree_leaf) : sizeof(struct btree_inner));
 }
-#endif
 
-bool treemap_is_empty(treemap_t *map)
+static struct btree_leaf *btree_leaf_new(treemap_t *map)
 {
-    return map->size == 0;
+    struct btree_leaf *leaf = btree_node_alloc(map, sizeof(struct btree_leaf));
+    leaf->header = (struct btree_node){.nkeys = 0, .is_leaf = true};
+    leaf->prev = leaf->next = NULL;
+    return leaf;
 }
 
-bool treemap_contains_key(treemap_t *map, void *key)
+static struct btree_inner *btree_inner_new(treemap_t *map)
 {
-    struct rbtree_node *node;
-    for (node = map->root; node != NULL;)
+    struct btree_inner *inner = btree_node_alloc(map, sizeof(struct btree_inner));
+    inner->header = (struct btree_node){.nkeys = 0, .is_leaf = false};
+    return inner;
+}
+
+/* Returns the position of the first of the n keys greater than or equal
+ * to key (lower) or strictly greater than it (upper). */
+static size_t btree_search(treemap_t *map, void **keys, size_t n, void *key, bool upper)
+{
+    size_t low = 0, high = n;
+
+    while (low < high)
     {
-        int key_cmp_val = treemap_compare_keys(map, key, node->key);
-        if (key_cmp_val < 0)
-            node = node->left;
-        else if (key_cmp_val > 0)
-            node = node->right;
+        size_t mid = (low + high) / 2;
+        int cmp = treemap_compare_keys(map, keys[mid], key);
+
+        if (cmp < 0 || (upper && cmp == 0))
+            low = mid + 1;
         else
-            return true;
+            high = mid;
     }
 
-    return false;
+    return low;
 }
 
-bool treemap_contains_value_at_node(treemap_t *map, struct rbtree_node *node, void *value)
+/* Fetches every cache line of a node at once, so that a search pays
+ * one miss per level rather than one per line it happens to touch.
+ * Nodes are only aligned for max_align_t, so most of them straddle one
+ * more line than their size fills, and the range is rounded out to line
+ * boundaries to cover it. */
+static inline void btree_prefetch(struct btree_node *node)
 {
-    if (node == NULL)
-        return false;
+    uintptr_t line = (uintptr_t)node & ~(uintptr_t)63;
+    uintptr_t end = (uintptr_t)node + btree_NODE_SIZE;
 
-    return node->value == value ||
-           treemap_contains_value_at_node(map, node->left, value) ||
-           treemap_contains_value_at_node(map, node->right, value);
+    for (; line < end; line += 64)
+        __builtin_prefetch((const void *)line);
 }
 
-bool treemap_contains_value(treemap_t *map, void *value)
+static struct btree_leaf *btree_find_leaf(treemap_t *map, void *key)
 {
-    return treemap_contains_value_at_node(map, map->root, value);
+    struct btree_node *node = map->btree_root;
+
+    while (node != NULL && !node->is_leaf)
+    {
+        struct btree_inner *inner = (struct btree_inner *)node;
+        node = inner->children[btree_search(map, inner->keys, node->nkeys, key, true)];
+        btree_prefetch(node);
+    }
+
+    return (struct btree_leaf *)node;
 }
 
-size_t treemap_size(treemap_t *map)
+/* Returns the position of key in its leaf, or -1. */
+static long btree_find(treemap_t *map, void *key, struct btree_leaf **leaf)
 {
-    return map->size;
+    *leaf = btree_find_leaf(map, key);
+    if (*leaf == NULL)
+        return -1;
+
+    size_t pos = btree_search(map, (*leaf)->keys, (*leaf)->header.nkeys, key, false);
+    if (pos < (*leaf)->header.nkeys && treemap_compare_keys(map, (*leaf)->keys[pos], key) == 0)
+        return pos;
+
+    return -1;
 }
 
-void *treemap_get_at(treemap_t *map, void *key)
+static struct btree_leaf *btree_first_leaf(treemap_t *map)
 {
-    struct rbtree_node *node;
-    for (node = map->root; node != NULL;)
+    struct btree_node *node = map->btree_root;
+
+    while (node != NULL && !node->is_leaf)
+        node = ((struct btree_inner *)node)->children[0];
+
+    return (struct btree_leaf *)node;
+}
+
+static void btree_leaf_insert(struct btree_leaf *leaf, size_t pos, void *key, void *value)
+{
+    size_t nmoved = leaf->header.nkeys - pos;
+    memmove(&leaf->keys[pos + 1], &leaf->keys[pos], nmoved * sizeof(void *));
+    memmove(&leaf->values[pos + 1], &leaf->values[pos], nmoved * sizeof(void *));
+
+    leaf->keys[pos] = key;
+    leaf->values[pos] = value;
+    leaf->header.nkeys++;
+}
+
+static void btree_inner_insert(struct btree_inner *inner, size_t pos, void *separator, struct btree_node *right)
+{
+    size_t nmoved = inner->header.nkeys - pos;
+    memmove(&inner->keys[pos + 1], &inner->keys[pos], nmoved * sizeof(void *));
+    memmove(&inner->children[pos + 2], &inner->children[pos + 1], nmoved * sizeof(struct btree_node *));
+
+    inner->keys[pos] = separator;
+    inner->children[pos + 1] = right;
+    inner->header.nkeys++;
+}
+
+static struct btree_split btree_split_leaf(treemap_t *map, struct btree_leaf *leaf, size_t pos, void *key, void *value)
+{
+    struct btree_leaf *right = btree_leaf_new(map);
+    size_t mid = treemap_BTREE_LEAF_KEYS / 2;
+
+    right->header.nkeys = treemap_BTREE_LEAF_KEYS - mid;
+    memcpy(right->keys, &leaf->keys[mid], right->header.nkeys * sizeof(void *));
+    memcpy(right->values, &leaf->values[mid], right->header.nkeys * sizeof(void *));
+    leaf->header.nkeys = mid;
+
+    if (pos <= mid)
+        btree_leaf_insert(leaf, pos, key, value);
+    else
+        btree_leaf_insert(right, pos - mid, key, value);
+
+    right->prev = leaf;
+    right->next = leaf->next;
+    if (leaf->next != NULL)
+        leaf->next->prev = right;
+    leaf->next = right;
+
+    return (struct btree_split){right->keys[0], (struct btree_node *)right};
+}
+
+static struct btree_split btree_split_inner(treemap_t *map, struct btree_inner *inner, size_t pos,
+                                            void *separator, struct btree_node *child)
+{
+    /* Lay the overfull node out in full, then cut it around the median,
+     * which moves up to the parent. */
+    void *keys[treemap_BTREE_INNER_KEYS + 1];
+    struct btree_node *children[treemap_BTREE_INNER_KEYS + 2];
+    size_t nkeys = treemap_BTREE_INNER_KEYS;
+
+    memcpy(keys, inner->keys, pos * sizeof(void *));
+    keys[pos] = separator;
+    memcpy(&keys[pos + 1], &inner->keys[pos], (nkeys - pos) * sizeof(void *));
+
+    memcpy(children, inner->children, (pos + 1) * sizeof(struct btree_node *));
+    children[pos + 1] = child;
+    memcpy(&children[pos + 2], &inner->children[pos + 1], (nkeys - pos) * sizeof(struct btree_node *));
+
+    size_t mid = (nkeys + 1) / 2;
+    struct btree_inner *right = btree_inner_new(map);
+
+    inner->header.nkeys = mid;
+    memcpy(inner->keys, keys, mid * sizeof(void *));
+    memcpy(inner->children, children, (mid + 1) * sizeof(struct btree_node *));
+
+    right->header.nkeys = nkeys - mid;
+    memcpy(right->keys, &keys[mid + 1], right->header.nkeys * sizeof(void *));
+    memcpy(right->children, &children[mid + 1], (right->header.nkeys + 1) * sizeof(struct btree_node *));
+
+    return (struct btree_split){keys[mid], (struct btree_node *)right};
+}
+
+static struct btree_split btree_set_at_node(treemap_t *map, struct btree_node *node, void *key, void *value)
+{
+    if (node->is_leaf)
     {
-        int key_cmp_val = treemap_compare_keys(map, key, node->key);
-        if (key_cmp_val < 0)
-            node = node->left;
-        else if (key_cmp_val > 0)
-            node = node->right;
-        else
-            return node->value;
+        struct btree_leaf *leaf = (struct btree_leaf *)node;
+        size_t pos = btree_search(map, leaf->keys, node->nkeys, key, false);
+
+        if (pos < node->nkeys && treemap_compare_keys(map, leaf->keys[pos], key) == 0)
+        {
+            leaf->values[pos] = value;
+            return (struct btree_split){NULL, NULL};
+        }
+
+        map->size++;
+
+        if (node->nkeys < treemap_BTREE_LEAF_KEYS)
+        {
+            btree_leaf_insert(leaf, pos, key, value);
+            return (struct btree_split){NULL, NULL};
+        }
+
+        return btree_split_leaf(map, leaf, pos, key, value);
     }
 
-    return NULL;
+    struct btree_inner *inner = (struct btree_inner *)node;
+    size_t pos = btree_search(map, inner->keys, node->nkeys, key, true);
+    btree_prefetch(inner->children[pos]);
+    struct btree_split split = btree_set_at_node(map, inner->children[pos], key, value);
+
+    if (split.right == NULL)
+        return split;
+
+    if (node->nkeys < treemap_BTREE_INNER_KEYS)
+    {
+        btree_inner_insert(inner, pos, split.separator, split.right);
+        return (struct btree_split){NULL, NULL};
+    }
+
+    return btree_split_inner(map, inner, pos, split.separator, split.right);
 }
 
-struct rbtree_node *treemap_set_at_node(treemap_t *map, struct rbtree_node *node, void *key, void *value)
+static void treemap_btree_set_at(treemap_t *map, void *key, void *value)
 {
-    if (node == NULL)
+    if (map->btree_root == NULL)
+        map->btree_root = (struct btree_node *)btree_leaf_new(map);
+
+    struct btree_split split = btree_set_at_node(map, map->btree_root, key, value);
+
+    if (split.right != NULL)
     {
-        struct rbtree_node *new_node = $new(
-            struct rbtree_node,
-            .color = RBTREE_COLOR_RED,
-            .key = key,
-            .value = value,
-            .parent = NULL,
-            .left = NULL,
-            .right = NULL);
+        struct btree_inner *root = btree_inner_new(map);
+        root->header.nkeys = 1;
+        root->keys[0] = split.separator;
+        root->children[0] = map->btree_root;
+        root->children[1] = split.right;
+        map->btree_root = (struct btree_node *)root;
+    }
+}
 
-        map->size++;
-        return new_node;
+/* Drops the separator at pos and the child to its right. */
+static void btree_inner_remove(struct btree_inner *inner, size_t pos)
+{
+    size_t nmoved = inner->header.nkeys - pos - 1;
+    memmove(&inner->keys[pos], &inner->keys[pos + 1], nmoved * sizeof(void *));
+    memmove(&inner->children[pos + 1], &inner->children[pos + 2], nmoved * sizeof(struct btree_node *));
+    inner->header.nkeys--;
+}
+
+/* Refills the underfull leaf at pos of its parent from a sibling, or
+ * merges it with one when both siblings are at their minimum. */
+static void btree_rebalance_leaf(treemap_t *map, struct btree_inner *parent, size_t pos)
+{
+    struct btree_leaf *leaf = (struct btree_leaf *)parent->children[pos];
+    struct btree_leaf *left = pos > 0 ? (struct btree_leaf *)parent->children[pos - 1] : NULL;
+    struct btree_leaf *right = pos < parent->header.nkeys ? (struct btree_leaf *)parent->children[pos + 1] : NULL;
+
+    if (left != NULL && left->header.nkeys > btree_LEAF_MIN_KEYS)
+    {
+        size_t last = --left->header.nkeys;
+        btree_leaf_insert(leaf, 0, left->keys[last], left->values[last]);
+        parent->keys[pos - 1] = leaf->keys[0];
+        return;
+    }
+
+    if (right != NULL && right->header.nkeys > btree_LEAF_MIN_KEYS)
+    {
+        btree_leaf_insert(leaf, leaf->header.nkeys, right->keys[0], right->values[0]);
+        right->header.nkeys--;
+        memmove(right->keys, &right->keys[1], right->header.nkeys * sizeof(void *));
+        memmove(right->values, &right->values[1], right->header.nkeys * sizeof(void *));
+        parent->keys[pos] = right->keys[0];
+        return;
     }
 
-    int key_cmp_val = treemap_compare_keys(map, key, node->key);
-    if (key_cmp_val < 0)
-        rbtree_set_left(node->left, treemap_set_at_node(map, node->left, key, value));
-    else if (key_cmp_val > 0)
-        rbtree_set_right(node, treemap_set_at_node(map, node->right, key, value));
+    /* Merge the right one of the pair into the left one. */
+    if (left == NULL)
+    {
+        left = leaf;
+        pos++;
+    }
     else
-        node->value = value;
+        right = leaf;
 
-    if (rbtree_is_red(node->right) && rbtree_is_black(node->left))
-        node = rbtree_rotate_left(node);
-    if (rbtree_is_red(node->left) && rbtree_is_red(node->left->left))
-        node = rbtree_rotate_right(node);
-    if (rbtree_is_red(node->left) && rbtree_is_red(node->right))
-        rbtree_flip_colors(node);
+    memcpy(&left->keys[left->header.nkeys], right->keys, right->header.nkeys * sizeof(void *));
+    memcpy(&left->values[left->header.nkeys], right->values, right->header.nkeys * sizeof(void *));
+    left->header.nkeys += right->header.nkeys;
 
-    return node;
+    left->next = right->next;
+    if (right->next != NULL)
+        right->next->prev = left;
+
+    btree_inner_remove(parent, pos - 1);
+    btree_node_free(map, (struct btree_node *)right);
+}
+
+static void btree_rebalance_inner(treemap_t *map, struct btree_inner *parent, size_t pos)
+{
+    struct btree_inner *inner = (struct btree_inner *)parent->children[pos];
+    struct btree_inner *left = pos > 0 ? (struct btree_inner *)parent->children[pos - 1] : NULL;
+    struct btree_inner *right = pos < parent->header.nkeys ? (struct btree_inner *)parent->children[pos + 1] : NULL;
+
+    /* Borrowing rotates through the parent: the parent's separator moves
+     * down, and the sibling's outermost separator replaces it. */
+    if (left != NULL && left->header.nkeys > btree_INNER_MIN_KEYS)
+    {
+        size_t nkeys = inner->header.nkeys;
+        memmove(&inner->keys[1], inner->keys, nkeys * sizeof(void *));
+        memmove(&inner->children[1], inner->children, (nkeys + 1) * sizeof(struct btree_node *));
+
+        inner->keys[0] = parent->keys[pos - 1];
+        inner->children[0] = left->children[left->header.nkeys];
+        inner->header.nkeys++;
+
+        parent->keys[pos - 1] = left->keys[--left->header.nkeys];
+        return;
+    }
+
+    if (right != NULL && right->header.nkeys > btree_INNER_MIN_KEYS)
+    {
+        inner->keys[inner->header.nkeys] = parent->keys[pos];
+        inner->children[inner->header.nkeys + 1] = right->children[0];
+        inner->header.nkeys++;
+
+        parent->keys[pos] = right->keys[0];
+
+        size_t nkeys = --right->header.nkeys;
+        memmove(right->keys, &right->keys[1], nkeys * sizeof(void *));
+        memmove(right->children, &right->children[1], (nkeys + 1) * sizeof(struct btree_node *));
+        return;
+    }
+
+    if (left == NULL)
+    {
+        left = inner;
+        pos++;
+    }
+    else
+        right = inner;
+
+    /* The separator between the pair moves down between their halves. */
+    size_t nkeys = left->header.nkeys;
+    left->keys[nkeys] = parent->keys[pos - 1];
+    memcpy(&left->keys[nkeys + 1], right->keys, right->header.nkeys * sizeof(void *));
+    memcpy(&left->children[nkeys + 1], right->children, (right->header.nkeys + 1) * sizeof(struct btree_node *));
+    left->header.nkeys += 1 + right->header.nkeys;
+
+    btree_inner_remove(parent, pos - 1);
+    btree_node_free(map, (struct btree_node *)right);
+}
+
+/* Removes key from the subtree at node. Separators of removed keys are
+ * left in place, since they still split the keys around them. */
+static bool btree_remove_at_node(treemap_t *map, struct btree_node *node, void *key, void **value)
+{
+    if (node->is_leaf)
+    {
+        struct btree_leaf *leaf = (struct btree_leaf *)node;
+        size_t pos = btree_search(map, leaf->keys, node->nkeys, key, false);
+
+        if (pos == node->nkeys || treemap_compare_keys(map, leaf->keys[pos], key) != 0)
+            return false;
+
+        *value = leaf->values[pos];
+        node->nkeys--;
+        memmove(&leaf->keys[pos], &leaf->keys[pos + 1], (node->nkeys - pos) * sizeof(void *));
+        memmove(&leaf->values[pos], &leaf->values[pos + 1], (node->nkeys - pos) * sizeof(void *));
+        map->size--;
+        return true;
+    }
+
+    struct btree_inner *inner = (struct btree_inner *)node;
+    size_t pos = btree_search(map, inner->keys, node->nkeys, key, true);
+    struct btree_node *child = inner->children[pos];
+    btree_prefetch(child);
+
+    if (!btree_remove_at_node(map, child, key, value))
+        return false;
+
+    if (child->is_leaf && child->nkeys < btree_LEAF_MIN_KEYS)
+        btree_rebalance_leaf(map, inner, pos);
+    else if (!child->is_leaf && child->nkeys < btree_INNER_MIN_KEYS)
+        btree_rebalance_inner(map, inner, pos);
+
+    return true;
+}
+
+static void *treemap_btree_remove_at(treemap_t *map, void *key)
+{
+    void *value = NULL;
+
+    if (map->btree_root == NULL || !btree_remove_at_node(map, map->btree_root, key, &value))
+        return NULL;
+
+    struct btree_node *root = map->btree_root;
+
+    if (root->is_leaf && root->nkeys == 0)
+    {
+        btree_node_free(map, root);
+        map->btree_root = NULL;
+    }
+    else if (!root->is_leaf && root->nkeys == 0)
+    {
+        map->btree_root = ((struct btree_inner *)root)->children[0];
+        btree_node_free(map, root);
+    }
+
+    return value;
+}
+
+static void btree_free_at_node(treemap_t *map, struct btree_node *node)
+{
+    if (!node->is_leaf)
+    {
+        struct btree_inner *inner = (struct btree_inner *)node;
+        for (size_t i = 0; i <= node->nkeys; i++)
+            btree_free_at_node(map, inner->children[i]);
+    }
+
+    btree_node_free(map, node);
+}
+
+/* -------------------- compact red-black tree engine --------------------
+ * The same red-black tree, but with its nodes in one array that doubles
+ * as it fills, and linked by their 32-bit positions in it instead of by
+ * pointers, with the color in the top bit of the parent's. Nodes shrink
+ * from 48 bytes plus an allocation each to 32 bytes, and nodes inserted
+ * one after the other sit next to each other. Position 0 is a black nil
+ * sentinel standing in for every missing child, as in CLRS, which lets
+ * the fixups read and write through it without checking for nil.
+ */
+
+#define crbtree_NIL 0
+#define crbtree_RED_BIT 0x80000000u
+#define crbtree_MAX_NODES 0x7fffffffu
+#define crbtree_INITIAL_CAP 16
+#define crbtree_ALIGN 64 /* Aligning the array keeps every node within one cache line. */
+
+static inline uint32_t crbtree_parent(struct crbtree *tree, uint32_t node)
+{
+    return tree->nodes[node].parent & ~crbtree_RED_BIT;
+}
+
+static inline void crbtree_set_parent(struct crbtree *tree, uint32_t node, uint32_t parent)
+{
+    tree->nodes[node].parent = (tree->nodes[node].parent & crbtree_RED_BIT) | parent;
+}
+
+static inline bool crbtree_is_red(struct crbtree *tree, uint32_t node)
+{
+    return tree->nodes[node].parent & crbtree_RED_BIT;
+}
+
+static inline void crbtree_set_red(struct crbtree *tree, uint32_t node, bool red)
+{
+    tree->nodes[node].parent = crbtree_parent(tree, node) | (red ? crbtree_RED_BIT : 0);
+}
+
+#define crbtree_BLOCK_SIZE(capacity) ((capacity) * sizeof(struct crbtree_node) + crbtree_ALIGN)
+
+/* Makes room for n more nodes past the end of the array. Allocators
+ * only promise malloc's alignment, so the array is moved by hand into
+ * a slightly larger block rather than reallocated. */
+static void crbtree_reserve(treemap_t *map, size_t n)
+{
+    struct crbtree *tree = &map->compact;
+    if (tree->end + n <= tree->capacity)
+        return;
+    if (tree->end + n > crbtree_MAX_NODES)
+        panic("Compact treemaps hold at most %u entries", crbtree_MAX_NODES - 1);
+
+    size_t capacity = max(tree->capacity, (uint32_t)crbtree_INITIAL_CAP);
+    while (capacity < tree->end + n)
+        capacity *= 2;
+    capacity = min(capacity, (size_t)crbtree_MAX_NODES);
+
+    void *block = allocator_alloc(map->allocator, crbtree_BLOCK_SIZE(capacity));
+    struct crbtree_node *nodes = (struct crbtree_node *)(((uintptr_t)block + crbtree_ALIGN - 1) & ~(uintptr_t)(crbtree_ALIGN - 1));
+
+    if (tree->block != NULL)
+    {
+        memcpy(nodes, tree->nodes, tree->end * sizeof(struct crbtree_node));
+        allocator_free(map->allocator, tree->block, crbtree_BLOCK_SIZE(tree->capacity));
+    }
+
+    tree->nodes = nodes;
+    tree->block = block;
+    tree->capacity = capacity;
+}
+
+/* Hands out a removed node if there is one, or else the next unused
+ * one. Either may move the array, so callers re-read node addresses. */
+static uint32_t crbtree_node_alloc(treemap_t *map)
+{
+    struct crbtree *tree = &map->compact;
+
+    if (tree->free != crbtree_NIL)
+    {
+        uint32_t node = tree->free;
+        tree->free = tree->nodes[node].child[1];
+        return node;
+    }
+
+    crbtree_reserve(map, 1);
+    return tree->end++;
+}
+
+static void crbtree_node_free(struct crbtree *tree, uint32_t node)
+{
+    tree->nodes[node].child[1] = tree->free;
+    tree->free = node;
+}
+
+/* Rotates node down toward dir, lifting its child from the other side
+ * into its place. */
+static void crbtree_rotate(struct crbtree *tree, uint32_t node, int dir)
+{
+    struct crbtree_node *nodes = tree->nodes;
+    uint32_t child = nodes[node].child[!dir];
+    uint32_t parent = crbtree_parent(tree, node);
+
+    nodes[node].child[!dir] = nodes[child].child[dir];
+    if (nodes[child].child[dir] != crbtree_NIL)
+        crbtree_set_parent(tree, nodes[child].child[dir], node);
+
+    crbtree_set_parent(tree, child, parent);
+    if (parent == crbtree_NIL)
+        tree->root = child;
+    else
+        nodes[parent].child[node == nodes[parent].child[1]] = child;
+
+    nodes[child].child[dir] = node;
+    crbtree_set_parent(tree, node, child);
+}
+
+static void crbtree_insert_fixup(struct crbtree *tree, uint32_t node)
+{
+    while (crbtree_is_red(tree, crbtree_parent(tree, node)))
+    {
+        uint32_t parent = crbtree_parent(tree, node);
+        uint32_t grandparent = crbtree_parent(tree, parent);
+        int dir = parent == tree->nodes[grandparent].child[1];
+        uint32_t uncle = tree->nodes[grandparent].child[!dir];
+
+        if (crbtree_is_red(tree, uncle))
+        {
+            crbtree_set_red(tree, parent, false);
+            crbtree_set_red(tree, uncle, false);
+            crbtree_set_red(tree, grandparent, true);
+            node = grandparent;
+            continue;
+        }
+
+        if (node == tree->nodes[parent].child[!dir])
+        {
+            node = parent;
+            crbtree_rotate(tree, node, dir);
+            parent = crbtree_parent(tree, node);
+        }
+
+        crbtree_set_red(tree, parent, false);
+        crbtree_set_red(tree, grandparent, true);
+        crbtree_rotate(tree, grandparent, !dir);
+    }
+
+    crbtree_set_red(tree, tree->root, false);
+}
+
+/* Puts replacement where node was under node's parent. The replacement
+ * may be the sentinel, whose parent the removal fixup then reads. */
+static void crbtree_transplant(struct crbtree *tree, uint32_t node, uint32_t replacement)
+{
+    uint32_t parent = crbtree_parent(tree, node);
+
+    if (parent == crbtree_NIL)
+        tree->root = replacement;
+    else
+        tree->nodes[parent].child[node == tree->nodes[parent].child[1]] = replacement;
+    crbtree_set_parent(tree, replacement, parent);
+}
+
+static void crbtree_remove_fixup(struct crbtree *tree, uint32_t node)
+{
+    struct crbtree_node *nodes = tree->nodes;
+
+    while (node != tree->root && !crbtree_is_red(tree, node))
+    {
+        uint32_t parent = crbtree_parent(tree, node);
+        int dir = node == nodes[parent].child[1];
+        uint32_t sibling = nodes[parent].child[!dir];
+
+        if (crbtree_is_red(tree, sibling))
+        {
+            crbtree_set_red(tree, sibling, false);
+            crbtree_set_red(tree, parent, true);
+            crbtree_rotate(tree, parent, dir);
+            sibling = nodes[parent].child[!dir];
+        }
+
+        if (!crbtree_is_red(tree, nodes[sibling].child[0]) && !crbtree_is_red(tree, nodes[sibling].child[1]))
+        {
+            crbtree_set_red(tree, sibling, true);
+            node = parent;
+            continue;
+        }
+
+        if (!crbtree_is_red(tree, nodes[sibling].child[!dir]))
+        {
+            crbtree_set_red(tree, nodes[sibling].child[dir], false);
+            crbtree_set_red(tree, sibling, true);
+            crbtree_rotate(tree, sibling, !dir);
+            sibling = nodes[parent].child[!dir];
+        }
+
+        crbtree_set_red(tree, sibling, crbtree_is_red(tree, parent));
+        crbtree_set_red(tree, parent, false);
+        crbtree_set_red(tree, nodes[sibling].child[!dir], false);
+        crbtree_rotate(tree, parent, dir);
+        node = tree->root;
+    }
+
+    crbtree_set_red(tree, node, false);
+}
+
+static uint32_t crbtree_extreme_at(struct crbtree *tree, uint32_t node, int dir)
+{
+    while (tree->nodes[node].child[dir] != crbtree_NIL)
+        node = tree->nodes[node].child[dir];
+    return node;
+}
+
+/* Returns the node after node in key order if dir is 1, or the one
+ * before it if dir is 0, or the sentinel if there is none. */
+static uint32_t crbtree_step(struct crbtree *tree, uint32_t node, int dir)
+{
+    if (tree->nodes[node].child[dir] != crbtree_NIL)
+        return crbtree_extreme_at(tree, tree->nodes[node].child[dir], !dir);
+
+    uint32_t parent = crbtree_parent(tree, node);
+    while (parent != crbtree_NIL && node == tree->nodes[parent].child[dir])
+    {
+        node = parent;
+        parent = crbtree_parent(tree, parent);
+    }
+
+    return parent;
+}
+
+static void crbtree_remove(struct crbtree *tree, uint32_t node)
+{
+    struct crbtree_node *nodes = tree->nodes;
+    bool removed_red = crbtree_is_red(tree, node);
+    uint32_t child;
+
+    if (nodes[node].child[0] == crbtree_NIL || nodes[node].child[1] == crbtree_NIL)
+    {
+        child = nodes[node].child[nodes[node].child[0] == crbtree_NIL];
+        crbtree_transplant(tree, node, child);
+    }
+    else
+    {
+        /* The successor takes the node's place and color, so the color
+         * lost is the successor's own, from where it was. */
+        uint32_t successor = crbtree_extreme_at(tree, nodes[node].child[1], 0);
+        removed_red = crbtree_is_red(tree, successor);
+        child = nodes[successor].child[1];
+
+        if (crbtree_parent(tree, successor) == node)
+            crbtree_set_parent(tree, child, successor);
+        else
+        {
+            crbtree_transplant(tree, successor, child);
+            nodes[successor].child[1] = nodes[node].child[1];
+            crbtree_set_parent(tree, nodes[successor].child[1], successor);
+        }
+
+        crbtree_transplant(tree, node, successor);
+        nodes[successor].child[0] = nodes[node].child[0];
+        crbtree_set_parent(tree, nodes[successor].child[0], successor);
+        crbtree_set_red(tree, successor, crbtree_is_red(tree, node));
+    }
+
+    if (!removed_red)
+        crbtree_remove_fixup(tree, child);
+}
+
+static uint32_t crbtree_find(treemap_t *map, void *key)
+{
+    struct crbtree_node *nodes = map->compact.nodes;
+    uint32_t node = map->compact.root;
+
+    while (node != crbtree_NIL)
+    {
+        int key_cmp_val = treemap_compare_keys(map, key, nodes[node].key);
+        if (key_cmp_val < 0)
+            node = nodes[node].child[0];
+        else if (key_cmp_val > 0)
+            node = nodes[node].child[1];
+        else
+            break;
+    }
+
+    return node;
+}
+
+static void treemap_crbtree_set_at(treemap_t *map, void *key, void *value)
+{
+    struct crbtree *tree = &map->compact;
+    struct crbtree_node *nodes = tree->nodes;
+    uint32_t parent = crbtree_NIL, node = tree->root;
+    int key_cmp_val = 0;
+
+    while (node != crbtree_NIL)
+    {
+        key_cmp_val = treemap_compare_keys(map, key, nodes[node].key);
+        if (key_cmp_val == 0)
+        {
+            nodes[node].value = value;
+            return;
+        }
+
+        /* Branching on the comparison, rather than indexing with it,
+           lets the cpu run ahead down the likely side of the tree. */
+        parent = node;
+        if (key_cmp_val < 0)
+            node = nodes[node].child[0];
+        else
+            node = nodes[node].child[1];
+    }
+
+    node = crbtree_node_alloc(map);
+    tree->nodes[node] = (struct crbtree_node){
+        .key = key,
+        .value = value,
+        .parent = parent | crbtree_RED_BIT,
+        .child = {crbtree_NIL, crbtree_NIL}};
+
+    if (parent == crbtree_NIL)
+        tree->root = node;
+    else
+        tree->nodes[parent].child[key_cmp_val > 0] = node;
+    map->size++;
+
+    crbtree_insert_fixup(tree, node);
+}
+
+static void *treemap_crbtree_remove_at(treemap_t *map, void *key)
+{
+    uint32_t node = crbtree_find(map, key);
+    if (node == crbtree_NIL)
+        return NULL;
+
+    void *value = map->compact.nodes[node].value;
+    crbtree_remove(&map->compact, node);
+    crbtree_node_free(&map->compact, node);
+    map->size--;
+
+    return value;
+}
+
+/* Empties the tree, keeping its array. */
+static void crbtree_clear(struct crbtree *tree)
+{
+    tree->nodes[crbtree_NIL] = (struct crbtree_node){0};
+    tree->root = crbtree_NIL;
+    tree->end = crbtree_NIL + 1;
+    tree->free = crbtree_NIL;
+}
+
+static size_t treemap_node_size(treemap_backend_t backend, bool order_statistics)
+{
+    return backend == TREEMAP_BACKEND_BTREE ? btree_NODE_SIZE : rbtree_NODE_SIZE(order_statistics);
+}
+
+treemap_t *_treemap_new_(treemap_config_t config)
+{
+    if (config.order_statistics && config.backend != TREEMAP_BACKEND_RBTREE)
+        panic("Order statistics are only supported by the red-black tree engine");
+
+    allocator_t *allocator = allocator_or_default(config.allocator);
+    bool compact = config.backend == TREEMAP_BACKEND_RBTREE_COMPACT;
+
+    treemap_t *map = $new_in(
+        allocator,
+        treemap_t,
+#if POLYMORPHIC_DS
+        .type = DS_TYPE_TREEMAP,
+#endif
+#if treemap_ALLOW_KEY_CMP_FN_OVERLOAD
+        .key_cmp_fn = config.key_compare_fn,
+#endif
+        .backend = config.backend,
+        .order_statistics = config.order_statistics,
+        .size = 0,
+        .root = NULL,
+        .btree_root = NULL,
+        .allocator = allocator,
+        .pool = config.pool_nodes && !compact
+                    ? node_pool_new(treemap_node_size(config.backend, config.order_statistics),
+                                    .allocator = allocator)
+                    : NULL);
+
+    if (compact)
+    {
+        crbtree_reserve(map, crbtree_INITIAL_CAP);
+        crbtree_clear(&map->compact);
+    }
+
+    return map;
+}
+
+treemap_config_t treemap_get_config(treemap_t *map)
+{
+    return (treemap_config_t){
+#if treemap_ALLOW_KEY_CMP_FN_OVERLOAD
+        .key_compare_fn = map->key_cmp_fn,
+#endif
+        .backend = map->backend,
+        .pool_nodes = map->pool != NULL,
+        .order_statistics = map->order_statistics,
+        .allocator = map->allocator};
+}
+
+#if treemap_ALLOW_KEY_CMP_FN_OVERLOAD
+compare_fn_t treemap_get_key_cmp_fn(treemap_t *map)
+{
+    return map->key_cmp_fn;
+}
+#endif
+
+static struct rbtree_node *treemap_find_node(treemap_t *map, void *key)
+{
+    struct rbtree_node *node = map->root;
+
+    while (node != NULL)
+    {
+        int key_cmp_val = treemap_compare_keys(map, key, node->key);
+        if (key_cmp_val < 0)
+            node = node->left;
+        else if (key_cmp_val > 0)
+            node = node->right;
+        else
+            return node;
+    }
+
+    return NULL;
+}
+
+bool treemap_is_empty(treemap_t *map)
+{
+    return map->size == 0;
+}
+
+bool treemap_contains_key(treemap_t *map, void *key)
+{
+    if (map->backend == TREEMAP_BACKEND_BTREE)
+    {
+        struct btree_leaf *leaf;
+        return btree_find(map, key, &leaf) >= 0;
+    }
+    if (map->backend == TREEMAP_BACKEND_RBTREE_COMPACT)
+        return crbtree_find(map, key) != crbtree_NIL;
+
+    return treemap_find_node(map, key) != NULL;
+}
+
+bool treemap_contains_value(treemap_t *map, void *value)
+{
+    if (map->backend == TREEMAP_BACKEND_BTREE)
+    {
+        for (struct btree_leaf *leaf = btree_first_leaf(map); leaf != NULL; leaf = leaf->next)
+        {
+            for (size_t i = 0; i < leaf->header.nkeys; i++)
+            {
+                if (leaf->values[i] == value)
+                    return true;
+            }
+        }
+
+        return false;
+    }
+
+    if (map->backend == TREEMAP_BACKEND_RBTREE_COMPACT)
+    {
+        struct crbtree *tree = &map->compact;
+        for (uint32_t node = crbtree_extreme_at(tree, tree->root, 0);
+             node != crbtree_NIL;
+             node = crbtree_step(tree, node, 1))
+        {
+            if (tree->nodes[node].value == value)
+                return true;
+        }
+
+        return false;
+    }
+
+    for (struct rbtree_node *node = map->root != NULL ? rbtree_min_at(map->root) : NULL;
+         node != NULL;
+         node = rbtree_next(node))
+    {
+        if (node->value == value)
+            return true;
+    }
+
+    return false;
+}
+
+size_t treemap_size(treemap_t *map)
+{
+    return map->size;
+}
+
+void *treemap_get_at(treemap_t *map, void *key)
+{
+    if (map->backend == TREEMAP_BACKEND_BTREE)
+    {
+        struct btree_leaf *leaf;
+        long pos = btree_find(map, key, &leaf);
+        return pos >= 0 ? leaf->values[pos] : NULL;
+    }
+    if (map->backend == TREEMAP_BACKEND_RBTREE_COMPACT)
+    {
+        uint32_t node = crbtree_find(map, key);
+        return node != crbtree_NIL ? map->compact.nodes[node].value : NULL;
+    }
+
+    struct rbtree_node *node = treemap_find_node(map, key);
+    return node != NULL ? node->value : NULL;
+}
+
+static struct rbtree_node *treemap_node_alloc(treemap_t *map)
+{
+    return map->pool != NULL
+               ? node_pool_alloc(map->pool)
+               : allocator_alloc(map->allocator, rbtree_NODE_SIZE(map->order_statistics));
+}
+
+static void treemap_node_free(treemap_t *map, struct rbtree_node *node)
+{
+    if (map->pool != NULL)
+        node_pool_release(map->pool, node);
+    else
+        allocator_free(map->allocator, node, rbtree_NODE_SIZE(map->order_statistics));
+}
+
+void treemap_set_at(treemap_t *map, void *key, void *value)
+{
+    if (map->backend == TREEMAP_BACKEND_BTREE)
+    {
+        treemap_btree_set_at(map, key, value);
+        return;
+    }
+    if (map->backend == TREEMAP_BACKEND_RBTREE_COMPACT)
+    {
+        treemap_crbtree_set_at(map, key, value);
+        return;
+    }
+
+    struct rbtree_node *parent = NULL;
+    struct rbtree_node **link = &map->root;
+
+    while (*link != NULL)
+    {
+        parent = *link;
+        int key_cmp_val = treemap_compare_keys(map, key, parent->key);
+
+        if (key_cmp_val < 0)
+            link = &parent->left;
+        else if (key_cmp_val > 0)
+            link = &parent->right;
+        else
+        {
+            parent->value = value;
+            return;
+        }
+    }
+
+    struct rbtree_node *node = treemap_node_alloc(map);
+    *node = (struct rbtree_node){
+        .color = RBTREE_COLOR_RED,
+        .key = key,
+        .value = value,
+        .parent = parent,
+        .left = NULL,
+        .right = NULL};
+
+    *link = node;
+    map->size++;
+
+    if (map->order_statistics)
+    {
+        for (; parent != NULL; parent = parent->parent)
+            ((struct rbtree_counted_node *)parent)->count++;
+        ((struct rbtree_counted_node *)node)->count = 1;
+    }
+
+    rbtree_insert_fixup(map, node);
+}
+
+void *treemap_remove_at(treemap_t *map, void *key)
+{
+    if (map->backend == TREEMAP_BACKEND_BTREE)
+        return treemap_btree_remove_at(map, key);
+    if (map->backend == TREEMAP_BACKEND_RBTREE_COMPACT)
+        return treemap_crbtree_remove_at(map, key);
+
+    struct rbtree_node *node = treemap_find_node(map, key);
+    if (node == NULL)
+        return NULL;
+
+    void *value = node->value;
+    rbtree_remove(map, node);
+    treemap_node_free(map, node);
+    map->size--;
+
+    return value;
+}
+
+/* Builds a perfectly balanced tree over the n sorted entries, splitting
+ * them at the middle, so that subtree sizes never differ by more than
+ * one. Every path down then ends at the last level or the one above it,
+ * so painting only the last level red, unless it is full, gives every
+ * path the same number of black nodes. */
+static struct rbtree_node *rbtree_build(treemap_t *map, size_t n, map_entry_t entries[n],
+                                        size_t depth, size_t red_depth, struct rbtree_node *parent)
+{
+    if (n == 0)
+        return NULL;
+
+    size_t mid = n / 2;
+    struct rbtree_node *node = treemap_node_alloc(map);
+    *node = (struct rbtree_node){
+        .color = depth == red_depth ? RBTREE_COLOR_RED : RBTREE_COLOR_BLACK,
+        .key = entries[mid].key,
+        .value = entries[mid].value,
+        .parent = parent};
+
+    node->left = rbtree_build(map, mid, entries, depth + 1, red_depth, node);
+    node->right = rbtree_build(map, n - mid - 1, entries + mid + 1, depth + 1, red_depth, node);
+
+    if (map->order_statistics)
+        ((struct rbtree_counted_node *)node)->count = n;
+
+    return node;
+}
+
+/* Lays the nodes out in preorder, so that every node is followed by
+ * its left subtree, and a descent mostly moves forward in the array. */
+static uint32_t crbtree_build(treemap_t *map, size_t n, map_entry_t entries[n],
+                              size_t depth, size_t red_depth, uint32_t parent)
+{
+    if (n == 0)
+        return crbtree_NIL;
+
+    size_t mid = n / 2;
+    uint32_t node = map->compact.end++;
+    map->compact.nodes[node] = (struct crbtree_node){
+        .key = entries[mid].key,
+        .value = entries[mid].value,
+        .parent = parent | (depth == red_depth ? crbtree_RED_BIT : 0)};
+
+    map->compact.nodes[node].child[0] = crbtree_build(map, mid, entries, depth + 1, red_depth, node);
+    map->compact.nodes[node].child[1] = crbtree_build(map, n - mid - 1, entries + mid + 1, depth + 1, red_depth, node);
+
+    return node;
+}
+
+/* Returns the number of nodes at each level of a B+tree built by
+ * btree_build over n entries, from the leaves up. */
+static size_t btree_build_level(size_t nchildren, size_t fanout)
+{
+    return (nchildren + fanout - 1) / fanout;
+}
+
+/* Packs the n sorted entries into full leaves, then groups every level
+ * into full parents until one node is left. Each level is spread evenly
+ * across its nodes, which keeps every node but the root at least half
+ * full. Separators are the least key under each child but the first. */
+static void btree_build(treemap_t *map, size_t n, map_entry_t entries[n])
+{
+    size_t count = btree_build_level(n, treemap_BTREE_LEAF_KEYS);
+    struct btree_node **nodes = malloc(count * sizeof(struct btree_node *));
+    void **mins = malloc(count * sizeof(void *));
+    struct btree_leaf *prev = NULL;
+
+    for (size_t i = 0, pos = 0; i < count; i++)
+    {
+        struct btree_leaf *leaf = btree_leaf_new(map);
+        size_t nkeys = n / count + (i < n % count);
+
+        for (size_t j = 0; j < nkeys; j++, pos++)
+        {
+            leaf->keys[j] = entries[pos].key;
+            leaf->values[j] = entries[pos].value;
+        }
+
+        leaf->header.nkeys = nkeys;
+        leaf->prev = prev;
+        if (prev != NULL)
+            prev->next = leaf;
+
+        nodes[i] = &leaf->header;
+        mins[i] = leaf->keys[0];
+        prev = leaf;
+    }
+
+    /* Parents are written over the slots of their first child, which
+     * have already been read. */
+    while (count > 1)
+    {
+        size_t nparents = btree_build_level(count, treemap_BTREE_INNER_KEYS + 1);
+
+        for (size_t i = 0, child = 0; i < nparents; i++)
+        {
+            struct btree_inner *inner = btree_inner_new(map);
+            size_t nchildren = count / nparents + (i < count % nparents);
+            void *min = mins[child];
+
+            for (size_t j = 0; j < nchildren; j++, child++)
+            {
+                inner->children[j] = nodes[child];
+                if (j > 0)
+                    inner->keys[j - 1] = mins[child];
+            }
+
+            inner->header.nkeys = nchildren - 1;
+            nodes[i] = &inner->header;
+            mins[i] = min;
+        }
+
+        count = nparents;
+    }
+
+    map->btree_root = nodes[0];
+    free(nodes);
+    free(mins);
+}
+
+/* Builds the empty map from n entries sorted by strictly increasing keys,
+ * in O(n) and without rebalancing. A pooled map takes all of its nodes
+ * from one contiguous chunk. */
+static void treemap_build(treemap_t *map, size_t n, map_entry_t entries[n])
+{
+    if (n == 0)
+        return;
+
+    if (map->backend == TREEMAP_BACKEND_BTREE)
+    {
+        if (map->pool != NULL)
+        {
+            size_t nnodes = 0;
+            for (size_t count = btree_build_level(n, treemap_BTREE_LEAF_KEYS); count > 1;
+                 count = btree_build_level(count, treemap_BTREE_INNER_KEYS + 1))
+                nnodes += count;
+            node_pool_reserve(map->pool, nnodes + 1);
+        }
+
+        btree_build(map, n, entries);
+    }
+    else
+    {
+        /* The last level is full when n is one less than a power of two. */
+        size_t last_depth = 63 - __builtin_clzl(n);
+        bool full = (n & (n + 1)) == 0;
+
+        if (map->backend == TREEMAP_BACKEND_RBTREE_COMPACT)
+        {
+            crbtree_reserve(map, n);
+            map->compact.root = crbtree_build(map, n, entries, 0, full ? SIZE_MAX : last_depth, crbtree_NIL);
+        }
+        else
+        {
+            if (map->pool != NULL)
+                node_pool_reserve(map->pool, n);
+            map->root = rbtree_build(map, n, entries, 0, full ? SIZE_MAX : last_depth, NULL);
+        }
+    }
+
+    map->size = n;
+}
+
+/* Sorts entries by key with a bottom-up merge sort, which is stable, so
+ * that entries with equal keys keep their order. */
+static void treemap_sort_entries(treemap_t *map, size_t n, map_entry_t entries[n])
+{
+    map_entry_t *buffer = malloc(n * sizeof(map_entry_t));
+    map_entry_t *from = entries, *to = buffer;
+
+    for (size_t width = 1; width < n; width *= 2)
+    {
+        for (size_t lo = 0; lo < n; lo += 2 * width)
+        {
+            size_t mid = min(lo + width, n), hi = min(lo + 2 * width, n);
+            size_t i = lo, j = mid, k = lo;
+
+            while (i < mid && j < hi)
+                to[k++] = treemap_compare_keys(map, from[j].key, from[i].key) < 0 ? from[j++] : from[i++];
+            while (i < mid)
+                to[k++] = from[i++];
+            while (j < hi)
+                to[k++] = from[j++];
+        }
+
+        map_entry_t *swap = from;
+        from = to;
+        to = swap;
+    }
+
+    if (from != entries)
+        memcpy(entries, from, n * sizeof(map_entry_t));
+    free(buffer);
+}
+
+treemap_t *_treemap_from_sorted_(size_t n, map_entry_t entries[n], treemap_config_t config)
+{
+    treemap_t *map = _treemap_new_(config);
+
+    for (size_t i = 1; i < n; i++)
+    {
+        if (treemap_compare_keys(map, entries[i - 1].key, entries[i].key) >= 0)
+            panic("Entries must be sorted by strictly increasing keys");
+    }
+
+    treemap_build(map, n, entries);
+    return map;
+}
+
+void _treemap_set_all_(treemap_t *map, size_t n, map_entry_t entries[n])
+{
+    if (map->size > 0 || n < 2)
+    {
+        for (size_t i = 0; i < n; i++)
+            treemap_set_at(map, entries[i].key, entries[i].value);
+        return;
+    }
+
+    /* An empty map is sorted and built at once instead. Of the entries
+     * sharing a key, the sort keeps the last one last, and only that one
+     * is kept, as if they had been set one by one. */
+    map_entry_t *sorted = malloc(n * sizeof(map_entry_t));
+    memcpy(sorted, entries, n * sizeof(map_entry_t));
+    treemap_sort_entries(map, n, sorted);
+
+    size_t nunique = 0;
+    for (size_t i = 0; i < n; i++)
+    {
+        if (nunique > 0 && treemap_compare_keys(map, sorted[nunique - 1].key, sorted[i].key) == 0)
+            sorted[nunique - 1] = sorted[i];
+        else
+            sorted[nunique++] = sorted[i];
+    }
+
+    treemap_build(map, nunique, sorted);
+    free(sorted);
+}
+
+map_entry_t treemap_find(treemap_t *map, bipred_fn_t bipred)
+{
+    treemap_ref_t *ref = treemap_ref(map);
+    map_entry_t found = {0};
+
+    for (; ref != NULL && treemap_ref_is_valid(ref); treemap_ref_next(ref))
+    {
+        if (bipred(treemap_ref_get_key(ref), treemap_ref_get_value(ref)))
+        {
+            found = treemap_ref_get_entry(ref);
+            break;
+        }
+    }
+
+    if (ref != NULL)
+        treemap_ref_free(ref);
+    return found;
+}
+
+hashset_t *treemap_keys(treemap_t *map)
+{
+    hashset_t *keys = hashset_new();
+
+    if (map->backend == TREEMAP_BACKEND_BTREE)
+    {
+        for (struct btree_leaf *leaf = btree_first_leaf(map); leaf != NULL; leaf = leaf->next)
+        {
+            for (size_t i = 0; i < leaf->header.nkeys; i++)
+                hashset_add(keys, leaf->keys[i]);
+        }
+
+        return keys;
+    }
+
+    if (map->backend == TREEMAP_BACKEND_RBTREE_COMPACT)
+    {
+        struct crbtree *tree = &map->compact;
+        for (uint32_t node = crbtree_extreme_at(tree, tree->root, 0);
+             node != crbtree_NIL;
+             node = crbtree_step(tree, node, 1))
+        {
+            hashset_add(keys, tree->nodes[node].key);
+        }
+
+        return keys;
+    }
+
+    for (struct rbtree_node *node = map->root != NULL ? rbtree_min_at(map->root) : NULL;
+         node != NULL;
+         node = rbtree_next(node))
+    {
+        hashset_add(keys, node->key);
+    }
+
+    return keys;
+}
+
+struct arraylist *treemap_values(treemap_t *map)
+{
+    struct arraylist *values = _arraylist_new_(
+        (arraylist_config_t){
+            .item_size = sizeof(void *)});
+
+    if (map->backend == TREEMAP_BACKEND_BTREE)
+    {
+        for (struct btree_leaf *leaf = btree_first_leaf(map); leaf != NULL; leaf = leaf->next)
+        {
+            for (size_t i = 0; i < leaf->header.nkeys; i++)
+                _arraylist_add_(values, &leaf->values[i]);
+        }
+
+        return values;
+    }
+
+    if (map->backend == TREEMAP_BACKEND_RBTREE_COMPACT)
+    {
+        struct crbtree *tree = &map->compact;
+        for (uint32_t node = crbtree_extreme_at(tree, tree->root, 0);
+             node != crbtree_NIL;
+             node = crbtree_step(tree, node, 1))
+        {
+            _arraylist_add_(values, &tree->nodes[node].value);
+        }
+
+        return values;
+    }
+
+    for (struct rbtree_node *node = map->root != NULL ? rbtree_min_at(map->root) : NULL;
+         node != NULL;
+         node = rbtree_next(node))
+    {
+        _arraylist_add_(values, &node->value);
+    }
+
+    return values;
+}
+
+/* Which neighbour of a key treemap_seek looks for. */
+typedef enum treemap_seek_mode
+{
+    TREEMAP_SEEK_FLOOR,   /* The greatest key <= key. */
+    TREEMAP_SEEK_CEILING, /* The least key >= key. */
+    TREEMAP_SEEK_LOWER,   /* The greatest key < key. */
+    TREEMAP_SEEK_HIGHER,  /* The least key > key. */
+} treemap_seek_mode_t;
+
+static struct rbtree_node *rbtree_seek(treemap_t *map, void *key, treemap_seek_mode_t mode)
+{
+    struct rbtree_node *node = map->root, *found = NULL;
+
+    while (node != NULL)
+    {
+        int cmp = treemap_compare_keys(map, node->key, key);
+        bool match = mode == TREEMAP_SEEK_FLOOR     ? cmp <= 0
+                     : mode == TREEMAP_SEEK_CEILING ? cmp >= 0
+                     : mode == TREEMAP_SEEK_LOWER   ? cmp < 0
+                                                    : cmp > 0;
+
+        /* Walking below the lower bounds narrows on the greatest match,
+         * and walking below the upper bounds narrows on the least. */
+        if (match)
+            found = node;
+        if (mode == TREEMAP_SEEK_FLOOR || mode == TREEMAP_SEEK_LOWER)
+            node = match ? node->right : node->left;
+        else
+            node = match ? node->left : node->right;
+    }
+
+    return found;
+}
+
+static uint32_t crbtree_seek(treemap_t *map, void *key, treemap_seek_mode_t mode)
+{
+    struct crbtree_node *nodes = map->compact.nodes;
+    uint32_t node = map->compact.root, found = crbtree_NIL;
+    bool lower = mode == TREEMAP_SEEK_FLOOR || mode == TREEMAP_SEEK_LOWER;
+
+    while (node != crbtree_NIL)
+    {
+        int cmp = treemap_compare_keys(map, nodes[node].key, key);
+        bool match = mode == TREEMAP_SEEK_FLOOR     ? cmp <= 0
+                     : mode == TREEMAP_SEEK_CEILING ? cmp >= 0
+                     : mode == TREEMAP_SEEK_LOWER   ? cmp < 0
+                                                    : cmp > 0;
+
+        if (match)
+            found = node;
+        node = nodes[node].child[match == lower];
+    }
+
+    return found;
+}
+
+/* The leaf the descent lands in holds every key from its separator up
+ * to the next, so the neighbour sought is in it or at the near end of
+ * the leaf next to it. */
+static bool btree_seek(treemap_t *map, void *key, treemap_seek_mode_t mode,
+                       struct btree_leaf **leaf, size_t *pos)
+{
+    *leaf = btree_find_leaf(map, key);
+    if (*leaf == NULL)
+        return false;
+
+    bool upper = mode == TREEMAP_SEEK_FLOOR || mode == TREEMAP_SEEK_HIGHER;
+    size_t i = btree_search(map, (*leaf)->keys, (*leaf)->header.nkeys, key, upper);
+
+    if (mode == TREEMAP_SEEK_CEILING || mode == TREEMAP_SEEK_HIGHER)
+    {
+        if (i == (*leaf)->header.nkeys)
+        {
+            *leaf = (*leaf)->next;
+            i = 0;
+        }
+    }
+    else if (i-- == 0)
+    {
+        *leaf = (*leaf)->prev;
+        i = *leaf != NULL ? (*leaf)->header.nkeys - 1 : 0;
+    }
+
+    *pos = i;
+    return *leaf != NULL;
+}
+
+/* Points ref at the neighbour of key, returning false if there is none. */
+static bool treemap_seek(treemap_t *map, void *key, treemap_seek_mode_t mode, treemap_ref_t *ref)
+{
+    if (map->backend == TREEMAP_BACKEND_BTREE)
+        return btree_seek(map, key, mode, &ref->leaf, &ref->leaf_pos);
+    if (map->backend == TREEMAP_BACKEND_RBTREE_COMPACT)
+    {
+        ref->index = crbtree_seek(map, key, mode);
+        return ref->index != crbtree_NIL;
+    }
+
+    ref->node = rbtree_seek(map, key, mode);
+    return ref->node != NULL;
+}
+
+static map_entry_t treemap_seek_entry(treemap_t *map, void *key, treemap_seek_mode_t mode)
+{
+    treemap_ref_t ref = {.map = map};
+
+    if (!treemap_seek(map, key, mode, &ref))
+        return (map_entry_t){0};
+    return treemap_ref_get_entry(&ref);
+}
+
+map_entry_t treemap_first(treemap_t *map)
+{
+    if (map->size == 0)
+        return (map_entry_t){0};
+
+    if (map->backend == TREEMAP_BACKEND_BTREE)
+    {
+        struct btree_leaf *leaf = btree_first_leaf(map);
+        return (map_entry_t){.key = leaf->keys[0], .value = leaf->values[0]};
+    }
+    if (map->backend == TREEMAP_BACKEND_RBTREE_COMPACT)
+    {
+        struct crbtree_node *node = &map->compact.nodes[crbtree_extreme_at(&map->compact, map->compact.root, 0)];
+        return (map_entry_t){.key = node->key, .value = node->value};
+    }
+
+    struct rbtree_node *node = rbtree_min_at(map->root);
+    return (map_entry_t){.key = node->key, .value = node->value};
+}
+
+map_entry_t treemap_last(treemap_t *map)
+{
+    if (map->size == 0)
+        return (map_entry_t){0};
+
+    if (map->backend == TREEMAP_BACKEND_BTREE)
+    {
+        struct btree_node *node = map->btree_root;
+        while (!node->is_leaf)
+            node = ((struct btree_inner *)node)->children[node->nkeys];
+
+        struct btree_leaf *leaf = (struct btree_leaf *)node;
+        return (map_entry_t){.key = leaf->keys[node->nkeys - 1], .value = leaf->values[node->nkeys - 1]};
+    }
+    if (map->backend == TREEMAP_BACKEND_RBTREE_COMPACT)
+    {
+        struct crbtree_node *node = &map->compact.nodes[crbtree_extreme_at(&map->compact, map->compact.root, 1)];
+        return (map_entry_t){.key = node->key, .value = node->value};
+    }
+
+    struct rbtree_node *node = rbtree_max_at(map->root);
+    return (map_entry_t){.key = node->key, .value = node->value};
+}
+
+map_entry_t treemap_floor(treemap_t *map, void *key)
+{
+    return treemap_seek_entry(map, key, TREEMAP_SEEK_FLOOR);
+}
+
+map_entry_t treemap_ceiling(treemap_t *map, void *key)
+{
+    return treemap_seek_entry(map, key, TREEMAP_SEEK_CEILING);
+}
+
+map_entry_t treemap_lower(treemap_t *map, void *key)
+{
+    return treemap_seek_entry(map, key, TREEMAP_SEEK_LOWER);
+}
+
+map_entry_t treemap_higher(treemap_t *map, void *key)
+{
+    return treemap_seek_entry(map, key, TREEMAP_SEEK_HIGHER);
+}
+
+map_entry_t treemap_select(treemap_t *map, long pos)
+{
+    if (!map->order_statistics)
+        panic("Order statistics are not enabled for this map");
+
+    size_t rank = collection_ordered_pos(pos, map->size);
+    struct rbtree_node *node = map->root;
+
+    /* Descend towards the rank, skipping whole left subtrees. */
+    for (size_t left = rbtree_count(node->left); rank != left; left = rbtree_count(node->left))
+    {
+        if (rank < left)
+            node = node->left;
+        else
+        {
+            rank -= left + 1;
+            node = node->right;
+        }
+    }
+
+    return (map_entry_t){.key = node->key, .value = node->value};
+}
+
+size_t treemap_rank(treemap_t *map, void *key)
+{
+    if (!map->order_statistics)
+        panic("Order statistics are not enabled for this map");
+
+    struct rbtree_node *node = map->root;
+    size_t rank = 0;
+
+    while (node != NULL)
+    {
+        if (treemap_compare_keys(map, node->key, key) < 0)
+        {
+            rank += rbtree_count(node->left) + 1;
+            node = node->right;
+        }
+        else
+            node = node->left;
+    }
+
+    return rank;
+}
+
+treemap_ref_t *treemap_range_ref(treemap_t *map, void *lo, void *hi)
+{
+    treemap_ref_t ref = {
+#if POLYMORPHIC_DS
+        .type = DS_TYPE_TREEMAP_REF,
+#endif
+        .map = map,
+        .pos = 0,
+        .bounded = true,
+        .lo = lo,
+        .hi = hi};
+
+    if (!treemap_seek(map, lo, TREEMAP_SEEK_CEILING, &ref) ||
+        treemap_compare_keys(map, treemap_ref_get_key(&ref), hi) >= 0)
+        return NULL;
+
+    return $box(ref);
+}
+
+treemap_ref_t *treemap_ref(treemap_t *map)
+{
+    if (map->size == 0)
+        return NULL;
+
+    if (map->backend == TREEMAP_BACKEND_BTREE)
+        return $new(
+            treemap_ref_t,
+#if POLYMORPHIC_DS
+            .type = DS_TYPE_TREEMAP_REF,
+#endif
+            .map = map,
+            .pos = 0,
+            .leaf = btree_first_leaf(map),
+            .leaf_pos = 0);
+
+    if (map->backend == TREEMAP_BACKEND_RBTREE_COMPACT)
+        return $new(
+            treemap_ref_t,
+#if POLYMORPHIC_DS
+            .type = DS_TYPE_TREEMAP_REF,
+#endif
+            .map = map,
+            .pos = 0,
+            .index = crbtree_extreme_at(&map->compact, map->compact.root, 0));
+
+    /* Stepping goes through the parent pointers, so that walking the
+     * whole map never allocates past the reference itself. */
+    return $new(
+        treemap_ref_t,
+#if POLYMORPHIC_DS
+        .type = DS_TYPE_TREEMAP_REF,
+#endif
+        .map = map,
+        .pos = 0,
+        .node = rbtree_min_at(map->root));
+}
+
+bool treemap_equal(treemap_t *map1, treemap_t *map2)
+{
+    if (map1->size != map2->size)
+        return false;
+
+    treemap_ref_t *ref = treemap_ref(map1);
+    bool equal = true;
+
+    for (; ref != NULL && treemap_ref_is_valid(ref); treemap_ref_next(ref))
+    {
+        void *key = treemap_ref_get_key(ref);
+        void *value = treemap_ref_get_value(ref);
+        if (!treemap_contains_key(map2, key) || treemap_get_at(map2, key) != value)
+        {
+            equal = false;
+            break;
+        }
+    }
+
+    if (ref != NULL)
+        treemap_ref_free(ref);
+    return equal;
+}
+
+/* Frees the tree without a stack by flattening it as it goes: while
+ * the node has a left child, rotate that child above it, and once it
+ * has none, free it and carry on down its right spine. */
+static void rbtree_free_nodes(treemap_t *map)
+{
+    struct rbtree_node *node = map->root;
+
+    while (node != NULL)
+    {
+        struct rbtree_node *next;
+
+        if (node->left != NULL)
+        {
+            next = node->left;
+            node->left = next->right;
+            next->right = node;
+        }
+        else
+        {
+            next = node->right;
+            treemap_node_free(map, node);
+        }
+
+        node = next;
+    }
+
+    map->root = NULL;
+}
+
+/* Frees every node, leaving the map empty but usable. */
+static void treemap_clear(treemap_t *map)
+{
+    if (map->pool != NULL)
+    {
+        node_pool_free(map->pool);
+        map->pool = node_pool_new(treemap_node_size(map->backend, map->order_statistics),
+                                  .allocator = map->allocator);
+    }
+    else if (map->btree_root != NULL)
+        btree_free_at_node(map, map->btree_root);
+    else if (map->backend == TREEMAP_BACKEND_RBTREE_COMPACT)
+        crbtree_clear(&map->compact);
+    else
+        rbtree_free_nodes(map);
+
+    map->root = NULL;
+    map->btree_root = NULL;
+    map->size = 0;
+}
+
+void treemap_free(treemap_t *map)
+{
+    if (map->pool != NULL)
+        node_pool_free(map->pool);
+    else if (map->btree_root != NULL)
+        btree_free_at_node(map, map->btree_root);
+    else if (map->backend == TREEMAP_BACKEND_RBTREE_COMPACT)
+        allocator_free(map->allocator, map->compact.block, crbtree_BLOCK_SIZE(map->compact.capacity));
+    else
+        rbtree_free_nodes(map);
+    allocator_free(map->allocator, map, sizeof(treemap_t));
+}
+
+/* ------------------------ split and join -------------------------
+ * Joining links a node between two trees whose keys are all below and
+ * all above its own, by walking down the spine of the taller tree to a
+ * subtree as tall as the shorter one, and putting the node there, red,
+ * above both. Only the usual insertion fixup is left to do. Splitting
+ * walks down to the key, and joins each subtree it leaves behind onto
+ * the half it belongs to, so both take O(log n) and O(log^2 n) steps.
+ */
+
+/* Returns the number of black nodes on every path down from node. */
+static size_t rbtree_black_height(struct rbtree_node *node)
+{
+    size_t height = 0;
+
+    for (; node != NULL; node = node->left)
+        height += rbtree_is_black(node);
+
+    return height;
+}
+
+/* Detaches the subtree at node, making it a tree of its own. */
+static struct rbtree_node *rbtree_detach(struct rbtree_node *node)
+{
+    if (node != NULL)
+    {
+        node->parent = NULL;
+        node->color = RBTREE_COLOR_BLACK;
+    }
+
+    return node;
+}
+
+/* Joins the trees at left and right through node, and returns the root
+ * of the result. Every key under left must be less than node's, and
+ * every key under right greater. */
+static struct rbtree_node *rbtree_join(treemap_t *map, struct rbtree_node *left, struct rbtree_node *node,
+                                       struct rbtree_node *right)
+{
+    left = rbtree_detach(left);
+    right = rbtree_detach(right);
+
+    size_t left_height = rbtree_black_height(left), right_height = rbtree_black_height(right);
+    bool down_left = left_height >= right_height;
+
+    /* Fixing up only looks at the tree through its root. */
+    treemap_t tree = {.order_statistics = map->order_statistics, .root = down_left ? left : right};
+    struct rbtree_node *parent = NULL, *child = tree.root;
+
+    for (size_t height = max(left_height, right_height);
+         height > min(left_height, right_height) || rbtree_is_red(child);
+         child = down_left ? child->right : child->left)
+    {
+        height -= rbtree_is_black(child);
+        parent = child;
+    }
+
+    node->color = RBTREE_COLOR_RED;
+    node->parent = parent;
+    node->left = down_left ? child : left;
+    node->right = down_left ? right : child;
+
+    if (node->left != NULL)
+        node->left->parent = node;
+    if (node->right != NULL)
+        node->right->parent = node;
+
+    if (parent == NULL)
+        tree.root = node;
+    else if (down_left)
+        parent->right = node;
+    else
+        parent->left = node;
+
+    if (map->order_statistics)
+    {
+        for (struct rbtree_node *ancestor = node; ancestor != NULL; ancestor = ancestor->parent)
+            rbtree_recount(ancestor);
+    }
+
+    rbtree_insert_fixup(&tree, node);
+    return tree.root;
+}
+
+/* Splits the tree at node into the trees of the keys below key, and of
+ * the keys at or above it. */
+static void rbtree_split(treemap_t *map, struct rbtree_node *node, void *key,
+                         struct rbtree_node **lo, struct rbtree_node **hi)
+{
+    if (node == NULL)
+    {
+        *lo = *hi = NULL;
+        return;
+    }
+
+    struct rbtree_node *left = node->left, *right = node->right, *rest;
+
+    if (treemap_compare_keys(map, node->key, key) < 0)
+    {
+        rbtree_split(map, right, key, &rest, hi);
+        *lo = rbtree_join(map, left, node, rest);
+    }
+    else
+    {
+        rbtree_split(map, left, key, lo, &rest);
+        *hi = rbtree_join(map, rest, node, right);
+    }
+}
+
+/* Splitting and joining move nodes between maps, so the maps must own
+ * their nodes one by one, and know the size of every subtree to keep
+ * their own sizes. */
+static void treemap_check_splittable(treemap_t *map)
+{
+    if (map->backend != TREEMAP_BACKEND_RBTREE)
+        panic("Splitting and joining are only supported by the red-black tree engine");
+    if (map->pool != NULL)
+        panic("Splitting and joining need maps without node pools");
+    if (!map->order_statistics)
+        panic("Splitting and joining need maps with order statistics");
+}
+
+void treemap_split(treemap_t *map, void *key, treemap_t **lo, treemap_t **hi)
+{
+    treemap_check_splittable(map);
+
+    *hi = _treemap_new_(treemap_get_config(map));
+    rbtree_split(map, map->root, key, &map->root, &(*hi)->root);
+
+    map->size = rbtree_count(map->root);
+    (*hi)->size = rbtree_count((*hi)->root);
+    *lo = map;
+}
+
+treemap_t *treemap_join(treemap_t *lo, treemap_t *hi)
+{
+    treemap_check_splittable(lo);
+    treemap_check_splittable(hi);
+    if (lo->allocator != hi->allocator)
+        panic("Joined maps must share an allocator");
+#if treemap_ALLOW_KEY_CMP_FN_OVERLOAD
+    if (lo->key_cmp_fn != hi->key_cmp_fn)
+        panic("Joined maps must share a key comparison function");
+#endif
+
+    if (lo->size > 0 && hi->size > 0)
+    {
+        /* The greatest key of lo becomes the node the trees join through. */
+        struct rbtree_node *node = rbtree_max_at(lo->root);
+        if (treemap_compare_keys(lo, node->key, rbtree_min_at(hi->root)->key) >= 0)
+            panic("Joined maps must have every key of the first below every key of the second");
+
+        rbtree_remove(lo, node);
+        lo->root = rbtree_join(lo, lo->root, node, hi->root);
+    }
+    else if (lo->size == 0)
+        lo->root = hi->root;
+
+    lo->size += hi->size;
+    hi->root = NULL;
+    treemap_free(hi);
+
+    return lo;
+}
+
+void *treemap_ref_get_key(treemap_ref_t *ref)
+{
+    if (!treemap_ref_is_valid(ref))
+        panic("Reference is out of bounds");
+    if (ref->map->backend == TREEMAP_BACKEND_BTREE)
+        return ref->leaf->keys[ref->leaf_pos];
+    if (ref->map->backend == TREEMAP_BACKEND_RBTREE_COMPACT)
+        return ref->map->compact.nodes[ref->index].key;
+    return ref->node->key;
+}
+
+void *treemap_ref_get_value(treemap_ref_t *ref)
+{
+    if (!treemap_ref_is_valid(ref))
+        panic("Reference is out of bounds");
+    if (ref->map->backend == TREEMAP_BACKEND_BTREE)
+        return ref->leaf->values[ref->leaf_pos];
+    if (ref->map->backend == TREEMAP_BACKEND_RBTREE_COMPACT)
+        return ref->map->compact.nodes[ref->index].value;
+    return ref->node->value;
+}
+
+map_entry_t treemap_ref_get_entry(treemap_ref_t *ref)
+{
+    return (map_entry_t){
+        .key = treemap_ref_get_key(ref),
+        .value = treemap_ref_get_value(ref)};
+}
+
+treemap_t *treemap_ref_get_map(treemap_ref_t *ref)
+{
+    return ref->map;
+}
+
+size_t treemap_ref_get_pos(treemap_ref_t *ref)
+{
+    if (!treemap_ref_is_valid(ref))
+        panic("Reference is out of bounds");
+    return ref->pos;
+}
+
+bool treemap_ref_is_valid(treemap_ref_t *ref)
+{
+    return ref->pos != INVALID_REF;
+}
+
+/* Moves ref one entry forward or back, returning false if that leaves
+ * the map or the ref's range, in which case ref is left anywhere. */
+static bool treemap_ref_step(treemap_ref_t *ref, bool forward)
+{
+    if (ref->map->backend == TREEMAP_BACKEND_BTREE)
+    {
+        if (forward && ++ref->leaf_pos == ref->leaf->header.nkeys)
+        {
+            ref->leaf = ref->leaf->next;
+            ref->leaf_pos = 0;
+        }
+        else if (!forward && ref->leaf_pos-- == 0)
+        {
+            ref->leaf = ref->leaf->prev;
+            ref->leaf_pos = ref->leaf != NULL ? ref->leaf->header.nkeys - 1 : 0;
+        }
+
+        if (ref->leaf == NULL)
+            return false;
+    }
+    else if (ref->map->backend == TREEMAP_BACKEND_RBTREE_COMPACT)
+    {
+        ref->index = crbtree_step(&ref->map->compact, ref->index, forward);
+        if (ref->index == crbtree_NIL)
+            return false;
+    }
+    else
+    {
+        ref->node = forward ? rbtree_next(ref->node) : rbtree_prev(ref->node);
+        if (ref->node == NULL)
+            return false;
+    }
+
+    if (!ref->bounded)
+        return true;
+
+    void *key = treemap_ref_get_key(ref);
+    return forward
+               ? treemap_compare_keys(ref->map, key, ref->hi) < 0
+               : treemap_compare_keys(ref->map, key, ref->lo) >= 0;
+}
+
+bool treemap_ref_has_prev(treemap_ref_t *ref)
+{
+    if (!treemap_ref_is_valid(ref))
+        panic("Reference is out of bounds");
+
+    treemap_ref_t peek = *ref;
+    return treemap_ref_step(&peek, false);
+}
+
+bool treemap_ref_has_next(treemap_ref_t *ref)
+{
+    if (!treemap_ref_is_valid(ref))
+        panic("Reference is out of bounds");
+
+    treemap_ref_t peek = *ref;
+    return treemap_ref_step(&peek, true);
+}
+
+map_entry_t treemap_ref_next(treemap_ref_t *ref)
+{
+    if (!treemap_ref_is_valid(ref))
+        panic("Reference is out of bounds");
+    if (!treemap_ref_step(ref, true))
+    {
+        ref->pos = INVALID_REF;
+        return (map_entry_t){0};
+    }
+
+    ref->pos++;
+    return treemap_ref_get_entry(ref);
+}
+
+map_entry_t treemap_ref_prev(treemap_ref_t *ref)
+{
+    if (!treemap_ref_is_valid(ref))
+        panic("Reference is out of bounds");
+    if (!treemap_ref_step(ref, false))
+    {
+        ref->pos = INVALID_REF;
+        return (map_entry_t){0};
+    }
+
+    ref->pos--;
+    return treemap_ref_get_entry(ref);
+}
+
+void treemap_ref_free(treemap_ref_t *ref)
+{
+    free(ref);
+}
+
+/* ------------------------------------------------------------- */
+/*             ---------- persistent treemap ----------          */
+/* ------------------------------------------------------------- */
+
+/* Nodes keep no parent pointer, since a shared node has a parent in
+ * every version that reaches it. Each node holds one reference to
+ * each of its children, and each version one to its root. */
+struct ptreemap_node
+{
+    enum rbtree_color color;
+    size_t refs;
+    void *key;
+    void *value;
+    struct ptreemap_node *child[2]; /* Left, then right. */
+};
+
+struct ptreemap
+{
+    size_t refs;
+#if treemap_ALLOW_KEY_CMP_FN_OVERLOAD
+    compare_fn_t key_cmp_fn;
+#endif
+    size_t size;
+    struct ptreemap_node *root;
+    allocator_t *allocator;
+};
+
+struct ptreemap_ref
+{
+    ptreemap_t *map;
+    size_t pos;
+    size_t depth;
+    struct ptreemap_node *path[]; /* The current node last, after the ancestors it is left of. */
+};
+
+static int ptreemap_compare_keys(ptreemap_t *map, void *key1, void *key2)
+{
+#if treemap_ALLOW_KEY_CMP_FN_OVERLOAD
+    return map->key_cmp_fn != NULL ? map->key_cmp_fn(key1, key2) : (key1 < key2 ? -1 : key1 > key2);
+#else
+    return key1 < key2 ? -1 : key1 > key2;
+#endif
+}
+
+static inline bool ptreemap_node_is_red(struct ptreemap_node *node)
+{
+    return node != NULL && node->color == RBTREE_COLOR_RED;
+}
+
+static struct ptreemap_node *ptreemap_node_retain(struct ptreemap_node *node)
+{
+    if (node != NULL)
+        __atomic_fetch_add(&node->refs, 1, __ATOMIC_RELAXED);
+    return node;
+}
+
+/* Drops a reference to node, and once the last one is gone, frees it
+ * and drops its own references, looping down the right spine so that
+ * only left children recurse. */
+static void ptreemap_node_release(allocator_t *allocator, struct ptreemap_node *node)
+{
+    while (node != NULL && __atomic_fetch_sub(&node->refs, 1, __ATOMIC_ACQ_REL) == 1)
+    {
+        struct ptreemap_node *right = node->child[1];
+        ptreemap_node_release(allocator, node->child[0]);
+        allocator_free(allocator, node, sizeof(struct ptreemap_node));
+        node = right;
+    }
+}
+
+/* Trades the caller's reference to node for one to a node it may
+ * change: node itself if no one else holds it, which no one can start
+ * to since the caller holds the only reference, or else a copy of it
+ * sharing its children. This is the only place nodes are copied, so
+ * an update copies exactly the nodes other versions still reach. */
+static struct ptreemap_node *ptreemap_node_own(allocator_t *allocator, struct ptreemap_node *node)
+{
+    if (__atomic_load_n(&node->refs, __ATOMIC_ACQUIRE) == 1)
+        return node;
+
+    struct ptreemap_node *copy = $new_in(
+        allocator,
+        struct ptreemap_node,
+        .color = node->color,
+        .refs = 1,
+        .key = node->key,
+        .value = node->value,
+        .child = {ptreemap_node_retain(node->child[0]), ptreemap_node_retain(node->child[1])});
+    ptreemap_node_release(allocator, node);
+    return copy;
+}
+
+/* Rotates the owned node down toward dir, lifting its child from the
+ * other side, owned in turn, into its place, black above red. */
+static struct ptreemap_node *ptreemap_rotate(allocator_t *allocator, struct ptreemap_node *node, int dir)
+{
+    struct ptreemap_node *child = ptreemap_node_own(allocator, node->child[!dir]);
+
+    node->child[!dir] = child->child[dir];
+    child->child[dir] = node;
+    node->color = RBTREE_COLOR_RED;
+    child->color = RBTREE_COLOR_BLACK;
+
+    return child;
+}
+
+static ptreemap_t *ptreemap_version(ptreemap_t *map, struct ptreemap_node *root, size_t size)
+{
+    return $new_in(
+        map->allocator,
+        ptreemap_t,
+        .refs = 1,
+#if treemap_ALLOW_KEY_CMP_FN_OVERLOAD
+        .key_cmp_fn = map->key_cmp_fn,
+#endif
+        .size = size,
+        .root = root,
+        .allocator = map->allocator);
+}
+
+ptreemap_t *_ptreemap_new_(ptreemap_config_t config)
+{
+    allocator_t *allocator = allocator_or_default(config.allocator);
+
+    return $new_in(
+        allocator,
+        ptreemap_t,
+        .refs = 1,
+#if treemap_ALLOW_KEY_CMP_FN_OVERLOAD
+        .key_cmp_fn = config.key_compare_fn,
+#endif
+        .size = 0,
+        .root = NULL,
+        .allocator = allocator);
+}
+
+ptreemap_t *ptreemap_snapshot(ptreemap_t *map)
+{
+    __atomic_fetch_add(&map->refs, 1, __ATOMIC_RELAXED);
+    return map;
+}
+
+static struct ptreemap_node *ptreemap_find_node(ptreemap_t *map, void *key)
+{
+    struct ptreemap_node *node = map->root;
+
+    while (node != NULL)
+    {
+        int key_cmp_val = ptreemap_compare_keys(map, key, node->key);
+        if (key_cmp_val == 0)
+            return node;
+        node = node->child[key_cmp_val > 0];
+    }
+
+    return NULL;
+}
+
+bool ptreemap_is_empty(ptreemap_t *map)
+{
+    return map->size == 0;
+}
+
+bool ptreemap_contains_key(ptreemap_t *map, void *key)
+{
+    return ptreemap_find_node(map, key) != NULL;
+}
+
+size_t ptreemap_size(ptreemap_t *map)
+{
+    return map->size;
 }
 
-void treemap_set_at(treemap_t *map, void *key, void *value)
+void *ptreemap_get_at(ptreemap_t *map, void *key)
 {
-    map->root = treemap_set_at_node(map, map->root, key, value);
-    map->root->color = RBTREE_COLOR_BLACK;
+    struct ptreemap_node *node = ptreemap_find_node(map, key);
+    return node != NULL ? node->value : NULL;
 }
 
-struct treemap_remove_result
-{
-    void *value;
-    struct rbtree_node *root;
-} treemap_remove_at_node(treemap_t *map, struct rbtree_node *node, void *key)
+/* Inserts into the subtree, taking the caller's reference to it and
+ * returning one to the new subtree, whose root may be left red above
+ * a red child for the caller to fix, as in a bottom-up insertion. */
+static struct ptreemap_node *ptreemap_insert(ptreemap_t *map, struct ptreemap_node *node,
+                                             void *key, void *value, bool *added)
 {
-    void *value;
-
     if (node == NULL)
-        return (struct treemap_remove_result){NULL, node};
-
-    if (treemap_compare_keys(map, key, node->key) < 0)
     {
-        if (rbtree_is_black(node->left) && rbtree_is_black(node->left->left))
-            node = rbtree_move_red_left(node);
-
-        struct treemap_remove_result result = treemap_remove_at_node(map, node->left, key);
-        rbtree_set_left(node, result.root);
-        value = result.value;
+        *added = true;
+        return $new_in(
+            map->allocator,
+            struct ptreemap_node,
+            .color = RBTREE_COLOR_RED,
+            .refs = 1,
+            .key = key,
+            .value = value);
     }
 
-    else
+    node = ptreemap_node_own(map->allocator, node);
+
+    int key_cmp_val = ptreemap_compare_keys(map, key, node->key);
+    if (key_cmp_val == 0)
     {
-        if (rbtree_is_red(node->left))
-            node = rbtree_rotate_right(node);
-        if (treemap_compare_keys(map, key, node->key) == 0 && node->right == NULL)
-            return (struct treemap_remove_result){node->value, NULL};
-        if (rbtree_is_black(node->right) && rbtree_is_black(node->right->left))
-            node = rbtree_move_red_right(node);
+        node->value = value;
+        return node;
+    }
 
-        if (treemap_compare_keys(map, key, node->key) == 0)
-        {
-            value = node->value;
-            struct rbtree_node *min_right = rbtree_min_at(node->right);
-            node->key = min_right->key;
-            node->value = min_right->value;
-            rbtree_set_right(node, rbtree_remove_min_at(node->right));
-        }
+    int dir = key_cmp_val > 0;
+    node->child[dir] = ptreemap_insert(map, node->child[dir], key, value, added);
 
-        else
-        {
-            struct treemap_remove_result result = treemap_remove_at_node(map, node->right, key);
-            rbtree_set_right(node, result.root);
-            value = result.value;
-        }
+    struct ptreemap_node *child = node->child[dir];
+    if (!ptreemap_node_is_red(child) ||
+        (!ptreemap_node_is_red(child->child[0]) && !ptreemap_node_is_red(child->child[1])))
+        return node;
+
+    if (ptreemap_node_is_red(node->child[!dir]))
+    {
+        /* Red uncle: push the red up a level. */
+        node->child[!dir] = ptreemap_node_own(map->allocator, node->child[!dir]);
+        node->color = RBTREE_COLOR_RED;
+        node->child[0]->color = RBTREE_COLOR_BLACK;
+        node->child[1]->color = RBTREE_COLOR_BLACK;
+        return node;
     }
 
-    return (struct treemap_remove_result){value, rbtree_balance(node)};
+    if (ptreemap_node_is_red(child->child[!dir]))
+        node->child[dir] = ptreemap_rotate(map->allocator, child, dir);
+    return ptreemap_rotate(map->allocator, node, !dir);
 }
 
-void *treemap_remove_at(treemap_t *map, void *key)
+ptreemap_t *ptreemap_set_at(ptreemap_t *map, void *key, void *value)
 {
-    if (map->root == NULL)
-        return NULL;
+    struct ptreemap_node *node = ptreemap_find_node(map, key);
+    if (node != NULL && node->value == value)
+        return ptreemap_snapshot(map);
 
-    if (rbtree_is_black(map->root->left) && rbtree_is_black(map->root->right))
-        map->root->color = RBTREE_COLOR_RED;
+    bool added = false;
+    struct ptreemap_node *root = ptreemap_insert(map, ptreemap_node_retain(map->root), key, value, &added);
+    root->color = RBTREE_COLOR_BLACK;
 
-    struct treemap_remove_result result = treemap_remove_at_node(map, map->root, key);
-    map->root = result.root;
+    return ptreemap_version(map, root, map->size + added);
+}
 
-    if (result.value != NULL)
-        map->size--;
+/* Restores the black height of the owned node's subtree after its
+ * child toward dir lost one, setting done once the height is back,
+ * or leaving the whole subtree one short for the caller to fix. */
+static struct ptreemap_node *ptreemap_remove_fixup(ptreemap_t *map, struct ptreemap_node *node,
+                                                   int dir, bool *done)
+{
+    struct ptreemap_node *parent = node;
 
-    if (map->root != NULL)
-        map->root->color = RBTREE_COLOR_BLACK;
+    /* A red sibling is rotated above the parent, so that the sibling
+     * left to work with is one of its black children. */
+    if (ptreemap_node_is_red(node->child[!dir]))
+        node = ptreemap_rotate(map->allocator, parent, dir);
 
-    return result.value;
-}
+    struct ptreemap_node *sibling = parent->child[!dir] = ptreemap_node_own(map->allocator, parent->child[!dir]);
 
-void _treemap_set_all_(treemap_t *map, size_t n, map_entry_t entries[n])
-{
-    for (int i = 0; i < n; i++)
+    if (!ptreemap_node_is_red(sibling->child[0]) && !ptreemap_node_is_red(sibling->child[1]))
     {
-        map_entry_t entry = entries[n];
-        treemap_set_at(map, entry.key, entry.value);
+        *done = ptreemap_node_is_red(parent);
+        parent->color = RBTREE_COLOR_BLACK;
+        sibling->color = RBTREE_COLOR_RED;
+        return node;
     }
-}
 
-hashset_t *treemap_key_at_node(struct rbtree_node *node, hashset_t *keys)
-{
-    if (node == NULL)
-        return keys;
+    enum rbtree_color color = parent->color;
+    struct ptreemap_node *top;
 
-    hashset_add(keys, node->key);
-    treemap_key_at_node(node->left, keys);
-    treemap_key_at_node(node->right, keys);
+    if (!ptreemap_node_is_red(sibling->child[!dir]))
+        parent->child[!dir] = ptreemap_rotate(map->allocator, sibling, !dir);
+    top = ptreemap_rotate(map->allocator, parent, dir);
 
-    return keys;
+    top->color = color;
+    for (int i = 0; i < 2; i++)
+    {
+        top->child[i] = ptreemap_node_own(map->allocator, top->child[i]);
+        top->child[i]->color = RBTREE_COLOR_BLACK;
+    }
+
+    *done = true;
+    if (node == parent)
+        return top;
+    node->child[dir] = top;
+    return node;
 }
 
-map_entry_t treemap_find(treemap_t *map, bipred_fn_t bipred)
+/* Removes the key, which must be in the subtree, taking the caller's
+ * reference to it and returning one to the new subtree. */
+static struct ptreemap_node *ptreemap_delete(ptreemap_t *map, struct ptreemap_node *node,
+                                             void *key, bool *done)
 {
-    for (treemap_ref_t *ref = treemap_ref(map);
-         treemap_ref_is_valid(ref);
-         treemap_ref_next(ref))
+    node = ptreemap_node_own(map->allocator, node);
+
+    int key_cmp_val = ptreemap_compare_keys(map, key, node->key);
+    if (key_cmp_val == 0)
     {
-        if (bipred(ref->node->key, ref->node->value))
-            return (map_entry_t){
-                .key = ref->node->key,
-                .value = ref->node->value};
+        if (node->child[0] == NULL || node->child[1] == NULL)
+        {
+            struct ptreemap_node *child = node->child[node->child[0] == NULL];
+
+            if (ptreemap_node_is_red(node))
+                *done = true;
+            else if (ptreemap_node_is_red(child))
+            {
+                child = ptreemap_node_own(map->allocator, child);
+                child->color = RBTREE_COLOR_BLACK;
+                *done = true;
+            }
+
+            allocator_free(map->allocator, node, sizeof(struct ptreemap_node));
+            return child;
+        }
+
+        /* Take over the predecessor's entry, and remove it instead. */
+        struct ptreemap_node *pred = node->child[0];
+        while (pred->child[1] != NULL)
+            pred = pred->child[1];
+
+        node->key = key = pred->key;
+        node->value = pred->value;
+        key_cmp_val = -1;
     }
 
-    return (map_entry_t){0};
+    int dir = key_cmp_val > 0;
+    node->child[dir] = ptreemap_delete(map, node->child[dir], key, done);
+
+    return *done ? node : ptreemap_remove_fixup(map, node, dir, done);
 }
 
-hashset_t *treemap_keys(treemap_t *map)
+ptreemap_t *ptreemap_remove_at(ptreemap_t *map, void *key)
 {
-    hashset_t *keys = hashset_new();
-    return treemap_key_at_node(map->root, keys);
+    if (ptreemap_find_node(map, key) == NULL)
+        return ptreemap_snapshot(map);
+
+    bool done = false;
+    struct ptreemap_node *root = ptreemap_delete(map, ptreemap_node_retain(map->root), key, &done);
+    if (ptreemap_node_is_red(root))
+    {
+        root = ptreemap_node_own(map->allocator, root);
+        root->color = RBTREE_COLOR_BLACK;
+    }
+
+    return ptreemap_version(map, root, map->size - 1);
 }
 
-struct arraylist *treemap_value_at_node(struct rbtree_node *node, struct arraylist *values)
+static map_entry_t ptreemap_extreme(ptreemap_t *map, int dir)
 {
+    struct ptreemap_node *node = map->root;
     if (node == NULL)
-        return values;
-
-    _arraylist_add_(values, node->value);
-    treemap_value_at_node(node->left, values);
-    treemap_value_at_node(node->right, values);
+        return (map_entry_t){0};
 
-    return values;
+    while (node->child[dir] != NULL)
+        node = node->child[dir];
+    return (map_entry_t){.key = node->key, .value = node->value};
 }
 
-struct arraylist *treemap_values(treemap_t *map)
+map_entry_t ptreemap_first(ptreemap_t *map)
 {
-    struct arraylist *values = _arraylist_new_(
-        (arraylist_config_t){
-            .item_size = 0 // TODO
-        });
-    return treemap_value_at_node(map->root, values);
+    return ptreemap_extreme(map, 0);
 }
 
-treemap_ref_t *treemap_ref(treemap_t *map)
+map_entry_t ptreemap_last(ptreemap_t *map)
 {
-    if (map->size == 0)
-        return NULL;
-
-    treemap_ref_t *ref = $new(
-        treemap_ref_t,
-#if POLYMORPHIC_DS
-        .type = DS_TYPE_TREEMAP_REF,
-#endif
-        .map = map,
-        .pos = 0,
-        .node = map->root,
-        .inorder_history = _linkedlist_new_(
-            (linkedlist_config_t){
-                .item_size = sizeof(struct rbtree_node *)}));
-
-    /* Initialize this reference at the bottom of the map domain poset. */
-
-    for (; ref->node->left != NULL; ref->node = ref->node->left)
-    {
-        struct rbtree_node *node = ref->node;
-        _linkedlist_add_back_(ref->inorder_history, &node);
-    }
-
-    return ref;
+    return ptreemap_extreme(map, 1);
 }
 
-bool treemap_equal(treemap_t *map1, treemap_t *map2)
+bool ptreemap_equal(ptreemap_t *map1, ptreemap_t *map2)
 {
     if (map1->size != map2->size)
         return false;
+    if (map1->root == map2->root)
+        return true;
 
-    for (treemap_ref_t *ref = treemap_ref(map1);
-         treemap_ref_has_next(ref);
-         treemap_ref_next(ref))
+    ptreemap_ref_t *ref1 = ptreemap_ref(map1), *ref2 = ptreemap_ref(map2);
+    bool equal = true;
+
+    for (; ref1 != NULL && ptreemap_ref_is_valid(ref1); ptreemap_ref_next(ref1), ptreemap_ref_next(ref2))
     {
-        void *key = treemap_ref_get_key(ref);
-        void *value = treemap_ref_get_value(ref);
-        if (!treemap_contains_key(map2, key) || treemap_get_at(map2, key) != value)
-            return false;
+        if (ptreemap_compare_keys(map1, ptreemap_ref_get_key(ref1), ptreemap_ref_get_key(ref2)) != 0 ||
+            ptreemap_ref_get_value(ref1) != ptreemap_ref_get_value(ref2))
+        {
+            equal = false;
+            break;
+        }
     }
 
-    return true;
+    if (ref1 != NULL)
+    {
+        ptreemap_ref_free(ref1);
+        ptreemap_ref_free(ref2);
+    }
+    return equal;
 }
 
-void treemap_free_at_node(treemap_t *map, struct rbtree_node *node)
+void ptreemap_free(ptreemap_t *map)
 {
-    if (node == NULL)
+    if (__atomic_fetch_sub(&map->refs, 1, __ATOMIC_ACQ_REL) != 1)
         return;
 
-    treemap_free_at_node(map, node->left);
-    treemap_free_at_node(map, node->right);
-    free(node);
+    ptreemap_node_release(map->allocator, map->root);
+    allocator_free(map->allocator, map, sizeof(ptreemap_t));
 }
 
-void treemap_free(treemap_t *map)
+static void ptreemap_ref_descend(ptreemap_ref_t *ref, struct ptreemap_node *node)
 {
-    treemap_free_at_node(map, map->root);
-    free(map);
+    for (; node != NULL; node = node->child[0])
+        ref->path[ref->depth++] = node;
 }
 
-void *treemap_ref_get_key(treemap_ref_t *ref)
+ptreemap_ref_t *ptreemap_ref(ptreemap_t *map)
 {
-    if (!treemap_ref_is_valid(ref))
-        panic("Reference is out of bounds");
-    return ref->node->key;
+    if (map->size == 0)
+        return NULL;
+
+    /* A red-black tree of n nodes is at most 2 log2(n + 1) deep. */
+    size_t height = 2 * (64 - __builtin_clzl(map->size));
+
+    ptreemap_ref_t *ref = malloc(sizeof(ptreemap_ref_t) + height * sizeof(struct ptreemap_node *));
+    *ref = (ptreemap_ref_t){
+        .map = ptreemap_snapshot(map),
+        .pos = 0,
+        .depth = 0};
+    ptreemap_ref_descend(ref, map->root);
+
+    return ref;
 }
 
-void *treemap_ref_get_value(treemap_ref_t *ref)
+void *ptreemap_ref_get_key(ptreemap_ref_t *ref)
 {
-    if (!treemap_ref_is_valid(ref))
+    if (!ptreemap_ref_is_valid(ref))
         panic("Reference is out of bounds");
-    return ref->node->value;
+    return ref->path[ref->depth - 1]->key;
 }
 
-map_entry_t treemap_ref_get_entry(treemap_ref_t *ref)
+void *ptreemap_ref_get_value(ptreemap_ref_t *ref)
 {
-    if (!treemap_ref_is_valid(ref))
+    if (!ptreemap_ref_is_valid(ref))
         panic("Reference is out of bounds");
+    return ref->path[ref->depth - 1]->value;
+}
+
+map_entry_t ptreemap_ref_get_entry(ptreemap_ref_t *ref)
+{
     return (map_entry_t){
-        .key = ref->node->key,
-        .value = ref->node->value};
+        .key = ptreemap_ref_get_key(ref),
+        .value = ptreemap_ref_get_value(ref)};
 }
 
-treemap_t *treemap_ref_get_map(treemap_ref_t *ref)
+ptreemap_t *ptreemap_ref_get_map(ptreemap_ref_t *ref)
 {
     return ref->map;
 }
 
-size_t treemap_ref_get_pos(treemap_ref_t *ref)
+size_t ptreemap_ref_get_pos(ptreemap_ref_t *ref)
 {
-    if (!treemap_ref_is_valid(ref))
+    if (!ptreemap_ref_is_valid(ref))
         panic("Reference is out of bounds");
     return ref->pos;
 }
 
-bool treemap_ref_is_valid(treemap_ref_t *ref)
+bool ptreemap_ref_is_valid(ptreemap_ref_t *ref)
 {
     return ref->pos != INVALID_REF;
 }
 
-bool treemap_ref_has_next(treemap_ref_t *ref)
+bool ptreemap_ref_has_next(ptreemap_ref_t *ref)
 {
-    if (!treemap_ref_is_valid(ref))
+    if (!ptreemap_ref_is_valid(ref))
         panic("Reference is out of bounds");
-    return ref->node != NULL || !linkedlist_is_empty(ref->inorder_history);
+    return ref->path[ref->depth - 1]->child[1] != NULL || ref->depth > 1;
 }
 
-map_entry_t treemap_ref_next(treemap_ref_t *ref)
+map_entry_t ptreemap_ref_next(ptreemap_ref_t *ref)
 {
-    if (!treemap_ref_is_valid(ref))
+    if (!ptreemap_ref_is_valid(ref))
         panic("Reference is out of bounds");
-    if (!treemap_ref_has_next(ref))
+
+    struct ptreemap_node *node = ref->path[--ref->depth];
+    ptreemap_ref_descend(ref, node->child[1]);
+    if (ref->depth == 0)
     {
         ref->pos = INVALID_REF;
         return (map_entry_t){0};
     }
 
-    for (ref->node = ref->node->right;
-         ref->node != NULL;
-         ref->node = ref->node->left)
-    {
-        struct rbtree_node *node = ref->node;
-        _linkedlist_add_back_(ref->inorder_history, &node);
-    }
-
-    ref->node = _linkedlist_remove_back_(ref->inorder_history);
     ref->pos++;
-
-    return (map_entry_t){.key = ref->node->key, .value = ref->node->value};
+    return ptreemap_ref_get_entry(ref);
 }
 
-void treemap_ref_free(treemap_ref_t *ref)
+void ptreemap_ref_free(ptreemap_ref_t *ref)
 {
-    linkedlist_free(ref->inorder_history);
+    ptreemap_free(ref->map);
     free(ref);
 }
 
@@ -3141,6 +6398,9 @@ struct hashset_ref
 hashset_t *_hashset_new_(hashset_config_t config)
 {
     hashmap_t *map = hashmap_new(
+            .backend = config.backend,
+            .pool_nodes = config.pool_nodes,
+            .allocator = config.allocator,
 #if hashmap_ALLOW_KEY_EQ_FN_OVERLOAD
             .key_equal_fn = config.equal_fn,
 #endif
@@ -3149,7 +6409,8 @@ hashset_t *_hashset_new_(hashset_config_t config)
 #endif
     );
 
-    return $new(
+    return $new_in(
+        map->allocator,
         hashset_t,
 #if POLYMORPHIC_DS
         .type = DS_TYPE_HASHSET,
@@ -3369,8 +6630,9 @@ bool hashset_equal(hashset_t *set1, hashset_t *set2)
 
 void hashset_free(hashset_t *set)
 {
+    allocator_t *allocator = set->map->allocator;
     hashmap_free(set->map);
-    free(set);
+    allocator_free(allocator, set, sizeof(hashset_t));
 }
 
 void *hashset_ref_get_item(hashset_ref_t *ref)
@@ -3440,15 +6702,23 @@ struct treeset_ref
     treemap_ref_t *map_ref;
 };
 
-treeset_t *_treeset_new_(treeset_config_t config)
+static treemap_config_t treeset_map_config(treeset_config_t config)
 {
-    treemap_t *map = treemap_new(
+    return (treemap_config_t){
+        .backend = config.backend,
+        .pool_nodes = config.pool_nodes,
+        .order_statistics = config.order_statistics,
+        .allocator = config.allocator,
 #if treemap_ALLOW_KEY_CMP_FN_OVERLOAD
-            .key_compare_fn = config.compare_fn
+        .key_compare_fn = config.compare_fn
 #endif
-    );
+    };
+}
 
-    return $new(
+static treeset_t *treeset_wrap(treemap_t *map)
+{
+    return $new_in(
+        map->allocator,
         treeset_t,
 #if POLYMORPHIC_DS
         .type = DS_TYPE_TREESET,
@@ -3456,6 +6726,26 @@ treeset_t *_treeset_new_(treeset_config_t config)
         .map = map);
 }
 
+treeset_t *_treeset_new_(treeset_config_t config)
+{
+    return treeset_wrap(_treemap_new_(treeset_map_config(config)));
+}
+
+treeset_config_t treeset_get_config(treeset_t *set)
+{
+    treemap_config_t config = treemap_get_config(set->map);
+
+    return (treeset_config_t){
+        .backend = config.backend,
+        .pool_nodes = config.pool_nodes,
+        .order_statistics = config.order_statistics,
+        .allocator = config.allocator,
+#if treemap_ALLOW_KEY_CMP_FN_OVERLOAD
+        .compare_fn = config.key_compare_fn
+#endif
+    };
+}
+
 #if treemap_ALLOW_KEY_CMP_FN_OVERLOAD
 compare_fn_t treeset_get_cmp_fn(treeset_t *set)
 {
@@ -3483,10 +6773,31 @@ void treeset_add(treeset_t *set, void *item)
     treemap_set_at(set->map, item, NULL);
 }
 
+/* Pairs each item with the NULL value the set's map stores for it. */
+static map_entry_t *treeset_entries(size_t nitems, void *items[nitems])
+{
+    map_entry_t *entries = malloc(nitems * sizeof(map_entry_t));
+
+    for (size_t i = 0; i < nitems; i++)
+        entries[i] = (map_entry_t){.key = items[i], .value = NULL};
+
+    return entries;
+}
+
+treeset_t *_treeset_from_sorted_(size_t nitems, void *items[nitems], treeset_config_t config)
+{
+    map_entry_t *entries = treeset_entries(nitems, items);
+    treemap_t *map = _treemap_from_sorted_(nitems, entries, treeset_map_config(config));
+    free(entries);
+
+    return treeset_wrap(map);
+}
+
 void _treeset_add_all_(treeset_t *set, size_t nitems, void *items[nitems])
 {
-    for (int i = 0; i < nitems; i++)
-        treeset_add(set, items[i]);
+    map_entry_t *entries = treeset_entries(nitems, items);
+    _treemap_set_all_(set->map, nitems, entries);
+    free(entries);
 }
 
 void *treeset_remove(treeset_t *set, void *item)
@@ -3494,69 +6805,211 @@ void *treeset_remove(treeset_t *set, void *item)
     return treemap_remove_at(set->map, item);
 }
 
-treeset_t *treeset_union(treeset_t *set1, treeset_t *set2)
+/* Which of the items of two sets a merge keeps. */
+typedef enum treeset_merge_mode
 {
-    /* Assumes that set1 and set2 have the same comparison function
-     * defined over their items. */
+    TREESET_MERGE_UNION,
+    TREESET_MERGE_INTERSECTION,
+    TREESET_MERGE_DIFFERENCE,
+} treeset_merge_mode_t;
 
-    treeset_t *set_union = treeset_new();
+/* Walks both sets in order at once, writing the items kept into out in
+ * order, and returns how many there were. Assumes that set1 and set2
+ * have the same comparison function defined over their items. */
+static size_t treeset_merge(treeset_t *set1, treeset_t *set2, treeset_merge_mode_t mode, map_entry_t *out)
+{
+    treemap_ref_t *ref1 = treemap_ref(set1->map), *ref2 = treemap_ref(set2->map);
+    bool valid1 = ref1 != NULL, valid2 = ref2 != NULL;
+    size_t n = 0;
 
-    for (treemap_ref_t *ref = treemap_ref(set1->map);
-         treemap_ref_has_next(ref);
-         treemap_ref_next(ref))
+    while (valid1 && valid2)
     {
-        treeset_add(set_union, treemap_ref_get_key(ref));
+        void *item1 = treemap_ref_get_key(ref1), *item2 = treemap_ref_get_key(ref2);
+        int cmp = treemap_compare_keys(set1->map, item1, item2);
+
+        if (cmp < 0 && mode != TREESET_MERGE_INTERSECTION)
+            out[n++] = (map_entry_t){.key = item1};
+        else if (cmp > 0 && mode == TREESET_MERGE_UNION)
+            out[n++] = (map_entry_t){.key = item2};
+        else if (cmp == 0 && mode != TREESET_MERGE_DIFFERENCE)
+            out[n++] = (map_entry_t){.key = item1};
+
+        if (cmp <= 0)
+        {
+            treemap_ref_next(ref1);
+            valid1 = treemap_ref_is_valid(ref1);
+        }
+        if (cmp >= 0)
+        {
+            treemap_ref_next(ref2);
+            valid2 = treemap_ref_is_valid(ref2);
+        }
     }
 
-    for (treemap_ref_t *ref = treemap_ref(set2->map);
-         treemap_ref_has_next(ref);
-         treemap_ref_next(ref))
+    /* Whatever is left of one set is past the end of the other. */
+    while (valid1 && mode != TREESET_MERGE_INTERSECTION)
     {
-        treeset_add(set_union, treemap_ref_get_key(ref));
+        out[n++] = (map_entry_t){.key = treemap_ref_get_key(ref1)};
+        treemap_ref_next(ref1);
+        valid1 = treemap_ref_is_valid(ref1);
     }
 
-    return set_union;
+    while (valid2 && mode == TREESET_MERGE_UNION)
+    {
+        out[n++] = (map_entry_t){.key = treemap_ref_get_key(ref2)};
+        treemap_ref_next(ref2);
+        valid2 = treemap_ref_is_valid(ref2);
+    }
+
+    if (ref1 != NULL)
+        treemap_ref_free(ref1);
+    if (ref2 != NULL)
+        treemap_ref_free(ref2);
+
+    return n;
+}
+
+/* Whether probing the larger of two sets for each item of the smaller
+ * one beats walking both, at log2(larger) steps a probe. */
+static bool treeset_should_probe(size_t smaller, size_t larger)
+{
+    return smaller * (64 - __builtin_clzl(larger | 1)) < larger;
+}
+
+/* Builds the result of a merge as a set configured like set1. */
+static treeset_t *treeset_merge_new(treeset_t *set1, treeset_t *set2, treeset_merge_mode_t mode, size_t max_items)
+{
+    map_entry_t *items = malloc(max(max_items, 1) * sizeof(map_entry_t));
+    size_t nitems = treeset_merge(set1, set2, mode, items);
+
+    treemap_t *map = _treemap_new_(treemap_get_config(set1->map));
+    treemap_build(map, nitems, items);
+    free(items);
+
+    return treeset_wrap(map);
+}
+
+treeset_t *treeset_union(treeset_t *set1, treeset_t *set2)
+{
+    return treeset_merge_new(set1, set2, TREESET_MERGE_UNION, set1->map->size + set2->map->size);
 }
 
 treeset_t *treeset_intersection(treeset_t *set1, treeset_t *set2)
 {
-    /* Assumes that set1 and set2 have the same comparison function
-     * defined over their items. */
+    return treeset_merge_new(set1, set2, TREESET_MERGE_INTERSECTION, min(set1->map->size, set2->map->size));
+}
 
-    treeset_t *set_intersection = treeset_new();
+treeset_t *treeset_difference(treeset_t *set1, treeset_t *set2)
+{
+    return treeset_merge_new(set1, set2, TREESET_MERGE_DIFFERENCE, set1->map->size);
+}
 
-    for (treemap_ref_t *ref = treemap_ref(set1->map);
-         treemap_ref_has_next(ref);
-         treemap_ref_next(ref))
+void treeset_union_into(treeset_t *set, treeset_t *other)
+{
+    /* A few items are cheaper to insert than the whole set to rebuild. */
+    if (treeset_should_probe(other->map->size, set->map->size))
+    {
+        treemap_ref_t *ref = treemap_ref(other->map);
+        for (; ref != NULL && treemap_ref_is_valid(ref); treemap_ref_next(ref))
+            treemap_set_at(set->map, treemap_ref_get_key(ref), NULL);
+
+        if (ref != NULL)
+            treemap_ref_free(ref);
+        return;
+    }
+
+    map_entry_t *items = malloc((set->map->size + other->map->size) * sizeof(map_entry_t));
+    size_t nitems = treeset_merge(set, other, TREESET_MERGE_UNION, items);
+
+    if (nitems > set->map->size)
     {
-        if (treeset_contains(set2, treemap_ref_get_value(ref)))
-            treeset_add(set_intersection, treemap_ref_get_key(ref));
+        treemap_clear(set->map);
+        treemap_build(set->map, nitems, items);
     }
 
-    return set_intersection;
+    free(items);
 }
 
-treeset_t *treeset_difference(treeset_t *set1, treeset_t *set2)
+void treeset_retain_all(treeset_t *set, treeset_t *other)
 {
-    /* Assumes that set1 and set2 have the same comparison function
-     * defined over their items. */
+    map_entry_t *items = malloc(max(min(set->map->size, other->map->size), 1) * sizeof(map_entry_t));
+    size_t nitems = 0;
 
-    treeset_t *set_intersection = treeset_new();
+    /* Against a much smaller set, only its items need to be looked up. */
+    if (treeset_should_probe(other->map->size, set->map->size))
+    {
+        treemap_ref_t *ref = treemap_ref(other->map);
+        for (; ref != NULL && treemap_ref_is_valid(ref); treemap_ref_next(ref))
+        {
+            if (treemap_contains_key(set->map, treemap_ref_get_key(ref)))
+                items[nitems++] = (map_entry_t){.key = treemap_ref_get_key(ref)};
+        }
 
-    for (treemap_ref_t *ref = treemap_ref(set1->map);
-         treemap_ref_has_next(ref);
-         treemap_ref_next(ref))
+        if (ref != NULL)
+            treemap_ref_free(ref);
+    }
+    else
+        nitems = treeset_merge(set, other, TREESET_MERGE_INTERSECTION, items);
+
+    if (nitems < set->map->size)
     {
-        if (!treeset_contains(set2, treemap_ref_get_value(ref)))
-            treeset_add(set_intersection, treemap_ref_get_key(ref));
+        treemap_clear(set->map);
+        treemap_build(set->map, nitems, items);
     }
 
-    return set_intersection;
+    free(items);
+}
+
+void treeset_remove_all(treeset_t *set, treeset_t *other)
+{
+    map_entry_t *items = malloc(max(set->map->size, 1) * sizeof(map_entry_t));
+    size_t nitems = treeset_merge(set, other, TREESET_MERGE_DIFFERENCE, items);
+
+    if (nitems < set->map->size)
+    {
+        treemap_clear(set->map);
+        treemap_build(set->map, nitems, items);
+    }
+
+    free(items);
+}
+
+void treeset_split(treeset_t *set, void *item, treeset_t **lo, treeset_t **hi)
+{
+    treemap_t *map_lo, *map_hi;
+    treemap_split(set->map, item, &map_lo, &map_hi);
+
+    *lo = set;
+    *hi = treeset_wrap(map_hi);
+}
+
+treeset_t *treeset_join(treeset_t *lo, treeset_t *hi)
+{
+    lo->map = treemap_join(lo->map, hi->map);
+    allocator_free(lo->map->allocator, hi, sizeof(treeset_t));
+    return lo;
 }
 
 bool treeset_is_subset(treeset_t *set, treeset_t *subset)
 {
-    return treeset_is_empty(treeset_difference(subset, set));
+    if (subset->map->size > set->map->size)
+        return false;
+
+    map_entry_t *items = malloc(max(subset->map->size, 1) * sizeof(map_entry_t));
+    size_t nitems = treeset_merge(subset, set, TREESET_MERGE_DIFFERENCE, items);
+    free(items);
+
+    return nitems == 0;
+}
+
+void *treeset_select(treeset_t *set, long pos)
+{
+    return treemap_select(set->map, pos).key;
+}
+
+size_t treeset_rank(treeset_t *set, void *item)
+{
+    return treemap_rank(set->map, item);
 }
 
 void *treeset_find(treeset_t *set, pred_fn_t pred)
@@ -3643,21 +7096,33 @@ bool treeset_equal(treeset_t *set1, treeset_t *set2)
     if (set1->map->size != set2->map->size)
         return false;
 
-    for (treemap_ref_t *ref = treemap_ref(set1->map);
-         treemap_ref_has_next(ref);
-         treemap_ref_next(ref))
+    /* Equal sets hold the same items in the same order. */
+    treemap_ref_t *ref1 = treemap_ref(set1->map), *ref2 = treemap_ref(set2->map);
+    bool equal = true;
+
+    for (; ref1 != NULL && treemap_ref_is_valid(ref1); treemap_ref_next(ref1), treemap_ref_next(ref2))
     {
-        if (!treeset_contains(set2, treemap_ref_get_key(ref)))
-            return false;
+        if (treemap_compare_keys(set1->map, treemap_ref_get_key(ref1), treemap_ref_get_key(ref2)) != 0)
+        {
+            equal = false;
+            break;
+        }
     }
 
-    return true;
+    if (ref1 != NULL)
+    {
+        treemap_ref_free(ref1);
+        treemap_ref_free(ref2);
+    }
+
+    return equal;
 }
 
 void treeset_free(treeset_t *set)
 {
+    allocator_t *allocator = set->map->allocator;
     treemap_free(set->map);
-    free(set);
+    allocator_free(allocator, set, sizeof(treeset_t));
 }
 
 void *treeset_ref_get_item(treeset_ref_t *ref)
@@ -3680,6 +7145,11 @@ bool treeset_ref_is_valid(treeset_ref_t *ref)
     return treemap_ref_is_valid(ref->map_ref);
 }
 
+bool treeset_ref_has_prev(treeset_ref_t *ref)
+{
+    return treemap_ref_has_prev(ref->map_ref);
+}
+
 bool treeset_ref_has_next(treeset_ref_t *ref)
 {
     return treemap_ref_has_next(ref->map_ref);
@@ -3690,6 +7160,11 @@ void *treeset_ref_next(treeset_ref_t *ref)
     return treemap_ref_next(ref->map_ref).key;
 }
 
+void *treeset_ref_prev(treeset_ref_t *ref)
+{
+    return treemap_ref_prev(ref->map_ref).key;
+}
+
 void treeset_ref_free(treeset_ref_t *ref)
 {
     treemap_ref_free(ref->map_ref);
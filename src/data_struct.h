@@ -5,6 +5,8 @@
 #include <math.h>
 #include "panic.h"
 #include "functions.h"
+#include "alloc.h"
+#include "sort.h"
 
 #define POLYMORPHIC_DS true
 
@@ -121,6 +123,12 @@ void              collection_ref_free           (collection_ref_t *);
     })
 #define array_unslice(slc)           ((typeof(*(slc)))_array_unslice_((slc), sizeof(**(slc))))
 #define array_equal(arr1, arr2)      (_array_equal_((arr1), (arr2)))
+#define array_sort(arr)              (sort((arr), array_size((arr))))
+#define array_sort_by(arr, cmp_fn)   (sort_buffer((arr), array_size((arr)), sizeof(*(arr)), (cmp_fn)))
+#define array_stable_sort(arr)       (stable_sort((arr), array_size((arr))))
+#define array_stable_sort_by(arr, cmp_fn) \
+    (stable_sort_buffer((arr), array_size((arr)), sizeof(*(arr)), (cmp_fn)))
+#define array_radix_sort(arr)        (radix_sort((arr), array_size((arr))))
 #define array_free(arr)              (_array_free_((arr)))
 
 #define range(_start_, _stop_) \
@@ -151,6 +159,7 @@ typedef struct array_config
 {
     size_t item_size;
     size_t size;
+    allocator_t *allocator; /* Allocator for the array. NULL means the system allocator. */
 #if array_ALLOW_EQ_FN_OVERLOAD
     equal_fn_t equal_fn;
 #endif
@@ -267,13 +276,28 @@ void        list_ref_free     (list_ref_t *);
  * dynamically allocated buffer, which is re-
  * allocated as necessary.
  * 
- * Has amortized O(1) lookups and assocations, and
- * sub-O(n) insertions + deletions.
+ * The buffer is used as a ring: the items start
+ * at a head slot and wrap around its end, so that
+ * items can be added and removed at either end
+ * without moving the others, which makes the list
+ * usable as a queue or deque.
+ * 
+ * Has amortized O(1) lookups and assocations,
+ * amortized O(1) insertions + deletions at either
+ * end, and O(min(pos, size - pos)) elsewhere.
+ * 
+ * Lists made with an inline capacity keep that
+ * many items inside the list itself, and only
+ * allocate a buffer once they outgrow it, so that
+ * a small list costs a single allocation.
+ *
+ * Sorting first unwraps the items into
+ * consecutive slots, then sorts them in place
+ * with the kernels of sort.h.
  */
 
 #define arraylist_DEFAULT_CAP 10
-#define arraylist_SIZE_UP_RATIO 0.7
-#define arraylist_SIZE_DOWN_RATIO 0.3
+#define arraylist_SHRINK_DIVISOR 4 /* The buffer halves once at most 1 / arraylist_SHRINK_DIVISOR of it is used. */
 #define arraylist_ALLOW_EQ_FN_OVERLOAD true
 
 #define arraylist_t(type)     type *
@@ -290,12 +314,24 @@ void        list_ref_free     (list_ref_t *);
     ((arraylist_t(type))_arraylist_new_((arraylist_config_t){ \
         .item_size = sizeof(type), ##__VA_ARGS__}))
 
+#define arraylist_new_small(type, _n_, ...) \
+    (arraylist_new(type, .inline_capacity = (_n_), ##__VA_ARGS__))
+
 #define arraylist_get_config(list) \
     (_arraylist_get_config_((struct arraylist *)(list)))
 
 #define arraylist_is_empty(list) \
     (_arraylist_is_empty_((struct arraylist *)(list)))
 
+#define arraylist_capacity(list) \
+    (_arraylist_capacity_((struct arraylist *)(list)))
+
+#define arraylist_reserve(list, _capacity_) \
+    (_arraylist_reserve_((struct arraylist *)(list), (_capacity_)))
+
+#define arraylist_shrink_to_fit(list) \
+    (_arraylist_shrink_to_fit_((struct arraylist *)(list)))
+
 #define arraylist_contains(list, _item_)                         \
     ({                                                           \
         typeof((list)) item = (_item_);                          \
@@ -347,6 +383,52 @@ void        list_ref_free     (list_ref_t *);
             (void *)items);                        \
     })
 
+#define arraylist_insert_range(list, _pos_, _nitems_, _items_)                     \
+    ({                                                                             \
+        const typeof(*(list)) *range_items = (_items_);                            \
+        _arraylist_insert_range_((struct arraylist *)(list), (_pos_), (_nitems_),  \
+                                 (void *)range_items);                             \
+    })
+
+#define arraylist_remove_range(list, _pos_, _nitems_, _removed_)                   \
+    ({                                                                             \
+        typeof(*(list)) *range_removed = (_removed_);                              \
+        _arraylist_remove_range_((struct arraylist *)(list), (_pos_), (_nitems_),  \
+                                 range_removed);                                   \
+    })
+
+#define arraylist_splice(list, _pos_, _nremove_, _ninsert_, _items_)               \
+    ({                                                                             \
+        const typeof(*(list)) *range_items = (_items_);                            \
+        _arraylist_splice_((struct arraylist *)(list), (_pos_), (_nremove_),       \
+                           (_ninsert_), (void *)range_items);                      \
+    })
+
+#define arraylist_extend_from_buffer(list, _nitems_, _items_)                      \
+    ({                                                                             \
+        const typeof(*(list)) *range_items = (_items_);                            \
+        _arraylist_extend_from_buffer_((struct arraylist *)(list), (_nitems_),     \
+                                       (void *)range_items);                       \
+    })
+
+#define arraylist_contiguous(list) \
+    ((typeof((list)))_arraylist_contiguous_((struct arraylist *)(list)))
+
+#define arraylist_sort(list) \
+    (sort(arraylist_contiguous(list), arraylist_size(list)))
+
+#define arraylist_sort_by(list, _compare_fn_) \
+    (sort_buffer(arraylist_contiguous(list), arraylist_size(list), sizeof(*(list)), (_compare_fn_)))
+
+#define arraylist_stable_sort(list) \
+    (stable_sort(arraylist_contiguous(list), arraylist_size(list)))
+
+#define arraylist_stable_sort_by(list, _compare_fn_) \
+    (stable_sort_buffer(arraylist_contiguous(list), arraylist_size(list), sizeof(*(list)), (_compare_fn_)))
+
+#define arraylist_radix_sort(list) \
+    (radix_sort(arraylist_contiguous(list), arraylist_size(list)))
+
 #define arraylist_concat(list1, list2)                      \
     ({                                                      \
         $assert_same_type(                                  \
@@ -435,10 +517,19 @@ void        list_ref_free     (list_ref_t *);
 #define arraylist_ref_free(ref) \
     (_arraylist_ref_free_((struct arraylist_ref *)(ref)))
 
+typedef enum arraylist_growth
+{
+    ARRAYLIST_GROWTH_2X,
+    ARRAYLIST_GROWTH_1_5X /* Wastes less space, for more reallocations. */
+} arraylist_growth_t;
+
 typedef struct arraylist_config
 {
     size_t capacity;
     size_t item_size;
+    size_t inline_capacity;    /* Items held inside the list itself, before it spills to a buffer. */
+    arraylist_growth_t growth; /* Factor the buffer grows by when full. */
+    allocator_t *allocator; /* Allocator for the list and its buffer. NULL means the system allocator. */
 #if arraylist_ALLOW_EQ_FN_OVERLOAD
     equal_fn_t equal_fn;
 #endif
@@ -449,42 +540,50 @@ typedef struct eq_config
     equal_fn_t eq_fn;
 } eq_config_t;
 
-struct arraylist     *_arraylist_new_          (arraylist_config_t);
-arraylist_config_t    _arraylist_get_config_   (struct arraylist *);
-bool                  _arraylist_is_empty_     (struct arraylist *);
-bool                  _arraylist_contains_     (struct arraylist *, void *);
-size_t                _arraylist_size_         (struct arraylist *);
-void                 *_arraylist_at_           (struct arraylist *, int);
-void                 *_arraylist_get_first_    (struct arraylist *);
-void                 *_arraylist_get_last_	   (struct arraylist *);
-void                  _arraylist_add_          (struct arraylist *, void *);
-void                  _arraylist_add_front_    (struct arraylist *, void *);
-void                  _arraylist_add_back_     (struct arraylist *, void *);
-void                  _arraylist_add_at_       (struct arraylist *, long, void *);
-void                  _arraylist_add_all_      (struct arraylist *, size_t, void *);
-struct arraylist     *_arraylist_concat_       (struct arraylist *, struct arraylist *);
-size_t                _arraylist_pos_of_       (struct arraylist *, void *);
-void                 *_arraylist_remove_       (struct arraylist *, void *);
-void                 *_arraylist_remove_front_ (struct arraylist *);
-void                 *_arraylist_remove_back_  (struct arraylist *);
-void                 *_arraylist_remove_at_    (struct arraylist *, int);
-void                 *_arraylist_find_         (struct arraylist *, pred_fn_t);
-struct arraylist     *_arraylist_map_          (struct arraylist *, map_fn_t);
-struct arraylist     *_arraylist_filter_       (struct arraylist *, pred_fn_t);
-void                 *_arraylist_reduce_       (struct arraylist *, reduce_fn_t);
-bool                  _arraylist_equal_        (struct arraylist *, struct arraylist *, eq_config_t config);
-void                  _arraylist_free_         (struct arraylist *);
-
-struct arraylist_ref *_arraylist_ref_          (struct arraylist *);
-void                 *_arraylist_ref_get_item_ (struct arraylist_ref *);
-struct arraylist     *_arraylist_ref_get_list_ (struct arraylist_ref *);
-size_t                _arraylist_ref_get_pos_  (struct arraylist_ref *);
-bool                  _arraylist_ref_is_valid_ (struct arraylist_ref *);
-bool                  _arraylist_ref_has_prev_ (struct arraylist_ref *);
-bool                  _arraylist_ref_has_next_ (struct arraylist_ref *);
-void                 *_arraylist_ref_next_     (struct arraylist_ref *);
-void                 *_arraylist_ref_prev_     (struct arraylist_ref *);
-void                  _arraylist_ref_free_     (struct arraylist_ref *);
+struct arraylist     *_arraylist_new_                (arraylist_config_t);
+arraylist_config_t    _arraylist_get_config_         (struct arraylist *);
+bool                  _arraylist_is_empty_           (struct arraylist *);
+size_t                _arraylist_capacity_           (struct arraylist *);
+void                  _arraylist_reserve_            (struct arraylist *, size_t); /* Grows the buffer to hold at least the given number of items, and never shrinks below it. */
+void                  _arraylist_shrink_to_fit_      (struct arraylist *); /* Shrinks the buffer to the items it holds, and lets it shrink that far again. */
+bool                  _arraylist_contains_           (struct arraylist *, void *);
+size_t                _arraylist_size_               (struct arraylist *);
+void                 *_arraylist_at_                 (struct arraylist *, int);
+void                 *_arraylist_get_first_          (struct arraylist *);
+void                 *_arraylist_get_last_           (struct arraylist *);
+void                  _arraylist_add_                (struct arraylist *, void *);
+void                  _arraylist_add_front_          (struct arraylist *, void *);
+void                  _arraylist_add_back_           (struct arraylist *, void *);
+void                  _arraylist_add_at_             (struct arraylist *, long, void *);
+void                  _arraylist_add_all_            (struct arraylist *, size_t, void *);
+void                  _arraylist_insert_range_       (struct arraylist *, size_t pos, size_t nitems, void *); /* Inserts the items before pos, which may be the size, to append. */
+void                  _arraylist_remove_range_       (struct arraylist *, size_t pos, size_t nitems, void *removed); /* Copies the removed items into removed, unless it is NULL. */
+void                  _arraylist_splice_             (struct arraylist *, size_t pos, size_t nremove, size_t ninsert, void *); /* Replaces nremove items at pos with ninsert items. */
+void                  _arraylist_extend_from_buffer_ (struct arraylist *, size_t nitems, void *);
+void                 *_arraylist_contiguous_         (struct arraylist *); /* Moves the items to consecutive slots, if they wrap, and returns the first. */
+struct arraylist     *_arraylist_concat_             (struct arraylist *, struct arraylist *);
+size_t                _arraylist_pos_of_             (struct arraylist *, void *);
+void                 *_arraylist_remove_             (struct arraylist *, void *);
+void                 *_arraylist_remove_front_       (struct arraylist *);
+void                 *_arraylist_remove_back_        (struct arraylist *);
+void                 *_arraylist_remove_at_          (struct arraylist *, int);
+void                 *_arraylist_find_               (struct arraylist *, pred_fn_t);
+struct arraylist     *_arraylist_map_                (struct arraylist *, map_fn_t);
+struct arraylist     *_arraylist_filter_             (struct arraylist *, pred_fn_t);
+void                 *_arraylist_reduce_             (struct arraylist *, reduce_fn_t);
+bool                  _arraylist_equal_              (struct arraylist *, struct arraylist *, eq_config_t config);
+void                  _arraylist_free_               (struct arraylist *);
+
+struct arraylist_ref *_arraylist_ref_                (struct arraylist *);
+void                 *_arraylist_ref_get_item_       (struct arraylist_ref *);
+struct arraylist     *_arraylist_ref_get_list_       (struct arraylist_ref *);
+size_t                _arraylist_ref_get_pos_        (struct arraylist_ref *);
+bool                  _arraylist_ref_is_valid_       (struct arraylist_ref *);
+bool                  _arraylist_ref_has_prev_       (struct arraylist_ref *);
+bool                  _arraylist_ref_has_next_       (struct arraylist_ref *);
+void                 *_arraylist_ref_next_           (struct arraylist_ref *);
+void                 *_arraylist_ref_prev_           (struct arraylist_ref *);
+void                  _arraylist_ref_free_           (struct arraylist_ref *);
 
 /* ------------------- linkedlist -------------------
  * @implements list
@@ -666,6 +765,8 @@ void                  _arraylist_ref_free_     (struct arraylist_ref *);
 typedef struct linkedlist_config
 {
     size_t item_size;
+    bool pool_nodes; /* Allocate nodes from a node pool, released all at once on free. */
+    allocator_t *allocator; /* Allocator for the list and its nodes. NULL means the system allocator. */
 #if linkedlist_ALLOW_EQ_FN_OVERLOAD
     equal_fn_t equal_fn;
 #endif
@@ -769,11 +870,20 @@ void              map_ref_free       (map_ref_t *);
  * An implementation of map that uses a hash
  * table to store key-value pairs. Has O(1) 
  * lookups and assocations, with unsorted keys.
+ *
+ * Two engines are available through the config:
+ * the default chained table, which iterates in
+ * insertion order, and an open addressing table
+ * that keeps keys and values in flat slot arrays
+ * and probes a group of control bytes at a time,
+ * which iterates in an unspecified order.
  */
 
-#define hashmap_DEFAULT_CAP 10
+#define hashmap_DEFAULT_CAP 16 /* Capacities are always powers of two. */
 #define hashmap_SIZE_UP_RATIO 0.7
 #define hashmap_SIZE_DOWN_RATIO 0.3
+#define hashmap_REHASH_STEP 4
+#define hashmap_BATCH_SIZE 16 /* Keys whose lookups are overlapped by hashmap_get_many. */
 #define hashmap_ALLOW_HASH_FN_OVERLOAD true
 #define hashmap_ALLOW_KEY_EQ_FN_OVERLOAD true
 
@@ -789,7 +899,7 @@ void              map_ref_free       (map_ref_t *);
 
 #define hashmap_set_all(map, ...)                             \
     ({                                                        \
-        map_entry_t entries[] = (map_entry_t[]){__VA_ARGS__}; \
+        map_entry_t entries[] = {__VA_ARGS__};                \
         _hashmap_set_all_(                                    \
             map,                                              \
             sizeof(entries) / sizeof(map_entry_t),            \
@@ -799,9 +909,19 @@ void              map_ref_free       (map_ref_t *);
 typedef struct hashmap     hashmap_t;
 typedef struct hashmap_ref hashmap_ref_t;
 
+typedef enum hashmap_backend
+{
+    HASHMAP_BACKEND_CHAINED,
+    HASHMAP_BACKEND_OPEN_ADDRESSING
+} hashmap_backend_t;
+
 typedef struct hashmap_config
 {
     size_t capacity;
+    hashmap_backend_t backend;
+    bool incremental_rehash; /* Spread resizes of the chained engine across later operations. */
+    bool pool_nodes;         /* Allocate the chained engine's entries from a node pool. */
+    allocator_t *allocator;  /* Allocator for the map, its tables and entries. NULL means the system allocator. */
 #if hashmap_ALLOW_KEY_EQ_FN_OVERLOAD 
     equal_fn_t key_equal_fn;
 #endif
@@ -817,7 +937,10 @@ bool              hashmap_contains_key   (hashmap_t *, void *);
 bool              hashmap_contains_value (hashmap_t *, void *);
 size_t            hashmap_size           (hashmap_t *);
 void             *hashmap_get_at         (hashmap_t *, void *);
+void              hashmap_get_many       (hashmap_t *, size_t n, void *keys[n], void *values[n]);
+void              hashmap_contains_many  (hashmap_t *, size_t n, void *keys[n], bool found[n]);
 void              hashmap_set_at         (hashmap_t *, void *, void *);
+void              hashmap_reserve        (hashmap_t *, size_t);
 void             *hashmap_remove_at      (hashmap_t *, void *);
 void              _hashmap_set_all_      (hashmap_t *, size_t n, map_entry_t[n]);
 map_entry_t       hashmap_find           (hashmap_t *, bipred_fn_t);
@@ -845,9 +968,36 @@ void              hashmap_ref_free       (hashmap_ref_t *);
  * An implementation of map that uses a red-
  * black tree. Has O(log n) lookups and assoc-
  * iations, with sorted keys.
+ *
+ * A B+tree engine is available through the
+ * config. It keeps the keys of each node
+ * contiguous in nodes a few cache lines wide,
+ * so a lookup touches a handful of nodes
+ * instead of one per level of a binary tree,
+ * and links its leaves for in-order scans.
+ *
+ * A compact red-black tree engine keeps all
+ * of its nodes in one growable array, linked
+ * by 32-bit positions rather than pointers.
+ * Its nodes take a third less memory, with
+ * no allocation per entry, and keys inserted
+ * in order end up next to each other. It
+ * holds at most 2^31 - 2 entries.
+ *
+ * With order statistics enabled, red-black
+ * tree nodes also count their subtrees, so
+ * that finding the key at a position, or the
+ * position of a key, takes O(log n).
+ *
+ * Such maps, when they own their nodes one
+ * by one rather than through a pool, can also
+ * be split at a key and joined back together
+ * in O(log^2 n), moving nodes between maps.
  */
 
 #define treemap_ALLOW_KEY_CMP_FN_OVERLOAD true
+#define treemap_BTREE_INNER_KEYS 15 /* Separators per inner node, sized with the children to 256 bytes, which span 4 or 5 cache lines. */
+#define treemap_BTREE_LEAF_KEYS 14  /* Entries per leaf, sized with the sibling links to 256 bytes, which span 4 or 5 cache lines. */
 
 #define treemap(...)                         \
     ({                                       \
@@ -859,9 +1009,12 @@ void              hashmap_ref_free       (hashmap_ref_t *);
 #define treemap_new(...) \
     (_treemap_new_((treemap_config_t){__VA_ARGS__}))
 
+#define treemap_from_sorted(entries, n, ...) \
+    (_treemap_from_sorted_((n), (entries), (treemap_config_t){__VA_ARGS__}))
+
 #define treemap_set_all(map, ...)                             \
     ({                                                        \
-        map_entry_t entries[] = (map_entry_t[]){__VA_ARGS__}; \
+        map_entry_t entries[] = {__VA_ARGS__};                \
         _treemap_set_all_(                                    \
             map,                                              \
             sizeof(entries) / sizeof(map_entry_t),            \
@@ -871,12 +1024,24 @@ void              hashmap_ref_free       (hashmap_ref_t *);
 typedef struct treemap     treemap_t;
 typedef struct treemap_ref treemap_ref_t;
 
+typedef enum treemap_backend
+{
+    TREEMAP_BACKEND_RBTREE,
+    TREEMAP_BACKEND_BTREE,
+    TREEMAP_BACKEND_RBTREE_COMPACT
+} treemap_backend_t;
+
 typedef struct treemap_config
 {
     compare_fn_t key_compare_fn;
+    treemap_backend_t backend;
+    bool pool_nodes; /* Allocate nodes from a node pool, released all at once on free. The compact engine ignores it, having one array already. */
+    bool order_statistics; /* Keep subtree sizes in the nodes, for treemap_select and treemap_rank. Red-black tree engine only. */
+    allocator_t *allocator; /* Allocator for the map and its nodes. NULL means the system allocator. */
 } treemap_config_t;
 
 treemap_t        *_treemap_new_          (treemap_config_t);
+treemap_t        *_treemap_from_sorted_  (size_t n, map_entry_t[n], treemap_config_t); /* Builds a map from entries sorted by strictly increasing keys in O(n). A map with pool_nodes takes every node from one allocation. */
 treemap_config_t  treemap_get_config     (treemap_t *);
 bool              treemap_is_empty       (treemap_t *);
 bool              treemap_contains_key   (treemap_t *, void *);
@@ -885,24 +1050,93 @@ size_t            treemap_size           (treemap_t *);
 void             *treemap_get_at         (treemap_t *, void *);
 void              treemap_set_at         (treemap_t *, void *, void *);
 void             *treemap_remove_at      (treemap_t *, void *);
-void              _treemap_set_all_      (treemap_t *, size_t n, map_entry_t[n]);
+void              _treemap_set_all_      (treemap_t *, size_t n, map_entry_t[n]); /* Into an empty map, sorts the entries and builds the tree at once. */
 map_entry_t       treemap_find           (treemap_t *, bipred_fn_t);
+map_entry_t       treemap_first          (treemap_t *);                  /* The navigation functions return a zeroed entry if there is no such key. */
+map_entry_t       treemap_last           (treemap_t *);
+map_entry_t       treemap_floor          (treemap_t *, void *);          /* The entry with the greatest key less than or equal to the given one. */
+map_entry_t       treemap_ceiling        (treemap_t *, void *);          /* The entry with the least key greater than or equal to the given one. */
+map_entry_t       treemap_lower          (treemap_t *, void *);          /* The entry with the greatest key strictly less than the given one. */
+map_entry_t       treemap_higher         (treemap_t *, void *);          /* The entry with the least key strictly greater than the given one. */
+map_entry_t       treemap_select         (treemap_t *, long pos);        /* The entry at the given position in key order, negative positions counting from the end. Needs order statistics. */
+size_t            treemap_rank           (treemap_t *, void *);          /* The number of keys less than the given one, which need not be in the map. Needs order statistics. */
+void              treemap_split          (treemap_t *, void *key, treemap_t **lo, treemap_t **hi); /* Consumes the map, moving the keys below key to lo and the rest to hi. */
+treemap_t        *treemap_join           (treemap_t *lo, treemap_t *hi); /* Consumes both maps, where every key of lo is below every key of hi, and returns their union. */
 struct hashset   *treemap_keys           (treemap_t *);
 struct arraylist *treemap_values         (treemap_t *);
 bool              treemap_equal          (treemap_t *, treemap_t *);
 void              treemap_free           (treemap_t *);
 
 treemap_ref_t    *treemap_ref            (treemap_t *);
+treemap_ref_t    *treemap_range_ref      (treemap_t *, void *lo, void *hi); /* Iterates over the keys in [lo, hi), or returns NULL if there are none. */
 void             *treemap_ref_get_key    (treemap_ref_t *);
 void             *treemap_ref_get_value  (treemap_ref_t *);
 map_entry_t       treemap_ref_get_entry  (treemap_ref_t *);
 treemap_t        *treemap_ref_get_map    (treemap_ref_t *);
 size_t            treemap_ref_get_pos    (treemap_ref_t *);
 bool              treemap_ref_is_valid   (treemap_ref_t *);
+bool              treemap_ref_has_prev   (treemap_ref_t *);
 bool              treemap_ref_has_next   (treemap_ref_t *);
 map_entry_t       treemap_ref_next       (treemap_ref_t *);
+map_entry_t       treemap_ref_prev       (treemap_ref_t *);
 void              treemap_ref_free       (treemap_ref_t *);
 
+/* ------------- persistent treemap -----------
+ * A red-black tree map whose versions never
+ * change once made. Setting or removing a key
+ * returns a new version that copies only the
+ * O(log n) nodes on the path to the key, and
+ * shares every other node with the version it
+ * came from, so both stay valid side by side.
+ *
+ * Versions and nodes are reference counted:
+ * taking a snapshot of a version is O(1), and
+ * freeing a version releases whichever nodes
+ * no other version still shares. Counts are
+ * updated atomically, so versions may be read,
+ * iterated and freed from several threads at
+ * once without locks, provided the allocator
+ * may be called from any of them. Handing the
+ * latest version from a writer to its readers
+ * is left to the caller, e.g. under a mutex.
+ */
+
+#define ptreemap_new(...) \
+    (_ptreemap_new_((ptreemap_config_t){__VA_ARGS__}))
+
+typedef struct ptreemap     ptreemap_t;
+typedef struct ptreemap_ref ptreemap_ref_t;
+
+typedef struct ptreemap_config
+{
+    compare_fn_t key_compare_fn;
+    allocator_t *allocator; /* Allocator for the versions and their nodes. NULL means the system allocator. */
+} ptreemap_config_t;
+
+ptreemap_t       *_ptreemap_new_          (ptreemap_config_t);
+ptreemap_t       *ptreemap_snapshot       (ptreemap_t *);                 /* Returns the same version, which must now be freed once more. */
+bool              ptreemap_is_empty       (ptreemap_t *);
+bool              ptreemap_contains_key   (ptreemap_t *, void *);
+size_t            ptreemap_size           (ptreemap_t *);
+void             *ptreemap_get_at         (ptreemap_t *, void *);
+ptreemap_t       *ptreemap_set_at         (ptreemap_t *, void *, void *); /* Returns a new version with the association, leaving the given one as it was. */
+ptreemap_t       *ptreemap_remove_at      (ptreemap_t *, void *);         /* Returns a new version without the key, leaving the given one as it was. */
+map_entry_t       ptreemap_first          (ptreemap_t *);                 /* Returns a zeroed entry if the map is empty. */
+map_entry_t       ptreemap_last           (ptreemap_t *);
+bool              ptreemap_equal          (ptreemap_t *, ptreemap_t *);
+void              ptreemap_free           (ptreemap_t *);                 /* Releases the version, and its nodes no other version shares. */
+
+ptreemap_ref_t   *ptreemap_ref            (ptreemap_t *);                 /* Holds a snapshot of the version until freed, or returns NULL if it is empty. */
+void             *ptreemap_ref_get_key    (ptreemap_ref_t *);
+void             *ptreemap_ref_get_value  (ptreemap_ref_t *);
+map_entry_t       ptreemap_ref_get_entry  (ptreemap_ref_t *);
+ptreemap_t       *ptreemap_ref_get_map    (ptreemap_ref_t *);
+size_t            ptreemap_ref_get_pos    (ptreemap_ref_t *);
+bool              ptreemap_ref_is_valid   (ptreemap_ref_t *);
+bool              ptreemap_ref_has_next   (ptreemap_ref_t *);
+map_entry_t       ptreemap_ref_next       (ptreemap_ref_t *);
+void              ptreemap_ref_free       (ptreemap_ref_t *);
+
 #if POLYMORPHIC_DS
 
 /* -------------------- set -------------------
@@ -986,6 +1220,9 @@ typedef struct hashset_ref hashset_ref_t;
 
 typedef struct hashset_config
 {
+    hashmap_backend_t backend;
+    bool pool_nodes;
+    allocator_t *allocator;
 #if hashmap_ALLOW_KEY_EQ_FN_OVERLOAD
     equal_fn_t equal_fn;
 #endif
@@ -1042,10 +1279,13 @@ void              hashset_ref_free     (hashset_ref_t *);
 #define treeset_new(...) \
     (_treeset_new_((treeset_config_t){__VA_ARGS__}))
 
+#define treeset_from_sorted(items, n, ...) \
+    (_treeset_from_sorted_((n), (items), (treeset_config_t){__VA_ARGS__}))
+
 #define treeset_add_all(set, ...)           \
     ({                                      \
         void *items[] = {__VA_ARGS__};      \
-        treeset_add_all(                    \
+        _treeset_add_all_(                  \
             set,                            \
             sizeof(items) / sizeof(void *), \
             items);                         \
@@ -1056,12 +1296,17 @@ typedef struct treeset_ref treeset_ref_t;
 
 typedef struct treeset_config
 {
+    treemap_backend_t backend;
+    bool pool_nodes;
+    bool order_statistics;
+    allocator_t *allocator;
 #if treemap_ALLOW_KEY_CMP_FN_OVERLOAD
     compare_fn_t compare_fn;
 #endif
 } treeset_config_t;
 
 treeset_t        *_treeset_new_        (treeset_config_t);
+treeset_t        *_treeset_from_sorted_(size_t n, void *[n], treeset_config_t); /* Builds a set from items in strictly increasing order in O(n). */
 treeset_config_t  treeset_get_config   (treeset_t *);
 size_t            treeset_size         (treeset_t *);
 bool              treeset_is_empty     (treeset_t *);
@@ -1072,7 +1317,14 @@ void             *treeset_remove       (treeset_t *, void *);
 treeset_t        *treeset_union        (treeset_t *, treeset_t *);
 treeset_t        *treeset_intersection (treeset_t *, treeset_t *);
 treeset_t        *treeset_difference   (treeset_t *, treeset_t *);
+void              treeset_union_into   (treeset_t *, treeset_t *);     /* Adds every item of the second set to the first. */
+void              treeset_retain_all   (treeset_t *, treeset_t *);     /* Removes the items of the first set missing from the second. */
+void              treeset_remove_all   (treeset_t *, treeset_t *);     /* Removes the items of the first set found in the second. */
+void              treeset_split        (treeset_t *, void *item, treeset_t **lo, treeset_t **hi);
+treeset_t        *treeset_join         (treeset_t *lo, treeset_t *hi);
 bool              treeset_is_subset    (treeset_t *, treeset_t *subset);
+void             *treeset_select       (treeset_t *, long pos);
+size_t            treeset_rank         (treeset_t *, void *);
 void             *treeset_find         (treeset_t *, pred_fn_t);
 treeset_t        *treeset_map          (treeset_t *, map_fn_t);
 treeset_t        *treeset_filter       (treeset_t *, pred_fn_t);
@@ -1085,6 +1337,8 @@ void             *treeset_ref_get_item (treeset_ref_t *);
 treeset_t        *treeset_ref_get_set  (treeset_ref_t *);
 size_t            treeset_ref_get_pos  (treeset_ref_t *);
 bool              treeset_ref_is_valid (treeset_ref_t *);
+bool              treeset_ref_has_prev (treeset_ref_t *);
 bool              treeset_ref_has_next (treeset_ref_t *);
 void             *treeset_ref_next     (treeset_ref_t *);
+void             *treeset_ref_prev     (treeset_ref_t *);
 void              treeset_ref_free     (treeset_ref_t *);
\ No newline at end of file
@@ -1,13 +1,108 @@
+#include <stdint.h>
 #include "functions.h"
 
-size_t _hash_(size_t nitems, const void *items[nitems])
+/* A multiply-and-fold byte hasher. The secrets and the read loops
+ * follow wyhash (final version 4), which is in the public domain, but
+ * the finalization differs, so its output does not match wyhash's. */
+
+#define hash_SECRET0 0xa0761d6478bd642full
+#define hash_SECRET1 0xe7037ed1a0b428dbull
+#define hash_SECRET2 0x8ebc6af09c88c6e3ull
+#define hash_SECRET3 0x589965cc75374cc3ull
+
+static inline uint64_t hash_mum(uint64_t a, uint64_t b)
 {
-    size_t hash = 89389;
+    __uint128_t r = (__uint128_t)a * b;
+    return (uint64_t)r ^ (uint64_t)(r >> 64);
+}
 
-    for (int i = 0; i < nitems; i++)
-        hash = ((hash << 5) + hash) + (size_t)items[i];
+static inline uint64_t hash_read64(const uint8_t *p)
+{
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
 
-    return hash;
+static inline uint64_t hash_read32(const uint8_t *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+size_t hash_mix(size_t x)
+{
+    uint64_t h = x;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ull;
+    h ^= h >> 33;
+    return h;
+}
+
+/* Tables index by the low bits of a hash, and user hashes may only vary
+ * in their high bits, so even those go through the full finalizer. */
+size_t hash_key(hash_fn_t hash_fn, const void *key)
+{
+    return hash_mix(hash_fn != NULL ? hash_fn(key) : (size_t)key);
+}
+
+size_t hash_bytes(const void *data, size_t nbytes)
+{
+    const uint8_t *p = data;
+    uint64_t seed = hash_mum(hash_SECRET0, hash_SECRET1);
+    uint64_t a, b;
+
+    if (nbytes <= 16)
+    {
+        if (nbytes >= 4)
+        {
+            size_t offset = (nbytes >> 3) << 2;
+            a = (hash_read32(p) << 32) | hash_read32(p + offset);
+            b = (hash_read32(p + nbytes - 4) << 32) | hash_read32(p + nbytes - 4 - offset);
+        }
+        else if (nbytes > 0)
+        {
+            a = ((uint64_t)p[0] << 16) | ((uint64_t)p[nbytes >> 1] << 8) | p[nbytes - 1];
+            b = 0;
+        }
+        else
+            a = b = 0;
+    }
+    else
+    {
+        size_t i = nbytes;
+
+        if (i > 48)
+        {
+            uint64_t seed1 = seed, seed2 = seed;
+
+            do
+            {
+                seed = hash_mum(hash_read64(p) ^ hash_SECRET1, hash_read64(p + 8) ^ seed);
+                seed1 = hash_mum(hash_read64(p + 16) ^ hash_SECRET2, hash_read64(p + 24) ^ seed1);
+                seed2 = hash_mum(hash_read64(p + 32) ^ hash_SECRET3, hash_read64(p + 40) ^ seed2);
+                p += 48;
+                i -= 48;
+            } while (i > 48);
+
+            seed ^= seed1 ^ seed2;
+        }
+
+        for (; i > 16; p += 16, i -= 16)
+            seed = hash_mum(hash_read64(p) ^ hash_SECRET1, hash_read64(p + 8) ^ seed);
+
+        a = hash_read64(p + i - 16);
+        b = hash_read64(p + i - 8);
+    }
+
+    return hash_mum(hash_SECRET1 ^ nbytes, hash_mum(a ^ hash_SECRET1, b ^ seed));
+}
+
+size_t _hash_(size_t nitems, const void *items[nitems])
+{
+    return hash_bytes(items, nitems * sizeof(void *));
 }
 
 size_t identity_hash(const void *item)
@@ -15,6 +110,11 @@ size_t identity_hash(const void *item)
     return (size_t)item;
 }
 
+size_t ptrhash(const void *item)
+{
+    return hash_mix((size_t)item);
+}
+
 bool streq(const void *s1, const void *s2) 
 {
     return strcmp((char *)s1, (char *)s2) == 0;
@@ -22,12 +122,5 @@ bool streq(const void *s1, const void *s2)
 
 size_t strhash(const void *s)
 {
-    size_t hash = 53812;
-    const char *str = s;
-    char c;
-
-    while ((c = *str++))
-        hash = ((hash << 5) + hash) + c;
-
-    return hash;
-}
\ No newline at end of file
+    return hash_bytes(s, strlen(s));
+}
@@ -60,6 +60,11 @@ typedef void   *(*reduce_fn_t)   (const void *, const void *);
     })
 size_t _hash_        (size_t n, const void *[n]);
 
+size_t hash_mix      (size_t);                    /* Finalizes an integer into a hash whose every bit depends on every input bit. */
+size_t hash_key      (hash_fn_t, const void *); /* Hashes a key for a table: the hash function's result, or the key itself if it is NULL, through hash_mix. */
+size_t hash_bytes    (const void *, size_t nbytes); /* Hashes a byte buffer with a multiply-and-fold hasher. */
+
 size_t identity_hash (const void *);
+size_t ptrhash       (const void *);
 bool   streq         (const void *, const void *);
 size_t strhash       (const void *);
\ No newline at end of file
@@ -0,0 +1,87 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <limits.h>
+#include "sort.h"
+#include "functions.h"
+#include "debug.h"
+
+/* ------------------------------------------------------------- */
+/*                  ---------- kernels ----------                */
+/* ------------------------------------------------------------- */
+
+/* NaN compares unordered with everything, which would let a partition
+   scan run off the end of the buffer, so NaNs are ordered after every
+   number instead. */
+#define sort_LESS_NAN_LAST(a, b) (*(a) < *(b) || (*(b) != *(b) && *(a) == *(a)))
+
+sort_DEFINE(int,      int,           *a < *b)
+sort_DEFINE(long,     long,          *a < *b)
+sort_DEFINE(unsigned, unsigned,      *a < *b)
+sort_DEFINE(ulong,    unsigned long, *a < *b)
+sort_DEFINE(float,    float,         sort_LESS_NAN_LAST(a, b))
+sort_DEFINE(double,   double,        sort_LESS_NAN_LAST(a, b))
+
+sort_DEFINE_RADIX(int,      int,           unsigned,      1u << (sizeof(int) * CHAR_BIT - 1))
+sort_DEFINE_RADIX(long,     long,          unsigned long, 1ul << (sizeof(long) * CHAR_BIT - 1))
+sort_DEFINE_RADIX(unsigned, unsigned,      unsigned,      0)
+sort_DEFINE_RADIX(ulong,    unsigned long, unsigned long, 0)
+
+/* ------------------------------------------------------------- */
+/*                  ---------- buffers ----------                */
+/* ------------------------------------------------------------- */
+
+struct sort_context
+{
+    size_t item_size;
+    compare_fn_t compare_fn;
+};
+
+/* Defines kernels ordered by the context's comparison function, over
+   items of size bytes. */
+#define sort_DEFINE_COMPARE(name, tmp_t, size)                                         \
+    static inline size_t _sort_##name##_size(const void *context)                      \
+    {                                                                                  \
+        return (size);                                                                 \
+    }                                                                                  \
+                                                                                       \
+    static inline bool _sort_##name##_less(const void *a, const void *b,               \
+                                           const void *context)                        \
+    {                                                                                  \
+        return ((const struct sort_context *)context)->compare_fn(a, b) < 0;           \
+    }                                                                                  \
+                                                                                       \
+    _sort_DEFINE_KERNELS_(_sort_##name, tmp_t)
+
+/* Items of the common sizes are moved as whole words, rather than by a
+   memcpy of a size only known at run time. */
+sort_DEFINE_COMPARE(buffer4, uint32_t,    sizeof(uint32_t))
+sort_DEFINE_COMPARE(buffer8, uint64_t,    sizeof(uint64_t))
+sort_DEFINE_COMPARE(buffer,  max_align_t, ((const struct sort_context *)context)->item_size)
+
+void sort_buffer(void *items, size_t n, size_t item_size, compare_fn_t compare_fn)
+{
+    struct sort_context context = {.item_size = item_size, .compare_fn = compare_fn};
+
+    if (item_size == sizeof(uint32_t))
+        _sort_buffer4_pdqsort(items, n, &context);
+    else if (item_size == sizeof(uint64_t))
+        _sort_buffer8_pdqsort(items, n, &context);
+    else
+        _sort_buffer_pdqsort(items, n, &context);
+}
+
+void stable_sort_buffer(void *items, size_t n, size_t item_size, compare_fn_t compare_fn)
+{
+    struct sort_context context = {.item_size = item_size, .compare_fn = compare_fn};
+    uint8_t *scratch = malloc(max(n / 2, (size_t)1) * item_size);
+
+    if (item_size == sizeof(uint32_t))
+        _sort_buffer4_timsort(items, n, scratch, &context);
+    else if (item_size == sizeof(uint64_t))
+        _sort_buffer8_timsort(items, n, scratch, &context);
+    else
+        _sort_buffer_timsort(items, n, scratch, &context);
+
+    free(scratch);
+}
@@ -0,0 +1,685 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include "functions.h"
+
+/* ------------------ sort --------------------
+ * Sorts for flat buffers of items. sort_* is a
+ * pattern-defeating quicksort: an introsort that
+ * detects already sorted runs and runs of equal
+ * items in linear time, and falls back to heap
+ * sort if partitions keep coming out unbalanced.
+ * It is not stable and allocates nothing.
+ * stable_sort_* is a timsort: it merges natural
+ * runs, so nearly sorted input is close to
+ * linear, and needs n / 2 items of scratch.
+ * radix_sort_* is an LSD radix sort on integer
+ * keys, a byte at a time, which skips bytes
+ * every key shares. It is stable and needs n
+ * items of scratch.
+ *
+ * sort_DEFINE generates both comparison sorts
+ * for a type and an ordering, so that the
+ * comparison and the item moves are inlined
+ * rather than made through a function pointer
+ * and memcpy. Kernels for the primitive types
+ * are defined in sort.c, and sort, stable_sort
+ * and radix_sort pick one from the item type.
+ * sort_buffer and stable_sort_buffer take any
+ * item size and a compare_fn_t, like qsort.
+ */
+
+#define sort_INSERTION_THRESHOLD     24  /* Partitions smaller than this are insertion sorted. */
+#define sort_NINTHER_THRESHOLD       128 /* Partitions larger than this pick the median of three medians as a pivot. */
+#define sort_PARTIAL_INSERTION_LIMIT 8   /* Items an already partitioned partition may move before it is partitioned again. */
+#define sort_RADIX_THRESHOLD         256 /* Buffers smaller than this are comparison sorted by radix_sort. */
+#define sort_MAX_RUNS                128 /* Bounds the pending runs of a stable sort, which grow in length like Fibonacci numbers. */
+
+/* The number of tmp_t it takes to hold an item of size bytes. */
+#define sort_TMP_LENGTH(tmp_t, size) (((size) + sizeof(tmp_t) - 1) / sizeof(tmp_t))
+
+struct sort_run
+{
+    size_t start;
+    size_t length;
+};
+
+/* The length runs are extended to, so that the number of runs is at, or
+   just under, a power of two and the merges stay balanced. */
+static inline size_t sort_min_run(size_t n)
+{
+    size_t odd = 0;
+    while (n >= 64)
+    {
+        odd |= n & 1;
+        n >>= 1;
+    }
+    return n + odd;
+}
+
+/* Defines the sort kernels over items of name##_size(context) bytes in
+   order by name##_less(a, b, context). Items are moved through arrays of
+   tmp_t, which must be aligned for the item type. */
+#define _sort_DEFINE_KERNELS_(name, tmp_t)                                                                                                  \
+static inline uint8_t *name##_at(uint8_t *base, size_t pos, const void *context)                                                            \
+{                                                                                                                                           \
+    return base + pos * name##_size(context);                                                                                               \
+}                                                                                                                                           \
+                                                                                                                                            \
+static inline void name##_swap(uint8_t *first, uint8_t *second, const void *context)                                                        \
+{                                                                                                                                           \
+    size_t size = name##_size(context);                                                                                                     \
+    tmp_t tmp[sort_TMP_LENGTH(tmp_t, size)];                                                                                                \
+                                                                                                                                            \
+    memcpy(tmp, first, size);                                                                                                               \
+    memcpy(first, second, size);                                                                                                            \
+    memcpy(second, tmp, size);                                                                                                              \
+}                                                                                                                                           \
+                                                                                                                                            \
+static inline void name##_sort2(uint8_t *first, uint8_t *second, const void *context)                                                       \
+{                                                                                                                                           \
+    if (name##_less(second, first, context))                                                                                                \
+        name##_swap(first, second, context);                                                                                                \
+}                                                                                                                                           \
+                                                                                                                                            \
+static inline void name##_sort3(uint8_t *first, uint8_t *second, uint8_t *third, const void *context)                                       \
+{                                                                                                                                           \
+    name##_sort2(first, second, context);                                                                                                   \
+    name##_sort2(second, third, context);                                                                                                   \
+    name##_sort2(first, second, context);                                                                                                   \
+}                                                                                                                                           \
+                                                                                                                                            \
+static void name##_insertion_sort(uint8_t *base, size_t n, const void *context)                                                             \
+{                                                                                                                                           \
+    size_t size = name##_size(context);                                                                                                     \
+    tmp_t tmp[sort_TMP_LENGTH(tmp_t, size)];                                                                                                \
+                                                                                                                                            \
+    for (size_t i = 1; i < n; i++)                                                                                                          \
+    {                                                                                                                                       \
+        uint8_t *item = base + i * size;                                                                                                    \
+        if (!name##_less(item, item - size, context))                                                                                       \
+            continue;                                                                                                                       \
+                                                                                                                                            \
+        memcpy(tmp, item, size);                                                                                                            \
+        do                                                                                                                                  \
+        {                                                                                                                                   \
+            memcpy(item, item - size, size);                                                                                                \
+            item -= size;                                                                                                                   \
+        } while (item > base && name##_less(tmp, item - size, context));                                                                    \
+        memcpy(item, tmp, size);                                                                                                            \
+    }                                                                                                                                       \
+}                                                                                                                                           \
+                                                                                                                                            \
+/* Insertion sorts, but gives up once it has moved too many items. */                                                                       \
+static bool name##_partial_insertion_sort(uint8_t *base, size_t n, const void *context)                                                     \
+{                                                                                                                                           \
+    size_t size = name##_size(context);                                                                                                     \
+    tmp_t tmp[sort_TMP_LENGTH(tmp_t, size)];                                                                                                \
+    size_t moved = 0;                                                                                                                       \
+                                                                                                                                            \
+    for (size_t i = 1; i < n; i++)                                                                                                          \
+    {                                                                                                                                       \
+        uint8_t *item = base + i * size;                                                                                                    \
+        if (!name##_less(item, item - size, context))                                                                                       \
+            continue;                                                                                                                       \
+                                                                                                                                            \
+        memcpy(tmp, item, size);                                                                                                            \
+        do                                                                                                                                  \
+        {                                                                                                                                   \
+            memcpy(item, item - size, size);                                                                                                \
+            item -= size;                                                                                                                   \
+            moved++;                                                                                                                        \
+        } while (item > base && name##_less(tmp, item - size, context));                                                                    \
+        memcpy(item, tmp, size);                                                                                                            \
+                                                                                                                                            \
+        if (moved > sort_PARTIAL_INSERTION_LIMIT)                                                                                           \
+            return false;                                                                                                                   \
+    }                                                                                                                                       \
+                                                                                                                                            \
+    return true;                                                                                                                            \
+}                                                                                                                                           \
+                                                                                                                                            \
+static void name##_sift_down(uint8_t *base, size_t root, size_t n, const void *context)                                                     \
+{                                                                                                                                           \
+    while (2 * root + 1 < n)                                                                                                                \
+    {                                                                                                                                       \
+        size_t child = 2 * root + 1;                                                                                                        \
+        if (child + 1 < n && name##_less(name##_at(base, child, context), name##_at(base, child + 1, context), context))                    \
+            child++;                                                                                                                        \
+        if (!name##_less(name##_at(base, root, context), name##_at(base, child, context), context))                                         \
+            return;                                                                                                                         \
+                                                                                                                                            \
+        name##_swap(name##_at(base, root, context), name##_at(base, child, context), context);                                              \
+        root = child;                                                                                                                       \
+    }                                                                                                                                       \
+}                                                                                                                                           \
+                                                                                                                                            \
+static void name##_heapsort(uint8_t *base, size_t n, const void *context)                                                                   \
+{                                                                                                                                           \
+    for (size_t i = n / 2; i-- > 0;)                                                                                                        \
+        name##_sift_down(base, i, n, context);                                                                                              \
+                                                                                                                                            \
+    for (size_t end = n; end-- > 1;)                                                                                                        \
+    {                                                                                                                                       \
+        name##_swap(base, name##_at(base, end, context), context);                                                                          \
+        name##_sift_down(base, 0, end, context);                                                                                            \
+    }                                                                                                                                       \
+}                                                                                                                                           \
+                                                                                                                                            \
+/* Partitions around the pivot at base[0], with items equal to it going                                                                     \
+   right, and returns where the pivot ends up. The median-of-three pivot                                                                    \
+   choice guarantees an item on each side that stops the scans. */                                                                          \
+static size_t name##_partition_right(uint8_t *base, size_t n, bool *already_partitioned, const void *context)                               \
+{                                                                                                                                           \
+    size_t size = name##_size(context);                                                                                                     \
+    tmp_t pivot[sort_TMP_LENGTH(tmp_t, size)];                                                                                              \
+    size_t first = 0, last = n;                                                                                                             \
+                                                                                                                                            \
+    memcpy(pivot, base, size);                                                                                                              \
+                                                                                                                                            \
+    while (name##_less(name##_at(base, ++first, context), pivot, context))                                                                  \
+        ;                                                                                                                                   \
+    if (first == 1)                                                                                                                         \
+        while (first < last && !name##_less(name##_at(base, --last, context), pivot, context))                                              \
+            ;                                                                                                                               \
+    else                                                                                                                                    \
+        while (!name##_less(name##_at(base, --last, context), pivot, context))                                                              \
+            ;                                                                                                                               \
+                                                                                                                                            \
+    *already_partitioned = first >= last;                                                                                                   \
+                                                                                                                                            \
+    while (first < last)                                                                                                                    \
+    {                                                                                                                                       \
+        name##_swap(name##_at(base, first, context), name##_at(base, last, context), context);                                              \
+        while (name##_less(name##_at(base, ++first, context), pivot, context))                                                              \
+            ;                                                                                                                               \
+        while (!name##_less(name##_at(base, --last, context), pivot, context))                                                              \
+            ;                                                                                                                               \
+    }                                                                                                                                       \
+                                                                                                                                            \
+    memcpy(base, name##_at(base, first - 1, context), size);                                                                                \
+    memcpy(name##_at(base, first - 1, context), pivot, size);                                                                               \
+    return first - 1;                                                                                                                       \
+}                                                                                                                                           \
+                                                                                                                                            \
+/* Partitions around the pivot at base[0], with items equal to it going                                                                     \
+   left. Used when the pivot equals the one bounding the items on the left,                                                                 \
+   which puts every item equal to it in its final place at once. */                                                                         \
+static size_t name##_partition_left(uint8_t *base, size_t n, const void *context)                                                           \
+{                                                                                                                                           \
+    size_t size = name##_size(context);                                                                                                     \
+    tmp_t pivot[sort_TMP_LENGTH(tmp_t, size)];                                                                                              \
+    size_t first = 0, last = n;                                                                                                             \
+                                                                                                                                            \
+    memcpy(pivot, base, size);                                                                                                              \
+                                                                                                                                            \
+    while (name##_less(pivot, name##_at(base, --last, context), context))                                                                   \
+        ;                                                                                                                                   \
+    if (last + 1 == n)                                                                                                                      \
+        while (first < last && !name##_less(pivot, name##_at(base, ++first, context), context))                                             \
+            ;                                                                                                                               \
+    else                                                                                                                                    \
+        while (!name##_less(pivot, name##_at(base, ++first, context), context))                                                             \
+            ;                                                                                                                               \
+                                                                                                                                            \
+    while (first < last)                                                                                                                    \
+    {                                                                                                                                       \
+        name##_swap(name##_at(base, first, context), name##_at(base, last, context), context);                                              \
+        while (name##_less(pivot, name##_at(base, --last, context), context))                                                               \
+            ;                                                                                                                               \
+        while (!name##_less(pivot, name##_at(base, ++first, context), context))                                                             \
+            ;                                                                                                                               \
+    }                                                                                                                                       \
+                                                                                                                                            \
+    memcpy(base, name##_at(base, last, context), size);                                                                                     \
+    memcpy(name##_at(base, last, context), pivot, size);                                                                                    \
+    return last;                                                                                                                            \
+}                                                                                                                                           \
+                                                                                                                                            \
+/* Swaps a few items around the ends of a partition that came out badly                                                                     \
+   unbalanced, so that the next pivots avoid the same pattern. */                                                                           \
+static void name##_break_patterns(uint8_t *base, size_t n, const void *context)                                                             \
+{                                                                                                                                           \
+    if (n < sort_INSERTION_THRESHOLD)                                                                                                       \
+        return;                                                                                                                             \
+                                                                                                                                            \
+    size_t quarter = n / 4;                                                                                                                 \
+    name##_swap(base, name##_at(base, quarter, context), context);                                                                          \
+    name##_swap(name##_at(base, n - 1, context), name##_at(base, n - quarter, context), context);                                           \
+                                                                                                                                            \
+    if (n > sort_NINTHER_THRESHOLD)                                                                                                         \
+    {                                                                                                                                       \
+        name##_swap(name##_at(base, 1, context), name##_at(base, quarter + 1, context), context);                                           \
+        name##_swap(name##_at(base, 2, context), name##_at(base, quarter + 2, context), context);                                           \
+        name##_swap(name##_at(base, n - 2, context), name##_at(base, n - quarter - 1, context), context);                                   \
+        name##_swap(name##_at(base, n - 3, context), name##_at(base, n - quarter - 2, context), context);                                   \
+    }                                                                                                                                       \
+}                                                                                                                                           \
+                                                                                                                                            \
+static void name##_pdqsort_loop(uint8_t *base, size_t n, unsigned bad_allowed, bool leftmost, const void *context)                          \
+{                                                                                                                                           \
+    size_t size = name##_size(context);                                                                                                     \
+                                                                                                                                            \
+    while (n >= sort_INSERTION_THRESHOLD)                                                                                                   \
+    {                                                                                                                                       \
+        size_t half = n / 2;                                                                                                                \
+        if (n > sort_NINTHER_THRESHOLD)                                                                                                     \
+        {                                                                                                                                   \
+            name##_sort3(base, name##_at(base, half, context), name##_at(base, n - 1, context), context);                                   \
+            name##_sort3(name##_at(base, 1, context), name##_at(base, half - 1, context), name##_at(base, n - 2, context), context);        \
+            name##_sort3(name##_at(base, 2, context), name##_at(base, half + 1, context), name##_at(base, n - 3, context), context);        \
+            name##_sort3(name##_at(base, half - 1, context), name##_at(base, half, context), name##_at(base, half + 1, context), context);  \
+            name##_swap(base, name##_at(base, half, context), context);                                                                     \
+        }                                                                                                                                   \
+        else                                                                                                                                \
+        {                                                                                                                                   \
+            name##_sort3(name##_at(base, half, context), base, name##_at(base, n - 1, context), context);                                   \
+        }                                                                                                                                   \
+                                                                                                                                            \
+        /* The item before a partition that is not leftmost is the pivot                                                                    \
+           that bounds it, so a pivot equal to it is the smallest item. */                                                                  \
+        if (!leftmost && !name##_less(base - size, base, context))                                                                          \
+        {                                                                                                                                   \
+            size_t pivot_pos = name##_partition_left(base, n, context);                                                                     \
+            base = name##_at(base, pivot_pos + 1, context);                                                                                 \
+            n -= pivot_pos + 1;                                                                                                             \
+            continue;                                                                                                                       \
+        }                                                                                                                                   \
+                                                                                                                                            \
+        bool already_partitioned;                                                                                                           \
+        size_t pivot_pos = name##_partition_right(base, n, &already_partitioned, context);                                                  \
+        size_t left_n = pivot_pos, right_n = n - pivot_pos - 1;                                                                             \
+        uint8_t *right = name##_at(base, pivot_pos + 1, context);                                                                           \
+                                                                                                                                            \
+        if (left_n < n / 8 || right_n < n / 8)                                                                                              \
+        {                                                                                                                                   \
+            if (--bad_allowed == 0)                                                                                                         \
+            {                                                                                                                               \
+                name##_heapsort(base, n, context);                                                                                          \
+                return;                                                                                                                     \
+            }                                                                                                                               \
+            name##_break_patterns(base, left_n, context);                                                                                   \
+            name##_break_patterns(right, right_n, context);                                                                                 \
+        }                                                                                                                                   \
+        else if (already_partitioned &&                                                                                                     \
+                 name##_partial_insertion_sort(base, left_n, context) &&                                                                    \
+                 name##_partial_insertion_sort(right, right_n, context))                                                                    \
+        {                                                                                                                                   \
+            return;                                                                                                                         \
+        }                                                                                                                                   \
+                                                                                                                                            \
+        /* Recursing into the smaller side bounds the stack to O(log n). */                                                                 \
+        if (left_n < right_n)                                                                                                               \
+        {                                                                                                                                   \
+            name##_pdqsort_loop(base, left_n, bad_allowed, leftmost, context);                                                              \
+            base = right;                                                                                                                   \
+            n = right_n;                                                                                                                    \
+            leftmost = false;                                                                                                               \
+        }                                                                                                                                   \
+        else                                                                                                                                \
+        {                                                                                                                                   \
+            name##_pdqsort_loop(right, right_n, bad_allowed, false, context);                                                               \
+            n = left_n;                                                                                                                     \
+        }                                                                                                                                   \
+    }                                                                                                                                       \
+                                                                                                                                            \
+    name##_insertion_sort(base, n, context);                                                                                                \
+}                                                                                                                                           \
+                                                                                                                                            \
+static void name##_pdqsort(uint8_t *base, size_t n, const void *context)                                                                    \
+{                                                                                                                                           \
+    if (n < 2)                                                                                                                              \
+        return;                                                                                                                             \
+    name##_pdqsort_loop(base, n, 64 - __builtin_clzl(n), true, context);                                                                    \
+}                                                                                                                                           \
+                                                                                                                                            \
+static void name##_reverse(uint8_t *base, size_t n, const void *context)                                                                    \
+{                                                                                                                                           \
+    for (size_t i = 0; i < n / 2; i++)                                                                                                      \
+        name##_swap(name##_at(base, i, context), name##_at(base, n - 1 - i, context), context);                                             \
+}                                                                                                                                           \
+                                                                                                                                            \
+/* The length of the run at the start of base, reversing it if it is                                                                        \
+   strictly descending, which keeps equal items in order. */                                                                                \
+static size_t name##_count_run(uint8_t *base, size_t n, const void *context)                                                                \
+{                                                                                                                                           \
+    if (n < 2)                                                                                                                              \
+        return n;                                                                                                                           \
+                                                                                                                                            \
+    size_t end = 2;                                                                                                                         \
+    if (name##_less(name##_at(base, 1, context), base, context))                                                                            \
+    {                                                                                                                                       \
+        while (end < n && name##_less(name##_at(base, end, context), name##_at(base, end - 1, context), context))                           \
+            end++;                                                                                                                          \
+        name##_reverse(base, end, context);                                                                                                 \
+    }                                                                                                                                       \
+    else                                                                                                                                    \
+    {                                                                                                                                       \
+        while (end < n && !name##_less(name##_at(base, end, context), name##_at(base, end - 1, context), context))                          \
+            end++;                                                                                                                          \
+    }                                                                                                                                       \
+                                                                                                                                            \
+    return end;                                                                                                                             \
+}                                                                                                                                           \
+                                                                                                                                            \
+/* Extends the sorted base[0, sorted) to base[0, n), inserting each item                                                                    \
+   after any equal ones. */                                                                                                                 \
+static void name##_binary_insertion_sort(uint8_t *base, size_t sorted, size_t n, const void *context)                                       \
+{                                                                                                                                           \
+    size_t size = name##_size(context);                                                                                                     \
+    tmp_t tmp[sort_TMP_LENGTH(tmp_t, size)];                                                                                                \
+                                                                                                                                            \
+    for (size_t i = sorted; i < n; i++)                                                                                                     \
+    {                                                                                                                                       \
+        memcpy(tmp, name##_at(base, i, context), size);                                                                                     \
+                                                                                                                                            \
+        size_t low = 0, high = i;                                                                                                           \
+        while (low < high)                                                                                                                  \
+        {                                                                                                                                   \
+            size_t mid = low + (high - low) / 2;                                                                                            \
+            if (name##_less(tmp, name##_at(base, mid, context), context))                                                                   \
+                high = mid;                                                                                                                 \
+            else                                                                                                                            \
+                low = mid + 1;                                                                                                              \
+        }                                                                                                                                   \
+                                                                                                                                            \
+        memmove(name##_at(base, low + 1, context), name##_at(base, low, context), (i - low) * size);                                        \
+        memcpy(name##_at(base, low, context), tmp, size);                                                                                   \
+    }                                                                                                                                       \
+}                                                                                                                                           \
+                                                                                                                                            \
+/* The number of items in base[0, n) that key does not sort before. */                                                                      \
+static size_t name##_upper_bound(uint8_t *base, size_t n, const uint8_t *key, const void *context)                                          \
+{                                                                                                                                           \
+    size_t low = 0, high = n;                                                                                                               \
+    while (low < high)                                                                                                                      \
+    {                                                                                                                                       \
+        size_t mid = low + (high - low) / 2;                                                                                                \
+        if (name##_less(key, name##_at(base, mid, context), context))                                                                       \
+            high = mid;                                                                                                                     \
+        else                                                                                                                                \
+            low = mid + 1;                                                                                                                  \
+    }                                                                                                                                       \
+    return low;                                                                                                                             \
+}                                                                                                                                           \
+                                                                                                                                            \
+/* The number of items in base[0, n) that sort before key. */                                                                               \
+static size_t name##_lower_bound(uint8_t *base, size_t n, const uint8_t *key, const void *context)                                          \
+{                                                                                                                                           \
+    size_t low = 0, high = n;                                                                                                               \
+    while (low < high)                                                                                                                      \
+    {                                                                                                                                       \
+        size_t mid = low + (high - low) / 2;                                                                                                \
+        if (name##_less(name##_at(base, mid, context), key, context))                                                                       \
+            low = mid + 1;                                                                                                                  \
+        else                                                                                                                                \
+            high = mid;                                                                                                                     \
+    }                                                                                                                                       \
+    return low;                                                                                                                             \
+}                                                                                                                                           \
+                                                                                                                                            \
+/* Merges the adjacent sorted runs base[0, left_n) and the right_n items                                                                    \
+   after it, through scratch with room for the shorter of the two. */                                                                       \
+static void name##_merge(uint8_t *base, size_t left_n, size_t right_n, uint8_t *scratch, const void *context)                               \
+{                                                                                                                                           \
+    size_t size = name##_size(context);                                                                                                     \
+    uint8_t *right = name##_at(base, left_n, context);                                                                                      \
+                                                                                                                                            \
+    /* Left items that sort before the whole right run, and right items                                                                     \
+       that sort after the whole left run, are already in place. */                                                                         \
+    size_t in_place = name##_upper_bound(base, left_n, right, context);                                                                     \
+    base = name##_at(base, in_place, context);                                                                                              \
+    left_n -= in_place;                                                                                                                     \
+    if (left_n == 0)                                                                                                                        \
+        return;                                                                                                                             \
+                                                                                                                                            \
+    right_n = name##_lower_bound(right, right_n, right - size, context);                                                                    \
+    if (right_n == 0)                                                                                                                       \
+        return;                                                                                                                             \
+                                                                                                                                            \
+    if (left_n <= right_n)                                                                                                                  \
+    {                                                                                                                                       \
+        uint8_t *left = scratch, *left_end = scratch + left_n * size;                                                                       \
+        uint8_t *right_end = right + right_n * size;                                                                                        \
+        uint8_t *out = base;                                                                                                                \
+                                                                                                                                            \
+        memcpy(scratch, base, left_n * size);                                                                                               \
+        while (left < left_end && right < right_end)                                                                                        \
+        {                                                                                                                                   \
+            if (name##_less(right, left, context))                                                                                          \
+            {                                                                                                                               \
+                memcpy(out, right, size);                                                                                                   \
+                right += size;                                                                                                              \
+            }                                                                                                                               \
+            else                                                                                                                            \
+            {                                                                                                                               \
+                memcpy(out, left, size);                                                                                                    \
+                left += size;                                                                                                               \
+            }                                                                                                                               \
+            out += size;                                                                                                                    \
+        }                                                                                                                                   \
+        memcpy(out, left, left_end - left);                                                                                                 \
+    }                                                                                                                                       \
+    else                                                                                                                                    \
+    {                                                                                                                                       \
+        uint8_t *left = right, *right_end = scratch + right_n * size;                                                                       \
+        uint8_t *out = right + right_n * size;                                                                                              \
+                                                                                                                                            \
+        memcpy(scratch, right, right_n * size);                                                                                             \
+        while (left > base && right_end > scratch)                                                                                          \
+        {                                                                                                                                   \
+            out -= size;                                                                                                                    \
+            if (name##_less(right_end - size, left - size, context))                                                                        \
+            {                                                                                                                               \
+                left -= size;                                                                                                               \
+                memcpy(out, left, size);                                                                                                    \
+            }                                                                                                                               \
+            else                                                                                                                            \
+            {                                                                                                                               \
+                right_end -= size;                                                                                                          \
+                memcpy(out, right_end, size);                                                                                               \
+            }                                                                                                                               \
+        }                                                                                                                                   \
+        memcpy(base, scratch, right_end - scratch);                                                                                         \
+    }                                                                                                                                       \
+}                                                                                                                                           \
+                                                                                                                                            \
+static void name##_merge_at(uint8_t *base, struct sort_run *runs, size_t *nruns, size_t i, uint8_t *scratch, const void *context)           \
+{                                                                                                                                           \
+    name##_merge(name##_at(base, runs[i].start, context), runs[i].length, runs[i + 1].length, scratch, context);                            \
+    runs[i].length += runs[i + 1].length;                                                                                                   \
+                                                                                                                                            \
+    for (size_t j = i + 1; j + 1 < *nruns; j++)                                                                                             \
+        runs[j] = runs[j + 1];                                                                                                              \
+    (*nruns)--;                                                                                                                             \
+}                                                                                                                                           \
+                                                                                                                                            \
+/* Merges runs until their lengths shrink faster than the Fibonacci                                                                         \
+   numbers going up the stack, or down to one run when forced. */                                                                           \
+static void name##_merge_collapse(uint8_t *base, struct sort_run *runs, size_t *nruns, bool force, uint8_t *scratch, const void *context)   \
+{                                                                                                                                           \
+    while (*nruns > 1)                                                                                                                      \
+    {                                                                                                                                       \
+        size_t i = *nruns - 2;                                                                                                              \
+                                                                                                                                            \
+        if (force)                                                                                                                          \
+        {                                                                                                                                   \
+            if (i > 0 && runs[i - 1].length < runs[i + 1].length)                                                                           \
+                i--;                                                                                                                        \
+        }                                                                                                                                   \
+        else if ((i > 0 && runs[i - 1].length <= runs[i].length + runs[i + 1].length) ||                                                    \
+                 (i > 1 && runs[i - 2].length <= runs[i - 1].length + runs[i].length))                                                      \
+        {                                                                                                                                   \
+            if (runs[i - 1].length < runs[i + 1].length)                                                                                    \
+                i--;                                                                                                                        \
+        }                                                                                                                                   \
+        else if (runs[i].length > runs[i + 1].length)                                                                                       \
+        {                                                                                                                                   \
+            break;                                                                                                                          \
+        }                                                                                                                                   \
+                                                                                                                                            \
+        name##_merge_at(base, runs, nruns, i, scratch, context);                                                                            \
+    }                                                                                                                                       \
+}                                                                                                                                           \
+                                                                                                                                            \
+/* Sorts stably through scratch, with room for n / 2 items. */                                                                              \
+static void name##_timsort(uint8_t *base, size_t n, uint8_t *scratch, const void *context)                                                  \
+{                                                                                                                                           \
+    struct sort_run runs[sort_MAX_RUNS];                                                                                                    \
+    size_t nruns = 0;                                                                                                                       \
+    size_t min_run = sort_min_run(n);                                                                                                       \
+                                                                                                                                            \
+    for (size_t start = 0; start < n;)                                                                                                      \
+    {                                                                                                                                       \
+        uint8_t *run = name##_at(base, start, context);                                                                                     \
+        size_t length = name##_count_run(run, n - start, context);                                                                          \
+                                                                                                                                            \
+        if (length < min_run)                                                                                                               \
+        {                                                                                                                                   \
+            size_t extended = min(min_run, n - start);                                                                                      \
+            name##_binary_insertion_sort(run, length, extended, context);                                                                   \
+            length = extended;                                                                                                              \
+        }                                                                                                                                   \
+                                                                                                                                            \
+        runs[nruns++] = (struct sort_run){.start = start, .length = length};                                                                \
+        start += length;                                                                                                                    \
+        name##_merge_collapse(base, runs, &nruns, false, scratch, context);                                                                 \
+    }                                                                                                                                       \
+                                                                                                                                            \
+    name##_merge_collapse(base, runs, &nruns, true, scratch, context);                                                                      \
+}
+
+/* Defines sort_##name and stable_sort_##name over buffers of type, where
+   less is an expression of a and b, of type const type *, that is true
+   when *a sorts before *b. */
+#define sort_DEFINE(name, type, less)                                                  \
+    static inline size_t _sort_##name##_size(const void *context)                      \
+    {                                                                                  \
+        return sizeof(type);                                                           \
+    }                                                                                  \
+                                                                                       \
+    static inline bool _sort_##name##_less(const void *_a_, const void *_b_,           \
+                                           const void *context)                        \
+    {                                                                                  \
+        const type *a = _a_, *b = _b_;                                                 \
+        return (less);                                                                 \
+    }                                                                                  \
+                                                                                       \
+    _sort_DEFINE_KERNELS_(_sort_##name, type)                                          \
+                                                                                       \
+    void sort_##name(type *items, size_t n)                                            \
+    {                                                                                  \
+        _sort_##name##_pdqsort((uint8_t *)items, n, NULL);                             \
+    }                                                                                  \
+                                                                                       \
+    void stable_sort_##name(type *items, size_t n)                                     \
+    {                                                                                  \
+        type *scratch = malloc(max(n / 2, (size_t)1) * sizeof(type));                       \
+        _sort_##name##_timsort((uint8_t *)items, n, (uint8_t *)scratch, NULL);         \
+        free(scratch);                                                                 \
+    }
+
+/* Defines radix_sort_##name over buffers of an integer type, ordered by
+   the bits of key_t, an unsigned type of the same width, with sign_bit
+   flipped so that negative keys sort first. */
+#define sort_DEFINE_RADIX(name, type, key_t, sign_bit)                                 \
+    void radix_sort_##name(type *items, size_t n)                                      \
+    {                                                                                  \
+        if (n < sort_RADIX_THRESHOLD)                                                  \
+        {                                                                              \
+            sort_##name(items, n);                                                     \
+            return;                                                                    \
+        }                                                                              \
+                                                                                       \
+        /* Counts every digit of every key in a single pass. */                        \
+        size_t counts[sizeof(key_t)][256] = {0};                                       \
+        for (size_t i = 0; i < n; i++)                                                 \
+        {                                                                              \
+            key_t key = (key_t)items[i] ^ (sign_bit);                                  \
+            for (size_t digit = 0; digit < sizeof(key_t); digit++)                     \
+                counts[digit][(key >> 8 * digit) & 0xff]++;                            \
+        }                                                                              \
+                                                                                       \
+        type *from = items, *to = malloc(n * sizeof(type));                            \
+        type *scratch = to;                                                            \
+                                                                                       \
+        for (size_t digit = 0; digit < sizeof(key_t); digit++)                         \
+        {                                                                              \
+            size_t *count = counts[digit];                                             \
+            key_t first = (key_t)from[0] ^ (sign_bit);                                 \
+            if (count[(first >> 8 * digit) & 0xff] == n)                               \
+                continue;                                                              \
+                                                                                       \
+            size_t offset = 0;                                                         \
+            for (size_t value = 0; value < 256; value++)                               \
+            {                                                                          \
+                size_t nvalue = count[value];                                          \
+                count[value] = offset;                                                 \
+                offset += nvalue;                                                      \
+            }                                                                          \
+                                                                                       \
+            for (size_t i = 0; i < n; i++)                                             \
+            {                                                                          \
+                key_t key = (key_t)from[i] ^ (sign_bit);                               \
+                to[count[(key >> 8 * digit) & 0xff]++] = from[i];                      \
+            }                                                                          \
+                                                                                       \
+            type *swap = from;                                                         \
+            from = to;                                                                 \
+            to = swap;                                                                 \
+        }                                                                              \
+                                                                                       \
+        if (from != items)                                                             \
+            memcpy(items, from, n * sizeof(type));                                     \
+        free(scratch);                                                                 \
+    }
+
+void sort_int             (int *, size_t n);                                  /* Sorts the buffer in ascending order. */
+void sort_long            (long *, size_t n);                                 /* Sorts the buffer in ascending order. */
+void sort_unsigned        (unsigned *, size_t n);                             /* Sorts the buffer in ascending order. */
+void sort_ulong           (unsigned long *, size_t n);                        /* Sorts the buffer in ascending order. */
+void sort_float           (float *, size_t n);                                /* Sorts the buffer in ascending order, with NaNs last. */
+void sort_double          (double *, size_t n);                               /* Sorts the buffer in ascending order, with NaNs last. */
+void sort_buffer          (void *, size_t n, size_t item_size, compare_fn_t); /* Sorts the buffer of n items of item_size bytes by the comparison function. */
+
+void stable_sort_int      (int *, size_t n);                                  /* Sorts the buffer in ascending order, keeping equal items in order. */
+void stable_sort_long     (long *, size_t n);                                 /* Sorts the buffer in ascending order, keeping equal items in order. */
+void stable_sort_unsigned (unsigned *, size_t n);                             /* Sorts the buffer in ascending order, keeping equal items in order. */
+void stable_sort_ulong    (unsigned long *, size_t n);                        /* Sorts the buffer in ascending order, keeping equal items in order. */
+void stable_sort_float    (float *, size_t n);                                /* Sorts the buffer in ascending order, with NaNs last, keeping equal items in order. */
+void stable_sort_double   (double *, size_t n);                               /* Sorts the buffer in ascending order, with NaNs last, keeping equal items in order. */
+void stable_sort_buffer   (void *, size_t n, size_t item_size, compare_fn_t); /* Sorts the buffer by the comparison function, keeping equal items in order. */
+
+void radix_sort_int       (int *, size_t n);                                  /* Sorts the buffer in ascending order by radix. */
+void radix_sort_long      (long *, size_t n);                                 /* Sorts the buffer in ascending order by radix. */
+void radix_sort_unsigned  (unsigned *, size_t n);                             /* Sorts the buffer in ascending order by radix. */
+void radix_sort_ulong     (unsigned long *, size_t n);                        /* Sorts the buffer in ascending order by radix. */
+
+#define sort(items, n)                  \
+    (_Generic((items),                  \
+        int *: sort_int,                \
+        long *: sort_long,              \
+        unsigned *: sort_unsigned,      \
+        unsigned long *: sort_ulong,    \
+        float *: sort_float,            \
+        double *: sort_double)((items), (n)))
+
+#define stable_sort(items, n)                \
+    (_Generic((items),                       \
+        int *: stable_sort_int,              \
+        long *: stable_sort_long,            \
+        unsigned *: stable_sort_unsigned,    \
+        unsigned long *: stable_sort_ulong,  \
+        float *: stable_sort_float,          \
+        double *: stable_sort_double)((items), (n)))
+
+#define radix_sort(items, n)                \
+    (_Generic((items),                      \
+        int *: radix_sort_int,              \
+        long *: radix_sort_long,            \
+        unsigned *: radix_sort_unsigned,    \
+        unsigned long *: radix_sort_ulong)((items), (n)))
@@ -0,0 +1,210 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include "../src/alloc.h"
+#include "../src/functions.h"
+#include "../src/debug.h"
+#include "../src/testing.h"
+
+struct node
+{
+    struct node *next;
+    long value;
+};
+
+node_pool_t *pool;
+
+testing_DEFAULT_RESOURCE_HANDLER_ALL
+
+void before_each()
+{
+#if SHOULD_MEMORY_DEBUG
+    debug_mem_setup();
+#endif
+    pool = node_pool_new(sizeof(struct node));
+}
+
+void after_each()
+{
+    node_pool_free(pool);
+}
+
+void test_new()
+{
+    assert_equal(0, node_pool_size(pool));
+    assert_equal(0, node_pool_nchunks(pool));
+}
+
+void test_alloc()
+{
+    struct node *nodes[100];
+
+    for (int i = 0; i < 100; i++)
+    {
+        nodes[i] = node_pool_alloc(pool);
+        *nodes[i] = (struct node){.next = NULL, .value = i};
+    }
+
+    assert_equal(100, node_pool_size(pool));
+
+    for (int i = 0; i < 100; i++)
+    {
+        assert_equal(i, nodes[i]->value);
+        assert_true((uintptr_t)nodes[i] % sizeof(void *) == 0);
+    }
+}
+
+void test_release_reuses_nodes()
+{
+    struct node *a = node_pool_alloc(pool);
+    struct node *b = node_pool_alloc(pool);
+
+    node_pool_release(pool, a);
+    node_pool_release(pool, b);
+    assert_equal(0, node_pool_size(pool));
+
+    /* Released nodes come back most recently released first. */
+    assert_true(node_pool_alloc(pool) == b);
+    assert_true(node_pool_alloc(pool) == a);
+    assert_equal(1, node_pool_nchunks(pool));
+}
+
+void test_chunk_growth()
+{
+    for (int i = 0; i < node_pool_MIN_CHUNK_NODES; i++)
+        node_pool_alloc(pool);
+    assert_equal(1, node_pool_nchunks(pool));
+
+    node_pool_alloc(pool);
+    assert_equal(2, node_pool_nchunks(pool));
+
+    /* Chunks double, so a million nodes take a handful of them. */
+    for (int i = 0; i < 1000000; i++)
+        node_pool_alloc(pool);
+    assert_true(node_pool_nchunks(pool) < 30);
+}
+
+void test_chunk_nodes()
+{
+    node_pool_free(pool);
+    pool = node_pool_new(sizeof(struct node), .chunk_nodes = 4);
+
+    for (int i = 0; i < 4; i++)
+        node_pool_alloc(pool);
+    assert_equal(1, node_pool_nchunks(pool));
+
+    node_pool_alloc(pool);
+    assert_equal(2, node_pool_nchunks(pool));
+}
+
+void test_small_nodes()
+{
+    node_pool_free(pool);
+    pool = node_pool_new(1);
+
+    char *a = node_pool_alloc(pool);
+    char *b = node_pool_alloc(pool);
+
+    /* Nodes are padded to hold the freelist link. */
+    assert_true(b - a >= (long)sizeof(void *));
+    node_pool_release(pool, a);
+    assert_true(node_pool_alloc(pool) == a);
+}
+
+void test_arena_alloc()
+{
+    arena_t *arena = arena_new(.block_size = 256);
+    allocator_t *allocator = arena_allocator(arena);
+
+    char *a = allocator_alloc(allocator, 3);
+    char *b = allocator_alloc(allocator, 40);
+    assert_true((uintptr_t)a % _Alignof(max_align_t) == 0);
+    assert_true((uintptr_t)b % _Alignof(max_align_t) == 0);
+    assert_true(b >= a + 3);
+
+    /* Allocations bigger than a block get a block of their own. */
+    char *big = allocator_alloc(allocator, 1000);
+    memset(big, 1, 1000);
+    assert_true(arena_used(arena) >= 1043);
+
+    arena_free(arena);
+}
+
+void test_arena_realloc()
+{
+    arena_t *arena = arena_new();
+    allocator_t *allocator = arena_allocator(arena);
+
+    long *a = allocator_alloc(allocator, 4 * sizeof(long));
+    for (int i = 0; i < 4; i++)
+        a[i] = i;
+
+    /* The most recent allocation grows in place. */
+    assert_true(allocator_realloc(allocator, a, 4 * sizeof(long), 8 * sizeof(long)) == a);
+
+    long *b = allocator_alloc(allocator, sizeof(long));
+    long *moved = allocator_realloc(allocator, a, 8 * sizeof(long), 16 * sizeof(long));
+    assert_true(moved != a && moved != b);
+    for (int i = 0; i < 4; i++)
+        assert_equal(i, moved[i]);
+
+    arena_free(arena);
+}
+
+void test_arena_free_and_reset()
+{
+    arena_t *arena = arena_new(.block_size = 128);
+    allocator_t *allocator = arena_allocator(arena);
+
+    void *a = allocator_alloc(allocator, 16);
+    size_t used = arena_used(arena);
+
+    /* Freeing the most recent allocation rolls it back. */
+    void *b = allocator_alloc(allocator, 16);
+    allocator_free(allocator, b, 16);
+    assert_equal(used, arena_used(arena));
+    assert_true(allocator_alloc(allocator, 16) == b);
+
+    for (int i = 0; i < 100; i++)
+        allocator_alloc(allocator, 64);
+
+    arena_reset(arena);
+    assert_equal(0, arena_used(arena));
+    assert_true(allocator_alloc(allocator, 16) == a);
+
+    arena_free(arena);
+}
+
+void test_thread_cache()
+{
+    allocator_t *allocator = &thread_cache_allocator;
+
+    void *a = allocator_alloc(allocator, 40);
+    allocator_free(allocator, a, 40);
+
+    /* Blocks are reused within their size class. */
+    assert_true(allocator_alloc(allocator, 48) == a);
+    assert_true(allocator_realloc(allocator, a, 48, 33) == a);
+
+    void *b = allocator_realloc(allocator, a, 33, 1000);
+    memset(b, 0, 1000);
+    allocator_free(allocator, b, 1000);
+
+    thread_cache_flush();
+}
+
+int main(int argc, char *argv[])
+{
+    TEST_SUITE(
+        TEST(test_new),
+        TEST(test_alloc),
+        TEST(test_release_reuses_nodes),
+        TEST(test_chunk_growth),
+        TEST(test_chunk_nodes),
+        TEST(test_small_nodes),
+        TEST(test_arena_alloc),
+        TEST(test_arena_realloc),
+        TEST(test_arena_free_and_reset),
+        TEST(test_thread_cache));
+}
@@ -380,6 +380,32 @@ void test_range()
         assert_equal((unsigned short)(-2*i + 20), array_at(arrs, i));
 }                                                                        
 
+static int compare_foo_b(const void *a, const void *b)
+{
+    return ((const struct foo *)a)->b - ((const struct foo *)b)->b;
+}
+
+void test_sort()
+{
+    arr = array(int, 5, -3, 9, 0, -3, 7);
+    array_sort(arr);
+
+    int sorted[] = {-3, -3, 0, 5, 7, 9};
+    for (int i = 0; i < 6; i++)
+        assert_equal(sorted[i], array_at(arr, i));
+
+    arr2 = array(struct foo,
+                 (struct foo){0, 2, 0, 0.0},
+                 (struct foo){1, 1, 1, 1.0},
+                 (struct foo){2, 2, 2, 2.0},
+                 (struct foo){3, 1, 3, 3.0});
+    array_stable_sort_by(arr2, compare_foo_b);
+
+    int order[] = {1, 3, 0, 2};
+    for (int i = 0; i < 4; i++)
+        assert_equal(order[i], array_at(arr2, i).a);
+}
+
 int main(int argc, char *argv[])
 {
     TEST_SUITE(
@@ -396,5 +422,6 @@ int main(int argc, char *argv[])
         TEST(test_filter),
         TEST(test_reduce),
         TEST(test_slice),
-        TEST(test_range));
+        TEST(test_range),
+        TEST(test_sort));
 }
\ No newline at end of file
@@ -456,6 +456,243 @@ void test_resize_up_and_down()
     assert_equal(0, arraylist_size(list2));
 }
 
+void test_queue()
+{
+    /* Used as a queue, the items wrap around the end of the buffer, and
+       growing has to unwrap them in order. */
+    int next = 0, expected_front = 0;
+    for (int round = 0; round < 200; round++)
+    {
+        for (int i = 0; i < round % 7 + 1; i++)
+            arraylist_add_back(list1, next++);
+        for (int i = 0; i < round % 5 + 1 && !arraylist_is_empty(list1); i++)
+            assert_equal(expected_front++, arraylist_remove_front(list1));
+
+        for (int i = 0; i < arraylist_size(list1); i++)
+            assert_equal(expected_front + i, arraylist_at(list1, i));
+    }
+
+    for (int i = 0; i < 20; i++)
+        arraylist_add_front(list2, ((struct foo){i, (float)i}));
+    for (int i = 0; i < 20; i++)
+        assert_struct_equal(((struct foo){19 - i, (float)(19 - i)}), arraylist_at(list2, i));
+    for (int i = 0; i < 20; i++)
+        assert_struct_equal(((struct foo){i, (float)i}), arraylist_remove_back(list2));
+
+    assert_equal(0, arraylist_size(list2));
+}
+
+void test_reserve_shrink_to_fit()
+{
+    arraylist_reserve(list1, 100);
+    assert_equal(100, arraylist_capacity(list1));
+
+    for (int i = 0; i < 100; i++)
+        arraylist_add(list1, i);
+    assert_equal(100, arraylist_capacity(list1));
+
+    /* Reserved capacity is kept as the list drains. */
+    for (int i = 0; i < 95; i++)
+        arraylist_remove_back(list1);
+    assert_equal(100, arraylist_capacity(list1));
+
+    arraylist_shrink_to_fit(list1);
+    assert_equal(5, arraylist_capacity(list1));
+    for (int i = 0; i < 5; i++)
+        assert_equal(i, arraylist_at(list1, i));
+
+    /* Unwraps items that straddle the end of the buffer. */
+    arraylist_remove_front(list1);
+    arraylist_add_back(list1, 5);
+    arraylist_reserve(list1, 7);
+    assert_equal(7, arraylist_capacity(list1));
+    for (int i = 0; i < 5; i++)
+        assert_equal(i + 1, arraylist_at(list1, i));
+}
+
+void test_growth()
+{
+    arraylist_free(list1);
+    list1 = arraylist_new(int, .capacity = 8);
+    for (int i = 0; i < 9; i++)
+        arraylist_add(list1, i);
+    assert_equal(16, arraylist_capacity(list1));
+
+    arraylist_free(list1);
+    list1 = arraylist_new(int, .capacity = 8, .growth = ARRAYLIST_GROWTH_1_5X);
+    for (int i = 0; i < 9; i++)
+        arraylist_add(list1, i);
+    assert_equal(12, arraylist_capacity(list1));
+    for (int i = 0; i < 9; i++)
+        assert_equal(i, arraylist_at(list1, i));
+}
+
+void test_resize_hysteresis()
+{
+    arraylist_free(list1);
+    list1 = arraylist_new(int, .capacity = 8);
+    for (int i = 0; i < 64; i++)
+        arraylist_add(list1, i);
+    assert_equal(64, arraylist_capacity(list1));
+
+    /* Alternating at the growth threshold resizes once. */
+    for (int i = 0; i < 10; i++)
+    {
+        arraylist_add(list1, i);
+        assert_equal(128, arraylist_capacity(list1));
+        arraylist_remove_back(list1);
+        assert_equal(128, arraylist_capacity(list1));
+    }
+
+    /* And at the shrinking threshold too. */
+    while (arraylist_size(list1) > 32)
+        arraylist_remove_back(list1);
+    assert_equal(128, arraylist_capacity(list1));
+    for (int i = 0; i < 10; i++)
+    {
+        arraylist_remove_back(list1);
+        assert_equal(64, arraylist_capacity(list1));
+        arraylist_add(list1, i);
+        assert_equal(64, arraylist_capacity(list1));
+    }
+}
+
+void test_add_remove_at_wrapped()
+{
+    int mirror[64] = {-1};
+    int size = 1;
+
+    /* Start the items just before the end of the buffer. */
+    for (int i = 0; i < 6; i++)
+        arraylist_add_back(list1, -1);
+    for (int i = 0; i < 5; i++)
+        arraylist_remove_front(list1);
+
+    for (int i = 0; i < 40; i++)
+    {
+        int pos = (i * 7) % size;
+        arraylist_add_at(list1, pos, i);
+        memmove(&mirror[pos + 1], &mirror[pos], (size - pos) * sizeof(int));
+        mirror[pos] = i;
+        size++;
+    }
+
+    for (int i = 0; i < 30; i++)
+    {
+        int pos = (i * 5) % size;
+        assert_equal(mirror[pos], arraylist_remove_at(list1, pos));
+        memmove(&mirror[pos], &mirror[pos + 1], (size - pos - 1) * sizeof(int));
+        size--;
+
+        assert_equal(size, arraylist_size(list1));
+        for (int j = 0; j < size; j++)
+            assert_equal(mirror[j], arraylist_at(list1, j));
+    }
+}
+
+void test_ranges()
+{
+    int items[] = {10, 11, 12, 13};
+    int removed[4];
+
+    arraylist_extend_from_buffer(list1, 3, ((int[]){0, 1, 2}));
+    arraylist_insert_range(list1, 1, 4, items);
+    arraylist_insert_range(list1, 7, 2, items);
+
+    int expected_items[] = {0, 10, 11, 12, 13, 1, 2, 10, 11};
+    assert_equal(9, arraylist_size(list1));
+    for (int i = 0; i < 9; i++)
+        assert_equal(expected_items[i], arraylist_at(list1, i));
+
+    arraylist_remove_range(list1, 2, 3, removed);
+    assert_equal(11, removed[0]);
+    assert_equal(13, removed[2]);
+
+    arraylist_splice(list1, 0, 2, 1, items);
+    int spliced[] = {10, 1, 2, 10, 11};
+    assert_equal(5, arraylist_size(list1));
+    for (int i = 0; i < 5; i++)
+        assert_equal(spliced[i], arraylist_at(list1, i));
+
+    arraylist_remove_range(list1, 0, 5, NULL);
+    assert_true(arraylist_is_empty(list1));
+    assert_panic(arraylist_remove_range(list1, 0, 1, NULL));
+    assert_panic(arraylist_insert_range(list1, 1, 1, items));
+}
+
+void test_splice_wrapped()
+{
+    int mirror[512];
+    int size = 0, next = 0;
+    int items[16];
+
+    /* Splices of every shape on a list whose items keep wrapping around. */
+    for (int round = 0; round < 300; round++)
+    {
+        int pos = size == 0 ? 0 : (round * 37) % (size + 1);
+        int nremove = min(size - pos, (round * 13) % 9);
+        int ninsert = (round * 7) % (size > 200 ? 5 : 16);
+
+        for (int i = 0; i < ninsert; i++)
+            items[i] = next++;
+
+        arraylist_splice(list1, pos, nremove, ninsert, items);
+        memmove(&mirror[pos + ninsert], &mirror[pos + nremove], (size - pos - nremove) * sizeof(int));
+        memcpy(&mirror[pos], items, ninsert * sizeof(int));
+        size += ninsert - nremove;
+
+        if (round % 3 == 0 && size > 0)
+        {
+            arraylist_remove_front(list1);
+            memmove(&mirror[0], &mirror[1], --size * sizeof(int));
+        }
+
+        assert_equal(size, arraylist_size(list1));
+        for (int i = 0; i < size; i++)
+            assert_equal(mirror[i], arraylist_at(list1, i));
+    }
+}
+
+static int compare_foo_i(const void *a, const void *b)
+{
+    return ((const struct foo *)a)->i - ((const struct foo *)b)->i;
+}
+
+void test_sort()
+{
+    /* Adding at both ends wraps the items around the end of the buffer. */
+    for (int i = 0; i < 100; i++)
+    {
+        if (i % 2)
+            arraylist_add_front(list1, (i * 37) % 100);
+        else
+            arraylist_add_back(list1, (i * 37) % 100);
+    }
+
+    arraylist_sort(list1);
+    assert_equal(100, arraylist_size(list1));
+    for (int i = 0; i < 100; i++)
+        assert_equal(i, arraylist_at(list1, i));
+
+    arraylist_add_front(list1, 50);
+    arraylist_add_front(list1, -1);
+    arraylist_radix_sort(list1);
+    assert_equal(-1, arraylist_at(list1, 0));
+    assert_equal(50, arraylist_at(list1, 51));
+    assert_equal(50, arraylist_at(list1, 52));
+    assert_equal(99, arraylist_get_last(list1));
+
+    for (int i = 0; i < 40; i++)
+        arraylist_add(list2, ((struct foo){(i * 7) % 4, (float)i}));
+
+    arraylist_stable_sort_by(list2, compare_foo_i);
+    for (int i = 1; i < 40; i++)
+    {
+        struct foo prev = arraylist_at(list2, i - 1), cur = arraylist_at(list2, i);
+        assert_true(prev.i < cur.i || (prev.i == cur.i && prev.f < cur.f));
+    }
+}
+
 void test_concat()
 {
     arraylist_t(int) first1 = arraylist(int, 1, 2, 3);
@@ -760,6 +997,102 @@ void test_ref_backwards_iter()
     assert_false(arraylist_ref_has_prev(ref2));
 }
 
+void test_arena_allocator()
+{
+    arena_t *arena = arena_new();
+    arraylist_t(int) list = arraylist_new(int, .allocator = arena_allocator(arena));
+
+    for (int i = 0; i < 1000; i++)
+        arraylist_add(list, i);
+    for (int i = 0; i < 1000; i++)
+        assert_equal(i, arraylist_at(list, i));
+
+    arraylist_t(int) filtered = arraylist_filter(list, only_positive);
+    assert_equal(999, arraylist_size(filtered));
+    assert_true(arena_used(arena) >= 1999 * sizeof(int));
+
+    /* Both lists go away with the arena. */
+    arena_free(arena);
+}
+
+/* Counts the blocks and bytes a list holds, checking the sizes it frees. */
+struct alloc_counts
+{
+    long blocks;
+    long bytes;
+};
+
+static void *counting_alloc(void *context, size_t size)
+{
+    struct alloc_counts *counts = context;
+    counts->blocks++;
+    counts->bytes += size;
+    return malloc(size);
+}
+
+static void *counting_realloc(void *context, void *ptr, size_t old_size, size_t new_size)
+{
+    struct alloc_counts *counts = context;
+    counts->bytes += new_size - old_size;
+    return realloc(ptr, new_size);
+}
+
+static void counting_free(void *context, void *ptr, size_t size)
+{
+    struct alloc_counts *counts = context;
+    counts->blocks--;
+    counts->bytes -= size;
+    free(ptr);
+}
+
+void test_small_buffer()
+{
+    struct alloc_counts counts = {0};
+    allocator_t allocator = {
+        .alloc = counting_alloc,
+        .realloc = counting_realloc,
+        .free = counting_free,
+        .context = &counts};
+
+    arraylist_t(int) list = arraylist_new_small(int, 8, .allocator = &allocator);
+    assert_equal(1, counts.blocks);
+    assert_equal(8, arraylist_capacity(list));
+
+    /* Wraps around inside the inline buffer. */
+    for (int i = 0; i < 6; i++)
+        arraylist_add_back(list, i);
+    for (int i = 0; i < 4; i++)
+        assert_equal(i, arraylist_remove_front(list));
+    for (int i = 6; i < 12; i++)
+        arraylist_add_back(list, i);
+    assert_equal(1, counts.blocks);
+
+    /* Spills to the heap, in order. */
+    for (int i = 12; i < 40; i++)
+        arraylist_add_back(list, i);
+    assert_equal(2, counts.blocks);
+    for (int i = 0; i < 36; i++)
+        assert_equal(i + 4, arraylist_at(list, i));
+
+    /* And moves back in once it fits again. */
+    while (arraylist_size(list) > 5)
+        arraylist_remove_back(list);
+    arraylist_shrink_to_fit(list);
+    assert_equal(1, counts.blocks);
+    assert_equal(8, arraylist_capacity(list));
+    for (int i = 0; i < 5; i++)
+        assert_equal(i + 4, arraylist_at(list, i));
+
+    arraylist_t(int) filtered = arraylist_filter(list, only_positive);
+    assert_equal(2, counts.blocks);
+    assert_equal(5, arraylist_size(filtered));
+
+    arraylist_free(filtered);
+    arraylist_free(list);
+    assert_equal(0, counts.blocks);
+    assert_equal(0, counts.bytes);
+}
+
 int main(int argc, char *argv[])
 {
     TEST_SUITE(
@@ -781,6 +1114,14 @@ int main(int argc, char *argv[])
         TEST(test_remove_at),
         TEST(test_resize_down),
         TEST(test_resize_up_and_down),
+        TEST(test_queue),
+        TEST(test_reserve_shrink_to_fit),
+        TEST(test_growth),
+        TEST(test_resize_hysteresis),
+        TEST(test_add_remove_at_wrapped),
+        TEST(test_ranges),
+        TEST(test_splice_wrapped),
+        TEST(test_sort),
         TEST(test_concat),
         TEST(test_map),
         TEST(test_filter),
@@ -789,5 +1130,7 @@ int main(int argc, char *argv[])
         TEST(test_equal_item_eq_fn),
         TEST(test_ref_for_loop),
         TEST(test_ref_forward_iter),
-        TEST(test_ref_backwards_iter));
+        TEST(test_ref_backwards_iter),
+        TEST(test_arena_allocator),
+        TEST(test_small_buffer));
 }
\ No newline at end of file
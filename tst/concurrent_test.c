@@ -0,0 +1,476 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "../src/concurrent.h"
+#include "../src/functions.h"
+#include "../src/debug.h"
+#include "../src/testing.h"
+
+#define NTHREADS 8
+#define NKEYS 20000
+#define NREADERS 8
+#define NSTABLE_KEYS 1000
+#define NCHURN_KEYS 4000
+#define NWRITER_ROUNDS 20
+
+concurrent_hashmap_t *map;
+
+testing_DEFAULT_RESOURCE_HANDLER_ALL
+
+void before_each()
+{
+#if SHOULD_MEMORY_DEBUG
+    debug_mem_setup();
+#endif
+    map = concurrent_hashmap_new();
+}
+
+void after_each()
+{
+    concurrent_hashmap_free(map);
+}
+
+static long ncomputed;
+
+static void *compute_value(const void *key)
+{
+    __atomic_add_fetch(&ncomputed, 1, __ATOMIC_RELAXED);
+    return _((long)key * 2);
+}
+
+void test_new()
+{
+    assert_equal(concurrent_hashmap_DEFAULT_SHARDS, concurrent_hashmap_nshards(map));
+    assert_equal(0, concurrent_hashmap_size(map));
+
+    concurrent_hashmap_t *small = concurrent_hashmap_new(.nshards = 5);
+    assert_equal(8, concurrent_hashmap_nshards(small));
+    concurrent_hashmap_free(small);
+}
+
+void test_set_get_remove()
+{
+    for (long i = 1; i <= 1000; i++)
+        concurrent_hashmap_set_at(map, _(i), _(i + 1));
+
+    assert_equal(1000, concurrent_hashmap_size(map));
+
+    for (long i = 1; i <= 1000; i++)
+    {
+        assert_true(concurrent_hashmap_contains_key(map, _(i)));
+        assert_true(concurrent_hashmap_get_at(map, _(i)) == _(i + 1));
+    }
+
+    assert_false(concurrent_hashmap_contains_key(map, _(1001)));
+
+    for (long i = 1; i <= 1000; i += 2)
+        assert_true(concurrent_hashmap_remove_at(map, _(i)) == _(i + 1));
+
+    assert_equal(500, concurrent_hashmap_size(map));
+    assert_false(concurrent_hashmap_contains_key(map, _(1)));
+    assert_true(concurrent_hashmap_contains_key(map, _(2)));
+}
+
+void test_string_keys()
+{
+    concurrent_hashmap_t *strings = concurrent_hashmap_new(
+        .nshards = 4,
+        .key_equal_fn = streq,
+        .hash_fn = strhash);
+
+    char first[] = "hello", second[] = "hello";
+    concurrent_hashmap_set_at(strings, first, _(1));
+    assert_true(concurrent_hashmap_get_at(strings, second) == _(1));
+    assert_equal(1, concurrent_hashmap_size(strings));
+
+    concurrent_hashmap_free(strings);
+}
+
+void test_compute_if_absent()
+{
+    ncomputed = 0;
+
+    assert_true(concurrent_hashmap_compute_if_absent(map, _(21), compute_value) == _(42));
+    assert_true(concurrent_hashmap_compute_if_absent(map, _(21), compute_value) == _(42));
+    assert_equal(1, ncomputed);
+
+    concurrent_hashmap_set_at(map, _(5), _(7));
+    assert_true(concurrent_hashmap_compute_if_absent(map, _(5), compute_value) == _(7));
+    assert_equal(1, ncomputed);
+}
+
+static void *insert_range(void *arg)
+{
+    long start = (long)arg;
+
+    for (long i = start; i < start + NKEYS; i++)
+        concurrent_hashmap_set_at(map, _(i + 1), _(i));
+
+    return NULL;
+}
+
+void test_parallel_inserts()
+{
+    pthread_t threads[NTHREADS];
+
+    for (long t = 0; t < NTHREADS; t++)
+        pthread_create(&threads[t], NULL, insert_range, _(t * NKEYS));
+    for (long t = 0; t < NTHREADS; t++)
+        pthread_join(threads[t], NULL);
+
+    assert_equal(NTHREADS * NKEYS, concurrent_hashmap_size(map));
+
+    for (long i = 0; i < NTHREADS * NKEYS; i++)
+        if (concurrent_hashmap_get_at(map, _(i + 1)) != _(i))
+            fail();
+}
+
+static void *compute_all(void *arg)
+{
+    for (long i = 1; i <= NKEYS; i++)
+        concurrent_hashmap_compute_if_absent(map, _(i), compute_value);
+
+    return NULL;
+}
+
+void test_parallel_compute_if_absent()
+{
+    pthread_t threads[NTHREADS];
+    ncomputed = 0;
+
+    /* Every thread races on the same keys, yet each value is computed once. */
+    for (long t = 0; t < NTHREADS; t++)
+        pthread_create(&threads[t], NULL, compute_all, NULL);
+    for (long t = 0; t < NTHREADS; t++)
+        pthread_join(threads[t], NULL);
+
+    assert_equal(NKEYS, ncomputed);
+    assert_equal(NKEYS, concurrent_hashmap_size(map));
+}
+
+void test_rcu_set_get_remove()
+{
+    rcu_hashmap_t *rcu = rcu_hashmap_new();
+
+    for (long i = 1; i <= 1000; i++)
+        rcu_hashmap_set_at(rcu, _(i), _(i + 1));
+
+    assert_equal(1000, rcu_hashmap_size(rcu));
+
+    for (long i = 1; i <= 1000; i++)
+        assert_true(rcu_hashmap_get_at(rcu, _(i)) == _(i + 1));
+
+    rcu_hashmap_set_at(rcu, _(1), _(7));
+    assert_true(rcu_hashmap_get_at(rcu, _(1)) == _(7));
+    assert_equal(1000, rcu_hashmap_size(rcu));
+
+    for (long i = 2; i <= 1000; i += 2)
+        assert_true(rcu_hashmap_remove_at(rcu, _(i)) == _(i + 1));
+
+    assert_equal(500, rcu_hashmap_size(rcu));
+    assert_false(rcu_hashmap_contains_key(rcu, _(2)));
+    assert_true(rcu_hashmap_contains_key(rcu, _(3)));
+    assert_true(rcu_hashmap_remove_at(rcu, _(2)) == NULL);
+
+    /* Nothing is reading, so everything retired can be freed. */
+    assert_equal(0, rcu_hashmap_reclaim(rcu));
+
+    rcu_hashmap_free(rcu);
+}
+
+void test_rcu_string_keys()
+{
+    rcu_hashmap_t *rcu = rcu_hashmap_new(.key_equal_fn = streq, .hash_fn = strhash);
+
+    char first[] = "hello", second[] = "hello";
+    rcu_hashmap_set_at(rcu, first, _(1));
+    assert_true(rcu_hashmap_get_at(rcu, second) == _(1));
+
+    rcu_hashmap_free(rcu);
+}
+
+static rcu_hashmap_t *stress_map;
+static bool stress_done;
+static long stress_errors;
+static long stress_reads;
+
+/* Stable keys are always present and always map to key + 1, even while
+ * the writer resizes the table. Churn keys come and go, but whenever
+ * one is found, its value must be key + 1 too. */
+static void *stress_reader(void *arg)
+{
+    uint64_t state = (uint64_t)arg * 2654435761u + 1;
+    long reads = 0, errors = 0;
+
+    while (!__atomic_load_n(&stress_done, __ATOMIC_ACQUIRE))
+    {
+        state ^= state << 13, state ^= state >> 7, state ^= state << 17;
+        long key = state % (NSTABLE_KEYS + NCHURN_KEYS) + 1;
+        void *value = rcu_hashmap_get_at(stress_map, _(key));
+
+        if (key <= NSTABLE_KEYS ? value != _(key + 1) : value != NULL && value != _(key + 1))
+            errors++;
+        if (key <= NSTABLE_KEYS && !rcu_hashmap_contains_key(stress_map, _(key)))
+            errors++;
+
+        reads++;
+    }
+
+    __atomic_add_fetch(&stress_errors, errors, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&stress_reads, reads, __ATOMIC_RELAXED);
+    return NULL;
+}
+
+void test_rcu_stress()
+{
+    pthread_t readers[NREADERS];
+    stress_map = rcu_hashmap_new();
+    stress_done = false;
+    stress_errors = 0;
+    stress_reads = 0;
+
+    for (long i = 1; i <= NSTABLE_KEYS; i++)
+        rcu_hashmap_set_at(stress_map, _(i), _(i + 1));
+
+    for (long t = 0; t < NREADERS; t++)
+        pthread_create(&readers[t], NULL, stress_reader, _(t + 1));
+
+    for (int round = 0; round < NWRITER_ROUNDS; round++)
+    {
+        for (long i = NSTABLE_KEYS + 1; i <= NSTABLE_KEYS + NCHURN_KEYS; i++)
+            rcu_hashmap_set_at(stress_map, _(i), _(i + 1));
+        for (long i = 1; i <= NSTABLE_KEYS; i++)
+            rcu_hashmap_set_at(stress_map, _(i), _(i + 1));
+        for (long i = NSTABLE_KEYS + 1; i <= NSTABLE_KEYS + NCHURN_KEYS; i++)
+            rcu_hashmap_remove_at(stress_map, _(i));
+    }
+
+    __atomic_store_n(&stress_done, true, __ATOMIC_RELEASE);
+    for (long t = 0; t < NREADERS; t++)
+        pthread_join(readers[t], NULL);
+
+    assert_equal(0, stress_errors);
+    assert_true(stress_reads > 0);
+    assert_equal(NSTABLE_KEYS, rcu_hashmap_size(stress_map));
+    assert_equal(0, rcu_hashmap_reclaim(stress_map));
+
+    rcu_hashmap_free(stress_map);
+}
+
+static ptreemap_t *published;
+static pthread_mutex_t published_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Walks snapshots of whichever version is published. The writer sets
+ * every key to the round number in key order, so any one version has
+ * all the keys, with values that fall by at most one along the way. */
+static void *snapshot_reader(void *arg)
+{
+    long reads = 0, errors = 0;
+
+    while (!__atomic_load_n(&stress_done, __ATOMIC_ACQUIRE))
+    {
+        pthread_mutex_lock(&published_lock);
+        ptreemap_t *version = ptreemap_snapshot(published);
+        pthread_mutex_unlock(&published_lock);
+
+        ptreemap_ref_t *ref = ptreemap_ref(version);
+        long nkeys = 0, first = (long)ptreemap_ref_get_value(ref), last = first;
+
+        for (; ptreemap_ref_is_valid(ref); ptreemap_ref_next(ref), nkeys++)
+        {
+            long value = (long)ptreemap_ref_get_value(ref);
+            if (ptreemap_ref_get_key(ref) != _(nkeys + 1) || value > last || value < first - 1)
+                errors++;
+            last = value;
+        }
+
+        if (nkeys != NSTABLE_KEYS)
+            errors++;
+
+        ptreemap_ref_free(ref);
+        ptreemap_free(version);
+        reads++;
+    }
+
+    __atomic_add_fetch(&stress_errors, errors, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&stress_reads, reads, __ATOMIC_RELAXED);
+    return NULL;
+}
+
+void test_ptreemap_snapshot_readers()
+{
+    pthread_t readers[NREADERS];
+    stress_done = false;
+    stress_errors = 0;
+    stress_reads = 0;
+
+    published = ptreemap_new();
+    for (long i = 1; i <= NSTABLE_KEYS; i++)
+    {
+        ptreemap_t *next = ptreemap_set_at(published, _(i), _(0));
+        ptreemap_free(published);
+        published = next;
+    }
+
+    for (long t = 0; t < NREADERS; t++)
+        pthread_create(&readers[t], NULL, snapshot_reader, NULL);
+
+    for (long round = 1; round <= NWRITER_ROUNDS; round++)
+    {
+        for (long i = 1; i <= NSTABLE_KEYS; i++)
+        {
+            ptreemap_t *next = ptreemap_set_at(published, _(i), _(round));
+
+            pthread_mutex_lock(&published_lock);
+            ptreemap_t *old = published;
+            published = next;
+            pthread_mutex_unlock(&published_lock);
+
+            ptreemap_free(old);
+        }
+    }
+
+    __atomic_store_n(&stress_done, true, __ATOMIC_RELEASE);
+    for (long t = 0; t < NREADERS; t++)
+        pthread_join(readers[t], NULL);
+
+    assert_equal(0, stress_errors);
+    assert_true(stress_reads > 0);
+    assert_equal(NSTABLE_KEYS, ptreemap_size(published));
+    assert_true(ptreemap_get_at(published, _(NSTABLE_KEYS)) == _(NWRITER_ROUNDS));
+
+    ptreemap_free(published);
+}
+
+static thread_pool_t *pool;
+
+/* Sums the range [start, start + n) by splitting it in two until it
+ * is small, to exercise tasks that wait on tasks of their own. */
+struct range_sum
+{
+    long start, n;
+};
+
+static void *sum_range(void *arg)
+{
+    struct range_sum *range = arg;
+
+    if (range->n <= 100)
+    {
+        long sum = 0;
+        for (long i = range->start; i < range->start + range->n; i++)
+            sum += i;
+        return _(sum);
+    }
+
+    struct range_sum lo = {range->start, range->n / 2};
+    struct range_sum hi = {range->start + range->n / 2, range->n - range->n / 2};
+
+    thread_pool_task_t *task = thread_pool_submit(pool, sum_range, &lo);
+    long sum = (long)sum_range(&hi);
+    return _(sum + (long)thread_pool_wait(pool, task));
+}
+
+void test_thread_pool()
+{
+    pool = thread_pool_new(.nthreads = 4);
+    assert_equal(4, thread_pool_nthreads(pool));
+
+    struct range_sum range = {1, 100000};
+    thread_pool_task_t *task = thread_pool_submit(pool, sum_range, &range);
+    assert_true(thread_pool_wait(pool, task) == _(100000L * 100001 / 2));
+
+    thread_pool_free(pool);
+}
+
+static treeset_t *splittable_multiples(long step, long n)
+{
+    treeset_t *set = treeset_new(.order_statistics = true);
+    for (long i = step; i <= n; i += step)
+        treeset_add(set, _(i));
+    return set;
+}
+
+void test_treeset_split_join()
+{
+    treeset_t *set = splittable_multiples(1, 10000), *lo, *hi;
+
+    treeset_split(set, _(4000), &lo, &hi);
+    assert_equal(3999, treeset_size(lo));
+    assert_equal(6001, treeset_size(hi));
+    assert_true(treeset_contains(hi, _(4000)));
+    assert_false(treeset_contains(lo, _(4000)));
+    assert_true(treeset_select(hi, 0) == _(4000));
+
+    set = treeset_join(lo, hi);
+    assert_equal(10000, treeset_size(set));
+    for (long i = 0; i < 10000; i++)
+        assert_true(treeset_select(set, i) == _(i + 1));
+
+    treeset_free(set);
+}
+
+void test_treeset_parallel_ops()
+{
+    pool = thread_pool_new(.nthreads = 4);
+
+    /* Large enough to split several times before merging. */
+    treeset_t *set_union = treeset_parallel_union(pool, splittable_multiples(2, 200000), splittable_multiples(3, 200000));
+    treeset_t *set_intersection = treeset_parallel_intersection(pool, splittable_multiples(2, 200000), splittable_multiples(3, 200000));
+    treeset_t *set_difference = treeset_parallel_difference(pool, splittable_multiples(2, 200000), splittable_multiples(3, 200000));
+
+    assert_equal(133333, treeset_size(set_union));
+    assert_equal(33333, treeset_size(set_intersection));
+    assert_equal(66667, treeset_size(set_difference));
+
+    for (long i = 1; i <= 200000; i++)
+    {
+        if (treeset_contains(set_union, _(i)) != (i % 2 == 0 || i % 3 == 0) ||
+            treeset_contains(set_intersection, _(i)) != (i % 6 == 0) ||
+            treeset_contains(set_difference, _(i)) != (i % 2 == 0 && i % 3 != 0))
+            fail();
+    }
+
+    treeset_free(set_union);
+    treeset_free(set_intersection);
+    treeset_free(set_difference);
+    thread_pool_free(pool);
+}
+
+void test_treeset_parallel_add_all()
+{
+    pool = thread_pool_new(.nthreads = 4);
+    treeset_t *set = splittable_multiples(5, 100000);
+
+    void **items = malloc(100000 * sizeof(void *));
+    for (long i = 0; i < 100000; i++)
+        items[i] = _((i * 7919) % 100000 + 1);
+
+    treeset_parallel_add_all(pool, set, 100000, items);
+    assert_equal(100000, treeset_size(set));
+    for (long i = 0; i < 100000; i++)
+        assert_true(treeset_select(set, i) == _(i + 1));
+
+    free(items);
+    treeset_free(set);
+    thread_pool_free(pool);
+}
+
+int main(int argc, char *argv[])
+{
+    TEST_SUITE(
+        TEST(test_new),
+        TEST(test_set_get_remove),
+        TEST(test_string_keys),
+        TEST(test_compute_if_absent),
+        TEST(test_parallel_inserts),
+        TEST(test_parallel_compute_if_absent),
+        TEST(test_rcu_set_get_remove),
+        TEST(test_rcu_string_keys),
+        TEST(test_rcu_stress),
+        TEST(test_ptreemap_snapshot_readers),
+        TEST(test_thread_pool),
+        TEST(test_treeset_split_join),
+        TEST(test_treeset_parallel_ops),
+        TEST(test_treeset_parallel_add_all));
+}
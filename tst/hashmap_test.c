@@ -236,6 +236,276 @@ void test_ref_backward_iter()
 	}
 }
 
+void test_rehash()
+{
+	for (int i = 0; i < 1000; i++)
+		hashmap_set_at(map, _(i), _(-i));
+
+	for (int i = 0; i < 1000; i++)
+		assert_equal(-i, (long)hashmap_get_at(map, _(i)));
+
+	for (int i = 0; i < 1000; i++)
+		assert_equal(-i, (long)hashmap_remove_at(map, _(i)));
+
+	assert_true(hashmap_is_empty(map));
+}
+
+void test_incremental_rehash()
+{
+	hashmap_free(map);
+	map = hashmap_new(.incremental_rehash = true);
+
+	for (int i = 0; i < 5000; i++)
+	{
+		hashmap_set_at(map, _(i), _(-i));
+
+		/* Keys must stay visible while they sit in either table. */
+		assert_equal(0, (long)hashmap_get_at(map, _(0)));
+		assert_equal(-i / 2, (long)hashmap_get_at(map, _(i / 2)));
+		assert_true(hashmap_contains_key(map, _(i)));
+	}
+
+	assert_equal(5000, hashmap_size(map));
+
+	for (int i = 0; i < 5000; i += 2)
+		assert_equal(-i, (long)hashmap_remove_at(map, _(i)));
+
+	for (int i = 0; i < 5000; i++)
+		assert_equal(i % 2 == 0 ? 0 : -i, (long)hashmap_get_at(map, _(i)));
+
+	hashmap_ref_t *ref = hashmap_ref(map);
+	for (int i = 1; i < 5000; i += 2, hashmap_ref_next(ref))
+		assert_equal(_(i), hashmap_ref_get_key(ref));
+	hashmap_ref_free(ref);
+}
+
+void test_pool_nodes()
+{
+	hashmap_free(map);
+	map = hashmap_new(.pool_nodes = true);
+
+	for (int i = 0; i < 5000; i++)
+		hashmap_set_at(map, _(i), _(-i));
+	for (int i = 0; i < 5000; i += 2)
+		assert_equal(-i, (long)hashmap_remove_at(map, _(i)));
+	for (int i = 0; i < 5000; i += 2)
+		hashmap_set_at(map, _(i), _(i));
+
+	assert_equal(5000, hashmap_size(map));
+	for (int i = 0; i < 5000; i++)
+		assert_equal(i % 2 == 0 ? i : -i, (long)hashmap_get_at(map, _(i)));
+}
+
+size_t outstanding_bytes = 0;
+size_t nallocs = 0;
+
+void *counting_alloc(void *context, size_t size)
+{
+	outstanding_bytes += size;
+	nallocs++;
+	return malloc(size);
+}
+
+void *counting_realloc(void *context, void *ptr, size_t old_size, size_t new_size)
+{
+	outstanding_bytes += new_size - old_size;
+	return realloc(ptr, new_size);
+}
+
+void counting_free(void *context, void *ptr, size_t size)
+{
+	outstanding_bytes -= size;
+	free(ptr);
+}
+
+void test_allocator()
+{
+	allocator_t counting = {counting_alloc, counting_realloc, counting_free, NULL};
+	hashmap_config_t configs[] = {
+		{.allocator = &counting},
+		{.allocator = &counting, .pool_nodes = true},
+		{.allocator = &counting, .incremental_rehash = true},
+		{.allocator = &counting, .backend = HASHMAP_BACKEND_OPEN_ADDRESSING},
+	};
+
+	for (int c = 0; c < sizeof(configs) / sizeof(hashmap_config_t); c++)
+	{
+		hashmap_t *counted = _hashmap_new_(configs[c]);
+
+		for (int i = 0; i < 3000; i++)
+			hashmap_set_at(counted, _(i), _(i));
+		for (int i = 0; i < 3000; i += 3)
+			hashmap_remove_at(counted, _(i));
+
+		assert_true(outstanding_bytes > 0);
+		hashmap_free(counted);
+		assert_equal(0, outstanding_bytes);
+	}
+}
+
+void test_reserve()
+{
+	allocator_t counting = {counting_alloc, counting_realloc, counting_free, NULL};
+	hashmap_config_t configs[] = {
+		{.allocator = &counting, .pool_nodes = true},
+		{.allocator = &counting, .backend = HASHMAP_BACKEND_OPEN_ADDRESSING},
+	};
+
+	for (int c = 0; c < sizeof(configs) / sizeof(hashmap_config_t); c++)
+	{
+		hashmap_t *reserved = _hashmap_new_(configs[c]);
+		hashmap_reserve(reserved, 10000);
+
+		/* With the table presized, only the node pool's chunks may be
+		 * allocated during the load; the table itself never is. */
+		size_t nallocs_before = nallocs;
+		for (int i = 0; i < 10000; i++)
+			hashmap_set_at(reserved, _(i), _(-i));
+		assert_true(nallocs - nallocs_before <= 12);
+
+		for (int i = 0; i < 10000; i++)
+			assert_equal(-i, (long)hashmap_get_at(reserved, _(i)));
+
+		/* Reserving less than the current capacity is a no-op. */
+		hashmap_reserve(reserved, 10);
+		assert_equal(10000, hashmap_size(reserved));
+
+		hashmap_free(reserved);
+	}
+}
+
+void test_get_many()
+{
+	hashmap_config_t configs[] = {
+		{.incremental_rehash = true},
+		{.backend = HASHMAP_BACKEND_OPEN_ADDRESSING},
+	};
+
+	void *keys[1000];
+	void *values[1000];
+	bool found[1000];
+
+	for (int i = 0; i < 1000; i++)
+		keys[i] = _(i);
+
+	for (int c = 0; c < sizeof(configs) / sizeof(hashmap_config_t); c++)
+	{
+		hashmap_t *batched = _hashmap_new_(configs[c]);
+
+		/* Odd keys are present; the count is not a multiple of the batch. */
+		for (int i = 1; i < 1000; i += 2)
+			hashmap_set_at(batched, _(i), _(-i));
+
+		hashmap_get_many(batched, 999, keys, values);
+		hashmap_contains_many(batched, 999, keys, found);
+
+		for (int i = 0; i < 999; i++)
+		{
+			assert_equal(i % 2 == 0 ? 0 : -i, (long)values[i]);
+			assert_equal(i % 2 == 1, found[i]);
+		}
+
+		hashmap_free(batched);
+	}
+}
+
+void test_open_addressing()
+{
+	hashmap_free(map);
+	map = hashmap_new(.backend = HASHMAP_BACKEND_OPEN_ADDRESSING);
+
+	for (int i = 0; i < 1000; i++)
+		hashmap_set_at(map, _(i), _(-i));
+
+	assert_equal(1000, hashmap_size(map));
+
+	for (int i = 0; i < 1000; i++)
+	{
+		assert_true(hashmap_contains_key(map, _(i)));
+		assert_equal(-i, (long)hashmap_get_at(map, _(i)));
+	}
+
+	assert_false(hashmap_contains_key(map, _(1000)));
+
+	for (int i = 0; i < 1000; i += 2)
+		assert_equal(-i, (long)hashmap_remove_at(map, _(i)));
+
+	assert_equal(500, hashmap_size(map));
+
+	for (int i = 0; i < 1000; i++)
+		assert_equal(i % 2 == 1, hashmap_contains_key(map, _(i)));
+
+	hashmap_set_at(map, _(1), _(7));
+	assert_equal(7, (long)hashmap_get_at(map, _(1)));
+	assert_equal(500, hashmap_size(map));
+}
+
+void test_open_addressing_tombstones()
+{
+	hashmap_free(map);
+	map = hashmap_new(.backend = HASHMAP_BACKEND_OPEN_ADDRESSING);
+
+	/* Churn through many more keys than the table ever holds at once,
+	 * so that inserts have to reclaim deleted slots. */
+	for (int i = 0; i < 10000; i++)
+	{
+		hashmap_set_at(map, _(i), _(i));
+		if (i >= 8)
+			assert_equal(i - 8, (long)hashmap_remove_at(map, _(i - 8)));
+	}
+
+	assert_equal(8, hashmap_size(map));
+
+	for (int i = 10000 - 8; i < 10000; i++)
+		assert_equal(i, (long)hashmap_get_at(map, _(i)));
+}
+
+void test_open_addressing_hash_fn_key_eq_fn()
+{
+	hashmap_free(map);
+	map = hashmap_new(.backend = HASHMAP_BACKEND_OPEN_ADDRESSING,
+					  .key_equal_fn = streq,
+					  .hash_fn = strhash);
+	hashmap_set_all(map, {"first", _(1)}, {"second", _(2)}, {"third", _(3)});
+
+	char key[] = "second";
+	assert_true(hashmap_contains_key(map, key));
+	assert_false(hashmap_contains_key(map, "fourth"));
+
+	hashmap_set_at(map, key, _(-2));
+	assert_equal(hashmap_get_at(map, "second"), _(-2));
+	assert_equal(3, hashmap_size(map));
+}
+
+void test_open_addressing_ref_iter()
+{
+	hashmap_free(map);
+	map = hashmap_new(.backend = HASHMAP_BACKEND_OPEN_ADDRESSING);
+
+	bool seen[100] = {0};
+
+	for (int i = 0; i < 100; i++)
+		hashmap_set_at(map, _(i), _(-i));
+
+	hashmap_ref_t *ref = hashmap_ref(map);
+
+	for (int i = 0; i < 100; i++)
+	{
+		assert_true(hashmap_ref_is_valid(ref));
+
+		long key = (long)hashmap_ref_get_key(ref);
+		assert_equal(-key, (long)hashmap_ref_get_value(ref));
+		assert_false(seen[key]);
+		seen[key] = true;
+
+		assert_equal(i < 99, hashmap_ref_has_next(ref));
+		hashmap_ref_next(ref);
+	}
+
+	assert_false(hashmap_ref_is_valid(ref));
+	hashmap_ref_free(ref);
+}
+
 int main(int argc, char *argv[])
 {
 	TEST_SUITE(
@@ -253,5 +523,15 @@ int main(int argc, char *argv[])
 		TEST(test_equal),
 		TEST(test_hash_fn_key_eq_fn),
 		TEST(test_ref_forward_iter),
-		TEST(test_ref_backward_iter));
+		TEST(test_ref_backward_iter),
+		TEST(test_rehash),
+		TEST(test_incremental_rehash),
+		TEST(test_pool_nodes),
+		TEST(test_allocator),
+		TEST(test_reserve),
+		TEST(test_get_many),
+		TEST(test_open_addressing),
+		TEST(test_open_addressing_tombstones),
+		TEST(test_open_addressing_hash_fn_key_eq_fn),
+		TEST(test_open_addressing_ref_iter));
 }
\ No newline at end of file
@@ -760,6 +760,30 @@ void test_ref_backwards_iter()
     assert_false(linkedlist_ref_has_prev(ref2));
 }
 
+void test_pool_nodes()
+{
+    linkedlist_t(int) pooled = linkedlist_new(int, .pool_nodes = true);
+    assert_true(linkedlist_get_config(pooled).pool_nodes);
+
+    for (int i = 0; i < 1000; i++)
+        linkedlist_add_back(pooled, i);
+    for (int i = 0; i < 500; i++)
+        assert_equal(i, linkedlist_remove_front(pooled));
+    for (int i = 0; i < 500; i++)
+        linkedlist_add_front(pooled, -i);
+
+    assert_equal(1000, linkedlist_size(pooled));
+    assert_equal(-499, linkedlist_get_first(pooled));
+    assert_equal(999, linkedlist_get_last(pooled));
+
+    linkedlist_t(int) mapped = linkedlist_map(pooled, add_one);
+    assert_true(linkedlist_get_config(mapped).pool_nodes);
+    assert_equal(-498, linkedlist_get_first(mapped));
+
+    linkedlist_free(mapped);
+    linkedlist_free(pooled);
+}
+
 int main(int argc, char *argv[])
 {
     TEST_SUITE(
@@ -789,5 +813,6 @@ int main(int argc, char *argv[])
         TEST(test_equal_item_eq_fn),
         TEST(test_ref_for_loop),
         TEST(test_ref_forward_iter),
-        TEST(test_ref_backwards_iter));
+        TEST(test_ref_backwards_iter),
+        TEST(test_pool_nodes));
 }
\ No newline at end of file
@@ -0,0 +1,210 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <limits.h>
+#include <math.h>
+#include "../src/sort.h"
+#include "../src/functions.h"
+#include "../src/debug.h"
+#include "../src/testing.h"
+
+#define NITEMS 20000
+
+/* An odd size, which takes the memcpy path rather than a word-sized one. */
+struct keyed
+{
+    int key;
+    int pos;
+    char tag;
+};
+
+enum pattern
+{
+    PATTERN_RANDOM,
+    PATTERN_FEW_KEYS,
+    PATTERN_SORTED,
+    PATTERN_REVERSED,
+    PATTERN_EQUAL,
+    PATTERN_SAWTOOTH,
+    PATTERN_ORGAN_PIPE,
+    PATTERN_SORTED_TAIL,
+    NPATTERNS
+};
+
+static size_t sizes[] = {0, 1, 2, 3, 23, 24, 25, 127, 128, 129, 1000, NITEMS};
+
+long *items, *expected;
+
+testing_DEFAULT_RESOURCE_HANDLER_ALL
+
+void before_each()
+{
+#if SHOULD_MEMORY_DEBUG
+    debug_mem_setup();
+#endif
+    seed_rand(25);
+    items = malloc(NITEMS * sizeof(long));
+    expected = malloc(NITEMS * sizeof(long));
+}
+
+void after_each()
+{
+    free(items);
+    free(expected);
+}
+
+static int compare_long(const void *a, const void *b)
+{
+    long x = *(const long *)a, y = *(const long *)b;
+    return (x > y) - (x < y);
+}
+
+static int compare_keyed(const void *a, const void *b)
+{
+    return ((const struct keyed *)a)->key - ((const struct keyed *)b)->key;
+}
+
+static void fill(long *buffer, size_t n, enum pattern pattern)
+{
+    for (size_t i = 0; i < n; i++)
+    {
+        switch (pattern)
+        {
+        case PATTERN_RANDOM:      buffer[i] = (long)rand_int() - RAND_MAX / 2; break;
+        case PATTERN_FEW_KEYS:    buffer[i] = rand_int_range(0, 4); break;
+        case PATTERN_SORTED:      buffer[i] = i; break;
+        case PATTERN_REVERSED:    buffer[i] = n - i; break;
+        case PATTERN_EQUAL:       buffer[i] = 7; break;
+        case PATTERN_SAWTOOTH:    buffer[i] = i % 61; break;
+        case PATTERN_ORGAN_PIPE:  buffer[i] = i < n / 2 ? i : n - i; break;
+        case PATTERN_SORTED_TAIL: buffer[i] = i < n - n / 16 ? i : rand_int(); break;
+        default:                  break;
+        }
+    }
+}
+
+/* Runs the sort over every size and pattern, checking it against qsort. */
+static void check_sort(void (*sort_fn)(long *, size_t))
+{
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(*sizes); s++)
+    {
+        for (enum pattern pattern = 0; pattern < NPATTERNS; pattern++)
+        {
+            size_t n = sizes[s];
+            fill(items, n, pattern);
+            memcpy(expected, items, n * sizeof(long));
+            qsort(expected, n, sizeof(long), compare_long);
+
+            sort_fn(items, n);
+            assert_true(memcmp(expected, items, n * sizeof(long)) == 0);
+        }
+    }
+}
+
+static void sort_buffer_long(long *buffer, size_t n)
+{
+    sort_buffer(buffer, n, sizeof(long), compare_long);
+}
+
+static void stable_sort_buffer_long(long *buffer, size_t n)
+{
+    stable_sort_buffer(buffer, n, sizeof(long), compare_long);
+}
+
+void test_sort()
+{
+    check_sort(sort_long);
+    check_sort(sort_buffer_long);
+}
+
+void test_stable_sort()
+{
+    check_sort(stable_sort_long);
+    check_sort(stable_sort_buffer_long);
+}
+
+void test_radix_sort()
+{
+    check_sort(radix_sort_long);
+
+    int extremes[] = {0, INT_MAX, -1, INT_MIN, 1, INT_MIN + 1, INT_MAX - 1};
+    int sorted[] = {INT_MIN, INT_MIN + 1, -1, 0, 1, INT_MAX - 1, INT_MAX};
+    int ints[NITEMS / 64];
+
+    /* Enough copies to take the radix path, rather than the fallback. */
+    for (size_t i = 0; i < NITEMS / 64; i++)
+        ints[i] = extremes[i % 7];
+    radix_sort(ints, NITEMS / 64);
+
+    for (size_t i = 1; i < NITEMS / 64; i++)
+        assert_true(ints[i - 1] <= ints[i]);
+    assert_equal(INT_MIN, ints[0]);
+    assert_equal(INT_MAX, ints[NITEMS / 64 - 1]);
+
+    radix_sort(extremes, 7);
+    for (int i = 0; i < 7; i++)
+        assert_equal(sorted[i], extremes[i]);
+
+    unsigned long ulongs[] = {ULONG_MAX, 0, 1ul << 63, 42};
+    radix_sort(ulongs, 4);
+    assert_true(ulongs[0] == 0 && ulongs[1] == 42 && ulongs[2] == 1ul << 63 && ulongs[3] == ULONG_MAX);
+}
+
+void test_stability()
+{
+    struct keyed *keyed = malloc(NITEMS * sizeof(struct keyed));
+
+    /* Few keys, in runs of both directions, so that merges see long
+       stretches of equal items from both sides. */
+    for (int i = 0; i < NITEMS; i++)
+        keyed[i] = (struct keyed){.key = (i / 100) % 2 ? i % 5 : 4 - i % 5, .pos = i, .tag = 'a' + i % 26};
+
+    stable_sort_buffer(keyed, NITEMS, sizeof(struct keyed), compare_keyed);
+
+    for (int i = 1; i < NITEMS; i++)
+    {
+        assert_true(keyed[i - 1].key <= keyed[i].key);
+        if (keyed[i - 1].key == keyed[i].key)
+            assert_true(keyed[i - 1].pos < keyed[i].pos);
+        assert_equal('a' + keyed[i].pos % 26, keyed[i].tag);
+    }
+
+    free(keyed);
+}
+
+void test_typed()
+{
+    int ints[] = {3, -1, 2, -1, 0};
+    sort(ints, 5);
+    assert_true(ints[0] == -1 && ints[1] == -1 && ints[2] == 0 && ints[3] == 2 && ints[4] == 3);
+
+    unsigned uints[] = {UINT_MAX, 0, 7};
+    stable_sort(uints, 3);
+    assert_true(uints[0] == 0 && uints[1] == 7 && uints[2] == UINT_MAX);
+
+    /* NaNs sort after every number, rather than breaking the order. */
+    double doubles[200];
+    for (int i = 0; i < 200; i++)
+        doubles[i] = i % 10 == 0 ? NAN : (double)((i * 37) % 200) - 100.5;
+
+    sort(doubles, 200);
+    for (int i = 1; i < 180; i++)
+        assert_true(doubles[i - 1] <= doubles[i]);
+    for (int i = 180; i < 200; i++)
+        assert_true(isnan(doubles[i]));
+
+    float floats[] = {2.5f, NAN, -0.5f, 1.0f};
+    stable_sort(floats, 4);
+    assert_true(floats[0] == -0.5f && floats[1] == 1.0f && floats[2] == 2.5f && isnan(floats[3]));
+}
+
+int main(int argc, char *argv[])
+{
+    TEST_SUITE(
+        TEST(test_sort),
+        TEST(test_stable_sort),
+        TEST(test_radix_sort),
+        TEST(test_stability),
+        TEST(test_typed));
+}
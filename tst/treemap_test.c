@@ -229,6 +229,629 @@ void test_ref_forward_iter()
 	}
 }
 
+void test_ref_backward_iter()
+{
+	for (int i = 0; i < 100; i++)
+		treemap_set_at(map, _((i * 37) % 100), _(-((i * 37) % 100)));
+
+	treemap_ref_t *ref = treemap_ref(map);
+	while (treemap_ref_has_next(ref))
+		treemap_ref_next(ref);
+
+	for (int i = 99; i >= 0; i--)
+	{
+		assert_true(treemap_ref_is_valid(ref));
+		assert_true(treemap_ref_get_key(ref) == _(i));
+		assert_true(treemap_ref_get_value(ref) == _(-i));
+		assert_true(treemap_ref_has_prev(ref) == (i > 0));
+		treemap_ref_prev(ref);
+	}
+
+	assert_false(treemap_ref_is_valid(ref));
+	treemap_ref_free(ref);
+}
+
+void test_remove_many()
+{
+	for (long i = 0; i < 5000; i++)
+		treemap_set_at(map, _((i * 7919) % 5000 + 1), _((i * 7919) % 5000 + 1));
+
+	for (long i = 1; i <= 5000; i += 2)
+		assert_true(treemap_remove_at(map, _(i)) == _(i));
+
+	assert_equal(2500, treemap_size(map));
+
+	for (long i = 1; i <= 5000; i++)
+		assert_true(treemap_contains_key(map, _(i)) == (i % 2 == 0));
+}
+
+void test_remove_null_value()
+{
+	treemap_set_at(map, _(1), NULL);
+	treemap_set_at(map, _(2), NULL);
+	assert_equal(2, treemap_size(map));
+
+	assert_true(treemap_remove_at(map, _(1)) == NULL);
+	assert_equal(1, treemap_size(map));
+	assert_false(treemap_contains_key(map, _(1)));
+
+	assert_true(treemap_remove_at(map, _(1)) == NULL);
+	assert_equal(1, treemap_size(map));
+}
+
+void test_btree_set_get_remove()
+{
+	treemap_t *btree = treemap_new(.backend = TREEMAP_BACKEND_BTREE);
+
+	/* Enough keys for a few levels, inserted out of order. */
+	for (long i = 0; i < 5000; i++)
+		treemap_set_at(btree, _((i * 7919) % 5000), _(-((i * 7919) % 5000)));
+
+	assert_equal(5000, treemap_size(btree));
+
+	for (long i = 0; i < 5000; i++)
+	{
+		assert_true(treemap_contains_key(btree, _(i)));
+		assert_true(treemap_get_at(btree, _(i)) == _(-i));
+	}
+
+	treemap_set_at(btree, _(10), _(10));
+	assert_true(treemap_get_at(btree, _(10)) == _(10));
+	assert_equal(5000, treemap_size(btree));
+
+	for (long i = 0; i < 5000; i += 2)
+		assert_true(treemap_remove_at(btree, _(i)) == (i == 10 ? _(10) : _(-i)));
+
+	assert_equal(2500, treemap_size(btree));
+
+	for (long i = 0; i < 5000; i++)
+		assert_true(treemap_contains_key(btree, _(i)) == (i % 2 == 1));
+
+	for (long i = 1; i < 5000; i += 2)
+		treemap_remove_at(btree, _(i));
+
+	assert_true(treemap_is_empty(btree));
+	assert_true(treemap_remove_at(btree, _(1)) == NULL);
+
+	treemap_free(btree);
+}
+
+void test_btree_ref_iter()
+{
+	treemap_t *btree = treemap_new(.backend = TREEMAP_BACKEND_BTREE, .pool_nodes = true);
+
+	for (long i = 999; i >= 0; i--)
+		treemap_set_at(btree, _(i * 2), _(i));
+	for (long i = 0; i < 1000; i += 3)
+		treemap_remove_at(btree, _(i * 2));
+
+	treemap_ref_t *ref = treemap_ref(btree);
+
+	for (long i = 0; i < 1000; i++)
+	{
+		if (i % 3 == 0)
+			continue;
+
+		assert_true(treemap_ref_is_valid(ref));
+		assert_true(treemap_ref_get_key(ref) == _(i * 2));
+		assert_true(treemap_ref_get_value(ref) == _(i));
+		treemap_ref_next(ref);
+	}
+
+	assert_false(treemap_ref_is_valid(ref));
+	treemap_ref_free(ref);
+
+	ref = treemap_ref(btree);
+	while (treemap_ref_has_next(ref))
+		treemap_ref_next(ref);
+
+	for (long i = 999; i >= 0; i--)
+	{
+		if (i % 3 == 0)
+			continue;
+
+		assert_true(treemap_ref_get_key(ref) == _(i * 2));
+		treemap_ref_prev(ref);
+	}
+
+	assert_false(treemap_ref_is_valid(ref));
+
+	treemap_ref_free(ref);
+	treemap_free(btree);
+}
+
+void test_btree_sort_cmp_fn()
+{
+	treemap_t *btree = treemap_new(.backend = TREEMAP_BACKEND_BTREE, .key_compare_fn = (compare_fn_t)strcmp);
+	char keys[100][4];
+
+	for (int i = 99; i >= 0; i--)
+	{
+		sprintf(keys[i], "%03d", i);
+		treemap_set_at(btree, keys[i], _(i));
+	}
+
+	assert_true(treemap_get_at(btree, "042") == _(42));
+
+	treemap_ref_t *ref = treemap_ref(btree);
+	for (int i = 0; i < 100; i++, treemap_ref_next(ref))
+		assert_true(treemap_ref_get_key(ref) == keys[i]);
+
+	treemap_ref_free(ref);
+	treemap_free(btree);
+}
+
+/* Fills m with the even keys 2..2000, and checks every neighbour
+ * query against the odd keys between them and the even keys on them. */
+static void check_navigation(treemap_t *m)
+{
+	assert_true(treemap_first(m).key == NULL);
+	assert_true(treemap_floor(m, _(10)).key == NULL);
+	assert_true(treemap_range_ref(m, _(0), _(100)) == NULL);
+
+	for (long i = 1000; i >= 1; i--)
+		treemap_set_at(m, _(i * 2), _(-i));
+
+	assert_true(treemap_first(m).key == _(2));
+	assert_true(treemap_first(m).value == _(-1));
+	assert_true(treemap_last(m).key == _(2000));
+
+	for (long k = 1; k <= 2001; k++)
+	{
+		long below = k % 2 == 0 ? k - 2 : k - 1;
+		long above = k % 2 == 0 ? k + 2 : k + 1;
+
+		assert_true(treemap_floor(m, _(k)).key == _(k % 2 == 0 ? k : below));
+		assert_true(treemap_ceiling(m, _(k)).key == _(k % 2 == 0 ? k : (above > 2000 ? 0 : above)));
+		assert_true(treemap_lower(m, _(k)).key == _(below));
+		assert_true(treemap_higher(m, _(k)).key == _(above > 2000 ? 0 : above));
+	}
+
+	assert_true(treemap_floor(m, _(1001)).value == _(-500));
+	assert_true(treemap_higher(m, _(2000)).key == NULL);
+}
+
+void test_navigation()
+{
+	check_navigation(map);
+}
+
+void test_btree_navigation()
+{
+	treemap_t *btree = treemap_new(.backend = TREEMAP_BACKEND_BTREE);
+	check_navigation(btree);
+	treemap_free(btree);
+}
+
+static void check_range_ref(treemap_t *m)
+{
+	for (long i = 1; i <= 1000; i++)
+		treemap_set_at(m, _(i * 2), _(i));
+
+	treemap_ref_t *ref = treemap_range_ref(m, _(501), _(1000));
+	long k = 502;
+
+	for (; treemap_ref_is_valid(ref); treemap_ref_next(ref), k += 2)
+		assert_true(treemap_ref_get_key(ref) == _(k));
+	assert_equal(1000, k);
+
+	treemap_ref_free(ref);
+
+	/* The range also bounds stepping backwards. */
+	ref = treemap_range_ref(m, _(100), _(111));
+	while (treemap_ref_has_next(ref))
+		treemap_ref_next(ref);
+
+	assert_true(treemap_ref_get_key(ref) == _(110));
+	assert_equal(5, treemap_ref_get_pos(ref));
+
+	for (k = 110; treemap_ref_is_valid(ref); treemap_ref_prev(ref), k -= 2)
+		assert_true(treemap_ref_get_key(ref) == _(k));
+	assert_equal(98, k);
+
+	treemap_ref_free(ref);
+
+	assert_true(treemap_range_ref(m, _(101), _(102)) == NULL);
+	assert_true(treemap_range_ref(m, _(2001), _(3000)) == NULL);
+}
+
+void test_range_ref()
+{
+	check_range_ref(map);
+}
+
+void test_btree_range_ref()
+{
+	treemap_t *btree = treemap_new(.backend = TREEMAP_BACKEND_BTREE);
+	check_range_ref(btree);
+	treemap_free(btree);
+}
+
+void test_compact_set_get_remove()
+{
+	treemap_t *compact = treemap_new(.backend = TREEMAP_BACKEND_RBTREE_COMPACT);
+
+	/* Enough keys to grow the node array a few times. */
+	for (long i = 0; i < 5000; i++)
+		treemap_set_at(compact, _((i * 7919) % 5000), _(-((i * 7919) % 5000)));
+
+	assert_equal(5000, treemap_size(compact));
+	for (long i = 0; i < 5000; i++)
+		assert_true(treemap_get_at(compact, _(i)) == _(-i));
+
+	for (long i = 0; i < 5000; i += 2)
+		assert_true(treemap_remove_at(compact, _(i)) == _(-i));
+	assert_equal(2500, treemap_size(compact));
+
+	/* Removed nodes are reused before the array grows again. */
+	for (long i = 5000; i < 7500; i++)
+		treemap_set_at(compact, _(i), _(i));
+	assert_equal(5000, treemap_size(compact));
+	assert_true(treemap_contains_value(compact, _(7499)));
+
+	treemap_ref_t *ref = treemap_ref(compact);
+	for (long i = 1; i < 5000; i += 2, treemap_ref_next(ref))
+		assert_true(treemap_ref_get_key(ref) == _(i));
+	for (long i = 5000; i < 7500; i++, treemap_ref_next(ref))
+		assert_true(treemap_ref_get_key(ref) == _(i));
+	assert_false(treemap_ref_is_valid(ref));
+	treemap_ref_free(ref);
+
+	treemap_free(compact);
+}
+
+void test_compact_navigation()
+{
+	treemap_t *compact = treemap_new(.backend = TREEMAP_BACKEND_RBTREE_COMPACT);
+	check_navigation(compact);
+	treemap_free(compact);
+
+	compact = treemap_new(.backend = TREEMAP_BACKEND_RBTREE_COMPACT);
+	check_range_ref(compact);
+	treemap_free(compact);
+}
+
+void test_select_rank()
+{
+	treemap_t *counted = treemap_new(.order_statistics = true, .pool_nodes = true);
+
+	for (long i = 0; i < 3000; i++)
+		treemap_set_at(counted, _((i * 7919) % 3000), _(i));
+	for (long i = 0; i < 3000; i += 3)
+		treemap_remove_at(counted, _((i * 104729) % 3000));
+	treemap_set_at(counted, _(1), _(1));
+
+	/* Positions agree with the order a reference walks the keys in. */
+	treemap_ref_t *ref = treemap_ref(counted);
+	for (long pos = 0; treemap_ref_is_valid(ref); treemap_ref_next(ref), pos++)
+	{
+		assert_true(treemap_select(counted, pos).key == treemap_ref_get_key(ref));
+		assert_equal(pos, treemap_rank(counted, treemap_ref_get_key(ref)));
+	}
+	treemap_ref_free(ref);
+
+	assert_true(treemap_select(counted, -1).key == treemap_last(counted).key);
+	assert_equal(0, treemap_rank(counted, NULL));
+	assert_equal(treemap_size(counted), treemap_rank(counted, _(5000)));
+
+	treemap_free(counted);
+}
+
+void test_treeset_select_rank()
+{
+	treeset_t *set = treeset_new(.order_statistics = true);
+
+	for (long i = 100; i >= 1; i--)
+		treeset_add(set, _(i * 10));
+
+	assert_true(treeset_select(set, 0) == _(10));
+	assert_true(treeset_select(set, 49) == _(500));
+	assert_equal(50, treeset_rank(set, _(505)));
+
+	treeset_free(set);
+}
+
+void test_from_sorted()
+{
+	map_entry_t entries[1000];
+	for (long i = 0; i < 1000; i++)
+		entries[i] = (map_entry_t){_(i * 2), _(-i)};
+
+	for (treemap_backend_t backend = TREEMAP_BACKEND_RBTREE; backend <= TREEMAP_BACKEND_RBTREE_COMPACT; backend++)
+	{
+		treemap_t *built = treemap_from_sorted(entries, 1000, .backend = backend, .pool_nodes = true);
+		assert_equal(1000, treemap_size(built));
+
+		treemap_ref_t *ref = treemap_ref(built);
+		for (long i = 0; i < 1000; i++, treemap_ref_next(ref))
+			assert_true(treemap_ref_get_key(ref) == _(i * 2));
+		assert_false(treemap_ref_is_valid(ref));
+		treemap_ref_free(ref);
+
+		/* The built tree keeps working as an ordinary map. */
+		for (long i = 0; i < 1000; i += 2)
+			assert_true(treemap_remove_at(built, _(i * 2)) == _(-i));
+		for (long i = 0; i < 1000; i++)
+			treemap_set_at(built, _(i * 2 + 1), _(i));
+
+		assert_equal(1500, treemap_size(built));
+		assert_true(treemap_get_at(built, _(7)) == _(3));
+		assert_false(treemap_contains_key(built, _(4)));
+
+		treemap_free(built);
+	}
+
+	treemap_t *counted = treemap_from_sorted(entries, 1000, .order_statistics = true);
+	assert_true(treemap_select(counted, 500).key == _(1000));
+	assert_equal(250, treemap_rank(counted, _(499)));
+
+	/* Without pool_nodes, the built map owns its nodes one by one, and
+	 * can be split. */
+	treemap_t *lo, *hi;
+	treemap_split(counted, _(1000), &lo, &hi);
+	assert_equal(500, treemap_size(lo));
+	assert_equal(500, treemap_size(hi));
+	treemap_free(lo);
+	treemap_free(hi);
+}
+
+void test_set_all_duplicates()
+{
+	treemap_set_all(map, {_(5), _(1)}, {_(3), _(2)}, {_(5), _(3)}, {_(1), _(4)}, {_(3), _(5)});
+
+	assert_equal(3, treemap_size(map));
+	assert_true(treemap_get_at(map, _(1)) == _(4));
+	assert_true(treemap_get_at(map, _(3)) == _(5));
+	assert_true(treemap_get_at(map, _(5)) == _(3));
+}
+
+void test_treeset_from_sorted()
+{
+	void *items[100];
+	for (long i = 0; i < 100; i++)
+		items[i] = _(i + 1);
+
+	treeset_t *set = treeset_from_sorted(items, 100, .backend = TREEMAP_BACKEND_BTREE);
+	assert_equal(100, treeset_size(set));
+	assert_true(treeset_contains(set, _(100)));
+	assert_false(treeset_contains(set, _(101)));
+	treeset_free(set);
+
+	set = treeset_new();
+	treeset_add_all(set, _(3), _(1), _(2), _(1));
+	assert_equal(3, treeset_size(set));
+	assert_true(treeset_contains(set, _(2)));
+	treeset_free(set);
+}
+
+/* Fills a set with the multiples of step in [1, n]. */
+static treeset_t *multiples(treemap_backend_t backend, long step, long n)
+{
+	treeset_t *set = treeset_new(.backend = backend);
+	for (long i = step; i <= n; i += step)
+		treeset_add(set, _(i));
+	return set;
+}
+
+void test_treeset_set_algebra()
+{
+	for (treemap_backend_t backend = TREEMAP_BACKEND_RBTREE; backend <= TREEMAP_BACKEND_RBTREE_COMPACT; backend++)
+	{
+		treeset_t *twos = multiples(backend, 2, 3000), *threes = multiples(backend, 3, 3000);
+		treeset_t *set_union = treeset_union(twos, threes);
+		treeset_t *set_intersection = treeset_intersection(twos, threes);
+		treeset_t *set_difference = treeset_difference(twos, threes);
+
+		assert_equal(2000, treeset_size(set_union));
+		assert_equal(500, treeset_size(set_intersection));
+		assert_equal(1000, treeset_size(set_difference));
+
+		for (long i = 1; i <= 3000; i++)
+		{
+			assert_equal(i % 2 == 0 || i % 3 == 0, treeset_contains(set_union, _(i)));
+			assert_equal(i % 6 == 0, treeset_contains(set_intersection, _(i)));
+			assert_equal(i % 2 == 0 && i % 3 != 0, treeset_contains(set_difference, _(i)));
+		}
+
+		assert_true(treeset_is_subset(twos, set_intersection));
+		assert_false(treeset_is_subset(twos, threes));
+
+		treeset_free(set_union);
+		treeset_free(set_intersection);
+		treeset_free(set_difference);
+		treeset_free(twos);
+		treeset_free(threes);
+	}
+}
+
+void test_treeset_set_algebra_split()
+{
+	treeset_t *twos = treeset_new(.order_statistics = true), *odds = treeset_new(.order_statistics = true);
+	for (long i = 1; i <= 300; i++)
+		treeset_add(i % 2 == 0 ? twos : odds, _(i));
+
+	/* Results are configured like the first set, so they can be split
+	 * and joined like it. */
+	treeset_t *set_union = treeset_union(twos, odds), *lo, *hi;
+	treeset_split(set_union, _(101), &lo, &hi);
+	assert_equal(100, treeset_size(lo));
+	assert_equal(200, treeset_size(hi));
+
+	set_union = treeset_join(lo, hi);
+	assert_equal(300, treeset_size(set_union));
+
+	treeset_free(set_union);
+	treeset_free(twos);
+	treeset_free(odds);
+}
+
+void test_join_mismatched()
+{
+	arena_t *arena = arena_new();
+	treemap_t *lo = treemap_new(.order_statistics = true);
+	treemap_t *other_allocator = treemap_new(.order_statistics = true, .allocator = arena_allocator(arena));
+	treemap_t *other_cmp_fn = treemap_new(.order_statistics = true, .key_compare_fn = (compare_fn_t)strcmp);
+	treemap_set_at(lo, _(1), _(1));
+	treemap_set_at(other_allocator, _(2), _(2));
+
+	/* Nodes of one map would be freed through the other's allocator, or
+	 * ordered by the other's comparison. */
+	assert_panic(treemap_join(lo, other_allocator));
+	assert_panic(treemap_join(lo, other_cmp_fn));
+
+	treeset_t *set = treeset_new(.order_statistics = true);
+	treeset_t *other_set = treeset_new(.order_statistics = true, .allocator = arena_allocator(arena));
+	assert_panic(treeset_join(set, other_set));
+	assert_equal(1, treemap_size(lo));
+
+	treeset_free(set);
+	treeset_free(other_set);
+	treemap_free(lo);
+	treemap_free(other_allocator);
+	treemap_free(other_cmp_fn);
+	arena_free(arena);
+}
+
+void test_treeset_union_into_retain_all()
+{
+	for (treemap_backend_t backend = TREEMAP_BACKEND_RBTREE; backend <= TREEMAP_BACKEND_RBTREE_COMPACT; backend++)
+	{
+		/* Comparable sizes merge, and a much smaller set is probed. */
+		treeset_t *set = multiples(backend, 2, 3000), *threes = multiples(backend, 3, 3000);
+		treeset_t *few = multiples(backend, 1000, 3000), *odd_few = multiples(backend, 1001, 3000);
+
+		treeset_union_into(set, threes);
+		assert_equal(2000, treeset_size(set));
+		treeset_union_into(set, odd_few);
+		assert_equal(2001, treeset_size(set));
+		assert_true(treeset_contains(set, _(1001)));
+
+		treeset_retain_all(set, threes);
+		assert_equal(1000, treeset_size(set));
+		assert_true(treeset_equal(set, threes));
+
+		treeset_retain_all(set, few);
+		assert_equal(1, treeset_size(set));
+		assert_true(treeset_contains(set, _(3000)));
+
+		treeset_retain_all(set, odd_few);
+		assert_true(treeset_is_empty(set));
+
+		treeset_free(set);
+		treeset_free(threes);
+		treeset_free(few);
+		treeset_free(odd_few);
+	}
+}
+
+void test_persistent_versions()
+{
+	ptreemap_t *empty = ptreemap_new();
+	ptreemap_t *one = ptreemap_set_at(empty, _(1), _(10));
+	ptreemap_t *two = ptreemap_set_at(one, _(2), _(20));
+	ptreemap_t *changed = ptreemap_set_at(two, _(1), _(11));
+	ptreemap_t *removed = ptreemap_remove_at(two, _(1));
+
+	assert_true(ptreemap_is_empty(empty));
+	assert_equal(1, ptreemap_size(one));
+	assert_equal(2, ptreemap_size(two));
+	assert_equal(2, ptreemap_size(changed));
+	assert_equal(1, ptreemap_size(removed));
+
+	assert_equal(_(10), ptreemap_get_at(two, _(1)));
+	assert_equal(_(11), ptreemap_get_at(changed, _(1)));
+	assert_false(ptreemap_contains_key(one, _(2)));
+	assert_false(ptreemap_contains_key(removed, _(1)));
+	assert_equal(_(20), ptreemap_get_at(removed, _(2)));
+	assert_equal(NULL, ptreemap_get_at(removed, _(1)));
+	assert_equal(NULL, ptreemap_get_at(empty, _(1)));
+	assert_equal(_(2), ptreemap_first(removed).key);
+	assert_equal(_(2), ptreemap_last(changed).key);
+	assert_equal(NULL, ptreemap_first(empty).key);
+
+	/* Updates that change nothing, and snapshots, share the version. */
+	ptreemap_t *same = ptreemap_set_at(two, _(2), _(20));
+	ptreemap_t *snapshot = ptreemap_snapshot(two);
+	assert_true(two == same);
+	assert_true(ptreemap_equal(snapshot, two));
+	assert_false(ptreemap_equal(two, changed));
+	ptreemap_free(same);
+	ptreemap_free(snapshot);
+
+	/* A reference keeps its version alive. */
+	ptreemap_ref_t *ref = ptreemap_ref(changed);
+	ptreemap_free(changed);
+	assert_equal(_(11), ptreemap_ref_get_value(ref));
+	assert_true(ptreemap_ref_has_next(ref));
+	assert_equal(_(20), ptreemap_ref_next(ref).value);
+	assert_false(ptreemap_ref_has_next(ref));
+	ptreemap_ref_next(ref);
+	assert_false(ptreemap_ref_is_valid(ref));
+	ptreemap_ref_free(ref);
+
+	ptreemap_free(empty);
+	ptreemap_free(one);
+	ptreemap_free(two);
+	ptreemap_free(removed);
+}
+
+void test_persistent_history()
+{
+	ptreemap_t *versions[100];
+	treemap_t *plain[100];
+	ptreemap_t *current = ptreemap_new();
+
+	/* Keep every 50th version, and check each still matches a plain
+	 * map with the same history once all the updates are done. */
+	for (size_t i = 0; i < 5000; i++)
+	{
+		long key = (long)(i * 7919 % 1009);
+		ptreemap_t *next = i % 3 == 2 ? ptreemap_remove_at(current, _(key))
+									  : ptreemap_set_at(current, _(key), _(i));
+		ptreemap_free(current);
+		current = next;
+
+		if (i % 3 == 2)
+			treemap_remove_at(map, _(key));
+		else
+			treemap_set_at(map, _(key), _(i));
+
+		if (i % 50 == 49)
+		{
+			versions[i / 50] = ptreemap_snapshot(current);
+			plain[i / 50] = treemap_new();
+
+			treemap_ref_t *ref = treemap_ref(map);
+			for (; ref != NULL && treemap_ref_is_valid(ref); treemap_ref_next(ref))
+				treemap_set_at(plain[i / 50], treemap_ref_get_key(ref), treemap_ref_get_value(ref));
+			if (ref != NULL)
+				treemap_ref_free(ref);
+		}
+	}
+	ptreemap_free(current);
+
+	for (size_t v = 0; v < 100; v++)
+	{
+		assert_equal(treemap_size(plain[v]), ptreemap_size(versions[v]));
+
+		ptreemap_ref_t *ref = ptreemap_ref(versions[v]);
+		treemap_ref_t *plain_ref = treemap_ref(plain[v]);
+		for (; ref != NULL && ptreemap_ref_is_valid(ref); ptreemap_ref_next(ref), treemap_ref_next(plain_ref))
+		{
+			assert_equal(treemap_ref_get_key(plain_ref), ptreemap_ref_get_key(ref));
+			assert_equal(treemap_ref_get_value(plain_ref), ptreemap_ref_get_value(ref));
+		}
+		if (ref != NULL)
+		{
+			ptreemap_ref_free(ref);
+			treemap_ref_free(plain_ref);
+		}
+
+		ptreemap_free(versions[v]);
+		treemap_free(plain[v]);
+	}
+}
+
 int main(int argc, char *argv[])
 {
 	TEST_SUITE(
@@ -245,5 +868,28 @@ int main(int argc, char *argv[])
 		TEST(test_values),
 		TEST(test_equal),
 		TEST(test_sort_cmp_fn),
-		TEST(test_ref_forward_iter));
+		TEST(test_ref_forward_iter),
+		TEST(test_ref_backward_iter),
+		TEST(test_remove_many),
+		TEST(test_remove_null_value),
+		TEST(test_btree_set_get_remove),
+		TEST(test_btree_ref_iter),
+		TEST(test_btree_sort_cmp_fn),
+		TEST(test_navigation),
+		TEST(test_btree_navigation),
+		TEST(test_range_ref),
+		TEST(test_btree_range_ref),
+		TEST(test_compact_set_get_remove),
+		TEST(test_compact_navigation),
+		TEST(test_select_rank),
+		TEST(test_treeset_select_rank),
+		TEST(test_from_sorted),
+		TEST(test_set_all_duplicates),
+		TEST(test_treeset_from_sorted),
+		TEST(test_treeset_set_algebra),
+		TEST(test_treeset_set_algebra_split),
+		TEST(test_join_mismatched),
+		TEST(test_treeset_union_into_retain_all),
+		TEST(test_persistent_versions),
+		TEST(test_persistent_history));
 }
\ No newline at end of file